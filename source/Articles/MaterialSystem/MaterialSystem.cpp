@@ -287,7 +287,7 @@ void MaterialSystemApplication::app_render( hydra::graphics::CommandBuffer* comm
             save_material( material_filename_cache );
         }
 
-        bool property_changed = false;
+        hydra::graphics::Material* material = editor_material.material;
 
         uint32_t current_texture = 0;
         for ( uint32_t p = 0; p < editor_material.material->effect->num_properties; ++p ) {
@@ -295,8 +295,35 @@ void MaterialSystemApplication::app_render( hydra::graphics::CommandBuffer* comm
 
             switch ( property->type ) {
                 case hfx::Property::Float:
+                case hfx::Property::Range:
                 {
-                    property_changed = property_changed || ImGui::InputScalar( property->name, ImGuiDataType_Float, editor_material.material->local_constants_data + property->offset );
+                    if ( !property->array_count && ImGui::InputScalar( property->name, ImGuiDataType_Float, material->local_constants_data + property->offset ) ) {
+                        material->set_constants_dirty( property->offset, property->size );
+                    }
+                    break;
+                }
+
+                case hfx::Property::Int:
+                {
+                    if ( !property->array_count && ImGui::InputScalar( property->name, ImGuiDataType_S32, material->local_constants_data + property->offset ) ) {
+                        material->set_constants_dirty( property->offset, property->size );
+                    }
+                    break;
+                }
+
+                case hfx::Property::Color:
+                {
+                    if ( !property->array_count && ImGui::ColorEdit4( property->name, (float*)( material->local_constants_data + property->offset ) ) ) {
+                        material->set_constants_dirty( property->offset, property->size );
+                    }
+                    break;
+                }
+
+                case hfx::Property::Vector:
+                {
+                    if ( !property->array_count && ImGui::InputFloat4( property->name, (float*)( material->local_constants_data + property->offset ) ) ) {
+                        material->set_constants_dirty( property->offset, property->size );
+                    }
                     break;
                 }
 
@@ -333,17 +360,8 @@ void MaterialSystemApplication::app_render( hydra::graphics::CommandBuffer* comm
             }
         }
 
-        // If we changed a property, update the constant buffer.
-        if ( property_changed ) {
-
-            hydra::graphics::MapBufferParameters map_parameters = { editor_material.material->local_constants_buffer, 0, 0 };
-
-            void* buffer_data = gfx_device.map_buffer( map_parameters );
-            if ( buffer_data ) {
-                memcpy( buffer_data, editor_material.material->local_constants_data, editor_material.material->effect->local_constants_size );
-                gfx_device.unmap_buffer( map_parameters );
-            }
-        }
+        // Upload only the changed properties.
+        material->upload_constants( gfx_device );
     }
 
     ImGui::End();
@@ -389,7 +407,7 @@ void MaterialSystemApplication::app_render( hydra::graphics::CommandBuffer* comm
 
     // BHFX inpsector
     ImGui::Begin( "BHFX Inspector" );
-    if ( opened_file_type == Binary_HFX ) {
+    if ( opened_file_type == Binary_HFX && shader_effect_file.header ) {
 
         ImGui::Text( shader_effect_file.header->name );
         ImGui::Text( "Num passes %u", shader_effect_file.header->num_passes );
@@ -529,6 +547,8 @@ void MaterialSystemApplication::edit_file( const char* filepath ) {
         case Binary_HFX:
         {
             text_editor->SetText( "" );
+            // Release the previously inspected file mapping.
+            hfx::terminate_shader_effect_file( shader_effect_file );
             hfx::init_shader_effect_file( shader_effect_file, filepath );
 
             break;
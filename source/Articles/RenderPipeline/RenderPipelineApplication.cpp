@@ -1,10 +1,4 @@
 
-#define TINYGLTF_IMPLEMENTATION
-#define TINYGLTF_NO_STB_IMAGE_WRITE
-#define TINYGLTF_NOEXCEPTION
-#define TINYGLTF_USE_RAPIDJSON
-#include "tiny_gltf.h"
-
 #include "RenderPipelineApplication.h"
 #include "ShaderCodeGenerator.h"
 //#include "MaterialSystem.h"
@@ -14,7 +8,6 @@
 #include "imgui_node_editor.h"
 
 #include "rapidjson/document.h"
-#include "rapidjson/prettywriter.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
@@ -27,8 +20,6 @@
 #include "cglm/struct/vec3.h"
 #include "cglm/struct/project.h"
 #include "cglm/struct/affine.h"
-#include "cglm/struct/quat.h"
-#include "cglm/struct/box.h"
 
 namespace ed = ax::NodeEditor;
 
@@ -74,321 +65,6 @@ static Graph render_graph;
 static hash_map( TextureHandleNodeIdMap ) texture_to_node = nullptr;
 
 
-// Mesh/Models //////////////////////////////////////////////////////////////////
-
-static int32_t find_texture_index( tinygltf::ParameterMap& material_values, const char* parameter_name ) {
-    if ( material_values.find( parameter_name ) != material_values.end() ) {
-        tinygltf::Parameter& parameter = material_values[parameter_name];
-
-        auto iterator = parameter.json_double_value.find( "index" );
-        if ( iterator != parameter.json_double_value.end() ) {
-
-            return (int32_t)iterator->second;
-        }
-    }
-
-    return -1;
-}
-
-static void create_mesh( hydra::graphics::Device& device, tinygltf::Model& model, tinygltf::Mesh& mesh, 
-                         hydra::graphics::RenderScene& render_scene, hydra::graphics::Mesh& render_mesh,
-                         hydra::ResourceManager& resource_manager, hydra::StringBuffer& string_buffer,
-                         hydra::graphics::RenderPipeline* render_pipeline, const mat4s& world_transform ) {
-
-    // Scan through primitives/sub-meshes
-    for ( size_t i = 0; i < mesh.primitives.size(); ++i ) {
-        tinygltf::Primitive primitive = mesh.primitives[i];
-
-        hydra::graphics::SubMesh sub_mesh = { 0, 0, nullptr, 0 };
-
-        if ( primitive.indices >= 0 ) {
-            tinygltf::Accessor& index_buffer_accessor = model.accessors[primitive.indices];
-            
-            sub_mesh.index_buffer = render_scene.buffers[index_buffer_accessor.bufferView];
-            sub_mesh.start_index = index_buffer_accessor.byteOffset / tinygltf::GetComponentSizeInBytes( index_buffer_accessor.componentType );
-            sub_mesh.end_index = index_buffer_accessor.count;
-        }
-
-        const std::map<std::string, int>& primitive_attributes = primitive.attributes;
-
-        array_set_length( sub_mesh.vertex_buffers, 3 );
-        array_set_length( sub_mesh.vertex_buffer_offsets, 3 );
-        // TODO: improve
-        // Add vertex layout. For now use fixed position,normal vertex layout.
-        for ( auto &vertex_attribute : primitive.attributes ) {
-            tinygltf::Accessor vertex_attribute_accessor = model.accessors[vertex_attribute.second];
-
-            // TODO: Add multiple vertex buffers
-            if ( (vertex_attribute.first.compare( "NORMAL" ) == 0) ) {
-                hydra::graphics::BufferHandle vertex_buffer_handle = render_scene.buffers[vertex_attribute_accessor.bufferView];
-                sub_mesh.vertex_buffers[1] = vertex_buffer_handle;
-                sub_mesh.vertex_buffer_offsets[1] = vertex_attribute_accessor.byteOffset;
-            }
-            else if ( (vertex_attribute.first.compare( "POSITION" ) == 0) ) {
-                hydra::graphics::BufferHandle vertex_buffer_handle = render_scene.buffers[vertex_attribute_accessor.bufferView];
-                sub_mesh.vertex_buffers[0] = vertex_buffer_handle;
-                sub_mesh.vertex_buffer_offsets[0] = vertex_attribute_accessor.byteOffset;
-
-                // Add Bounding Box
-                if ( vertex_attribute_accessor.minValues.size() == 3 && vertex_attribute_accessor.maxValues.size() == 3 ) {
-                    sub_mesh.bounding_box.min = { (float)vertex_attribute_accessor.minValues[0], (float)vertex_attribute_accessor.minValues[1], (float)vertex_attribute_accessor.minValues[2] };
-                    sub_mesh.bounding_box.max = { (float)vertex_attribute_accessor.maxValues[0], (float)vertex_attribute_accessor.maxValues[1], (float)vertex_attribute_accessor.maxValues[2] };
-
-                    glms_aabb_transform( sub_mesh.bounding_box.box, world_transform, sub_mesh.bounding_box.box );
-                }
-            }
-            else if ( ( vertex_attribute.first.compare( "TEXCOORD_0" ) == 0 ) ) {
-                hydra::graphics::BufferHandle vertex_buffer_handle = render_scene.buffers[vertex_attribute_accessor.bufferView];
-                sub_mesh.vertex_buffers[2] = vertex_buffer_handle;
-                sub_mesh.vertex_buffer_offsets[2] = vertex_attribute_accessor.byteOffset;
-            }
-        }
-
-        // Search for material
-        tinygltf::Material& material = model.materials[primitive.material];
-
-        hydra::Resource* material_resource = resource_manager.load_resource( hydra::ResourceType::Material, string_buffer.append_use("%s.hmt", material.name.c_str()), device, render_pipeline );
-
-        // If not present, create it.
-        if ( !material_resource ) {
-            // Create material
-            rapidjson::Document document;
-            document.SetObject();
-
-            rapidjson::Document::AllocatorType& allocator = document.GetAllocator();
-
-            rapidjson::Value json_material_name;
-            json_material_name.SetString( material.name.c_str(), material.name.size(), allocator );
-
-            document.AddMember( "name", json_material_name, allocator );
-            document.AddMember( "effect_path", "PBR.hfx", allocator );
-
-            // Write bindings
-            rapidjson::Value bindings( rapidjson::kArrayType );
-            rapidjson::Value json_property_bindings( rapidjson::kObjectType );
-
-            rapidjson::Value json_name, json_value;
-
-            //"LocalConstants": "CB_Lines",
-            json_name.SetString( "ViewConstants", allocator );
-            json_value.SetString( "CB_Lines", allocator );
-
-            json_property_bindings.AddMember( json_name, json_value, allocator );
-
-            //"Transform" : "Transform"
-            json_name.SetString( "Transform", allocator );
-            json_value.SetString( "Transform", allocator );
-
-            json_property_bindings.AddMember( json_name, json_value, allocator );
-
-            // Add both properties and bindings
-            rapidjson::Value properties( rapidjson::kArrayType );
-            rapidjson::Value json_property( rapidjson::kObjectType );
-
-            // Search for textures
-            // 1. albedo
-            int32_t texture_index = find_texture_index( material.values, "baseColorTexture" );
-            if ( texture_index >= 0 ) {
-                tinygltf::Texture& tex = model.textures[texture_index];
-                tinygltf::Image& image = model.images[tex.source];
-                
-                json_name.SetString( "albedo", allocator );
-                json_value.SetString( image.uri.c_str(), image.uri.size(), allocator );
-    
-                json_property.AddMember( json_name, json_value, allocator );
-                json_property_bindings.AddMember( json_name, json_name, allocator );
-            }
-
-            // 2. normals
-            texture_index = material.normalTexture.index;
-
-            // 3. metallic/roughness
-            texture_index = find_texture_index( material.values, "metallicRoughnessTexture" );
-            if ( texture_index >= 0 ) {
-
-            }
-
-            // 4. occlusion
-
-            // 5. emissive
-
-            bindings.PushBack( json_property_bindings, allocator );
-            document.AddMember( "bindings", bindings, allocator );
-
-            // Write properties
-            // TODO: add PBR properties here.
-            
-            properties.PushBack( json_property, allocator );
-            document.AddMember( "properties", properties, allocator );
-
-            // Write document
-            rapidjson::StringBuffer strbuf;
-            rapidjson::PrettyWriter<rapidjson::StringBuffer> writer( strbuf );
-            document.Accept( writer );
-
-            // Write the material file
-            hydra::FileHandle file;
-            const char* filename = string_buffer.append_use("..\\data\\source\\%s.hmt", material.name.c_str() );
-            hydra::open_file( filename, "w", &file );
-            if ( file ) {
-                fwrite( strbuf.GetString(), strbuf.GetSize(), 1, file );
-                hydra::close_file( file );
-            }
-
-            // load newly created material
-            material_resource = resource_manager.load_resource( hydra::ResourceType::Material, string_buffer.append_use( "%s.hmt", material.name.c_str() ), device, render_pipeline );
-        }
-
-        sub_mesh.material = ( hydra::graphics::Material* )material_resource->asset;
-        sub_mesh.material->load_resources( render_pipeline->resource_database, device );
-
-        array_push( render_mesh.sub_meshes, sub_mesh );
-    }
-}
-
-static void create_meshes_from_node( hydra::graphics::Device& device, tinygltf::Model& model, tinygltf::Node& node,
-                                     hydra::graphics::RenderScene& render_scene, hydra::graphics::RenderNode& render_node,
-                                     hydra::ResourceManager& resource_manager, hydra::StringBuffer& string_buffer, hydra::graphics::RenderPipeline* render_pipeline ) {
-
-    mat4s world_transform = glms_mat4_identity();
-
-    // Concatenate SRT transforms
-    if ( node.scale.size() == 3 ) {
-        mat4s matrix = glms_scale_make( { (float)node.scale[0], (float)node.scale[1], (float)node.scale[2] } );
-        world_transform = glms_mat4_mul( world_transform, matrix );
-    }
-
-    if ( node.rotation.size() == 4 ) {
-        mat4s matrix = glms_quat_mat4( { (float)node.rotation[0], (float)node.rotation[1], (float)node.rotation[2], (float)node.rotation[3] } );
-        world_transform = glms_mat4_mul( world_transform, matrix );
-    }
-
-    if ( node.translation.size() == 3 ) {
-        mat4s matrix = glms_translate_make( { (float)node.translation[0], (float)node.translation[1], (float)node.translation[2] } );
-        world_transform = glms_mat4_mul( world_transform, matrix );
-    }
-
-    if ( node.matrix.size() == 16 ) {
-        hydra::print_format( "Matrix transform still not implemented!\n" );
-        //local_transform = HMM_MultiplyMat4( local_transform, {} );
-    }
-
-    // If parent is present, concatenate matrices
-    if ( render_node.parent_id != -1 ) {
-        world_transform = glms_mat4_mul( render_scene.node_transforms[render_node.parent_id], world_transform );
-    }
-
-    // Add local mesh of the node
-    if ( node.mesh >= 0 ) {
-        render_node.mesh = new hydra::graphics::Mesh();
-        create_mesh( device, model, model.meshes[node.mesh], render_scene, *render_node.mesh, resource_manager, string_buffer, render_pipeline, world_transform );
-    }
-
-    // Calculate node id.
-    render_node.node_id = array_length_u( render_scene.nodes );
-
-    // Add render node and local transform to the scene.
-    array_push( render_scene.nodes, render_node );
-    array_push( render_scene.node_transforms, world_transform );
-
-    // Add children nodes to the render scene.
-    for ( size_t i = 0; i < node.children.size(); i++ ) {
-
-        hydra::graphics::RenderNode children_node = { nullptr, array_length_u( render_scene.nodes ), render_node.node_id };
-        create_meshes_from_node( device, model, model.nodes[node.children[i]], render_scene, children_node, resource_manager, string_buffer, render_pipeline );
-    }
-}
-
-static bool load_model( hydra::graphics::Device& device, tinygltf::Model& model, const char* filename, 
-                        hydra::graphics::RenderScene& render_scene, hydra::ResourceManager& resource_manager,
-                        hydra::StringBuffer& string_buffer, hydra::graphics::RenderPipeline* render_pipeline ) {
-    tinygltf::TinyGLTF loader;
-    std::string err;
-    std::string warn;
-
-    bool res = loader.LoadASCIIFromFile( &model, &err, &warn, filename );
-    if ( !warn.empty() ) {
-        hydra::print_format( "GLTF WARNING: %s\n", warn.c_str() );
-    }
-
-    if ( !err.empty() ) {
-        hydra::print_format( "GLTF ERROR: %s\n", err.c_str() );
-    }
-
-    if ( !res )
-        hydra::print_format( "Failed to load glTF: %s\n", filename );
-    else
-        hydra::print_format( "Loaded glTF: %s\n", filename );
-
-    if ( res ) {
-        // Create shared graphics resources
-        hydra::graphics::BufferCreation buffer_creation;
-
-        array_init( render_scene.buffers );
-        array_init( render_scene.nodes );
-        array_init( render_scene.node_transforms );
-
-        // Create all buffers (vertex + index)
-        for ( size_t i = 0; i < model.bufferViews.size(); ++i ) {
-            const tinygltf::BufferView& buffer_view = model.bufferViews[i];
-            const tinygltf::Buffer& buffer = model.buffers[buffer_view.buffer];
-
-            // TODO Opengl:
-#if defined (HYDRA_OPENGL)
-            switch ( buffer_view.target ) {
-                case GL_ARRAY_BUFFER:
-                {
-                    buffer_creation.type = hydra::graphics::BufferType::Vertex;
-                    break;
-                }
-
-                case GL_ELEMENT_ARRAY_BUFFER:
-                {
-                    buffer_creation.type = hydra::graphics::BufferType::Index;
-                    break;
-                }
-
-                default:
-                {
-                    hydra::print_format( "Unsupported type %u\n", buffer_view.target );
-                    break;
-                }
-            }
-#endif // HYDRA_OPENGL
-
-            buffer_creation.initial_data = (void*)(&buffer.data.at( 0 ) + buffer_view.byteOffset);
-            buffer_creation.size = buffer_view.byteLength;
-            buffer_creation.usage = hydra::graphics::ResourceUsageType::Immutable;
-            
-            hydra::graphics::BufferHandle buffer_handle = device.create_buffer( buffer_creation );
-            
-            array_push( render_scene.buffers, buffer_handle );
-        }
-
-        // Create meshes for each render node
-        const tinygltf::Scene& scene = model.scenes[model.defaultScene];
-        for ( size_t i = 0; i < scene.nodes.size(); ++i ) {
-            tinygltf::Node& node = model.nodes[scene.nodes[i]];
-
-            hydra::graphics::RenderNode render_node = { nullptr, -1, -1 };
-            create_meshes_from_node( device, model, node, render_scene, render_node, resource_manager, string_buffer, render_pipeline );
-        }
-
-        // Create shared transformation matrix buffer.
-        {
-            hydra::graphics::BufferCreation buffer_creation;
-            buffer_creation.type = hydra::graphics::BufferType::Constant;
-            buffer_creation.initial_data = (void*)( &render_scene.node_transforms[0] );
-            buffer_creation.size = array_length_u( render_scene.node_transforms ) * sizeof(mat4s);
-            buffer_creation.usage = hydra::graphics::ResourceUsageType::Immutable;
-
-            render_scene.node_transforms_buffer = device.create_buffer( buffer_creation );
-        }
-    }
-
-    return res;
-}
-
 // RenderPipelineApplication ////////////////////////////////////////////////////
 
 void RenderPipelineApplication::app_init() {
@@ -403,6 +79,7 @@ void RenderPipelineApplication::app_init() {
     g_node_editor_context = ed::CreateEditor( &config );
 
     main_render_view.visible_render_scenes = nullptr;
+    main_render_view.scene_visibility = nullptr;
     main_render_view.camera.init( true, 0.1f, 1000.f );
 
     render_graph.init();
@@ -508,34 +185,23 @@ void RenderPipelineApplication::app_init() {
     hydra::Resource* material_resource = g_resource_manager.load_resource( hydra::ResourceType::Material, material_filename, gfx_device, render_pipeline_manager.current_render_pipeline );
     line_renderer.line_material = (hydra::graphics::Material*)material_resource->asset;
 
-    // Load scene
-    tinygltf::Model loaded_model;
-
+    // Load scene: the glTF is cooked the first time, then the binary scene is loaded without parsing.
+    // Scene, materials and textures load on the workers: the scene is added to the view by app_render once loaded.
 #if defined (HYDRA_OPENGL)
-    hydra::graphics::RenderScene render_scene;
-    //load_model( gfx_device, loaded_model, "../data/GLTF/Lantern/Lantern.gltf", render_scene, g_resource_manager, temporary_string_buffer, render_pipeline_manager.current_render_pipeline );
-    //load_model( gfx_device, loaded_model, "../data/GLTF/Box/Box.gltf", render_scene, g_resource_manager, temporary_string_buffer, render_pipeline_manager.current_render_pipeline );
-    load_model( gfx_device, loaded_model, "../data/source/GLTF/DamagedHelmet/DamagedHelmet.gltf", render_scene, g_resource_manager, temporary_string_buffer, render_pipeline_manager.current_render_pipeline );
-    render_scene.render_manager = &scene_renderer;
-
-    render_pipeline_manager.current_render_pipeline->resource_database.register_buffer( (char*)"Transform", render_scene.node_transforms_buffer );
+    loading_scene = g_resource_manager.load_resource_async( hydra::ResourceType::Scene, "GLTF/DamagedHelmet/DamagedHelmet.gltf", render_pipeline_manager.current_render_pipeline );
 
     line_renderer.line_material->load_resources( render_pipeline_manager.current_render_pipeline->resource_database, gfx_device );
 
-
-    hydra::graphics::RenderStage* rendering_stage = string_hash_get( render_pipeline_manager.current_render_pipeline->name_to_stage, "GBufferOpaque" );
-    render_scene.stage_mask.value = rendering_stage ? rendering_stage->geometry_stage_mask : 0;
-
     scene_renderer.material = line_renderer.line_material;
-
-    array_push( main_render_view.visible_render_scenes, render_scene );
 #else
+    loading_scene = nullptr;
 
     line_renderer.line_material->load_resources( render_pipeline_manager.current_render_pipeline->resource_database, gfx_device );
 
 #endif
 
     reload_shaders = false;
+    defragment_geometry = false;
 }
 
 void RenderPipelineApplication::app_terminate() {
@@ -544,12 +210,41 @@ void RenderPipelineApplication::app_terminate() {
 
 void RenderPipelineApplication::app_render( hydra::graphics::CommandBuffer* commands ) {
 
+    // Create the assets of completed asynchronous loads.
+    g_resource_manager.update( gfx_device );
+
+    if ( loading_scene && loading_scene->state == hydra::ResourceState::Loaded ) {
+        // The resource manager owns the scene: the view uses a copy of it.
+        hydra::graphics::RenderScene render_scene = {};
+        if ( loading_scene->asset ) {
+            render_scene = *(hydra::graphics::RenderScene*)loading_scene->asset;
+        }
+        render_scene.render_manager = &scene_renderer;
+
+        hydra::graphics::RenderStage* rendering_stage = string_hash_get( render_pipeline_manager.current_render_pipeline->name_to_stage, "GBufferOpaque" );
+        render_scene.stage_mask.value = rendering_stage ? rendering_stage->geometry_stage_mask : 0;
+
+        array_push( main_render_view.visible_render_scenes, render_scene );
+        loading_scene = nullptr;
+    }
+    else if ( loading_scene && loading_scene->state == hydra::ResourceState::Failed ) {
+        loading_scene = nullptr;
+    }
+
     if ( reload_shaders ) {
         g_resource_manager.reload_resources( hydra::ResourceType::Material, gfx_device, render_pipeline_manager.current_render_pipeline );
 
         reload_shaders = false;
     }
 
+    // Scenes share the arena: defragmenting it once moves the geometry of all of them.
+    hydra::graphics::GeometryArena* geometry_arena = array_length( main_render_view.visible_render_scenes ) ? main_render_view.visible_render_scenes[0].geometry_arena : nullptr;
+    if ( defragment_geometry && geometry_arena ) {
+        geometry_arena->defragment();
+        geometry_arena->print_report();
+    }
+    defragment_geometry = false;
+
     auto& io = ImGui::GetIO();
 
     hydra::graphics::Camera& camera = main_render_view.camera;
@@ -647,14 +342,46 @@ void RenderPipelineApplication::app_render( hydra::graphics::CommandBuffer* comm
         }
     }
 
-    // Render the pipeline
+    // Cull with the updated camera, then render the pipeline
+    hydra::graphics::cull_render_view( main_render_view, gfx_device );
+    scene_renderer.reset_statistics();
+
     if ( render_pipeline_manager.current_render_pipeline ) {
+        // Point light is an option of the deferred lights shader: select the variant.
+        hydra::graphics::RenderStage* lights_stage = string_hash_get( render_pipeline_manager.current_render_pipeline->name_to_stage, "DeferredLights" );
+        if ( lights_stage && lights_stage->material ) {
+            const uint32_t point_light_option = lights_stage->material->effect->get_option_mask( lights_stage->pass_index, "point_light" );
+            lights_stage->option_key = lighting_manager.use_point_light ? point_light_option : 0;
+        }
+
         render_pipeline_manager.current_render_pipeline->render( gfx_device, commands );
     }
 
     // Taken from NodeEditor simple example:
     ImGui::Text( "FPS: %.2f (%.2gms)", io.Framerate, io.Framerate ? 1000.0f / io.Framerate : 0.0f );
 
+    const hydra::graphics::DeviceStatistics& statistics = gfx_device.get_last_frame_statistics();
+    ImGui::Text( "Submits: %u, state changes: %u issued, %u skipped", statistics.submits, statistics.issued_state_changes, statistics.skipped_state_changes );
+    ImGui::Text( "Command memory: %u bytes", statistics.command_memory );
+    ImGui::Text( "Dynamic memory: %u bytes", statistics.dynamic_memory );
+
+    hydra::graphics::SceneRendererStatistics scene_statistics;
+    scene_renderer.get_statistics( scene_statistics );
+    ImGui::Text( "Scene draws: %u, batches: %u, instances: %u", scene_statistics.draws, scene_statistics.batches, scene_statistics.instances );
+
+    const hydra::graphics::CullingStatistics& culling_statistics = main_render_view.culling_statistics;
+    ImGui::Text( "Culling: %u tested, %u culled, %u visible", culling_statistics.tested, culling_statistics.culled, culling_statistics.visible );
+
+    const hydra::ResourceCompileStatistics& compile_statistics = g_resource_manager.get_compile_statistics();
+    ImGui::Text( "Resources: %u up to date, %u compiled", compile_statistics.hits, compile_statistics.misses );
+
+    if ( geometry_arena ) {
+        hydra::graphics::GeometryArenaStatistics geometry_statistics;
+        geometry_arena->get_statistics( geometry_statistics );
+        ImGui::Text( "Geometry: %u allocations in %u pages, %zu/%zu KB, %u free ranges", geometry_statistics.allocations, geometry_statistics.pages,
+                     geometry_statistics.used_memory / 1024, geometry_statistics.reserved_memory / 1024, geometry_statistics.free_ranges );
+    }
+
     ImGui::Separator();
 
     ed::SetCurrentEditor( g_node_editor_context );
@@ -781,6 +508,10 @@ void RenderPipelineApplication::app_render( hydra::graphics::CommandBuffer* comm
         if ( ImGui::Button( "Reload Shaders" ) ) {
             reload_shaders = true;
         }
+
+        if ( ImGui::Button( "Defragment Geometry" ) ) {
+            defragment_geometry = true;
+        }
     }
 
     ImGui::End();
@@ -1363,7 +1094,7 @@ hydra::graphics::RenderPipeline* RenderPipelineManager::create_pipeline( hydra::
     graphics::BufferCreation checker_constants_creation = {};
     checker_constants_creation.type = graphics::BufferType::Constant;
     checker_constants_creation.name = "ShaderToyConstants";
-    checker_constants_creation.usage = graphics::ResourceUsageType::Dynamic;
+    checker_constants_creation.usage = graphics::ResourceUsageType::Stream;
     checker_constants_creation.size = 16;
     checker_constants_creation.initial_data = nullptr;
 
@@ -5,6 +5,10 @@
 #include "hydra/hydra_graphics.h"
 #include "hydra/hydra_rendering.h"
 
+namespace hydra {
+struct Resource;
+} // namespace hydra
+
 struct RenderPipelineTextureCreation {
 
     hydra::graphics::TextureCreation texture_creation;
@@ -133,11 +137,13 @@ struct RenderPipelineApplication : public hydra::Application {
     hydra::graphics::LineRenderer   line_renderer;
     hydra::graphics::LightingManager lighting_manager;
     hydra::graphics::RenderView     main_render_view;
+    hydra::Resource*                loading_scene;          // Loaded asynchronously, added to the main view once loaded.
 
     CameraInput                     camera_input;
     CameraMovementUpdate            camera_movement_update;
 
     bool                            show_grid;
     bool                            reload_shaders;
+    bool                            defragment_geometry;
 
 }; // struct RenderPipelineApplication
@@ -2,6 +2,15 @@
 
 #include <Windows.h>
 
+// SSE2 is always available on x64.
+#if defined(_M_X64) || defined(__SSE2__)
+    #define HFX_LEXER_SIMD
+    #include <emmintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #endif // _MSC_VER
+#endif // _M_X64 || __SSE2__
+
 //
 // DataBuffer ///////////////////////////////////////////////////////////////////
 void init_data_buffer( DataBuffer* data_buffer, uint32_t max_entries, uint32_t buffer_size ) {
@@ -66,24 +75,154 @@ void init_lexer( Lexer* lexer, char* text, DataBuffer* data_buffer ) {
     reset( data_buffer );
 }
 
+//
+// Character classes, to test a character with one lookup.
+enum CharacterClass {
+    CharacterClass_Whitespace       = 1 << 0,
+    CharacterClass_EndOfLine        = 1 << 1,
+    CharacterClass_Alpha            = 1 << 2,
+    CharacterClass_Number           = 1 << 3,
+    CharacterClass_Identifier       = 1 << 4,       // Characters following the first of an identifier: alpha, numbers and underscore.
+    CharacterClass_Space            = 1 << 5,       // Whitespaces without end of lines.
+    CharacterClass_LineComment      = 1 << 6,       // Anything but end of lines and null.
+    CharacterClass_BlockComment     = 1 << 7,       // Anything but '*', end of lines and null.
+}; // enum CharacterClass
+
+struct CharacterClassTable {
+
+    CharacterClassTable() {
+        for ( uint32_t c = 0; c < 256; ++c ) {
+            classes[c] = CharacterClass_LineComment | CharacterClass_BlockComment;
+        }
+        classes[0] = 0;
+        classes['*'] = CharacterClass_LineComment;
+
+        classes[' '] = classes['\t'] = classes['\v'] = classes['\f'] = CharacterClass_Whitespace | CharacterClass_Space | CharacterClass_LineComment | CharacterClass_BlockComment;
+        classes['\n'] = classes['\r'] = CharacterClass_Whitespace | CharacterClass_EndOfLine;
+
+        for ( uint32_t c = 'a'; c <= 'z'; ++c ) {
+            classes[c] = classes[c - 'a' + 'A'] = CharacterClass_Alpha | CharacterClass_Identifier | CharacterClass_LineComment | CharacterClass_BlockComment;
+        }
+        for ( uint32_t c = '0'; c <= '9'; ++c ) {
+            classes[c] = CharacterClass_Number | CharacterClass_Identifier | CharacterClass_LineComment | CharacterClass_BlockComment;
+        }
+        classes['_'] |= CharacterClass_Identifier;
+    }
+
+    uint8_t                         classes[256];
+
+}; // struct CharacterClassTable
+
+static const CharacterClassTable    s_character_classes;
+
+static inline bool is_class( char c, uint32_t character_class ) {
+    return ( s_character_classes.classes[(uint8_t)c] & character_class ) != 0;
+}
+
 bool IsEndOfLine( char c ) {
-    bool Result = ((c == '\n') || (c == '\r'));
-    return(Result);
+    return is_class( c, CharacterClass_EndOfLine );
 }
 
 bool IsWhitespace( char c ) {
-    bool Result = ((c == ' ') || (c == '\t') || (c == '\v') || (c == '\f') || IsEndOfLine( c ));
-    return(Result);
+    return is_class( c, CharacterClass_Whitespace );
 }
 
 bool IsAlpha( char c ) {
-    bool Result = (((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')));
-    return(Result);
+    return is_class( c, CharacterClass_Alpha );
 }
 
 bool IsNumber( char c ) {
-    bool Result = ((c >= '0') && (c <= '9'));
-    return(Result);
+    return is_class( c, CharacterClass_Number );
+}
+
+// Most runs are short: check some characters one by one before scanning 16 at a time.
+static const uint32_t               k_scalar_scan_length    = 16;
+
+#if defined(HFX_LEXER_SIMD)
+
+static inline uint32_t first_bit( uint32_t mask ) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward( &index, mask );
+    return index;
+#else
+    return __builtin_ctz( mask );
+#endif // _MSC_VER
+}
+
+// Signed comparisons: characters above 127 are never in the range.
+static inline __m128i in_range( __m128i characters, char first, char last ) {
+    return _mm_and_si128( _mm_cmpgt_epi8( characters, _mm_set1_epi8( first - 1 ) ), _mm_cmplt_epi8( characters, _mm_set1_epi8( last + 1 ) ) );
+}
+
+static inline __m128i match_class( __m128i characters, CharacterClass character_class ) {
+    switch ( character_class ) {
+        case CharacterClass_Space:
+        {
+            const __m128i matches = _mm_or_si128( _mm_cmpeq_epi8( characters, _mm_set1_epi8( ' ' ) ), _mm_cmpeq_epi8( characters, _mm_set1_epi8( '\t' ) ) );
+            return _mm_or_si128( matches, in_range( characters, '\v', '\f' ) );
+        }
+
+        case CharacterClass_Identifier:
+        {
+            __m128i matches = _mm_or_si128( in_range( characters, 'a', 'z' ), in_range( characters, 'A', 'Z' ) );
+            matches = _mm_or_si128( matches, in_range( characters, '0', '9' ) );
+            return _mm_or_si128( matches, _mm_cmpeq_epi8( characters, _mm_set1_epi8( '_' ) ) );
+        }
+
+        default:
+        {
+            // Comments: match the stop characters and invert.
+            __m128i stops = _mm_or_si128( _mm_cmpeq_epi8( characters, _mm_set1_epi8( '\n' ) ), _mm_cmpeq_epi8( characters, _mm_set1_epi8( '\r' ) ) );
+            stops = _mm_or_si128( stops, _mm_cmpeq_epi8( characters, _mm_setzero_si128() ) );
+            if ( character_class == CharacterClass_BlockComment ) {
+                stops = _mm_or_si128( stops, _mm_cmpeq_epi8( characters, _mm_set1_epi8( '*' ) ) );
+            }
+            return _mm_xor_si128( stops, _mm_set1_epi8( -1 ) );
+        }
+    }
+}
+
+//
+// Loads are aligned so they never cross a page: reading past the null terminator is safe.
+static inline char* scan_text_wide( char* position, CharacterClass character_class ) {
+
+    const uintptr_t offset = (uintptr_t)position & 15;
+    const char* block = position - offset;
+    uint32_t skipped_mask = ( 1u << offset ) - 1;     // Characters before the position in the first block.
+
+    for ( ;; ) {
+        const __m128i characters = _mm_load_si128( (const __m128i*)block );
+        const uint32_t stop_mask = ~( (uint32_t)_mm_movemask_epi8( match_class( characters, character_class ) ) | skipped_mask ) & 0xffff;
+        if ( stop_mask ) {
+            return (char*)block + first_bit( stop_mask );
+        }
+
+        block += 16;
+        skipped_mask = 0;
+    }
+}
+
+#else
+
+static inline char* scan_text_wide( char* position, CharacterClass character_class ) {
+    while ( is_class( *position, character_class ) ) {
+        ++position;
+    }
+    return position;
+}
+
+#endif // HFX_LEXER_SIMD
+
+//
+// Returns the first character not in the class. Null is never part of the scanned classes.
+static inline char* scan_text( char* position, CharacterClass character_class ) {
+    for ( uint32_t i = 0; i < k_scalar_scan_length; ++i, ++position ) {
+        if ( !is_class( *position, character_class ) ) {
+            return position;
+        }
+    }
+    return scan_text_wide( position, character_class );
 }
 
 void next_token( Lexer* lexer, Token& token ) {
@@ -104,6 +243,8 @@ void next_token( Lexer* lexer, Token& token ) {
         case '\0':
         {
             token.type = Token::Token_EndOfStream;
+            // Stay on the terminator: reading after the end returns end of stream again.
+            --lexer->position;
         } break;
         case '(':
         {
@@ -183,9 +324,7 @@ void next_token( Lexer* lexer, Token& token ) {
             if ( IsAlpha( c ) ) {
                 token.type = Token::Token_Identifier;
 
-                while ( IsAlpha( lexer->position[0] ) || IsNumber( lexer->position[0] ) || (lexer->position[0] == '_') ) {
-                    ++lexer->position;
-                }
+                lexer->position = scan_text( lexer->position, CharacterClass_Identifier );
 
                 token.text.length = lexer->position - token.text.text;
             } // Numbers: handle also negative ones!
@@ -268,35 +407,42 @@ void skip_whitespace( Lexer* lexer ) {
         // Check if it is a pure whitespace first.
         if ( IsWhitespace( lexer->position[0] ) ) {
             // Handle change of line
-            if ( IsEndOfLine( lexer->position[0] ) )
+            if ( IsEndOfLine( lexer->position[0] ) ) {
                 ++lexer->line;
-
-            // Advance to next character
-            ++lexer->position;
+                ++lexer->position;
+            }
+            else {
+                // Skip indentation in one go.
+                lexer->position = scan_text( lexer->position, CharacterClass_Space );
+            }
 
         } // Check for single line comments ("//")
         else if ( (lexer->position[0] == '/') && (lexer->position[1] == '/') ) {
-            lexer->position += 2;
-            while ( lexer->position[0] && !IsEndOfLine( lexer->position[0] ) ) {
-                ++lexer->position;
-            }
+            lexer->position = scan_text( lexer->position + 2, CharacterClass_LineComment );
         } // Check for c-style comments
         else if ( (lexer->position[0] == '/') && (lexer->position[1] == '*') ) {
             lexer->position += 2;
 
             // Advance until the string is closed. Remember to check if line is changed.
-            while ( !((lexer->position[0] == '*') && (lexer->position[1] == '/')) ) {
+            for ( ;; ) {
+                lexer->position = scan_text( lexer->position, CharacterClass_BlockComment );
+
+                const char c = lexer->position[0];
+                if ( c == 0 ) {
+                    // Unterminated comment.
+                    break;
+                }
+                else if ( c == '*' && lexer->position[1] == '/' ) {
+                    lexer->position += 2;
+                    break;
+                }
+
                 // Handle change of line
-                if ( IsEndOfLine( lexer->position[0] ) )
+                if ( IsEndOfLine( c ) )
                     ++lexer->line;
 
-                // Advance to next character
                 ++lexer->position;
             }
-
-            if ( lexer->position[0] == '*' ) {
-                lexer->position += 2;
-            }
         }
         else {
             break;
@@ -306,6 +452,14 @@ void skip_whitespace( Lexer* lexer ) {
 
 bool equals_token( Lexer* lexer, Token& token, Token::Type expected_type ) {
     next_token( lexer, token );
+
+    // An unexpected end of stream is an error, and ends the loops waiting for the token.
+    if ( token.type == Token::Token_EndOfStream && expected_type != Token::Token_EndOfStream ) {
+        lexer->error = true;
+        lexer->error_line = lexer->line;
+        return true;
+    }
+
     return token.type == expected_type;
 }
 
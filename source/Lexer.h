@@ -101,7 +101,7 @@ void                                next_token( Lexer* lexer, Token& out_token )
 void                                skip_whitespace( Lexer* lexer );
 void                                parse_number( Lexer* lexer );
 
-bool                                equals_token( Lexer* lexer, Token& out_token, Token::Type expected_type );    // Check for token, no error if different
+bool                                equals_token( Lexer* lexer, Token& out_token, Token::Type expected_type );    // Check for token, no error if different. End of stream is an error and returns true.
 bool                                expect_token( Lexer* lexer, Token& out_token, Token::Type expected_type );   // Advance to next token and expect a type, error if not present
 bool                                check_token( Lexer* lexer, Token& out_token, Token::Type expected_type );    // Check the current token for errors.
 
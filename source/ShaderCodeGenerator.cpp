@@ -12,26 +12,127 @@
 
 namespace hfx {
 
+static const size_t                 k_shader_effect_checksum_seed = 0x4b1d9a3cfe2d7705;
+static const uint32_t               k_max_option_name_length = 32;     // Size of the option names in the variant table.
+
 #if defined(HFX_PARSING)
 
+static const uint32_t k_max_symbol_length   = 256;
+static const uint32_t k_invalid_symbol      = 0xffffffff;
+
+static const uint32_t k_max_pass_options        = 16;       // Bits of the variant key.
+static const uint32_t k_max_pass_variant_keys   = 1024;
+static const uint32_t k_max_option_define_length = 40;      // OPTION_ + name.
+static const uint32_t k_max_property_array_count = 256;
+
+static const char* s_symbol_names[] = { "code fragment", "resource list", "property", "vertex layout", "render state", "sampler state" };
+
+static const size_t   k_parser_arena_block_size  = 64 * 1024;
+static const uint32_t k_symbol_table_min_capacity = 16;
+static const size_t   k_symbol_hash_seed        = 0x2f6b1e9d43ac8571;
+
+//
+// Parsed nodes live in the parser arena: they are never destroyed, only released with the arena.
+template <typename T>
+static T* new_node( Parser* parser ) {
+    static_assert( std::is_trivially_destructible<T>::value, "Parsed nodes are released with the arena, without destructors." );
+    return new ( parser->arena.allocate( sizeof( T ), alignof( T ) ) ) T();
+}
+
+//
+// Keywords dispatched by the parser.
+namespace Keyword {
+    enum Enum {
+        Shader, Glsl, Pass, Properties, Pipeline, Layout, Includes, RenderStates, SamplerStates,
+        Compute, Vertex, VertexLayout, Fragment, Resources, Stage, Options,
+        If, Defined, VertexDefine, FragmentDefine, ComputeDefine, Pragma, Include, IncludeHfx, Endif,
+        Uniform, Image2D, Sampler2D, Cbuffer, Texture2D, Texture2DRW,
+        Count, None = Count
+    };
+} // namespace Keyword
+
+static const char* s_keyword_names[Keyword::Count] = {
+    "shader", "glsl", "pass", "properties", "pipeline", "layout", "includes", "render_states", "sampler_states",
+    "compute", "vertex", "vertex_layout", "fragment", "resources", "stage", "options",
+    "if", "defined", "VERTEX", "FRAGMENT", "COMPUTE", "pragma", "include", "include_hfx", "endif",
+    "uniform", "image2D", "sampler2D", "cbuffer", "texture2D", "texture2Drw"
+};
+
+static const uint32_t k_keyword_table_bits      = 7;
+static const uint32_t k_keyword_table_size      = 1 << k_keyword_table_bits;
+
+static inline uint32_t keyword_slot( const char* text, size_t length, uint32_t seed ) {
+    const uint32_t key = (uint8_t)text[0] | ( (uint8_t)text[length - 1] << 8 ) | ( (uint8_t)text[length / 2] << 16 ) | ( (uint32_t)length << 24 );
+    return ( key * seed ) >> ( 32 - k_keyword_table_bits );
+}
+
+//
+// Perfect hash of the keywords: the seed is searched once at startup so that each keyword has its own slot.
+struct KeywordTable {
+
+    KeywordTable() {
+        for ( seed = 0x9e3779b1; ; seed += 2 ) {
+            memset( slots, Keyword::None, sizeof( slots ) );
+
+            uint32_t k = 0;
+            for ( ; k < Keyword::Count; ++k ) {
+                const uint32_t slot = keyword_slot( s_keyword_names[k], strlen( s_keyword_names[k] ), seed );
+                if ( slots[slot] != Keyword::None ) {
+                    break;
+                }
+                slots[slot] = (uint8_t)k;
+            }
+
+            if ( k == Keyword::Count ) {
+                break;
+            }
+        }
+    }
+
+    uint8_t                         slots[k_keyword_table_size];
+    uint32_t                        seed;
+
+}; // struct KeywordTable
+
+static const KeywordTable s_keyword_table;
+
+//
+// Returns the keyword matching the whole text, or Keyword::None.
+static Keyword::Enum find_keyword( const StringRef& text ) {
+    if ( text.length == 0 ) {
+        return Keyword::None;
+    }
+
+    const uint8_t keyword = s_keyword_table.slots[keyword_slot( text.text, text.length, s_keyword_table.seed )];
+    if ( keyword == Keyword::None || strncmp( text.text, s_keyword_names[keyword], text.length ) != 0 || s_keyword_names[keyword][text.length] != 0 ) {
+        return Keyword::None;
+    }
+
+    return (Keyword::Enum)keyword;
+}
+
 void init_parser( Parser* parser, Lexer* lexer ) {
 
     parser->lexer = lexer;
 
-    parser->string_buffer.init(1024 * 16);
-
-    parser->shader.name.length = 0;
-    parser->shader.name.text = nullptr;
-    parser->shader.pipeline_name.length = 0;
-    parser->shader.pipeline_name.text = nullptr;
-    parser->shader.passes.clear();
-    parser->shader.properties.clear();
-    parser->shader.resource_lists.clear();
-    parser->shader.code_fragments.clear();
+    parser->arena.init( k_parser_arena_block_size );
+    parser->shader = Shader();
+    parser->errors = 0;
 }
 
 void terminate_parser( Parser* parser ) {
-    parser->string_buffer.terminate();
+    parser->arena.terminate();
+    parser->shader = Shader();
+}
+
+void reset_parser( Parser* parser, Lexer* lexer ) {
+
+    parser->lexer = lexer;
+
+    // All the lists and nodes of the shader are in the arena.
+    parser->arena.reset();
+    parser->shader = Shader();
+    parser->errors = 0;
 }
 
 void generate_ast( Parser* parser ) {
@@ -64,245 +165,220 @@ void generate_ast( Parser* parser ) {
 
 void identifier( Parser* parser, const Token& token ) {
 
-    // Scan the name to know which 
-    for ( uint32_t i = 0; i < token.text.length; ++i ) {
-        char c = *(token.text.text + i);
+    switch ( find_keyword( token.text ) ) {
+        case Keyword::Shader:
+        {
+            declaration_shader( parser );
+            break;
+        }
 
-        switch ( c ) {
-            case 's':
-            {
-                if ( expect_keyword( token.text, 6, "shader" ) ) {
-                    declaration_shader( parser );
-                    return;
-                }
-                else if ( expect_keyword( token.text, 14, "sampler_states" ) ) {
-                    declaration_sampler_states( parser );
-                    return;
-                }
+        case Keyword::SamplerStates:
+        {
+            declaration_sampler_states( parser );
+            break;
+        }
 
-                break;
-            }
+        case Keyword::Glsl:
+        {
+            declaration_glsl( parser );
+            break;
+        }
 
-            case 'g':
-            {
-                if ( expect_keyword( token.text, 4, "glsl" ) ) {
-                    declaration_glsl( parser );
-                    return;
-                }
-                break;
-            }
+        case Keyword::Pass:
+        {
+            declaration_pass( parser );
+            break;
+        }
 
-            case 'p':
-            {
-                if ( expect_keyword( token.text, 4, "pass" ) ) {
-                    declaration_pass( parser );
-                    return;
-                }
-                else if ( expect_keyword( token.text, 10, "properties" ) ) {
-                    declaration_properties( parser );
-                    return;
-                }
-                else if ( expect_keyword( token.text, 8, "pipeline" ) ) {
-                    declaration_pipeline( parser );
-                    return;
-                }
+        case Keyword::Properties:
+        {
+            declaration_properties( parser );
+            break;
+        }
 
-                break;
-            }
+        case Keyword::Pipeline:
+        {
+            declaration_pipeline( parser );
+            break;
+        }
 
-            case 'l':
-            {
-                if ( expect_keyword( token.text, 6, "layout" ) ) {
-                    declaration_layout( parser );
-                    return;
-                }
-                break;
-            }
+        case Keyword::Layout:
+        {
+            declaration_layout( parser );
+            break;
+        }
 
-            case 'i':
-            {
-                if ( expect_keyword( token.text, 8, "includes" ) ) {
-                    declaration_includes( parser );
-                    return;
-                }
-                break;
-            }
+        case Keyword::Includes:
+        {
+            declaration_includes( parser );
+            break;
+        }
 
-            case 'r':
-            {
-                if ( expect_keyword( token.text, 13, "render_states" ) ) {
-                    declaration_render_states( parser );
-                    return;
-                }
-                break;
-            }
+        case Keyword::RenderStates:
+        {
+            declaration_render_states( parser );
+            break;
         }
+
+        default:
+            break;
     }
 }
 
 void pass_identifier( Parser* parser, const Token& token, Pass& pass ) {
-    // Scan the name to know which 
-    for ( uint32_t i = 0; i < token.text.length; ++i ) {
-        char c = *(token.text.text + i);
 
-        switch ( c ) {
+    switch ( find_keyword( token.text ) ) {
+        case Keyword::Compute:
+        {
+            Pass::ShaderStage stage = { nullptr, Stage::Compute };
+            declaration_shader_stage( parser, stage );
 
-            case 'c':
-            {
-                if ( expect_keyword( token.text, 7, "compute" ) ) {
-                    Pass::ShaderStage stage = { nullptr, Stage::Compute };
-                    declaration_shader_stage( parser, stage );
+            pass.shader_stages.push( parser->arena, stage );
+            break;
+        }
 
-                    pass.shader_stages.emplace_back( stage );
-                    return;
-                }
-                break;
-            }
+        case Keyword::Vertex:
+        {
+            Pass::ShaderStage stage = { nullptr, Stage::Vertex };
+            declaration_shader_stage( parser, stage );
 
-            case 'v':
-            {
-                if ( expect_keyword( token.text, 6, "vertex" ) ) {
-                    Pass::ShaderStage stage = { nullptr, Stage::Vertex };
-                    declaration_shader_stage( parser, stage );
+            pass.shader_stages.push( parser->arena, stage );
+            break;
+        }
 
-                    pass.shader_stages.emplace_back( stage );
-                    return;
-                }
-                else if ( expect_keyword( token.text, 13, "vertex_layout" ) ) {
-                    declaration_pass_vertex_layout( parser, pass );
-                }
-                break;
-            }
+        case Keyword::VertexLayout:
+        {
+            declaration_pass_vertex_layout( parser, pass );
+            break;
+        }
 
-            case 'f':
-            {
-                if ( expect_keyword( token.text, 8, "fragment" ) ) {
-                    Pass::ShaderStage stage = { nullptr, Stage::Fragment };
-                    declaration_shader_stage( parser, stage );
+        case Keyword::Fragment:
+        {
+            Pass::ShaderStage stage = { nullptr, Stage::Fragment };
+            declaration_shader_stage( parser, stage );
 
-                    pass.shader_stages.emplace_back( stage );
-                    return;
-                }
-                break;
-            }
+            pass.shader_stages.push( parser->arena, stage );
+            break;
+        }
 
-            case 'r':
-            {
-                if ( expect_keyword( token.text, 9, "resources" ) ) {
-                    declaration_pass_resources( parser, pass );
-                    return;
-                }
-                else if ( expect_keyword( token.text, 13, "render_states" ) ) {
-                    declaration_pass_render_states( parser, pass );
-                    return;
-                }
-                break;
-            }
+        case Keyword::Resources:
+        {
+            declaration_pass_resources( parser, pass );
+            break;
+        }
 
-            case 's':
-            {
-                if ( expect_keyword( token.text, 5, "stage" ) ) {
-                    declaration_pass_stage( parser, pass );
-                    return;
-                }
-                break;
-            }
+        case Keyword::RenderStates:
+        {
+            declaration_pass_render_states( parser, pass );
+            break;
+        }
+
+        case Keyword::Stage:
+        {
+            declaration_pass_stage( parser, pass );
+            break;
+        }
+
+        case Keyword::Options:
+        {
+            declaration_pass_options( parser, pass );
+            break;
         }
+
+        default:
+            break;
     }
 }
 
 void directive_identifier( Parser* parser, const Token& token, CodeFragment& code_fragment ) {
 
     Token new_token;
-    for ( uint32_t i = 0; i < token.text.length; ++i ) {
-        char c = *(token.text.text + i);
-
-        switch ( c ) {
-            case 'i':
-            {
-                // Search for the pattern 'if defined'
-                if ( expect_keyword( token.text, 2, "if" ) ) {
-                    next_token( parser->lexer, new_token );
-
-                    if ( expect_keyword( new_token.text, 7, "defined" ) ) {
-                        next_token( parser->lexer, new_token );
-
-                        // Use 0 as not set value for the ifdef depth.
-                        ++code_fragment.ifdef_depth;
-
-                        if ( expect_keyword( new_token.text, 6, "VERTEX" ) ) {
-
-                            code_fragment.stage_ifdef_depth[Stage::Vertex] = code_fragment.ifdef_depth;
-                            code_fragment.current_stage = Stage::Vertex;
-                        }
-                        else if ( expect_keyword( new_token.text, 8, "FRAGMENT" ) ) {
-
-                            code_fragment.stage_ifdef_depth[Stage::Fragment] = code_fragment.ifdef_depth;
-                            code_fragment.current_stage = Stage::Fragment;
-                        }
-                        else if ( expect_keyword( new_token.text, 7, "COMPUTE" ) ) {
-
-                            code_fragment.stage_ifdef_depth[Stage::Compute] = code_fragment.ifdef_depth;
-                            code_fragment.current_stage = Stage::Compute;
-                        }
+    switch ( find_keyword( token.text ) ) {
+        case Keyword::If:
+        {
+            // Search for the pattern 'if defined'
+            next_token( parser->lexer, new_token );
+
+            if ( find_keyword( new_token.text ) == Keyword::Defined ) {
+                next_token( parser->lexer, new_token );
+
+                // Use 0 as not set value for the ifdef depth.
+                ++code_fragment.ifdef_depth;
+
+                switch ( find_keyword( new_token.text ) ) {
+                    case Keyword::VertexDefine:
+                    {
+                        code_fragment.stage_ifdef_depth[Stage::Vertex] = code_fragment.ifdef_depth;
+                        code_fragment.current_stage = Stage::Vertex;
+                        break;
                     }
 
-                    return;
-                }
-                break;
-            }
-
-            case 'p':
-            {
-                if ( expect_keyword( token.text, 6, "pragma" ) ) {
-                    next_token( parser->lexer, new_token );
-
-                    if ( expect_keyword( new_token.text, 7, "include" ) ) {
-                        next_token( parser->lexer, new_token );
-
-                        code_fragment.includes.emplace_back( new_token.text );
-                        code_fragment.includes_flags.emplace_back( (uint32_t)code_fragment.current_stage );
+                    case Keyword::FragmentDefine:
+                    {
+                        code_fragment.stage_ifdef_depth[Stage::Fragment] = code_fragment.ifdef_depth;
+                        code_fragment.current_stage = Stage::Fragment;
+                        break;
                     }
-                    else if ( expect_keyword( new_token.text, 11, "include_hfx" ) ) {
-                        next_token( parser->lexer, new_token );
 
-                        code_fragment.includes.emplace_back( new_token.text );
-                        uint32_t flag = (uint32_t)code_fragment.current_stage | 0x10;   // 0x10 = local hfx.
-                        code_fragment.includes_flags.emplace_back( flag );
+                    case Keyword::ComputeDefine:
+                    {
+                        code_fragment.stage_ifdef_depth[Stage::Compute] = code_fragment.ifdef_depth;
+                        code_fragment.current_stage = Stage::Compute;
+                        break;
                     }
 
-                    return;
+                    default:
+                        break;
                 }
-                break;
             }
+            break;
+        }
 
-            case 'e':
-            {
-                if ( expect_keyword( token.text, 5, "endif" ) ) {
+        case Keyword::Pragma:
+        {
+            next_token( parser->lexer, new_token );
 
-                    if ( code_fragment.stage_ifdef_depth[Stage::Vertex] == code_fragment.ifdef_depth ) {
+            const Keyword::Enum include_keyword = find_keyword( new_token.text );
+            if ( include_keyword == Keyword::Include ) {
+                next_token( parser->lexer, new_token );
 
-                        code_fragment.stage_ifdef_depth[Stage::Vertex] = 0xffffffff;
-                        code_fragment.current_stage = Stage::Count;
-                    }
-                    else if ( code_fragment.stage_ifdef_depth[Stage::Fragment] == code_fragment.ifdef_depth ) {
+                code_fragment.includes.push( parser->arena, new_token.text );
+                code_fragment.includes_flags.push( parser->arena, (uint32_t)code_fragment.current_stage );
+            }
+            else if ( include_keyword == Keyword::IncludeHfx ) {
+                next_token( parser->lexer, new_token );
 
-                        code_fragment.stage_ifdef_depth[Stage::Fragment] = 0xffffffff;
-                        code_fragment.current_stage = Stage::Count;
-                    }
-                    else if ( code_fragment.stage_ifdef_depth[Stage::Compute] == code_fragment.ifdef_depth ) {
+                code_fragment.includes.push( parser->arena, new_token.text );
+                uint32_t flag = (uint32_t)code_fragment.current_stage | 0x10;   // 0x10 = local hfx.
+                code_fragment.includes_flags.push( parser->arena, flag );
+            }
+            break;
+        }
 
-                        code_fragment.stage_ifdef_depth[Stage::Compute] = 0xffffffff;
-                        code_fragment.current_stage = Stage::Count;
-                    }
+        case Keyword::Endif:
+        {
+            if ( code_fragment.stage_ifdef_depth[Stage::Vertex] == code_fragment.ifdef_depth ) {
+
+                code_fragment.stage_ifdef_depth[Stage::Vertex] = 0xffffffff;
+                code_fragment.current_stage = Stage::Count;
+            }
+            else if ( code_fragment.stage_ifdef_depth[Stage::Fragment] == code_fragment.ifdef_depth ) {
 
-                    --code_fragment.ifdef_depth;
+                code_fragment.stage_ifdef_depth[Stage::Fragment] = 0xffffffff;
+                code_fragment.current_stage = Stage::Count;
+            }
+            else if ( code_fragment.stage_ifdef_depth[Stage::Compute] == code_fragment.ifdef_depth ) {
 
-                    return;
-                }
-                break;
+                code_fragment.stage_ifdef_depth[Stage::Compute] = 0xffffffff;
+                code_fragment.current_stage = Stage::Count;
             }
+
+            --code_fragment.ifdef_depth;
+            break;
         }
+
+        default:
+            break;
     }
 }
 
@@ -310,37 +386,30 @@ void directive_identifier( Parser* parser, const Token& token, CodeFragment& cod
 //
 void uniform_identifier( Parser* parser, const Token& token, CodeFragment& code_fragment ) {
 
-    for ( uint32_t i = 0; i < token.text.length; ++i ) {
-        char c = *(token.text.text + i);
+    hydra::graphics::ResourceType::Enum type;
+    switch ( find_keyword( token.text ) ) {
+        case Keyword::Image2D:
+        {
+            type = hydra::graphics::ResourceType::TextureRW;
+            break;
+        }
 
-        switch ( c ) {
-            case 'i':
-            {
-                if ( expect_keyword( token.text, 7, "image2D" ) ) {
-                    // Advance to next token to get the name
-                    Token name_token;
-                    next_token( parser->lexer, name_token );
+        case Keyword::Sampler2D:
+        {
+            type = hydra::graphics::ResourceType::Texture;
+            break;
+        }
 
-                    CodeFragment::Resource resource = { hydra::graphics::ResourceType::TextureRW, name_token.text };
-                    code_fragment.resources.emplace_back( resource );
-                }
-                break;
-            }
+        default:
+            return;
+    }
 
-            case 's':
-            {
-                if ( expect_keyword( token.text, 9, "sampler2D" ) ) {
-                    // Advance to next token to get the name
-                    Token name_token;
-                    next_token( parser->lexer, name_token );
+    // Advance to next token to get the name
+    Token name_token;
+    next_token( parser->lexer, name_token );
 
-                    CodeFragment::Resource resource = { hydra::graphics::ResourceType::Texture, name_token.text };
-                    code_fragment.resources.emplace_back( resource );
-                }
-                break;
-            }
-        }
-    }
+    CodeFragment::Resource resource = { type, name_token.text };
+    code_fragment.resources.push( parser->arena, resource );
 }
 
 //
@@ -430,79 +499,44 @@ void resource_binding_identifier( Parser* parser, const Token& token, ResourceBi
 
     Token other_token;
 
-    for ( uint32_t i = 0; i < token.text.length; ++i ) {
-        char c = *(token.text.text + i);
-
-        switch ( c ) {
-            case 'c':
-            {
-                if ( expect_keyword( token.text, 7, "cbuffer" ) ) {
-                    binding.type = hydra::graphics::ResourceType::Constants;
-                    binding.start = 0;
-                    binding.count = 1;
-
-                    next_token( parser->lexer, other_token );
-                    copy( other_token.text, binding.name, 32 );
-
-                    flags = find_property( parser, other_token.text ) ? 1 : 0;
-
-                    return;
-                }
-                break;
-            }
-
-            case 't':
-            {
-                if ( expect_keyword( token.text, 9, "texture2D" ) ) {
-                    binding.type = hydra::graphics::ResourceType::Texture;
-                    binding.start = 0;
-                    binding.count = 1;
-
-                    next_token( parser->lexer, other_token );
-
-                    copy( other_token.text, binding.name, 32 );
-
-                    flags = find_property( parser, other_token.text ) ? 1 : 0;
-
-                    return;
-                }
-                else if ( expect_keyword( token.text, 11, "texture2Drw" ) ) {
-                    binding.type = hydra::graphics::ResourceType::TextureRW;
-                    binding.start = 0;
-                    binding.count = 1;
-
-                    next_token( parser->lexer, other_token );
-                    next_token( parser->lexer, other_token );
-
-                    copy( other_token.text, binding.name, 32 );
-
-                    flags = find_property( parser, other_token.text ) ? 1 : 0;
+    switch ( find_keyword( token.text ) ) {
+        case Keyword::Cbuffer:
+        {
+            binding.type = hydra::graphics::ResourceType::Constants;
+            break;
+        }
 
-                    return;
-                }
+        case Keyword::Texture2D:
+        {
+            binding.type = hydra::graphics::ResourceType::Texture;
+            break;
+        }
 
-                break;
-            }
+        case Keyword::Texture2DRW:
+        {
+            binding.type = hydra::graphics::ResourceType::TextureRW;
+            // Skip the format.
+            next_token( parser->lexer, other_token );
+            break;
+        }
 
-            case 's':
-            {
-                if ( expect_keyword( token.text, 9, "sampler2D" ) ) {
-                    binding.type = hydra::graphics::ResourceType::Sampler;
-                    binding.start = 0;
-                    binding.count = 1;
+        case Keyword::Sampler2D:
+        {
+            binding.type = hydra::graphics::ResourceType::Sampler;
+            break;
+        }
 
-                    next_token( parser->lexer, other_token );
+        default:
+            return;
+    }
 
-                    copy( other_token.text, binding.name, 32 );
+    binding.start = 0;
+    binding.count = 1;
 
-                    flags = find_property( parser, other_token.text ) ? 1 : 0;
+    next_token( parser->lexer, other_token );
+    copy( other_token.text, binding.name, 32 );
 
-                    return;
-                }
-                break;
-            }
-        }
-    }
+    flags = find_property( parser, other_token.text ) ? 1 : 0;
 }
 
 //
@@ -644,109 +678,179 @@ void vertex_binding_identifier( Parser* parser, Token& token, hydra::graphics::V
 }
 
 //
-//
-const CodeFragment* find_code_fragment( const Parser* parser, const StringRef& name ) {
-    const uint32_t code_fragments_count = (uint32_t)parser->shader.code_fragments.size();
-    for ( uint32_t i = 0; i < code_fragments_count; ++i ) {
-        const CodeFragment* type = &parser->shader.code_fragments[i];
-        if ( equals( name, type->name ) ) {
-            return type;
-        }
+// Elements of included shaders are named "Shader.name": find the included shader and the name inside it.
+static const Shader* find_included_shader( const Shader& shader, const StringRef& name, StringRef& out_local_name ) {
+    const char* separator = (const char*)memchr( name.text, '.', name.length );
+    if ( !separator ) {
+        return nullptr;
     }
-    return nullptr;
-}
 
-//
-//
-const ResourceList* find_resource_list( const Parser* parser, const StringRef& name ) {
-    const std::vector<const ResourceList*>& declared_resources = parser->shader.resource_lists;
+    StringRef shader_name;
+    shader_name.text = name.text;
+    shader_name.length = separator - name.text;
 
-    for ( size_t i = 0; i < declared_resources.size(); i++ ) {
-        const ResourceList* list = declared_resources[i];
-        if ( equals( name, list->name ) ) {
-            return list;
+    for ( size_t i = 0; i < shader.included_shaders.size(); ++i ) {
+        const Shader* included_shader = shader.included_shaders[i];
+        if ( equals( shader_name, included_shader->name ) ) {
+            out_local_name.text = name.text + shader_name.length + 1;
+            out_local_name.length = name.length - shader_name.length - 1;
+            return included_shader;
         }
     }
     return nullptr;
 }
 
 //
-//
-const Property* find_property( const Parser* parser, const StringRef& name ) {
-    const std::vector<Property*>& properties = parser->shader.properties;
-    for ( size_t i = 0; i < properties.size(); i++ ) {
-        const Property* list = properties[i];
-        if ( equals( name, list->name ) ) {
-            return list;
-        }
+// Returns the index of the declaration in the list of its kind, or k_invalid_symbol.
+static uint32_t find_symbol( const Shader& shader, Symbol::Enum kind, const StringRef& name ) {
+    const SymbolTable& symbols = shader.symbols[kind];
+    if ( symbols.count == 0 ) {
+        return k_invalid_symbol;
     }
-    return nullptr;
-}
 
-//
-//
-const VertexLayout* find_vertex_layout( const Parser* parser, const StringRef& name ) {
-    const std::vector<const VertexLayout*>& layouts = parser->shader.vertex_layouts;
-    for ( size_t i = 0; i < layouts.size(); i++ ) {
-        const VertexLayout* layout = layouts[i];
-        if ( equals( name, layout->name ) ) {
-            return layout;
+    const uint32_t mask = symbols.capacity - 1;
+    for ( uint32_t slot = (uint32_t)hash_bytes( name.text, name.length, k_symbol_hash_seed ) & mask; symbols.names[slot].text; slot = ( slot + 1 ) & mask ) {
+        if ( equals( symbols.names[slot], name ) ) {
+            return symbols.values[slot];
         }
     }
-    return nullptr;
+    return k_invalid_symbol;
 }
 
-const RenderState* find_render_state( const Parser* parser, const StringRef& name ) {
-    const std::vector<const RenderState*>& render_states = parser->shader.render_states;
-    for ( size_t i = 0; i < render_states.size(); i++ ) {
-        const RenderState* render_state = render_states[i];
-        if ( equals( name, render_state->name ) ) {
-            return render_state;
-        }
+//
+// Insert without checking for duplicates. The table must have a free slot.
+static void insert_symbol( SymbolTable& symbols, const StringRef& name, uint32_t value ) {
+    const uint32_t mask = symbols.capacity - 1;
+    uint32_t slot = (uint32_t)hash_bytes( name.text, name.length, k_symbol_hash_seed ) & mask;
+    while ( symbols.names[slot].text ) {
+        slot = ( slot + 1 ) & mask;
     }
-    return nullptr;
-}
 
-const SamplerState* find_sampler_state( const Parser* parser, const StringRef& name ) {
-    const std::vector<const SamplerState*>& sampler_states = parser->shader.sampler_states;
-    for ( size_t i = 0; i < sampler_states.size(); i++ ) {
-        const SamplerState* state = sampler_states[i];
-        if ( equals( name, state->name ) ) {
-            return state;
-        }
-    }
-    return nullptr;
+    symbols.names[slot] = name;
+    symbols.values[slot] = value;
+    ++symbols.count;
 }
 
-
-//
 //
-void declaration_shader( Parser* parser ) {
-    // Parse name
-    Token token;
-    if ( !expect_token( parser->lexer, token, Token::Token_Identifier ) ) {
+// Add the declaration with the given index in its list. Duplicated names are reported and the first declaration is kept.
+static void add_symbol( Parser* parser, Symbol::Enum kind, const StringRef& name, size_t index ) {
+    if ( find_symbol( parser->shader, kind, name ) != k_invalid_symbol ) {
+        HYDRA_LOG( "Error: %s %.*s already declared in shader %.*s.\n", s_symbol_names[kind], (int)name.length, name.text, (int)parser->shader.name.length, parser->shader.name.text );
+        ++parser->errors;
         return;
     }
 
-    // Cache name string
-    parser->shader.name = token.text;
+    SymbolTable& symbols = parser->shader.symbols[kind];
+    // Keep the load under 3/4, rehashing into a table twice as big. The old one is released with the arena.
+    if ( ( symbols.count + 1 ) * 4 > symbols.capacity * 3 ) {
+        SymbolTable old_symbols = symbols;
 
-    if ( !expect_token( parser->lexer, token, Token::Token_OpenBrace ) ) {
-        return;
+        symbols.capacity = symbols.capacity ? symbols.capacity * 2 : k_symbol_table_min_capacity;
+        symbols.count = 0;
+        symbols.names = (StringRef*)parser->arena.allocate( sizeof( StringRef ) * symbols.capacity, alignof( StringRef ) );
+        symbols.values = (uint32_t*)parser->arena.allocate( sizeof( uint32_t ) * symbols.capacity, alignof( uint32_t ) );
+        memset( symbols.names, 0, sizeof( StringRef ) * symbols.capacity );
+
+        for ( uint32_t i = 0; i < old_symbols.capacity; ++i ) {
+            if ( old_symbols.names[i].text ) {
+                insert_symbol( symbols, old_symbols.names[i], old_symbols.values[i] );
+            }
+        }
     }
 
-    while ( !equals_token( parser->lexer, token, Token::Token_CloseBrace ) ) {
+    insert_symbol( symbols, name, (uint32_t)index );
+}
 
-        identifier( parser, token );
+//
+//
+static const CodeFragment* find_code_fragment( const Shader& shader, const StringRef& name ) {
+    const uint32_t index = find_symbol( shader, Symbol::CodeFragment, name );
+    if ( index != k_invalid_symbol ) {
+        return &shader.code_fragments[index];
     }
+
+    StringRef local_name;
+    const Shader* included_shader = find_included_shader( shader, name, local_name );
+    return included_shader ? find_code_fragment( *included_shader, local_name ) : nullptr;
 }
 
 //
 //
-void declaration_glsl( Parser* parser ) {
+const CodeFragment* find_code_fragment( const Parser* parser, const StringRef& name ) {
+    return find_code_fragment( parser->shader, name );
+}
 
-    // Parse name
-    Token token;
+//
+//
+static const ResourceList* find_resource_list( const Shader& shader, const StringRef& name ) {
+    const uint32_t index = find_symbol( shader, Symbol::ResourceList, name );
+    if ( index != k_invalid_symbol ) {
+        return shader.resource_lists[index];
+    }
+
+    StringRef local_name;
+    const Shader* included_shader = find_included_shader( shader, name, local_name );
+    return included_shader ? find_resource_list( *included_shader, local_name ) : nullptr;
+}
+
+//
+//
+const ResourceList* find_resource_list( const Parser* parser, const StringRef& name ) {
+    return find_resource_list( parser->shader, name );
+}
+
+//
+//
+const Property* find_property( const Parser* parser, const StringRef& name ) {
+    const uint32_t index = find_symbol( parser->shader, Symbol::Property, name );
+    return index != k_invalid_symbol ? parser->shader.properties[index] : nullptr;
+}
+
+//
+//
+const VertexLayout* find_vertex_layout( const Parser* parser, const StringRef& name ) {
+    const uint32_t index = find_symbol( parser->shader, Symbol::VertexLayout, name );
+    return index != k_invalid_symbol ? parser->shader.vertex_layouts[index] : nullptr;
+}
+
+const RenderState* find_render_state( const Parser* parser, const StringRef& name ) {
+    const uint32_t index = find_symbol( parser->shader, Symbol::RenderState, name );
+    return index != k_invalid_symbol ? parser->shader.render_states[index] : nullptr;
+}
+
+const SamplerState* find_sampler_state( const Parser* parser, const StringRef& name ) {
+    const uint32_t index = find_symbol( parser->shader, Symbol::SamplerState, name );
+    return index != k_invalid_symbol ? parser->shader.sampler_states[index] : nullptr;
+}
+
+//
+//
+void declaration_shader( Parser* parser ) {
+    // Parse name
+    Token token;
+    if ( !expect_token( parser->lexer, token, Token::Token_Identifier ) ) {
+        return;
+    }
+
+    // Cache name string
+    parser->shader.name = token.text;
+
+    if ( !expect_token( parser->lexer, token, Token::Token_OpenBrace ) ) {
+        return;
+    }
+
+    while ( !equals_token( parser->lexer, token, Token::Token_CloseBrace ) ) {
+
+        identifier( parser, token );
+    }
+}
+
+//
+//
+void declaration_glsl( Parser* parser ) {
+
+    // Parse name
+    Token token;
     if ( !expect_token( parser->lexer, token, Token::Token_Identifier ) ) {
         return;
     }
@@ -772,6 +876,12 @@ void declaration_glsl( Parser* parser ) {
     // Scan until close brace token
     while ( open_braces ) {
 
+        if ( token.type == Token::Token_EndOfStream ) {
+            HYDRA_LOG( "Error: glsl %.*s is not closed.\n", (int)code_fragment.name.length, code_fragment.name.text );
+            ++parser->errors;
+            break;
+        }
+
         if ( token.type == Token::Token_OpenBrace )
             ++open_braces;
         else if ( token.type == Token::Token_CloseBrace )
@@ -787,7 +897,7 @@ void declaration_glsl( Parser* parser ) {
         else if ( token.type == Token::Token_Identifier ) {
 
             // Parse uniforms to add resource dependencies if not explicit in the HFX file.
-            if ( expect_keyword( token.text, 7, "uniform" ) ) {
+            if ( find_keyword( token.text ) == Keyword::Uniform ) {
                 next_token( parser->lexer, token );
 
                 uniform_identifier( parser, token, code_fragment );
@@ -802,7 +912,8 @@ void declaration_glsl( Parser* parser ) {
     // Calculate code string length using the token before the last close brace.
     code_fragment.code.length = token.text.text - code_fragment.code.text;
 
-    parser->shader.code_fragments.emplace_back( code_fragment );
+    add_symbol( parser, Symbol::CodeFragment, code_fragment.name, parser->shader.code_fragments.size() );
+    parser->shader.code_fragments.push( parser->arena, code_fragment );
 }
 
 //
@@ -826,7 +937,7 @@ void declaration_pass( Parser* parser ) {
         pass_identifier( parser, token, pass );
     }
 
-    parser->shader.passes.emplace_back( pass );
+    parser->shader.passes.push( parser->arena, pass );
 }
 
 //
@@ -876,6 +987,12 @@ void declaration_properties( Parser* parser ) {
     // Scan until close brace token
     while ( open_braces ) {
 
+        if ( token.type == Token::Token_EndOfStream ) {
+            HYDRA_LOG( "Error: properties are not closed.\n" );
+            ++parser->errors;
+            break;
+        }
+
         if ( token.type == Token::Token_OpenBrace )
             ++open_braces;
         else if ( token.type == Token::Token_CloseBrace )
@@ -900,7 +1017,7 @@ void declaration_properties( Parser* parser ) {
 // Default_value is optional and depends on the type.
 //
 void declaration_property( Parser* parser, const StringRef& name ) {
-    Property* property = new Property();
+    Property* property = new_node<Property>( parser );
 
     // Cache name
     property->name = name;
@@ -957,6 +1074,29 @@ void declaration_property( Parser* parser, const StringRef& name ) {
         property->ui_arguments.length = token.text.text - property->ui_arguments.text;
     }
 
+    // Optional array count: type[count]
+    if ( token.type == Token::Token_OpenBracket ) {
+        if ( !expect_token( parser->lexer, token, Token::Token_Number ) ) {
+            return;
+        }
+
+        float array_count = 0.0f;
+        get_data( *parser->lexer->data_buffer, parser->lexer->data_buffer->current_entries - 1, array_count );
+        property->array_count = (uint32_t)array_count;
+
+        if ( !expect_token( parser->lexer, token, Token::Token_CloseBracket ) ) {
+            return;
+        }
+
+        if ( property->array_count == 0 || property->array_count > k_max_property_array_count || get_property_components( property->type ) == 0 ) {
+            HYDRA_LOG( "Error: property %.*s can not be an array of %u elements.\n", (int)property->name.length, property->name.text, property->array_count );
+            ++parser->errors;
+            property->array_count = 0;
+        }
+
+        next_token( parser->lexer, token );
+    }
+
     if ( !check_token( parser->lexer, token, Token::Token_CloseParen ) ) {
         return;
     }
@@ -972,12 +1112,24 @@ void declaration_property( Parser* parser, const StringRef& name ) {
         next_token( parser->lexer, token );
 
         if ( token.type == Token::Token_Number ) {
-            // Cache the data buffer entry index into the property for later retrieval.
-            property->data_index = parser->lexer->data_buffer->current_entries - 1;
+            float value = 0.0f;
+            get_data( *parser->lexer->data_buffer, parser->lexer->data_buffer->current_entries - 1, value );
+            property->default_values.push( parser->arena, value );
         }
         else if ( token.type == Token::Token_OpenParen ) {
-            // TODO: Colors and Vectors
-            // (number0, number1, ...)
+            // Colors, vectors and arrays: (number0, number1, ...)
+            while ( !equals_token( parser->lexer, token, Token::Token_CloseParen ) ) {
+
+                if ( token.type == Token::Token_Number ) {
+                    float value = 0.0f;
+                    get_data( *parser->lexer->data_buffer, parser->lexer->data_buffer->current_entries - 1, value );
+                    property->default_values.push( parser->arena, value );
+                }
+                else if ( token.type != Token::Token_Comma ) {
+                    HYDRA_LOG( "Error: expected number in the default value of property %.*s.\n", (int)property->name.length, property->name.text );
+                    ++parser->errors;
+                }
+            }
         }
         else if ( token.type == Token::Token_String ) {
             // Texture.
@@ -991,7 +1143,8 @@ void declaration_property( Parser* parser, const StringRef& name ) {
         *parser->lexer = cached_lexer;
     }
 
-    parser->shader.properties.push_back( property );
+    add_symbol( parser, Symbol::Property, property->name, parser->shader.properties.size() );
+    parser->shader.properties.push( parser->arena, property );
 }
 
 //
@@ -1012,12 +1165,13 @@ void declaration_layout( Parser* parser ) {
                 // Advance to next token
                 next_token( parser->lexer, token );
 
-                ResourceList* resource_list = new ResourceList();
+                ResourceList* resource_list = new_node<ResourceList>( parser );
                 resource_list->name = token.text;
 
                 declaration_resource_list( parser, *resource_list );
 
-                parser->shader.resource_lists.emplace_back( resource_list );
+                add_symbol( parser, Symbol::ResourceList, resource_list->name, parser->shader.resource_lists.size() );
+                parser->shader.resource_lists.push( parser->arena, resource_list );
 
                 // Having at least one list declared, disable automatic list generation.
                 parser->shader.has_local_resource_list = true;
@@ -1026,12 +1180,13 @@ void declaration_layout( Parser* parser ) {
 
                 next_token( parser->lexer, token );
 
-                VertexLayout* vertex_layout = new VertexLayout();
+                VertexLayout* vertex_layout = new_node<VertexLayout>( parser );
                 vertex_layout->name = token.text;
 
                 declaration_vertex_layout( parser, *vertex_layout );
 
-                parser->shader.vertex_layouts.emplace_back( vertex_layout );
+                add_symbol( parser, Symbol::VertexLayout, vertex_layout->name, parser->shader.vertex_layouts.size() );
+                parser->shader.vertex_layouts.push( parser->arena, vertex_layout );
             }
         }
     }
@@ -1049,11 +1204,11 @@ void declaration_resource_list( Parser* parser, ResourceList& resource_list ) {
     while ( !equals_token( parser->lexer, token, Token::Token_CloseBrace ) ) {
 
         if ( token.type == Token::Token_Identifier ) {
-            ResourceBinding binding;
+            ResourceBinding binding = {};
             uint32_t flags = 0;
             resource_binding_identifier( parser, token, binding, flags );
-            resource_list.resources.emplace_back( binding );
-            resource_list.flags.emplace_back( flags );
+            resource_list.resources.push( parser->arena, binding );
+            resource_list.flags.push( parser->arena, flags );
         }
     }
 }
@@ -1078,7 +1233,7 @@ void declaration_vertex_layout( Parser* parser, VertexLayout& vertex_layout ) {
                 next_token( parser->lexer, token );
 
                 vertex_attribute_identifier( parser, token, vertex_attribute );
-                vertex_layout.attributes.emplace_back( vertex_attribute );
+                vertex_layout.attributes.push( parser->arena, vertex_attribute );
             }
             else if ( expect_keyword( token.text, 7, "binding" ) ) {
                 hydra::graphics::VertexStream vertex_stream_binding;
@@ -1087,7 +1242,7 @@ void declaration_vertex_layout( Parser* parser, VertexLayout& vertex_layout ) {
                 next_token( parser->lexer, token );
 
                 vertex_binding_identifier( parser, token, vertex_stream_binding );
-                vertex_layout.streams.emplace_back( vertex_stream_binding );
+                vertex_layout.streams.push( parser->arena, vertex_stream_binding );
             }
         }
     }
@@ -1110,12 +1265,13 @@ void declaration_render_states( Parser* parser ) {
                 // Advance to next token
                 next_token( parser->lexer, token );
 
-                RenderState* render_state = new RenderState();
+                RenderState* render_state = new_node<RenderState>( parser );
                 render_state->name = token.text;
 
                 declaration_render_state( parser, *render_state );
 
-                parser->shader.render_states.emplace_back( render_state );
+                add_symbol( parser, Symbol::RenderState, render_state->name, parser->shader.render_states.size() );
+                parser->shader.render_states.push( parser->arena, render_state );
             }
         }
     }
@@ -1242,12 +1398,13 @@ void declaration_sampler_states( Parser* parser ) {
                 // Advance to next token
                 next_token( parser->lexer, token );
 
-                SamplerState* state = new SamplerState();
+                SamplerState* state = new_node<SamplerState>( parser );
                 state->name = token.text;
 
                 declaration_sampler_state( parser, *state );
 
-                parser->shader.sampler_states.emplace_back( state );
+                add_symbol( parser, Symbol::SamplerState, state->name, parser->shader.sampler_states.size() );
+                parser->shader.sampler_states.push( parser->arena, state );
             }
         }
     }
@@ -1315,7 +1472,7 @@ void declaration_pass_resources( Parser* parser, Pass& pass ) {
     // Now token contains the name of the resource list
     const ResourceList* resource_list = find_resource_list( parser, token.text );
     if ( resource_list ) {
-        pass.resource_lists.emplace_back( resource_list );
+        pass.resource_lists.push( parser->arena, resource_list );
     }
     else {
         // Error
@@ -1370,6 +1527,64 @@ void declaration_pass_render_states( Parser* parser, Pass& pass ) {
     }
 }
 
+//
+// options = (a, b, c): at most one option of the group is enabled, each one is a bit of the pass variant key.
+void declaration_pass_options( Parser* parser, Pass& pass ) {
+    Token token;
+
+    if ( !expect_token( parser->lexer, token, Token::Token_Equals ) ) {
+        return;
+    }
+
+    if ( !expect_token( parser->lexer, token, Token::Token_OpenParen ) ) {
+        return;
+    }
+
+    uint32_t group_mask = 0;
+    while ( !equals_token( parser->lexer, token, Token::Token_CloseParen ) ) {
+
+        if ( token.type == Token::Token_Comma ) {
+            continue;
+        }
+
+        if ( token.type != Token::Token_Identifier ) {
+            HYDRA_LOG( "Error: expected option name in pass %.*s.\n", (int)pass.name.length, pass.name.text );
+            ++parser->errors;
+            continue;
+        }
+
+        bool duplicated = false;
+        for ( size_t i = 0; i < pass.options.size(); ++i ) {
+            duplicated |= equals( pass.options[i], token.text );
+        }
+
+        if ( duplicated ) {
+            HYDRA_LOG( "Error: option %.*s already declared in pass %.*s.\n", (int)token.text.length, token.text.text, (int)pass.name.length, pass.name.text );
+            ++parser->errors;
+            continue;
+        }
+
+        if ( token.text.length >= k_max_option_name_length ) {
+            HYDRA_LOG( "Error: option %.*s is longer than %u characters.\n", (int)token.text.length, token.text.text, k_max_option_name_length - 1 );
+            ++parser->errors;
+            continue;
+        }
+
+        if ( pass.options.size() == k_max_pass_options ) {
+            HYDRA_LOG( "Error: pass %.*s has more than %u options.\n", (int)pass.name.length, pass.name.text, k_max_pass_options );
+            ++parser->errors;
+            continue;
+        }
+
+        group_mask |= 1 << pass.options.size();
+        pass.options.push( parser->arena, token.text );
+    }
+
+    if ( group_mask ) {
+        pass.option_groups.push( parser->arena, group_mask );
+    }
+}
+
 //
 //
 void declaration_includes( Parser* parser ) {
@@ -1382,73 +1597,140 @@ void declaration_includes( Parser* parser ) {
     while ( !equals_token( parser->lexer, token, Token::Token_CloseBrace ) ) {
 
         if ( token.type == Token::Token_String ) {
-            StringBuffer path_buffer;
-            path_buffer.init( 256 );
+            if ( !parser->include_cache ) {
+                HYDRA_LOG( "Cannot parse include %.*s without an include cache.\n", (int)token.text.length, token.text.text );
+                ++parser->errors;
+                continue;
+            }
 
-            path_buffer.append( "..\\data\\source\\" );
-            path_buffer.append( token.text );
+            // Missing includes, cycles and errors inside the include fail the including shader too.
+            const IncludeCache::Entry* include = get_include( *parser->include_cache, token.text );
+            if ( !include || include->parser.errors || include->lexer.error ) {
+                ++parser->errors;
+            }
 
-            char* text = hydra::read_file_into_memory( path_buffer.data, nullptr );
-            if ( text ) {
-                Lexer lexer;
-                DataBuffer data_buffer;
+            if ( include ) {
+                // Included elements are found through the included shader, not copied.
+                const Shader& included_shader = include->parser.shader;
+                parser->shader.included_shaders.push( parser->arena, &included_shader );
 
-                init_data_buffer( &data_buffer, 256, 2048 );
-                init_lexer( &lexer, text, &data_buffer );
+                // Track included files, nested ones too: they are dependencies of the compiled effect.
+                parser->shader.hfx_includes.push( parser->arena, token.text );
+                parser->shader.hfx_includes.append( parser->arena, included_shader.hfx_includes );
+            }
+        }
+    }
+}
 
-                Parser local_parser;
-                hfx::init_parser( &local_parser, &lexer );
-                hfx::generate_ast( &local_parser );
+//
+// IncludeCache ///////////////////////////////////////////////////////////////////////////////
+//
 
-                // TODO: cleanup code!
+static const uint32_t k_max_include_path_length = 512;
 
-                // Merge parsing results
-                hfx::Shader& shader = local_parser.shader;
-                // Merge resource lists
-                std::vector<const ResourceList*>& local_resource_lists = shader.resource_lists;
-                for ( size_t i = 0; i < local_resource_lists.size(); ++i ) {
-                    const ResourceList* resource_list = local_resource_lists[i];
-                    // Rename this resource list to give context.
+void init_include_cache( IncludeCache& cache ) {
+    cache.path_to_entry = nullptr;
+    cache.path_to_file = nullptr;
 
-                    char* new_name = parser->string_buffer.reserve( resource_list->name.length + shader.name.length + 2 );   // +1 for the point, +1 for the null terminator.
-                    memcpy( new_name, shader.name.text, shader.name.length );
-                    memcpy( new_name + shader.name.length, ".", 1 );
-                    memcpy( new_name + shader.name.length + 1, resource_list->name.text, resource_list->name.length );
-                    new_name[resource_list->name.length + shader.name.length + 1] = 0;
+    string_hash_init_dynamic( cache.path_to_entry );
+    string_hash_init_dynamic( cache.path_to_file );
+}
 
-                    ResourceList* new_resource_list = (ResourceList*)resource_list;
-                    new_resource_list->name.length = resource_list->name.length + shader.name.length + 1; // "." added to string.
-                    new_resource_list->name.text = new_name;
+static void free_include_cache_entries( IncludeCache& cache ) {
+    for ( size_t i = 0; i < string_hash_length( cache.path_to_entry ); ++i ) {
+        IncludeCache::Entry* entry = cache.path_to_entry[i].value;
+        if ( entry->text ) {
+            terminate_parser( &entry->parser );
+            terminate_data_buffer( &entry->data_buffer );
+            hydra::hy_free( entry->text );
+        }
+        delete entry;
+    }
 
-                    parser->shader.resource_lists.emplace_back( new_resource_list );
-                }
+    for ( size_t i = 0; i < string_hash_length( cache.path_to_file ); ++i ) {
+        if ( cache.path_to_file[i].value ) {
+            hydra::hy_free( cache.path_to_file[i].value );
+        }
+    }
+}
 
-                // Merge code fragments
-                std::vector<CodeFragment>& local_code_fragments = shader.code_fragments;
-                for ( size_t i = 0; i < local_code_fragments.size(); ++i ) {
-                    CodeFragment& code_fragment = local_code_fragments[i];
+void terminate_include_cache( IncludeCache& cache ) {
+    free_include_cache_entries( cache );
 
-                    char* new_name = parser->string_buffer.reserve( code_fragment.name.length + shader.name.length + 2 );   // +1 for the point, +1 for the null terminator.
-                    memcpy( new_name, shader.name.text, shader.name.length );
-                    memcpy( new_name + shader.name.length, ".", 1 );
-                    memcpy( new_name + shader.name.length + 1, code_fragment.name.text, code_fragment.name.length );
-                    new_name[code_fragment.name.length + shader.name.length + 1] = 0;
+    string_hash_free( cache.path_to_entry );
+    string_hash_free( cache.path_to_file );
+}
 
-                    code_fragment.name.length = code_fragment.name.length + shader.name.length + 1;
-                    code_fragment.name.text = new_name;
+//
+// Maps are emptied instead of created again: creating a stb_ds map writes its global seed, that is not thread safe.
+void reset_include_cache( IncludeCache& cache ) {
+    free_include_cache_entries( cache );
 
-                    parser->shader.code_fragments.emplace_back( code_fragment );
-                }
+    while ( string_hash_length( cache.path_to_entry ) ) {
+        string_hash_delete( cache.path_to_entry, cache.path_to_entry[0].key );
+    }
+    while ( string_hash_length( cache.path_to_file ) ) {
+        string_hash_delete( cache.path_to_file, cache.path_to_file[0].key );
+    }
+}
 
-                hfx::terminate_parser( &local_parser );
-            }
-            else {
-                HYDRA_LOG( "Cannot find include file %s\n", path_buffer.data);
-            }
+//
+// Returns the parsed include, parsing it the first time. Nested includes are parsed with the same cache.
+const IncludeCache::Entry* get_include( IncludeCache& cache, const StringRef& path ) {
+
+    char full_filename[k_max_include_path_length];
+    snprintf( full_filename, k_max_include_path_length, "..\\data\\source\\%.*s", (int)path.length, path.text );
+
+    const ptrdiff_t index = string_hash_get_index( cache.path_to_entry, full_filename );
+    if ( index >= 0 ) {
+        const IncludeCache::Entry* entry = cache.path_to_entry[index].value;
+        switch ( entry->state ) {
+            case IncludeCache::Entry::Parsed:
+                return entry;
+
+            case IncludeCache::Entry::Parsing:
+                HYDRA_LOG( "Include cycle: %s is included while parsing it.\n", full_filename );
+                return nullptr;
 
-            //parser->shader.hfx_includes.emplace_back( token.text );
+            default:
+                HYDRA_LOG( "Cannot find include file %s\n", full_filename );
+                return nullptr;
         }
     }
+
+    // Entries are allocated separately: their address does not change when the map grows while parsing nested includes.
+    IncludeCache::Entry* entry = new IncludeCache::Entry();
+    string_hash_put( cache.path_to_entry, full_filename, entry );
+
+    entry->text = hydra::read_file_into_memory( full_filename, nullptr );
+    if ( !entry->text ) {
+        entry->state = IncludeCache::Entry::Missing;
+        HYDRA_LOG( "Cannot find include file %s\n", full_filename );
+        return nullptr;
+    }
+
+    init_data_buffer( &entry->data_buffer, 256, 2048 );
+    init_lexer( &entry->lexer, entry->text, &entry->data_buffer );
+
+    init_parser( &entry->parser, &entry->lexer );
+    entry->parser.include_cache = &cache;
+    generate_ast( &entry->parser );
+
+    entry->state = IncludeCache::Entry::Parsed;
+    return entry;
+}
+
+//
+// Returns the content of a file, reading it the first time. Returns null for missing files.
+const char* get_include_file( IncludeCache& cache, const char* full_filename ) {
+    const ptrdiff_t index = string_hash_get_index( cache.path_to_file, full_filename );
+    if ( index >= 0 ) {
+        return cache.path_to_file[index].value;
+    }
+
+    char* text = hydra::read_file_into_memory( full_filename, nullptr );
+    string_hash_put( cache.path_to_file, full_filename, text );
+    return text;
 }
 
 //
@@ -1499,6 +1781,64 @@ void generate_shader_permutations( CodeGenerator* code_generator, const char* pa
 static const char*              s_shader_file_extension[Stage::Count + 1] = { ".vert", ".frag", ".geom", ".comp", ".tesc", ".tese", ".h" };
 static const char*              s_shader_stage_defines[Stage::Count + 1] = { "#define VERTEX\r\n", "#define FRAGMENT\r\n", "#define GEOMETRY\r\n", "#define COMPUTE\r\n", "#define HULL\r\n", "#define DOMAIN\r\n", "\r\n" };
 
+//
+//
+static uint32_t align_offset( uint32_t offset, uint32_t alignment ) {
+    return ( ( offset + alignment - 1 ) / alignment ) * alignment;
+}
+
+// GLSL and C++ types of the numeric properties, indexed by Property::Type.
+static const char*              s_property_glsl_types[] = { "float", "int", "float", "vec4", "vec4" };
+static const char*              s_property_cpp_types[] = { "float", "int32_t", "float", "float", "float" };
+
+//
+// Properties use only 4 bytes scalars and vec4, so the base alignment of an element is its size.
+// Std140 rounds up array strides and the block size to 16 bytes, std430 keeps them packed.
+uint32_t compute_constants_layout( const Shader& shader, MemoryLayout::Enum layout ) {
+    uint32_t offset = 0;
+    uint32_t block_alignment = layout == MemoryLayout::Std140 ? 16 : 4;
+
+    for ( size_t i = 0; i < shader.properties.size(); i++ ) {
+        hfx::Property* property = shader.properties[i];
+
+        const uint32_t components = get_property_components( property->type );
+        if ( !components ) {
+            continue;
+        }
+
+        const uint32_t element_size = components * sizeof( float );
+        uint32_t alignment = element_size;
+
+        if ( property->array_count ) {
+            alignment = layout == MemoryLayout::Std140 ? align_offset( alignment, 16 ) : alignment;
+            property->array_stride = align_offset( element_size, alignment );
+            property->size_in_bytes = property->array_stride * property->array_count;
+        }
+        else {
+            property->array_stride = 0;
+            property->size_in_bytes = element_size;
+        }
+
+        property->offset_in_bytes = align_offset( offset, alignment );
+        offset = property->offset_in_bytes + property->size_in_bytes;
+
+        block_alignment = alignment > block_alignment ? alignment : block_alignment;
+    }
+
+    return align_offset( offset, block_alignment );
+}
+
+//
+//
+static void fill_material_property( const Property& property, ShaderEffectFile::MaterialProperty& out_property ) {
+    out_property.type = property.type;
+    out_property.offset = (uint16_t)property.offset_in_bytes;
+    out_property.size = (uint16_t)property.size_in_bytes;
+    out_property.array_count = (uint16_t)property.array_count;
+    out_property.array_stride = (uint16_t)property.array_stride;
+    copy( property.name, out_property.name, 64 );
+}
+
 static void generate_glsl_and_defaults( const Shader& shader, StringBuffer& out_buffer, StringBuffer& out_defaults, const DataBuffer& data_buffer ) {
     if ( !shader.properties.size() ) {
         uint32_t zero_size = 0;
@@ -1506,89 +1846,102 @@ static void generate_glsl_and_defaults( const Shader& shader, StringBuffer& out_
         return;
     }
 
+    // Uniform blocks use std140: the same offsets are used for the default values and by the materials.
+    uint32_t constants_buffer_size = compute_constants_layout( shader, MemoryLayout::Std140 );
+
     // Add the local constants into the code.
     out_buffer.append( "\n\t\tlayout (std140, binding=7) uniform LocalConstants {\n\n" );
 
-    // For GPU the struct must be 16 bytes aligned. Track alignment
-    uint32_t gpu_struct_alignment = 0;
-
-    // In the defaults, write the type, size in '4 bytes' blocks, then data.
-    hydra::graphics::ResourceType::Enum resource_type = hydra::graphics::ResourceType::Constants;
-    out_defaults.append( &resource_type, sizeof( hydra::graphics::ResourceType::Enum ) );
-
-    // Reserve space for later writing the correct value.
-    char* buffer_size_memory = out_defaults.reserve( sizeof( uint32_t ) );
+    const ArenaArray<Property*>& properties = shader.properties;
+    for ( size_t i = 0; i < properties.size(); i++ ) {
+        const hfx::Property* property = properties[i];
+        if ( !get_property_components( property->type ) ) {
+            continue;
+        }
 
-    const std::vector<Property*>& properties = shader.properties;
-    for ( size_t i = 0; i < shader.properties.size(); i++ ) {
-        hfx::Property* property = shader.properties[i];
+        out_buffer.append( "\t\t\t%s\t\t\t\t\t", s_property_glsl_types[property->type] );
+        out_buffer.append( property->name );
+        if ( property->array_count ) {
+            out_buffer.append( "[%u]", property->array_count );
+        }
+        out_buffer.append( ";\n" );
+    }
 
-        switch ( property->type ) {
-            case Property::Float:
-            {
-                out_buffer.append( "\t\t\tfloat\t\t\t\t\t" );
-                out_buffer.append( property->name );
-                out_buffer.append( ";\n" );
+    // Only textures: empty blocks are not valid GLSL.
+    if ( constants_buffer_size == 0 ) {
+        out_buffer.append( "\t\t\tvec4\t\t\t\t\tpad_tail;\n" );
+        constants_buffer_size = 16;
+    }
 
-                // Get default value and write it into default buffer
-                if ( property->data_index != 0xffffffff ) {
-                    float value = 0.0f;
-                    get_data( data_buffer, property->data_index, value );
+    out_buffer.append( "\n\t\t} local_constants;\n\n" );
 
-                    out_defaults.append( &value, sizeof( float ) );
-                }
-                // Update offset
-                property->offset_in_bytes = gpu_struct_alignment * 4;
+    if ( constants_buffer_size > UINT16_MAX ) {
+        HYDRA_LOG( "Error: local constants of %u bytes, property offsets are limited to %u.\n", constants_buffer_size, UINT16_MAX );
+    }
 
-                ++gpu_struct_alignment;
-                break;
-            }
+    // In the defaults, write the type, size in bytes, then data.
+    hydra::graphics::ResourceType::Enum resource_type = hydra::graphics::ResourceType::Constants;
+    out_defaults.append( &resource_type, sizeof( hydra::graphics::ResourceType::Enum ) );
+    out_defaults.append( &constants_buffer_size, sizeof( uint32_t ) );
 
-            case Property::Int:
-            {
-                break;
-            }
+    char* constants_data = out_defaults.reserve( constants_buffer_size );
+    if ( !constants_data ) {
+        HYDRA_LOG( "Error: local constants of %u bytes do not fit in the defaults buffer.\n", constants_buffer_size );
+        return;
+    }
 
-            case Property::Range:
-            {
-                break;
-            }
+    // Values not specified are zero.
+    memset( constants_data, 0, constants_buffer_size );
 
-            case Property::Color:
-            {
-                break;
-            }
+    ShaderEffectFile::MaterialProperty material_property = {};
+    for ( size_t i = 0; i < properties.size(); i++ ) {
+        const hfx::Property* property = properties[i];
 
-            case Property::Vector:
-            {
-                break;
-            }
-        }
+        fill_material_property( *property, material_property );
+        write_property_values( &material_property, property->default_values.data(), (uint32_t)property->default_values.size(), constants_data );
     }
+}
+
+//
+// Define of an option in the shader code: OPTION_ followed by the option name in upper case.
+static void get_option_define( const StringRef& option, char* out_define ) {
+    static const char s_option_prefix[] = "OPTION_";
 
-    uint32_t tail_padding_size = 4 - (gpu_struct_alignment % 4);
-    out_buffer.append( "\t\t\tfloat\t\t\t\t\tpad_tail[%u];\n\n", tail_padding_size );
-    out_buffer.append( "\t\t} local_constants;\n\n" );
+    const size_t prefix_length = sizeof( s_option_prefix ) - 1;
+    const size_t length = option.length < k_max_option_define_length - prefix_length ? option.length : k_max_option_define_length - prefix_length - 1;
 
-    for ( uint32_t v = 0; v < tail_padding_size; ++v ) {
-        float value = 0.0f;
-        out_defaults.append( &value, sizeof( float ) );
+    memcpy( out_define, s_option_prefix, prefix_length );
+    for ( size_t i = 0; i < length; ++i ) {
+        out_define[prefix_length + i] = (char)toupper( option.text[i] );
     }
+    out_define[prefix_length + length] = 0;
+}
+
+//
+// Includes of a code fragment are added to the stage they are declared for, or to all stages.
+static bool is_include_in_stage( uint32_t include_flags, Stage stage ) {
+    const Stage include_stage = (Stage)( include_flags & 0xf );
+    return include_stage == stage || include_stage == Stage::Count;
+}
 
-    // Write the constant buffer size in bytes.
-    uint32_t constants_buffer_size = (gpu_struct_alignment + tail_padding_size) * sizeof( float );
-    memcpy( buffer_size_memory, &constants_buffer_size, sizeof( uint32_t ) );
+//
+// Code of an included file. Without an include cache the file is read each time and must be freed with hy_free.
+static char* read_include_file( const char* path, const Parser* parser, const StringRef& include, StringBuffer& filename_buffer ) {
+    filename_buffer.clear();
+    filename_buffer.append( path );
+    filename_buffer.append( include );
+    return parser->include_cache ? (char*)get_include_file( *parser->include_cache, filename_buffer.data ) : hydra::read_file_into_memory( filename_buffer.data, nullptr );
 }
 
 //
 // Finalize and append code to a code string buffer.
 // For embedded code (into binary HFX), prepend the stage and null terminate.
-static void append_finalized_shader_code( const char* path, const Parser* parser, Stage stage, const CodeFragment* code_fragment, StringBuffer& filename_buffer, StringBuffer& code_buffer, bool embedded, const StringBuffer& constants_buffer ) {
+static void append_finalized_shader_code( const char* path, const Parser* parser, Stage stage, const CodeFragment* code_fragment, const Pass* pass, uint32_t option_key, StringBuffer& filename_buffer, StringBuffer& code_buffer, bool embedded, const StringBuffer& constants_buffer ) {
 
     // Append small header: type
     int8_t stage_enum = (int8_t)stage;
     if ( embedded ) {
-        ShaderEffectFile::ChunkHeader header;
+        ShaderEffectFile::ChunkHeader header = {};
         header.code_size = 0;
         header.shader_stage = (int8_t)stage;
         code_buffer.append( &header, sizeof( ShaderEffectFile::ChunkHeader ) );
@@ -1597,8 +1950,7 @@ static void append_finalized_shader_code( const char* path, const Parser* parser
     // Append includes for the current stage.
     for ( size_t i = 0; i < code_fragment->includes.size(); i++ ) {
         uint32_t flag = code_fragment->includes_flags[i];
-        Stage code_fragment_stage = (Stage)(flag & 0xf);
-        if ( code_fragment_stage != stage && code_fragment_stage != Stage::Count ) {
+        if ( !is_include_in_stage( flag, stage ) ) {
             continue;
         }
 
@@ -1612,15 +1964,14 @@ static void append_finalized_shader_code( const char* path, const Parser* parser
             }
         }
         else {
-            // Open and read file
-            filename_buffer.clear();
-            filename_buffer.append( path );
-            filename_buffer.append( code_fragment->includes[i] );
-            char* include_code = hydra::read_file_into_memory( filename_buffer.data, nullptr );
+            // Open and read file, once per include cache.
+            char* include_code = read_include_file( path, parser, code_fragment->includes[i], filename_buffer );
             if ( include_code ) {
                 code_buffer.append( include_code );
 
-                hydra::hy_free( include_code );
+                if ( !parser->include_cache ) {
+                    hydra::hy_free( include_code );
+                }
             }
             else {
                 HYDRA_LOG( "Cannot find include file %s\n", filename_buffer.data );
@@ -1634,6 +1985,17 @@ static void append_finalized_shader_code( const char* path, const Parser* parser
     code_buffer.append( "\n\t\t" );
     code_buffer.append( s_shader_stage_defines[stage] );
 
+    // Add the defines of the enabled pass options.
+    if ( pass ) {
+        for ( uint32_t o = 0; o < pass->options.size(); ++o ) {
+            if ( option_key & ( 1 << o ) ) {
+                char option_define[k_max_option_define_length];
+                get_option_define( pass->options[o], option_define );
+                code_buffer.append( "\t\t#define %s\r\n", option_define );
+            }
+        }
+    }
+
     // Append local constants
     code_buffer.append( constants_buffer );
 
@@ -1679,7 +2041,7 @@ void output_shader_stage( CodeGenerator* code_generator, const char* path, const
 
     generate_glsl_and_defaults( code_generator->parser->shader, constants_buffer, constants_defaults_buffer, *code_generator->parser->lexer->data_buffer );
 
-    append_finalized_shader_code( path, code_generator->parser, stage.stage, stage.code, filename_buffer, code_buffer, false, constants_buffer );
+    append_finalized_shader_code( path, code_generator->parser, stage.stage, stage.code, nullptr, 0, filename_buffer, code_buffer, false, constants_buffer );
 
     fprintf( output_file, "%s", code_generator->string_buffers[1].data );
 
@@ -1687,13 +2049,14 @@ void output_shader_stage( CodeGenerator* code_generator, const char* path, const
 }
 
 //
-//
-static void update_shader_chunk_list( uint32_t* current_shader_offset, uint32_t pass_header_size, StringBuffer& offset_buffer, StringBuffer& code_buffer ) {
-
-    ShaderEffectFile::ShaderChunk chunk = { *current_shader_offset, code_buffer.current_size - *current_shader_offset };
-    offset_buffer.append( &chunk, sizeof( ShaderEffectFile::ShaderChunk ) );
+// Append zeroes until offset, the position of the end of the buffer inside the file or pass section, is aligned.
+static uint32_t append_alignment_padding( StringBuffer& buffer, uint32_t offset ) {
+    static char s_zeroes[ShaderEffectFile::k_alignment] = {};
 
-    *current_shader_offset = code_buffer.current_size + pass_header_size;
+    const uint32_t padding = align_offset( offset, ShaderEffectFile::k_alignment ) - offset;
+    // Raw bytes: a char pointer alone would pick the formatted append.
+    buffer.append( (void*)s_zeroes, padding );
+    return padding;
 }
 
 //
@@ -1704,11 +2067,11 @@ static void write_automatic_resources_layout( const hfx::Pass& pass, StringBuffe
 
     // Add the local constant buffer obtained from all the properties in the layout.
     hydra::graphics::ResourceListLayoutCreation::Binding binding = { hydra::graphics::ResourceType::Constants, 0, 1, "LocalConstants" };
-    char* num_resources_data = pass_buffer.reserve( sizeof( uint8_t ) );
+    char* num_resources_data = pass_buffer.reserve( sizeof( uint32_t ) );
 
-    uint8_t num_resources = 1;  // Local constants added
+    uint32_t num_resources = 1;  // Local constants added
     pass_buffer.append( (void*)&binding, sizeof( hydra::graphics::ResourceListLayoutCreation::Binding ) );
-    pass_offset += sizeof( hydra::graphics::ResourceListLayoutCreation::Binding ) + sizeof( uint8_t );
+    pass_offset += sizeof( hydra::graphics::ResourceListLayoutCreation::Binding ) + sizeof( uint32_t );
 
     for ( size_t s = 0; s < pass.shader_stages.size(); ++s ) {
         const Pass::ShaderStage shader_stage = pass.shader_stages[s];
@@ -1745,7 +2108,7 @@ static void write_automatic_resources_layout( const hfx::Pass& pass, StringBuffe
     }
 
     // Write num resources
-    memcpy( num_resources_data, &num_resources, sizeof( uint8_t ) );
+    memcpy( num_resources_data, &num_resources, sizeof( uint32_t ) );
 }
 
 //
@@ -1757,10 +2120,11 @@ static void write_resources_layout( const hfx::Pass& pass, StringBuffer& pass_bu
     for ( size_t r = 0; r < pass.resource_lists.size(); ++r ) {
         const ResourceList* resource_list = pass.resource_lists[r];
 
-        const uint8_t resources_count = (uint8_t)resource_list->resources.size();
-        pass_buffer.append( (void*)&resources_count, sizeof(uint8_t) );
+        // Count is stored in 32 bits to keep the bindings aligned.
+        const uint32_t resources_count = (uint32_t)resource_list->resources.size();
+        pass_buffer.append( (void*)&resources_count, sizeof( uint32_t ) );
         pass_buffer.append( (void*)resource_list->resources.data(), sizeof( ResourceBinding ) * resources_count );
-        pass_offset += sizeof( ResourceBinding ) * resources_count + sizeof( uint8_t );
+        pass_offset += sizeof( ResourceBinding ) * resources_count + sizeof( uint32_t );
     }
 }
 
@@ -1795,7 +2159,7 @@ static void write_default_values( StringBuffer& constants_defaults_buffer, Strin
     out_buffer.append( constants_defaults_buffer );
 
     // TODO: For each property that is not a number (basically textures)
-    //const std::vector<Property*>& properties = shader.properties;
+    //const ArenaArray<Property*>& properties = shader.properties;
     //for ( size_t i = 0; i < shader.properties.size(); i++ ) {
     //    hfx::Property* property = shader.properties[i];
 
@@ -1811,7 +2175,7 @@ static void write_default_values( StringBuffer& constants_defaults_buffer, Strin
 //
 static void write_properties( StringBuffer& out_buffer, const Shader& shader, const DataBuffer& data_buffer ) {
 
-    ShaderEffectFile::MaterialProperty material_property;
+    ShaderEffectFile::MaterialProperty material_property = {};
 
     uint32_t num_properties = (uint32_t)shader.properties.size();
     out_buffer.append( &num_properties, sizeof( uint32_t ) );
@@ -1819,9 +2183,7 @@ static void write_properties( StringBuffer& out_buffer, const Shader& shader, co
     for ( size_t i = 0; i < shader.properties.size(); i++ ) {
         hfx::Property* property = shader.properties[i];
 
-        material_property.type = property->type;
-        copy( property->name, material_property.name, 64 );
-        material_property.offset = property->offset_in_bytes;
+        fill_material_property( *property, material_property );
 
         char* material_property_write_data = out_buffer.reserve( sizeof( ShaderEffectFile::MaterialProperty ) );
 
@@ -1846,32 +2208,179 @@ static void write_properties( StringBuffer& out_buffer, const Shader& shader, co
 
 //
 //
-void compile_shader_effect_file( CodeGenerator* code_generator, const char* output_path, const char* filename ) {
+static bool is_identifier_character( char c ) {
+    return isalnum( (unsigned char)c ) || c == '_';
+}
 
-    FILE* output_file;
+//
+// Search identifier as a whole word.
+static bool contains_identifier( const StringRef& text, const char* identifier ) {
+    const size_t length = strlen( identifier );
 
-    StringBuffer& filename_buffer = code_generator->string_buffers[0];
-    filename_buffer.clear();
-    filename_buffer.append( output_path );
-    filename_buffer.append( filename );
-    fopen_s( &output_file, filename_buffer.data, "wb" );
+    for ( size_t i = 0; i + length <= text.length; ++i ) {
+        if ( strncmp( text.text + i, identifier, length ) != 0 ) {
+            continue;
+        }
 
-    if ( !output_file ) {
-        printf( "Error opening file. Aborting. \n" );
-        return;
+        const bool word_start = i == 0 || !is_identifier_character( text.text[i - 1] );
+        const bool word_end = i + length == text.length || !is_identifier_character( text.text[i + length] );
+        if ( word_start && word_end ) {
+            return true;
+        }
     }
 
-    // Calculate input path
-    StringBuffer& input_path_buffer = code_generator->string_buffers[7];
-    input_path_buffer.clear();
-    
-    const char* input_path = "";
-    const char* last_directory_separator = strrchr( code_generator->input_filename, '\\' );
-    if ( last_directory_separator ) {
-        const char* folder = input_path_buffer.append_use_substring( code_generator->input_filename, 0, last_directory_separator - &code_generator->input_filename[0] );
-        input_path = input_path_buffer.append_use( "%s\\", folder );
-    }
-    
+    return false;
+}
+
+//
+// Mask of the pass options used by a code text.
+static uint32_t get_code_option_mask( const Pass& pass, const StringRef& code ) {
+    uint32_t mask = 0;
+
+    for ( uint32_t o = 0; o < pass.options.size(); ++o ) {
+        char option_define[k_max_option_define_length];
+        get_option_define( pass.options[o], option_define );
+
+        if ( contains_identifier( code, option_define ) ) {
+            mask |= 1 << o;
+        }
+    }
+
+    return mask;
+}
+
+//
+// Mask of the pass options used by the code of a stage, includes added to the stage too. The other options do not change the stage code.
+static uint32_t get_stage_option_mask( const char* path, const Parser* parser, const Pass& pass, const Pass::ShaderStage& shader_stage, StringBuffer& filename_buffer ) {
+    const CodeFragment* code_fragment = shader_stage.code;
+    uint32_t mask = get_code_option_mask( pass, code_fragment->code );
+
+    for ( size_t i = 0; i < code_fragment->includes.size(); i++ ) {
+        const uint32_t flag = code_fragment->includes_flags[i];
+        if ( !is_include_in_stage( flag, shader_stage.stage ) ) {
+            continue;
+        }
+
+        if ( ( flag & 0x10 ) == 0x10 ) {
+            const CodeFragment* included_code_fragment = find_code_fragment( parser, code_fragment->includes[i] );
+            if ( included_code_fragment ) {
+                mask |= get_code_option_mask( pass, included_code_fragment->code );
+            }
+        }
+        else {
+            char* include_code = read_include_file( path, parser, code_fragment->includes[i], filename_buffer );
+            if ( include_code ) {
+                const StringRef include_text = { strlen( include_code ), include_code };
+                mask |= get_code_option_mask( pass, include_text );
+
+                if ( !parser->include_cache ) {
+                    hydra::hy_free( include_code );
+                }
+            }
+        }
+    }
+
+    return mask;
+}
+
+//
+// Keys of all the reachable variants, where for each group none or one option is enabled.
+// Options of later groups have higher bits, so keys are generated sorted and the first is always 0.
+// Returns false when there are too many combinations.
+static bool generate_variant_keys( const Pass& pass, std::vector<uint32_t>& out_keys ) {
+    out_keys.clear();
+    out_keys.push_back( 0 );
+
+    for ( size_t g = 0; g < pass.option_groups.size(); ++g ) {
+        const uint32_t group_mask = pass.option_groups[g];
+        const size_t previous_count = out_keys.size();
+
+        for ( uint32_t o = 0; o < pass.options.size(); ++o ) {
+            if ( ( group_mask & ( 1 << o ) ) == 0 ) {
+                continue;
+            }
+
+            for ( size_t k = 0; k < previous_count; ++k ) {
+                out_keys.push_back( out_keys[k] | ( 1 << o ) );
+            }
+        }
+
+        if ( out_keys.size() > k_max_pass_variant_keys ) {
+            HYDRA_LOG( "Error: pass %.*s has more than %u option combinations.\n", (int)pass.name.length, pass.name.text, k_max_pass_variant_keys );
+            out_keys.resize( 1 );
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//
+// Shader code of a pass, unique for each stage and options used by it.
+struct PassShaderChunk {
+    uint32_t                        start;          // Relative to the start of the pass shader code.
+    uint32_t                        size;
+    size_t                          hash;
+}; // struct PassShaderChunk
+
+//
+// Chunk containing the code of a stage with the options of key enabled.
+struct PassStageVariant {
+    uint32_t                        stage_index;
+    uint32_t                        option_key;     // Masked with the stage options.
+    uint32_t                        chunk_index;
+}; // struct PassStageVariant
+
+//
+// Finalize the code of a stage with the options enabled and return its chunk index.
+// Generated code identical to an existing chunk is removed and the existing chunk is used.
+static uint32_t add_pass_shader_chunk( const char* input_path, const Parser* parser, const Pass& pass, uint32_t stage_index, uint32_t option_key,
+                                       StringBuffer& filename_buffer, StringBuffer& code_buffer, const StringBuffer& constants_buffer, std::vector<PassShaderChunk>& chunks ) {
+
+    const Pass::ShaderStage& shader_stage = pass.shader_stages[stage_index];
+    const uint32_t previous_size = code_buffer.current_size;
+
+    // Each chunk starts aligned, so its header can be read in place.
+    append_alignment_padding( code_buffer, code_buffer.current_size );
+
+    PassShaderChunk chunk = { code_buffer.current_size, 0, 0 };
+    append_finalized_shader_code( input_path, parser, shader_stage.stage, shader_stage.code, &pass, option_key, filename_buffer, code_buffer, true, constants_buffer );
+
+    chunk.size = code_buffer.current_size - chunk.start;
+    chunk.hash = hash_bytes( code_buffer.data + chunk.start, chunk.size, k_shader_effect_checksum_seed );
+
+    for ( size_t c = 0; c < chunks.size(); ++c ) {
+        const PassShaderChunk& other_chunk = chunks[c];
+        if ( other_chunk.hash == chunk.hash && other_chunk.size == chunk.size && memcmp( code_buffer.data + other_chunk.start, code_buffer.data + chunk.start, chunk.size ) == 0 ) {
+            code_buffer.current_size = previous_size;
+            return (uint32_t)c;
+        }
+    }
+
+    chunks.emplace_back( chunk );
+    return (uint32_t)chunks.size() - 1;
+}
+
+//
+//
+bool compile_shader_effect_file( CodeGenerator* code_generator, const char* output_path, const char* filename ) {
+
+    StringBuffer& filename_buffer = code_generator->string_buffers[0];
+
+    // String buffers drop what does not fit: an effect with overflows is not written.
+    bool valid = true;
+
+    // Calculate input path
+    StringBuffer& input_path_buffer = code_generator->string_buffers[7];
+    input_path_buffer.clear();
+    
+    const char* input_path = "";
+    const char* last_directory_separator = strrchr( code_generator->input_filename, '\\' );
+    if ( last_directory_separator ) {
+        const char* folder = input_path_buffer.append_use_substring( code_generator->input_filename, 0, last_directory_separator - &code_generator->input_filename[0] );
+        input_path = input_path_buffer.append_use( "%s\\", folder );
+    }
+    
 
     // -------------------------------------------------------------------------------------------------------------------------------------------------------------------
     // Shader Effect File Format
@@ -1880,22 +2389,25 @@ void compile_shader_effect_file( CodeGenerator* code_generator, const char* outp
     // -------------------------------------------------------------------------------------------------------------------------------------------------------------------
     // |            |                  |                  Pass Header                     |                  Pass Data
     // -------------------------------------------------------------------------------------------------------------------------------------------------------------------
-    // |            |                  | Shaders count | Res Count | Res List Offset | name | (Render States | Vertex Input)* | Shader Chunk List | Shader Code | Res List
+    // |            |                  | Shaders count | Res Count | Res List Offset | name | (Render States | Vertex Input)* | Shader Chunk List | Shader Code | Res List | Variant Table
     // -------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
     // Pass Section:
     // |                  Pass Header                     |                 Pass Data
-    // ---------------------------------------------------------------------------------------------------------------------------------
-    // Shaders Count | Res Count | Res List Offset | name | (Render States | Vertex Input)* | Shader Chunk List | Shader Code | Res List
-    // ---------------------------------------------------------------------------------------------------------------------------------
+    // -------------------------------------------------------------------------------------------------------------------------------------------------
+    // Shaders Count | Res Count | Res List Offset | name | (Render States | Vertex Input)* | Shader Chunk List | Shader Code | Res List | Variant Table
+    // -------------------------------------------------------------------------------------------------------------------------------------------------
+
+    // Pass sections, shader chunks, resource lists, variant tables, resource defaults and properties start at offsets aligned to ShaderEffectFile::k_alignment.
+    // The header contains the checksum of everything after it, checked when loading.
 
     // Alias for string buffers used in the process.
     StringBuffer& shader_code_buffer = code_generator->string_buffers[1];
     StringBuffer& pass_offset_buffer = code_generator->string_buffers[2];
-    StringBuffer& shader_chunk_list_buffer = code_generator->string_buffers[3];
     StringBuffer& pass_buffer = code_generator->string_buffers[4];
     StringBuffer& constants_buffer = code_generator->string_buffers[5];
     StringBuffer& constants_defaults_buffer = code_generator->string_buffers[6];
+    StringBuffer& properties_buffer = code_generator->string_buffers[3];
 
     pass_offset_buffer.clear();
     pass_buffer.clear();
@@ -1919,13 +2431,22 @@ void compile_shader_effect_file( CodeGenerator* code_generator, const char* outp
     const uint32_t pass_count = (uint32_t)code_generator->parser->shader.passes.size();
 
     // Pass sections offset starts after header and list of passes offsets.
-    uint32_t pass_section_offset = sizeof( ShaderEffectFile::Header ) + sizeof( uint32_t ) * pass_count;
+    const uint32_t first_pass_section_offset = align_offset( sizeof( ShaderEffectFile::Header ) + sizeof( uint32_t ) * pass_count, ShaderEffectFile::k_alignment );
 
-    ShaderEffectFile::PassHeader pass_header;
+    // Variants memory, reused between passes.
+    std::vector<uint32_t> variant_keys;
+    std::vector<uint32_t> stage_option_masks;
+    std::vector<PassShaderChunk> shader_chunks;
+    std::vector<PassStageVariant> stage_variants;
+    std::vector<uint16_t> variant_chunks;
+    std::vector<ShaderEffectFile::VariantKey> variant_table;
 
     for ( uint32_t i = 0; i < pass_count; i++ ) {
 
-        pass_offset_buffer.append( &pass_section_offset, sizeof( uint32_t ) );
+        // Pass sections are padded, so offsets relative to the pass start have the same alignment as file offsets.
+        const uint32_t pass_start = pass_buffer.current_size;
+        const uint32_t pass_section_offset = first_pass_section_offset + pass_start;
+        pass_offset_buffer.append( (void*)&pass_section_offset, sizeof( uint32_t ) );
 
         const Pass& pass = code_generator->parser->shader.passes[i];
         const uint32_t pass_shader_stages = (uint32_t)pass.shader_stages.size();
@@ -1933,96 +2454,167 @@ void compile_shader_effect_file( CodeGenerator* code_generator, const char* outp
         // ----------------------------------------------
         // Pass Data
         // ----------------------------------------------
-        // (Render States | Vertex Input)* | Shader Chunk List | Shader Code | Res List    (* optionals)
+        // (Render States | Vertex Input)* | Shader Chunk List | Shader Code | Res List | Variant Table    (* optionals)
         // ----------------------------------------------
         // ShaderChunk = Shader Offset + Count
 
         const uint32_t vertex_input_size = pass.vertex_layout ? pass.vertex_layout->attributes.size() * sizeof( hydra::graphics::VertexAttribute ) + pass.vertex_layout->streams.size() * sizeof( hydra::graphics::VertexStream ) : 0;
         const uint32_t shader_list_offset = vertex_input_size + (pass.render_state ? sizeof( hydra::graphics::RasterizationCreation ) + sizeof( hydra::graphics::DepthStencilCreation ) + sizeof( hydra::graphics::BlendStateCreation ) : 0);
+
         //
-        // 2.1 For current pass calculate shader code offsets, relative to the pass section start.
+        // 2.1 For each reachable variant, finalize the code of each shader stage (vertex, fragment, compute...).
+        //     A stage is generated once for each combination of the options it uses, and identical code is shared.
+
+        valid &= generate_variant_keys( pass, variant_keys );
 
-        const uint32_t start_shader_code_offset = shader_list_offset + (pass_shader_stages * sizeof( ShaderEffectFile::ShaderChunk )) + sizeof( ShaderEffectFile::PassHeader );
-        uint32_t current_shader_code_offset = start_shader_code_offset;
+        stage_option_masks.clear();
+        for ( size_t s = 0; s < pass_shader_stages; ++s ) {
+            stage_option_masks.push_back( get_stage_option_mask( input_path, code_generator->parser, pass, pass.shader_stages[s], filename_buffer ) );
+        }
 
-        shader_chunk_list_buffer.clear();
+        shader_chunks.clear();
+        stage_variants.clear();
+        variant_chunks.clear();
+        variant_table.clear();
         shader_code_buffer.clear();
 
-        const bool automatic_layout = is_resources_layout_automatic( code_generator->parser->shader, pass );
-        uint32_t total_resources_layout = 0, local_resources = 0;
+        uint32_t num_variants = 0;
 
-        //
-        // 2.2 For each shader stage (vertex, fragment, compute...), finalize code and save offsets.
+        for ( size_t k = 0; k < variant_keys.size(); ++k ) {
+            const uint32_t option_key = variant_keys[k];
+            const size_t variant_start = variant_chunks.size();
 
-        for ( size_t s = 0; s < pass_shader_stages; ++s ) {
-            const Pass::ShaderStage shader_stage = pass.shader_stages[s];
-
-            append_finalized_shader_code( input_path, code_generator->parser, shader_stage.stage, shader_stage.code, filename_buffer, shader_code_buffer, true, constants_buffer );
-
-            update_shader_chunk_list( &current_shader_code_offset, start_shader_code_offset, shader_chunk_list_buffer, shader_code_buffer );
-
-            // Manually count resources for automatic layout.
-            // This needs to be done on a per pass level.
-            if ( automatic_layout ) {
-                for ( size_t p = 0; p < shader_stage.code->resources.size(); p++ ) {
-                    const hfx::CodeFragment::Resource& resource = shader_stage.code->resources[p];
-
-                    switch ( resource.type ) {
-                        case hydra::graphics::ResourceType::TextureRW:
-                        case hydra::graphics::ResourceType::Texture:
-                        case hydra::graphics::ResourceType::Constants:
-                        {
-                            ++local_resources;
-                            break;
-                        }
+            for ( uint32_t s = 0; s < pass_shader_stages; ++s ) {
+                const uint32_t stage_key = option_key & stage_option_masks[s];
+
+                uint32_t chunk_index = ShaderEffectFile::k_invalid_variant;
+                for ( size_t v = 0; v < stage_variants.size(); ++v ) {
+                    if ( stage_variants[v].stage_index == s && stage_variants[v].option_key == stage_key ) {
+                        chunk_index = stage_variants[v].chunk_index;
+                        break;
                     }
                 }
+
+                if ( chunk_index == ShaderEffectFile::k_invalid_variant ) {
+                    chunk_index = add_pass_shader_chunk( input_path, code_generator->parser, pass, s, stage_key, filename_buffer, shader_code_buffer, constants_buffer, shader_chunks );
+
+                    PassStageVariant stage_variant = { s, stage_key, chunk_index };
+                    stage_variants.emplace_back( stage_variant );
+                }
+
+                variant_chunks.push_back( (uint16_t)chunk_index );
+            }
+
+            // Keys using the same chunks share the variant.
+            uint32_t variant_index = num_variants;
+            for ( uint32_t v = 0; v < num_variants; ++v ) {
+                if ( memcmp( &variant_chunks[v * pass_shader_stages], &variant_chunks[variant_start], pass_shader_stages * sizeof( uint16_t ) ) == 0 ) {
+                    variant_index = v;
+                    break;
+                }
+            }
+
+            if ( variant_index == num_variants ) {
+                ++num_variants;
+            }
+            else {
+                variant_chunks.resize( variant_start );
             }
+
+            ShaderEffectFile::VariantKey variant_key = { option_key, variant_index };
+            variant_table.emplace_back( variant_key );
         }
 
-        // Update pass offset to the resource list sub-section
-        pass_section_offset += shader_code_buffer.current_size + start_shader_code_offset;
+        append_alignment_padding( shader_code_buffer, shader_code_buffer.current_size );
 
-        // Add local constant buffer in the count only if automatic layout is needed.
-        if ( automatic_layout ) {
-            ++local_resources;
-            ++total_resources_layout;
+        if ( shader_code_buffer.current_size + 1 >= shader_code_buffer.buffer_size ) {
+            HYDRA_LOG( "Error: shader code of pass %.*s is bigger than %u bytes.\n", (int)pass.name.length, pass.name.text, shader_code_buffer.buffer_size );
+            valid = false;
         }
-        // Add also the resource list declared
-        total_resources_layout += pass.resource_lists.size();
 
-        // Fill Pass Header
-        copy( pass.name, pass_header.name, 32 );
-        copy( pass.stage_name, pass_header.stage_name, 32 );
-        pass_header.num_shader_chunks = pass_shader_stages;
-        pass_header.num_resource_layouts = total_resources_layout;
-        pass_header.resource_table_offset = shader_code_buffer.current_size + start_shader_code_offset;
-        pass_header.has_resource_state = pass.render_state ? 1 : 0;
-        pass_header.shader_list_offset = shader_list_offset;
-        pass_header.num_vertex_attributes = pass.vertex_layout ? (uint8_t)pass.vertex_layout->attributes.size() : 0;
-        pass_header.num_vertex_streams = pass.vertex_layout ? (uint8_t)pass.vertex_layout->streams.size() : 0;
+        // Shader code starts aligned after the chunk list.
+        const uint32_t shader_chunk_list_end = sizeof( ShaderEffectFile::PassHeader ) + shader_list_offset + (uint32_t)shader_chunks.size() * sizeof( ShaderEffectFile::ShaderChunk );
+        const uint32_t start_shader_code_offset = align_offset( shader_chunk_list_end, ShaderEffectFile::k_alignment );
 
-        pass_buffer.append( (void*)&pass_header, sizeof( ShaderEffectFile::PassHeader ) );
+        //
+        // 2.2 Write pass data. The pass header is filled when all the offsets are known.
+
+        char* pass_header_memory = pass_buffer.reserve( sizeof( ShaderEffectFile::PassHeader ) );
 
         write_render_states( pass, pass_buffer );
         write_vertex_input( pass, pass_buffer );
-        
-        pass_buffer.append( shader_chunk_list_buffer );
+
+        for ( size_t c = 0; c < shader_chunks.size(); ++c ) {
+            ShaderEffectFile::ShaderChunk chunk = { start_shader_code_offset + shader_chunks[c].start, shader_chunks[c].size };
+            pass_buffer.append( (void*)&chunk, sizeof( ShaderEffectFile::ShaderChunk ) );
+        }
+
+        append_alignment_padding( pass_buffer, pass_buffer.current_size - pass_start );
         pass_buffer.append( shader_code_buffer );
 
         //
         // 2.3. Write resources layout, either automatic and manually specified. ///////////////////////////
-        //      Pass section offset must be updated for the next pass offset to be correct.
+
+        const bool automatic_layout = is_resources_layout_automatic( code_generator->parser->shader, pass );
+        const uint32_t resource_table_offset = pass_buffer.current_size - pass_start;
+        uint32_t resource_table_size = 0;
 
         // 2.3.1: First add all the declared resources in order of declaration.
-        write_resources_layout( pass, pass_buffer, pass_section_offset );
+        write_resources_layout( pass, pass_buffer, resource_table_size );
 
         // 2.3.2: Optionally if properties are present but no layout is specified for them, add the final resource layout.
         if ( automatic_layout ) {
-            write_automatic_resources_layout( pass, pass_buffer, pass_section_offset );
+            write_automatic_resources_layout( pass, pass_buffer, resource_table_size );
+        }
+
+        append_alignment_padding( pass_buffer, pass_buffer.current_size - pass_start );
+
+        //
+        // 2.4. Write variant table: option names, variant keys and the chunks of each variant. /////////////
+
+        const uint32_t variant_table_offset = pass_buffer.current_size - pass_start;
+
+        for ( size_t o = 0; o < pass.options.size(); ++o ) {
+            char option_name[k_max_option_name_length] = {};
+            copy( pass.options[o], option_name, k_max_option_name_length );
+            pass_buffer.append( (void*)option_name, k_max_option_name_length );
+        }
+
+        pass_buffer.append( (void*)variant_table.data(), (uint32_t)( variant_table.size() * sizeof( ShaderEffectFile::VariantKey ) ) );
+        if ( variant_chunks.size() ) {
+            pass_buffer.append( (void*)variant_chunks.data(), (uint32_t)( variant_chunks.size() * sizeof( uint16_t ) ) );
+        }
+
+        append_alignment_padding( pass_buffer, pass_buffer.current_size - pass_start );
+
+        // Fill Pass Header
+        ShaderEffectFile::PassHeader pass_header = {};
+        copy( pass.name, pass_header.name, 32 );
+        copy( pass.stage_name, pass_header.stage_name, 32 );
+        pass_header.num_shader_chunks = pass_shader_stages;
+        pass_header.num_resource_layouts = (uint8_t)pass.resource_lists.size() + ( automatic_layout ? 1 : 0 );
+        pass_header.resource_table_offset = resource_table_offset;
+        pass_header.has_resource_state = pass.render_state ? 1 : 0;
+        pass_header.shader_list_offset = shader_list_offset;
+        pass_header.num_vertex_attributes = pass.vertex_layout ? (uint8_t)pass.vertex_layout->attributes.size() : 0;
+        pass_header.num_vertex_streams = pass.vertex_layout ? (uint8_t)pass.vertex_layout->streams.size() : 0;
+        pass_header.num_options = (uint16_t)pass.options.size();
+        pass_header.num_variants = (uint16_t)num_variants;
+        pass_header.num_variant_keys = (uint32_t)variant_table.size();
+        pass_header.variant_table_offset = variant_table_offset;
+
+        if ( pass_header_memory ) {
+            memcpy( pass_header_memory, &pass_header, sizeof( ShaderEffectFile::PassHeader ) );
         }
     }
 
+    if ( pass_buffer.current_size + 1 >= pass_buffer.buffer_size ) {
+        HYDRA_LOG( "Error: passes of shader %.*s are bigger than %u bytes.\n", (int)code_generator->parser->shader.name.length, code_generator->parser->shader.name.text, pass_buffer.buffer_size );
+        valid = false;
+    }
+
+    append_alignment_padding( pass_offset_buffer, sizeof( ShaderEffectFile::Header ) + pass_offset_buffer.current_size );
+
     //
     // 3. Write default local constant values, to be used when creating the effect. ///////////
     //
@@ -2033,43 +2625,174 @@ void compile_shader_effect_file( CodeGenerator* code_generator, const char* outp
 
     write_default_values( constants_defaults_buffer, resources_buffer, code_generator->parser->shader );
 
+    const uint32_t resource_defaults_offset = sizeof( ShaderEffectFile::Header ) + pass_offset_buffer.current_size + pass_buffer.current_size;
+    append_alignment_padding( resources_buffer, resource_defaults_offset + resources_buffer.current_size );
+
+    //
+    // 4. Write properties. ///////////////////////////////////////////////////////////////////
+    //
+    properties_buffer.clear();
+    write_properties( properties_buffer, code_generator->parser->shader, *code_generator->parser->lexer->data_buffer );
+
+    if ( !valid ) {
+        HYDRA_LOG( "Error: shader effect %s%s not written.\n", output_path, filename );
+        return false;
+    }
+
+    //
+    // 5. Gather all sections after the header, to compute the checksum. //////////////////////
+    //
+    const uint32_t data_size = pass_offset_buffer.current_size + pass_buffer.current_size + resources_buffer.current_size + properties_buffer.current_size;
+    char* data = (char*)hydra::hy_malloc( data_size );
+    char* data_section = data;
+
+    memcpy( data_section, pass_offset_buffer.data, pass_offset_buffer.current_size );
+    data_section += pass_offset_buffer.current_size;
+    memcpy( data_section, pass_buffer.data, pass_buffer.current_size );
+    data_section += pass_buffer.current_size;
+    memcpy( data_section, resources_buffer.data, resources_buffer.current_size );
+    data_section += resources_buffer.current_size;
+    memcpy( data_section, properties_buffer.data, properties_buffer.current_size );
+
     // Fill the file header
-    ShaderEffectFile::Header file_header;
+    ShaderEffectFile::Header file_header = {};
+    file_header.magic = ShaderEffectFile::k_magic;
+    file_header.version = ShaderEffectFile::k_version;
+    file_header.alignment = ShaderEffectFile::k_alignment;
+    file_header.file_size = sizeof( ShaderEffectFile::Header ) + data_size;
+    file_header.checksum = hash_bytes( data, data_size, k_shader_effect_checksum_seed );
     memcpy( file_header.binary_header_magic, code_generator->binary_header_magic, 32 );
     file_header.num_passes = pass_count;
-    file_header.resource_defaults_offset = sizeof( ShaderEffectFile::Header ) + pass_offset_buffer.current_size + pass_buffer.current_size;
-    file_header.properties_offset = file_header.resource_defaults_offset + resources_buffer.current_size;
+    file_header.resource_defaults_offset = resource_defaults_offset;
+    file_header.properties_offset = resource_defaults_offset + resources_buffer.current_size;
     copy( code_generator->parser->shader.name, file_header.name, 32 );
     copy( code_generator->parser->shader.pipeline_name, file_header.pipeline_name, 32 );
 
-
     //
-    // 4. Actually write the file /////////////////////////////////////////////////////////////
+    // 6. Actually write the file /////////////////////////////////////////////////////////////
     //
+    filename_buffer.clear();
+    filename_buffer.append( output_path );
+    filename_buffer.append( filename );
 
-    // 4.1. Write the header
-    fwrite( &file_header, sizeof( ShaderEffectFile::Header ), 1, output_file );
-    // 4.2. Write the pass memory offsets
-    fwrite( pass_offset_buffer.data, pass_offset_buffer.current_size, 1, output_file );
-    // 4.3. Write the pass sections
-    fwrite( pass_buffer.data, pass_buffer.current_size, 1, output_file );
-    // 4.4. Write the resource defaults
-    fwrite( resources_buffer.data, resources_buffer.current_size, 1, output_file );
+    FILE* output_file = nullptr;
+    fopen_s( &output_file, filename_buffer.data, "wb" );
+    if ( output_file ) {
+        fwrite( &file_header, sizeof( ShaderEffectFile::Header ), 1, output_file );
+        fwrite( data, data_size, 1, output_file );
+        fclose( output_file );
+    }
+    else {
+        HYDRA_LOG( "Error opening file %s.\n", filename_buffer.data );
+    }
 
-    // 4.5. Write properties in string buffer.
-    resources_buffer.clear();
-    write_properties( resources_buffer, code_generator->parser->shader, *code_generator->parser->lexer->data_buffer );
+    hydra::hy_free( data );
 
-    //
-    // 5. Write properties to file. ///////////////////////////////////////////////////////////
-    //
-    fwrite( resources_buffer.data, resources_buffer.current_size, 1, output_file );
+    return output_file != nullptr;
+}
 
-    fclose( output_file );
+//
+// Initializer of a property with its default values, padding each element with zeroes up to floats_per_element.
+static void append_cpp_default_values( StringBuffer& buffer, const Property& property, uint32_t floats_per_element ) {
+    const uint32_t components = get_property_components( property.type );
+    const uint32_t max_values = ( property.array_count ? property.array_count : 1 ) * components;
+    const uint32_t num_values = property.default_values.size() < max_values ? (uint32_t)property.default_values.size() : max_values;
+    if ( !num_values ) {
+        return;
+    }
+
+    const bool is_list = property.array_count || floats_per_element > 1;
+    buffer.append( is_list ? " = { " : " = " );
+
+    // Elements after the last value are zero initialized.
+    const uint32_t num_elements = ( num_values - 1 ) / components + 1;
+    for ( uint32_t e = 0; e < num_elements; ++e ) {
+        for ( uint32_t f = 0; f < floats_per_element; ++f ) {
+            const uint32_t v = e * components + f;
+            const float value = ( f < components && v < num_values ) ? property.default_values[v] : 0.0f;
+
+            buffer.append( ( e || f ) ? ", " : "" );
+            if ( property.type == Property::Int ) {
+                buffer.append( "%d", (int32_t)value );
+            }
+            else {
+                buffer.append( "%ff", value );
+            }
+        }
+    }
+
+    buffer.append( is_list ? " }" : "" );
 }
 
 //
+// Member declaration of a property, with floats_per_element floats for each element.
+static void append_cpp_member( StringBuffer& buffer, const Property& property, uint32_t floats_per_element ) {
+    buffer.append( "\t%s\t\t\t\t\t", s_property_cpp_types[property.type] );
+    buffer.append( property.name );
+    if ( property.array_count ) {
+        buffer.append( "[%u]", property.array_count );
+    }
+    if ( floats_per_element > 1 ) {
+        buffer.append( "[%u]", floats_per_element );
+    }
+    append_cpp_default_values( buffer, property, floats_per_element );
+    buffer.append( ";\n" );
+}
+
 //
+// ImGui widget editing member, that is the property or one of its elements.
+static void append_imgui_widget( StringBuffer& buffer, const Property& property, const char* member ) {
+    const int ui_name_length = (int)property.ui_name.length;
+    const char* ui_name = property.ui_name.text;
+
+    switch ( property.type ) {
+        case Property::Range:
+        {
+            // Ui arguments contain the minimum and maximum: (min, max)
+            const char* arguments_end = property.ui_arguments.length ? property.ui_arguments.text + property.ui_arguments.length - 1 : nullptr;
+            while ( arguments_end && arguments_end > property.ui_arguments.text && *arguments_end != ')' ) {
+                --arguments_end;
+            }
+
+            if ( arguments_end && arguments_end > property.ui_arguments.text + 1 ) {
+                const int arguments_length = (int)( arguments_end - property.ui_arguments.text - 1 );
+                buffer.append( "ImGui::SliderFloat( \"%.*s\", &%s, %.*s );\n", ui_name_length, ui_name, member, arguments_length, property.ui_arguments.text + 1 );
+                break;
+            }
+
+            buffer.append( "ImGui::InputScalar( \"%.*s\", ImGuiDataType_Float, &%s );\n", ui_name_length, ui_name, member );
+            break;
+        }
+
+        case Property::Float:
+        {
+            buffer.append( "ImGui::InputScalar( \"%.*s\", ImGuiDataType_Float, &%s );\n", ui_name_length, ui_name, member );
+            break;
+        }
+
+        case Property::Int:
+        {
+            buffer.append( "ImGui::InputScalar( \"%.*s\", ImGuiDataType_S32, &%s );\n", ui_name_length, ui_name, member );
+            break;
+        }
+
+        case Property::Color:
+        {
+            buffer.append( "ImGui::ColorEdit4( \"%.*s\", %s );\n", ui_name_length, ui_name, member );
+            break;
+        }
+
+        case Property::Vector:
+        {
+            buffer.append( "ImGui::InputFloat4( \"%.*s\", %s );\n", ui_name_length, ui_name, member );
+            break;
+        }
+    }
+}
+
+//
+// LocalConstants mirrors the std140 block of the shaders: members are padded to the GPU offsets, checked with static_assert.
+// LocalConstantsUI stores the same values packed, for editing.
 void generate_shader_resource_header( CodeGenerator* code_generator, const char* path ) {
     FILE* output_file;
 
@@ -2090,15 +2813,17 @@ void generate_shader_resource_header( CodeGenerator* code_generator, const char*
     code_generator->string_buffers[1].clear();
     code_generator->string_buffers[2].clear();
     code_generator->string_buffers[3].clear();
+    code_generator->string_buffers[4].clear();
 
     // Alias string buffers for code clarity
     StringBuffer& cpu_constants = code_generator->string_buffers[0];
     StringBuffer& constants_ui = code_generator->string_buffers[1];
     StringBuffer& buffer_class = code_generator->string_buffers[2];
     StringBuffer& constants_ui_method = code_generator->string_buffers[3];
+    StringBuffer& constants_checks = code_generator->string_buffers[4];
 
     // Beginning
-    fprintf( output_file, "\n#pragma once\n#include <stdint.h>\n#include \"hydra/hydra_graphics.h\"\n\n// This file is autogenerated!\nnamespace " );
+    fprintf( output_file, "\n#pragma once\n#include <stdint.h>\n#include <stddef.h>\n#include <string.h>\n#include \"hydra/hydra_graphics.h\"\n\n// This file is autogenerated!\nnamespace " );
 
     fwrite( shader.name.text, shader.name.length, 1, output_file );
     fprintf( output_file, " {\n\n" );
@@ -2120,71 +2845,53 @@ void generate_shader_resource_header( CodeGenerator* code_generator, const char*
     buffer_class.append( "\t\thydra::graphics::MapBufferParameters map_parameters = { buffer.handle, 0, 0 };\n" );
     buffer_class.append( "\t\tLocalConstants* buffer_data = (LocalConstants*)device.map_buffer( map_parameters );\n\t\tif (buffer_data) {\n" );
 
-    // For GPU the struct must be 16 bytes aligned. Track alignment
-    uint32_t gpu_struct_alignment = 0;
+    // Same layout as the shader code, with the empty block of texture only effects.
+    uint32_t constants_size = compute_constants_layout( shader, MemoryLayout::Std140 );
+    constants_size = constants_size ? constants_size : 16;
+
+    uint32_t cpu_offset = 0;
+    uint32_t num_paddings = 0;
+    char member[k_max_symbol_length];
 
-    const DataBuffer& data_buffer = *code_generator->parser->lexer->data_buffer;
     // For each property write code
     for ( size_t i = 0; i < shader.properties.size(); i++ ) {
-        hfx::Property* property = shader.properties[i];
-
-        switch ( property->type ) {
-            case Property::Float:
-            {
-                constants_ui.append( "\tfloat\t\t\t\t\t" );
-                constants_ui.append( property->name );
-
-                cpu_constants.append( "\tfloat\t\t\t\t\t" );
-                cpu_constants.append( property->name );
-
-                if ( property->data_index != 0xffffffff ) {
-                    float value = 0.0f;
-                    get_data( data_buffer, property->data_index, value );
-                    constants_ui.append( "\t\t\t\t= %ff", value );
-                    cpu_constants.append( "\t\t\t\t= %ff", value );
-                }
-
-                constants_ui.append( ";\n" );
+        const hfx::Property& property = *shader.properties[i];
 
-                cpu_constants.append( ";\n" );
+        const uint32_t components = get_property_components( property.type );
+        if ( !components ) {
+            continue;
+        }
 
-                constants_ui_method.append( "\t\tImGui::InputScalar( \"" );
-                constants_ui_method.append( property->ui_name );
-                constants_ui_method.append( "\", ImGuiDataType_Float, &" );
-                constants_ui_method.append( property->name );
-                constants_ui_method.append( ");\n" );
+        // Gpu layout: padding before the member and padding inside the array elements.
+        if ( property.offset_in_bytes > cpu_offset ) {
+            cpu_constants.append( "\tuint8_t\t\t\t\t\tpad_%u[%u];\n", num_paddings++, property.offset_in_bytes - cpu_offset );
+        }
+        cpu_offset = property.offset_in_bytes + property.size_in_bytes;
 
-                // buffer_data->scale = constantsUI.scale;
-                buffer_class.append( "\t\t\tbuffer_data->" );
-                buffer_class.append( property->name );
-                buffer_class.append( " = constantsUI." );
-                buffer_class.append( property->name );
-                buffer_class.append( ";\n" );
+        const uint32_t gpu_floats_per_element = property.array_count ? property.array_stride / sizeof( float ) : components;
+        append_cpp_member( cpu_constants, property, gpu_floats_per_element );
+        append_cpp_member( constants_ui, property, components );
 
-                ++gpu_struct_alignment;
+        constants_checks.append( "static_assert( offsetof( LocalConstants, %.*s ) == %u, \"Offset of %.*s differs from the shader.\" );\n",
+                                 (int)property.name.length, property.name.text, property.offset_in_bytes, (int)property.name.length, property.name.text );
 
-                break;
-            }
+        // Ui and copy of each element into the buffer.
+        if ( property.array_count ) {
+            snprintf( member, k_max_symbol_length, "%.*s[i]", (int)property.name.length, property.name.text );
 
-            case Property::Int:
-            {
-                break;
-            }
+            constants_ui_method.append( "\t\tfor ( uint32_t i = 0; i < %u; ++i ) {\n\t\t\tImGui::PushID( i );\n\t\t\t", property.array_count );
+            append_imgui_widget( constants_ui_method, property, member );
+            constants_ui_method.append( "\t\t\tImGui::PopID();\n\t\t}\n" );
 
-            case Property::Range:
-            {
-                break;
-            }
+            buffer_class.append( "\t\t\tfor ( uint32_t i = 0; i < %u; ++i ) {\n\t\t\t\tmemcpy( &buffer_data->%s, &constantsUI.%s, sizeof( constantsUI.%s ) );\n\t\t\t}\n", property.array_count, member, member, member );
+        }
+        else {
+            snprintf( member, k_max_symbol_length, "%.*s", (int)property.name.length, property.name.text );
 
-            case Property::Color:
-            {
-                break;
-            }
+            constants_ui_method.append( "\t\t" );
+            append_imgui_widget( constants_ui_method, property, member );
 
-            case Property::Vector:
-            {
-                break;
-            }
+            buffer_class.append( "\t\t\tmemcpy( &buffer_data->%s, &constantsUI.%s, sizeof( constantsUI.%s ) );\n", member, member, member );
         }
     }
 
@@ -2197,16 +2904,20 @@ void generate_shader_resource_header( CodeGenerator* code_generator, const char*
     constants_ui_method.append( "}; // struct LocalConstantsUI\n\n" );
 
     // Add tail padding data
-    uint32_t tail_padding_size = 4 - (gpu_struct_alignment % 4);
-    cpu_constants.append( "\tfloat\t\t\t\t\tpad_tail[%u];\n\n", tail_padding_size );
+    if ( constants_size > cpu_offset ) {
+        cpu_constants.append( "\tuint8_t\t\t\t\t\tpad_tail[%u];\n", constants_size - cpu_offset );
+    }
+
+    cpu_constants.append( "\n}; // struct LocalConstants\n\n" );
 
-    cpu_constants.append( "}; // struct LocalConstants\n\n" );
+    constants_checks.append( "static_assert( sizeof( LocalConstants ) == %u, \"Size of LocalConstants differs from the shader.\" );\n\n", constants_size );
 
     buffer_class.append( "\t\t\tdevice.unmap_buffer( map_parameters );\n\t\t}\n\t}\n}; // struct LocalConstantBuffer\n\n" );
 
     fwrite( constants_ui.data, constants_ui.current_size, 1, output_file );
     fwrite( constants_ui_method.data, constants_ui_method.current_size, 1, output_file );
     fwrite( cpu_constants.data, cpu_constants.current_size, 1, output_file );
+    fwrite( constants_checks.data, constants_checks.current_size, 1, output_file );
     fwrite( buffer_class.data, buffer_class.current_size, 1, output_file );
 
 
@@ -2230,19 +2941,77 @@ bool is_resources_layout_automatic( const Shader& shader, const Pass& pass ) {
 
 //
 //
-void init_shader_effect_file( ShaderEffectFile& file, const char* full_filename ) {
+bool init_shader_effect_file( ShaderEffectFile& file, const char* full_filename ) {
 
-    char* memory = hydra::read_file_into_memory( full_filename, nullptr );
-    init_shader_effect_file( file, memory );
+    hydra::MappedFile mapped_file;
+    if ( !hydra::map_file( full_filename, mapped_file ) ) {
+        HYDRA_LOG( "Error: cannot open shader effect file %s.\n", full_filename );
+        return false;
+    }
+
+    if ( !init_shader_effect_file( file, mapped_file.memory, mapped_file.size ) ) {
+        HYDRA_LOG( "Error: invalid shader effect file %s.\n", full_filename );
+        hydra::unmap_file( mapped_file );
+        return false;
+    }
+
+    file.mapped_file = mapped_file;
+    return true;
 }
 
-void init_shader_effect_file( ShaderEffectFile& file, char* memory ) {
+void terminate_shader_effect_file( ShaderEffectFile& file ) {
+    hydra::unmap_file( file.mapped_file );
+
+    file = ShaderEffectFile();
+}
+
+//
+//
+bool is_shader_effect_file_valid( const char* memory, size_t size ) {
+
+    if ( !memory || size < sizeof( ShaderEffectFile::Header ) ) {
+        return false;
+    }
+
+    const ShaderEffectFile::Header* header = (const ShaderEffectFile::Header*)memory;
+    if ( header->magic != ShaderEffectFile::k_magic || header->version != ShaderEffectFile::k_version ) {
+        HYDRA_LOG( "Error: shader effect file version %u, expected %u. Compile it again.\n", header->magic == ShaderEffectFile::k_magic ? header->version : 0, ShaderEffectFile::k_version );
+        return false;
+    }
+
+    if ( header->alignment != ShaderEffectFile::k_alignment || ( (uintptr_t)memory % ShaderEffectFile::k_alignment ) != 0 ) {
+        HYDRA_LOG( "Error: shader effect file is not aligned to %u bytes.\n", ShaderEffectFile::k_alignment );
+        return false;
+    }
+
+    if ( header->file_size > size || header->properties_offset >= header->file_size || header->resource_defaults_offset > header->properties_offset ) {
+        HYDRA_LOG( "Error: shader effect file is truncated.\n" );
+        return false;
+    }
+
+    const size_t checksum = hash_bytes( (void*)( memory + sizeof( ShaderEffectFile::Header ) ), header->file_size - sizeof( ShaderEffectFile::Header ), k_shader_effect_checksum_seed );
+    if ( checksum != header->checksum ) {
+        HYDRA_LOG( "Error: shader effect file checksum mismatch.\n" );
+        return false;
+    }
+
+    return true;
+}
+
+//
+// Nothing is copied: header, passes, defaults and properties are accessed inside memory.
+bool init_shader_effect_file( ShaderEffectFile& file, char* memory, size_t size ) {
+
+    if ( !is_shader_effect_file_valid( memory, size ) ) {
+        return false;
+    }
+
     file.memory = memory;
     file.header = (hfx::ShaderEffectFile::Header*)file.memory;
 
     char* default_resources_data = file.memory + file.header->resource_defaults_offset;
 
-    uint32_t num_resources = *(uint32_t*)(default_resources_data);
+    // Skip the resource count: only the local constants defaults are read.
     default_resources_data += sizeof( uint32_t );
 
     // Read local constants defaults
@@ -2255,6 +3024,8 @@ void init_shader_effect_file( ShaderEffectFile& file, char* memory ) {
     // Cache property access
     file.num_properties = *(uint32_t*)(file.memory + file.header->properties_offset);
     file.properties_data = (file.memory + file.header->properties_offset) + sizeof( uint32_t );
+
+    return true;
 }
 
 //
@@ -2270,14 +3041,61 @@ ShaderEffectFile::MaterialProperty* get_property( char* properties_data, uint32_
     return (ShaderEffectFile::MaterialProperty*)(properties_data + index * sizeof( ShaderEffectFile::MaterialProperty ));
 }
 
+//
+//
+uint32_t get_property_components( Property::Type type ) {
+    switch ( type ) {
+        case Property::Float:
+        case Property::Int:
+        case Property::Range:
+            return 1;
+
+        case Property::Color:
+        case Property::Vector:
+            return 4;
+
+        default:
+            return 0;
+    }
+}
+
+//
+// Values fill the elements in order, each with the components of the type. Exceeding values are ignored.
+void write_property_values( const ShaderEffectFile::MaterialProperty* property, const float* values, uint32_t num_values, char* constants_data ) {
+    const uint32_t components = get_property_components( property->type );
+    const uint32_t num_elements = property->array_count ? property->array_count : 1;
+    const uint32_t count = num_values < num_elements * components ? num_values : num_elements * components;
+
+    for ( uint32_t i = 0; i < count; ++i ) {
+        char* destination = constants_data + property->offset + ( i / components ) * property->array_stride + ( i % components ) * sizeof( float );
+
+        if ( property->type == Property::Int ) {
+            const int32_t value = (int32_t)values[i];
+            memcpy( destination, &value, sizeof( int32_t ) );
+        }
+        else {
+            memcpy( destination, &values[i], sizeof( float ) );
+        }
+    }
+}
+
+//
+// Index in the shader chunk list of a stage of the variant.
+static uint32_t get_variant_chunk( ShaderEffectFile::PassHeader* pass_header, uint32_t variant_index, uint32_t stage_index ) {
+    const char* variant_table = (const char*)pass_header + pass_header->variant_table_offset;
+    const uint16_t* variant_chunks = (const uint16_t*)( variant_table + pass_header->num_options * k_max_option_name_length + pass_header->num_variant_keys * sizeof( ShaderEffectFile::VariantKey ) );
+
+    return variant_chunks[variant_index * pass_header->num_shader_chunks + stage_index];
+}
+
 //
 // Helper method to create shader stages
-void get_shader_creation( ShaderEffectFile::PassHeader* pass_header, uint32_t index, hydra::graphics::ShaderCreation::Stage* shader_creation ) {
+void get_shader_creation( ShaderEffectFile::PassHeader* pass_header, uint32_t index, hydra::graphics::ShaderCreation::Stage* shader_creation, uint32_t variant_index ) {
 
-    uint32_t shader_count = pass_header->num_shader_chunks;
     char* pass_memory = (char*)pass_header;
     char* shader_offset_list_start = pass_memory + sizeof( ShaderEffectFile::PassHeader ) + pass_header->shader_list_offset;
-    const uint32_t shader_offset = *(uint32_t*)(shader_offset_list_start + (index * sizeof( ShaderEffectFile::ShaderChunk )));
+    const uint32_t chunk_index = get_variant_chunk( pass_header, variant_index, index );
+    const uint32_t shader_offset = *(uint32_t*)(shader_offset_list_start + (chunk_index * sizeof( ShaderEffectFile::ShaderChunk )));
     char* shader_chunk_start = pass_memory + shader_offset;
 
     hfx::ShaderEffectFile::ChunkHeader* shader_chunk_header = ( hfx::ShaderEffectFile::ChunkHeader* )( shader_chunk_start );
@@ -2315,14 +3133,14 @@ static void get_vertex_input( ShaderEffectFile::PassHeader* pass_header, hydra::
 //
 // Fill the pipeline with more informations possible found in the HFX file.
 //
-void get_pipeline( ShaderEffectFile::PassHeader* pass_header, hydra::graphics::PipelineCreation& pipeline ) {
+void get_pipeline( ShaderEffectFile::PassHeader* pass_header, hydra::graphics::PipelineCreation& pipeline, uint32_t variant_index ) {
     // get_shader_creation
     // get_vertex_input
     uint32_t shader_count = pass_header->num_shader_chunks;
     hydra::graphics::ShaderCreation& creation = pipeline.shaders;
 
     for ( uint16_t i = 0; i < shader_count; i++ ) {
-        hfx::get_shader_creation( pass_header, i, &creation.stages[i] );
+        hfx::get_shader_creation( pass_header, i, &creation.stages[i], variant_index );
     }
 
     creation.name = pass_header->name;
@@ -2346,59 +3164,151 @@ const hydra::graphics::ResourceListLayoutCreation::Binding* get_pass_layout_bind
 
     // Scan through all the resouce layouts.
     while ( layout_index-- ) {
-        uint8_t num_bindings = (uint8_t)*pass_memory;
-        pass_memory += (sizeof( uint8_t ) + num_bindings * sizeof( hydra::graphics::ResourceListLayoutCreation::Binding ) );
+        uint32_t num_bindings = *(uint32_t*)pass_memory;
+        pass_memory += (sizeof( uint32_t ) + num_bindings * sizeof( hydra::graphics::ResourceListLayoutCreation::Binding ) );
     }
 
     // Retrieve bindings count
-    num_bindings = (uint8_t)*pass_memory;
+    num_bindings = (uint8_t)*(uint32_t*)pass_memory;
     // Returns the bindings.
-    return (const hydra::graphics::ResourceListLayoutCreation::Binding*)(pass_memory + sizeof( uint8_t ));
+    return (const hydra::graphics::ResourceListLayoutCreation::Binding*)(pass_memory + sizeof( uint32_t ));
+}
+
+//
+//
+const char* get_option_name( const ShaderEffectFile::PassHeader* pass_header, uint32_t index ) {
+    const char* variant_table = (const char*)pass_header + pass_header->variant_table_offset;
+    return variant_table + index * k_max_option_name_length;
+}
+
+//
+//
+uint32_t get_option_mask( const ShaderEffectFile::PassHeader* pass_header, const char* option_name ) {
+    for ( uint32_t o = 0; o < pass_header->num_options; ++o ) {
+        if ( strncmp( get_option_name( pass_header, o ), option_name, k_max_option_name_length ) == 0 ) {
+            return 1 << o;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Binary search of the key, variant keys are sorted.
+uint32_t get_variant_index( const ShaderEffectFile::PassHeader* pass_header, uint32_t option_key ) {
+    const char* variant_table = (const char*)pass_header + pass_header->variant_table_offset;
+    const ShaderEffectFile::VariantKey* variant_keys = (const ShaderEffectFile::VariantKey*)( variant_table + pass_header->num_options * k_max_option_name_length );
+
+    uint32_t first = 0, last = pass_header->num_variant_keys;
+    while ( first < last ) {
+        const uint32_t middle = ( first + last ) / 2;
+        if ( variant_keys[middle].key < option_key ) {
+            first = middle + 1;
+        }
+        else {
+            last = middle;
+        }
+    }
+
+    return ( first < pass_header->num_variant_keys && variant_keys[first].key == option_key ) ? variant_keys[first].variant_index : ShaderEffectFile::k_invalid_variant;
 }
 
 
 // HFX interface ////////////////////////////////////////////////////////////////
 
 static const size_t                 k_hfx_random_seed       = 0xfeba666ddea21a46;
+static const uint32_t               k_code_generator_buffer_size = 256 * 1024;    // Passes with options contain the code of all their variants.
 
 //
 //
-bool compile_hfx( const char* full_filename, const char* out_folder, const char* out_filename ) {
+bool compile_hfx( const char* full_filename, const char* out_folder, const char* out_filename, StringBuffer* out_includes ) {
+
+    CompilerContext context;
+    init_compiler_context( context );
+
+    const bool result = compile_hfx( context, full_filename, out_folder, out_filename, out_includes );
+
+    terminate_compiler_context( context );
+
+    return result;
+}
+
+//
+//
+bool compile_hfx( CompilerContext& context, const char* full_filename, const char* out_folder, const char* out_filename, StringBuffer* out_includes, const char* out_header_folder ) {
     char* text = hydra::read_file_into_memory( full_filename, nullptr );
     if ( !text ) {
         HYDRA_LOG( "Error compiling file %s: file not found.\n", full_filename );
         return false;
     }
 
-    set_rand_seed( k_hfx_random_seed );
     size_t source_file_hash = hash_string( text, k_hfx_random_seed );
 
     hydra::FileTime file_time = hydra::get_last_write_time( full_filename );
 
     Lexer lexer;
-    DataBuffer data_buffer;
-
-    init_data_buffer( &data_buffer, 256, 2048 );
-    init_lexer( &lexer, text, &data_buffer );
+    reset( &context.data_buffer );
+    init_lexer( &lexer, text, &context.data_buffer );
 
-    Parser parser;
-    hfx::init_parser( &parser, &lexer );
+    Parser& parser = context.parser;
+    reset_parser( &parser, &lexer );
     hfx::generate_ast( &parser );
 
-    hfx::CodeGenerator code_generator;
-    hfx::init_code_generator( &code_generator, &parser, 32 * 1024, 8, full_filename );
+    // The effect is still generated, but a compilation with errors fails.
+    const bool success = !lexer.error && parser.errors == 0;
+    if ( !success ) {
+        if ( lexer.error ) {
+            HYDRA_LOG( "Error compiling file %s: unexpected token at line %u.\n", full_filename, lexer.error_line );
+        }
+        else {
+            HYDRA_LOG( "Error compiling file %s: %u errors.\n", full_filename, parser.errors );
+        }
+    }
+
+    hfx::CodeGenerator& code_generator = context.code_generator;
+    strcpy( code_generator.input_filename, full_filename );
 
     // Init header magic
     memcpy( code_generator.binary_header_magic, &file_time, sizeof( hydra::FileTime ) );
     memcpy( &code_generator.binary_header_magic[sizeof( hydra::FileTime )], &source_file_hash, sizeof(size_t) );
 
-    hfx::compile_shader_effect_file( &code_generator, out_folder, out_filename );
+    const bool written = hfx::compile_shader_effect_file( &code_generator, out_folder, out_filename );
+
+    // Parsed names point into the source text: generate the header before freeing it.
+    if ( out_header_folder ) {
+        hfx::generate_shader_resource_header( &code_generator, out_header_folder );
+    }
+
+    if ( out_includes ) {
+        const ArenaArray<StringRef>& includes = parser.shader.hfx_includes;
+        for ( size_t i = 0; i < includes.size(); ++i ) {
+            out_includes->append_use_substring( includes[i].text, 0, (uint32_t)includes[i].length );
+        }
+    }
 
-    hfx::terminate_parser( &parser );
-    hfx::terminate_code_generator( &code_generator );
     hydra::hy_free( text );
 
-    return true;
+    return success && written;
+}
+
+//
+//
+void init_compiler_context( CompilerContext& context ) {
+    init_data_buffer( &context.data_buffer, 256, 2048 );
+    hfx::init_parser( &context.parser, nullptr );
+    hfx::init_code_generator( &context.code_generator, &context.parser, k_code_generator_buffer_size, 8, "" );
+    hfx::init_include_cache( context.include_cache );
+    context.parser.include_cache = &context.include_cache;
+}
+
+//
+//
+void terminate_compiler_context( CompilerContext& context ) {
+    hfx::terminate_parser( &context.parser );
+    hfx::terminate_code_generator( &context.code_generator );
+    delete[] context.code_generator.string_buffers;
+    terminate_data_buffer( &context.data_buffer );
+    hfx::terminate_include_cache( context.include_cache );
 }
 
 //
@@ -2421,12 +3331,16 @@ void generate_hfx_permutations( const char* file_path, const char* out_folder )
     init_data_buffer( &data_buffer, 256, 2048 );
     init_lexer( &lexer, text, &data_buffer );
 
+    IncludeCache include_cache;
+    hfx::init_include_cache( include_cache );
+
     Parser parser;
     hfx::init_parser( &parser, &lexer );
+    parser.include_cache = &include_cache;
     hfx::generate_ast( &parser );
 
     hfx::CodeGenerator code_generator;
-    hfx::init_code_generator( &code_generator, &parser, 32 * 1024, 8, file_path );
+    hfx::init_code_generator( &code_generator, &parser, k_code_generator_buffer_size, 8, file_path );
 
     // Init header magic
     memcpy( code_generator.binary_header_magic, &file_time, sizeof( hydra::FileTime ) );
@@ -2435,6 +3349,7 @@ void generate_hfx_permutations( const char* file_path, const char* out_folder )
     hfx::generate_shader_permutations( &code_generator, out_folder);
 
     hfx::terminate_parser( &parser );
+    hfx::terminate_include_cache( include_cache );
     hfx::terminate_code_generator( &code_generator );
     hydra::hy_free( text );
 }
@@ -1,6 +1,6 @@
 
 //
-// Hydra HFX v0.11
+// Hydra HFX v0.20
 //
 //      Source code     : https://www.github.com/jorenjoestar/
 //
@@ -9,6 +9,15 @@
 //
 // Revision history //////////////////////
 //
+//      0.20  (2020/03/23): + Parsed shaders are allocated from a per parser MemoryArena, released at once on reset. Arena usage is reported per compilation.
+//      0.19  (2020/03/23): + Local constants use std140 layout for all numeric properties and arrays. Added C++ mirror header with checked offsets.
+//      0.18  (2020/03/22): + Added pass options and shader variants. Only reachable variants are compiled and identical code is shared.
+//      0.17  (2020/03/21): + Versioned binary header with checksum and aligned sections. Binary files can be memory mapped and read in place.
+//      0.16  (2020/03/20): + Keywords are dispatched through a perfect hash table. Faster lexing of whitespaces, comments and identifiers.
+//      0.15  (2020/03/19): + Declarations are found through per kind symbol tables. Duplicated declarations are reported.
+//      0.14  (2020/03/18): + Added IncludeCache: included hfx files are parsed once and referenced by name, without copies.
+//      0.13  (2020/03/17): + Added CompilerContext, to reuse parsing and code generation memory between compilations.
+//      0.12  (2020/03/16): + compile_hfx can output the included files, to track compilation dependencies.
 //      0.11  (2020/02/06): + Added revision history.
 //
 // Defines ///////////////////////////////
@@ -33,6 +42,8 @@ namespace hfx {
     typedef hydra::graphics::ResourceListLayoutCreation::Binding ResourceBinding;
     typedef hydra::StringRef StringRef;
     typedef hydra::StringBuffer StringBuffer;
+    typedef hydra::MemoryArena MemoryArena;
+    using hydra::ArenaArray;
 
 #define HFX_PARSING
 
@@ -43,9 +54,19 @@ namespace hfx {
     // HFX interface ////////////////////////////////////////////////////////////
     //
 
-    bool                            compile_hfx( const char* full_filename, const char* out_folder, const char* out_filename );
+    struct CompilerContext;
+
+    // When out_includes is not null, the path of each included hfx file is appended null terminated.
+    // Returns false when the file is missing or has lexer or parser errors, including errors in its includes.
+    bool                            compile_hfx( const char* full_filename, const char* out_folder, const char* out_filename, StringBuffer* out_includes = nullptr );
+    // Same as above, reusing the memory of the context. Contexts are not shared: use one per thread to compile in parallel.
+    // When out_header_folder is not null, the C++ header mirroring the local constants is written there too.
+    bool                            compile_hfx( CompilerContext& context, const char* full_filename, const char* out_folder, const char* out_filename, StringBuffer* out_includes = nullptr, const char* out_header_folder = nullptr );
     void                            generate_hfx_permutations( const char* file_path, const char* out_folder );
 
+    void                            init_compiler_context( CompilerContext& context );
+    void                            terminate_compiler_context( CompilerContext& context );
+
 
     //
     // Parsing classes //////////////////////////////////////////////////////////
@@ -61,9 +82,9 @@ namespace hfx {
 
         }; // struct Resource
 
-        std::vector<StringRef>      includes;
-        std::vector<uint32_t>       includes_flags;     // Stage mask + File/Local include, used for referencing other hfx.
-        std::vector<Resource>       resources;          // Used to generate the layout table.
+        ArenaArray<StringRef>       includes;
+        ArenaArray<uint32_t>        includes_flags;     // Stage mask + File/Local include, used for referencing other hfx.
+        ArenaArray<Resource>        resources;          // Used to generate the layout table.
 
         StringRef                   name;
         StringRef                   code;
@@ -85,10 +106,15 @@ namespace hfx {
         StringRef                   ui_name;
         StringRef                   ui_arguments;
         StringRef                   default_value;
+        ArenaArray<float>           default_values;             // Numbers of the default value: (x, y, ...) for colors, vectors and arrays.
 
         Type                        type = Unknown;
+        uint32_t                    array_count = 0;            // 0 if the property is not an array.
+
+        // Position in the local constants, computed by compute_constants_layout.
         uint32_t                    offset_in_bytes = 0;
-        uint32_t                    data_index = 0xffffffff;     // Index into the DataBuffer holding the value
+        uint32_t                    size_in_bytes = 0;
+        uint32_t                    array_stride = 0;
 
     }; // struct Properties
 
@@ -97,8 +123,8 @@ namespace hfx {
     struct ResourceList {
 
         StringRef                   name;
-        std::vector<ResourceBinding> resources;
-        std::vector<uint32_t>       flags;
+        ArenaArray<ResourceBinding> resources;
+        ArenaArray<uint32_t>        flags;
 
     }; // struct ResourceList
 
@@ -107,8 +133,8 @@ namespace hfx {
     struct VertexLayout {
 
         StringRef                   name;
-        std::vector<hydra::graphics::VertexStream> streams;
-        std::vector<hydra::graphics::VertexAttribute> attributes;
+        ArenaArray<hydra::graphics::VertexStream> streams;
+        ArenaArray<hydra::graphics::VertexAttribute> attributes;
 
     }; // struct VertexLayout
 
@@ -137,12 +163,15 @@ namespace hfx {
 
         StringRef                   name;
         StringRef                   stage_name;
-        std::vector<ShaderStage>    shader_stages;
+        ArenaArray<ShaderStage>     shader_stages;
 
-        std::vector<const ResourceList*> resource_lists;         // List used by the pass
+        ArenaArray<const ResourceList*> resource_lists;          // List used by the pass
         const VertexLayout*         vertex_layout;
         const RenderState*          render_state;
 
+        ArenaArray<StringRef>       options;                    // Option i is bit i of the variant key, enabled with #define OPTION_<NAME>.
+        ArenaArray<uint32_t>        option_groups;              // Mask of each options declaration: at most one option per group is enabled.
+
     }; // struct Pass
 
     //
@@ -154,6 +183,26 @@ namespace hfx {
 
     }; // struct SamplerState
 
+    //
+    // Kinds of named declarations, each with its own symbol table.
+    namespace Symbol {
+        enum Enum {
+            CodeFragment, ResourceList, Property, VertexLayout, RenderState, SamplerState, Count
+        };
+    } // namespace Symbol
+
+    //
+    // Declaration name to index into the list of declarations of the same kind.
+    // Open addressing table allocated from the parser arena. Names are not copied, they point into the source text.
+    struct SymbolTable {
+
+        StringRef*                  names               = nullptr;
+        uint32_t*                   values              = nullptr;
+        uint32_t                    capacity            = 0;        // Power of two.
+        uint32_t                    count               = 0;
+
+    }; // struct SymbolTable
+
     //
     //
     struct Shader {
@@ -161,14 +210,17 @@ namespace hfx {
         StringRef                       name;
         StringRef                       pipeline_name;
 
-        std::vector<Pass>               passes;
-        std::vector<Property*>          properties;
-        std::vector<const ResourceList*> resource_lists;        // All declared lists
-        std::vector<const VertexLayout*> vertex_layouts;        // All declared vertex layouts
-        std::vector<const RenderState*> render_states;          // All declared render states
-        std::vector<const SamplerState*> sampler_states;        // All declared sampler states
-        std::vector<StringRef>          hfx_includes;           // HFX files included with this.
-        std::vector<CodeFragment>       code_fragments;
+        ArenaArray<Pass>                passes;
+        ArenaArray<Property*>           properties;
+        ArenaArray<const ResourceList*> resource_lists;         // All declared lists
+        ArenaArray<const VertexLayout*> vertex_layouts;         // All declared vertex layouts
+        ArenaArray<const RenderState*>  render_states;          // All declared render states
+        ArenaArray<const SamplerState*> sampler_states;         // All declared sampler states
+        ArenaArray<StringRef>           hfx_includes;           // HFX files included with this, nested ones too.
+        ArenaArray<const Shader*>       included_shaders;       // Owned by the include cache. Their elements are named "Shader.name".
+        ArenaArray<CodeFragment>        code_fragments;
+
+        SymbolTable                     symbols[Symbol::Count];         // Filled while parsing, first declaration wins.
 
         bool                            has_local_resource_list = false;
 
@@ -177,19 +229,66 @@ namespace hfx {
     //
     // Parser ///////////////////////////////////////////////////////////////////
 
+    struct IncludeCache;
+
     //
     //
     struct Parser {
 
         Lexer*                      lexer = nullptr;
+        IncludeCache*               include_cache = nullptr;        // Needed to parse includes.
 
-        StringBuffer                string_buffer;
+        MemoryArena                 arena;                          // Owns the parsed shader.
         Shader                      shader;
 
+        uint32_t                    errors = 0;                     // Reported errors, also counting failed includes.
+
     }; // struct Parser
 
+    //
+    // Included files, read and parsed once and shared by all the files including them.
+    // Parsed includes are immutable and stay in memory until the cache is terminated.
+    struct IncludeCache {
+
+        struct Entry {
+
+            enum State {
+                Parsing, Parsed, Missing
+            };
+
+            char*                   text = nullptr;
+            DataBuffer              data_buffer;
+            Lexer                   lexer;
+            Parser                  parser;
+            State                   state = Parsing;                // Including a file still parsing is a cycle.
+
+        }; // struct Entry
+
+        struct EntryMap {
+            char*                   key;
+            Entry*                  value;
+        }; // struct EntryMap
+
+        struct FileMap {
+            char*                   key;
+            char*                   value;
+        }; // struct FileMap
+
+        EntryMap*                   path_to_entry   = nullptr;      // Included hfx files.
+        FileMap*                    path_to_file    = nullptr;      // Files added to the shader code, null when missing.
+
+    }; // struct IncludeCache
+
+    void                            init_include_cache( IncludeCache& cache );
+    void                            terminate_include_cache( IncludeCache& cache );
+    void                            reset_include_cache( IncludeCache& cache );     // Removes all the includes, keeping the maps.
+
+    const IncludeCache::Entry*      get_include( IncludeCache& cache, const StringRef& path );
+    const char*                     get_include_file( IncludeCache& cache, const char* full_filename );
+
     void                            init_parser( Parser* parser, Lexer* lexer );
     void                            terminate_parser( Parser* parser );
+    void                            reset_parser( Parser* parser, Lexer* lexer );     // Release the parsed shader at once, keeping the arena memory.
 
     void                            generate_ast( Parser* parser );
 
@@ -223,6 +322,7 @@ namespace hfx {
     void                            declaration_pass_stage( Parser* parser, Pass& pass );
     void                            declaration_pass_vertex_layout( Parser* parser, Pass& pass );
     void                            declaration_pass_render_states( Parser* parser, Pass& pass );
+    void                            declaration_pass_options( Parser* parser, Pass& pass );
     void                            declaration_includes( Parser* parser );
     void                            declaration_render_states( Parser* parser );
     void                            declaration_render_state( Parser* parser, RenderState& render_state );
@@ -250,13 +350,37 @@ namespace hfx {
     void                            terminate_code_generator( CodeGenerator* code_generator );
 
     void                            generate_shader_permutations( CodeGenerator* code_generator, const char* path );
-    void                            compile_shader_effect_file( CodeGenerator* code_generator, const char* output_path, const char* filename );
+    // Returns false, without writing the file, when the effect does not fit in the code generator buffers or a pass has too many option combinations.
+    bool                            compile_shader_effect_file( CodeGenerator* code_generator, const char* output_path, const char* filename );
     void                            generate_shader_resource_header( CodeGenerator* code_generator, const char* path );
 
+    //
+    // Layout rules of a constants block, as in the GLSL specification.
+    namespace MemoryLayout {
+        enum Enum {
+            Std140, Std430
+        };
+    } // namespace MemoryLayout
+
+    // Computes offset, size and array stride of each numeric property. Returns the size of the whole block.
+    uint32_t                        compute_constants_layout( const Shader& shader, MemoryLayout::Enum layout );
+
     void                            output_shader_stage( CodeGenerator* code_generator, const char* path, const Pass::ShaderStage& stage );
 
     bool                            is_resources_layout_automatic( const Shader& shader, const Pass& pass );
 
+    //
+    // Memory used to compile one hfx file, kept between compilations.
+    // Includes are cached for the whole life of the context.
+    struct CompilerContext {
+
+        DataBuffer                  data_buffer;
+        Parser                      parser;
+        CodeGenerator               code_generator;
+        IncludeCache                include_cache;
+
+    }; // struct CompilerContext
+
 #else
     struct Property {
 
@@ -269,14 +393,26 @@ namespace hfx {
 
     //
     // Shader effect file containing all the informations to build a shader.
+    // All sections start at multiples of k_alignment from the file start and every structure is naturally aligned,
+    // so a file mapped in memory (or embedded at an aligned offset) can be read in place.
     struct ShaderEffectFile {
 
+        static const uint32_t           k_magic                 = 0x58464842;   // 'BHFX'
+        static const uint16_t           k_version               = 3;
+        static const uint16_t           k_alignment             = 16;
+        static const uint32_t           k_invalid_variant       = 0xffffffff;
+
         //
         // Main header of the file.
         struct Header {
+            uint32_t                    magic;
+            uint16_t                    version;
+            uint16_t                    alignment;
+            uint32_t                    file_size;
             uint32_t                    num_passes;
             uint32_t                    resource_defaults_offset;
             uint32_t                    properties_offset;
+            uint64_t                    checksum;       // Hash of everything after the header.
             char                        name[32];
             char                        binary_header_magic[32];
             char                        pipeline_name[32];
@@ -289,17 +425,30 @@ namespace hfx {
 
 
         struct PassHeader {
-            uint8_t                     num_shader_chunks;
+            uint8_t                     num_shader_chunks;      // Shader stages of each variant.
             uint8_t                     num_vertex_streams;
             uint8_t                     num_vertex_attributes;
             uint8_t                     num_resource_layouts;
             uint16_t                    has_resource_state;
             uint16_t                    shader_list_offset;
             uint32_t                    resource_table_offset;
+            uint16_t                    num_options;
+            uint16_t                    num_variants;
+            uint32_t                    num_variant_keys;
+            uint32_t                    variant_table_offset;
             char                        name[32];
             char                        stage_name[32];
         }; // struct PassHeader
 
+        //
+        // Variant table of a pass: option names (char[32] each), variant keys sorted by key,
+        // then for each variant the uint16_t index in the shader chunk list of each stage.
+        // Only reachable combinations of options have a key, and variants with the same code are shared.
+        struct VariantKey {
+            uint32_t                    key;
+            uint32_t                    variant_index;
+        }; // struct VariantKey
+
 
         struct ChunkHeader {
             uint32_t                    code_size;
@@ -310,12 +459,16 @@ namespace hfx {
 
             Property::Type              type;
             uint16_t                    offset;
+            uint16_t                    size;           // Bytes in the local constants, array padding included.
+            uint16_t                    array_count;    // 0 if the property is not an array.
+            uint16_t                    array_stride;
             char                        name[64];
         }; // struct MaterialProperty
 
 
         char*                           memory                  = nullptr;
         Header*                         header                  = nullptr;
+        hydra::MappedFile               mapped_file;            // Valid only when the file was opened by name.
 
         uint16_t                        num_resource_defaults   = 0;
         uint16_t                        num_properties          = 0;
@@ -328,17 +481,33 @@ namespace hfx {
     }; // struct ShaderEffectFile
 
     // ShaderEffectFile methods /////////////////////////////////////////////////
-    void                                init_shader_effect_file( ShaderEffectFile& file, const char* full_filename );
-    void                                init_shader_effect_file( ShaderEffectFile& file, char* memory );
+    // Maps the file in memory, to be released with terminate_shader_effect_file.
+    bool                                init_shader_effect_file( ShaderEffectFile& file, const char* full_filename );
+    // Reads in place from memory, that must be aligned to ShaderEffectFile::k_alignment and outlive the file.
+    bool                                init_shader_effect_file( ShaderEffectFile& file, char* memory, size_t size );
+    void                                terminate_shader_effect_file( ShaderEffectFile& file );
+
+    // Checks magic, version, alignment, size and checksum.
+    bool                                is_shader_effect_file_valid( const char* memory, size_t size );
 
     ShaderEffectFile::PassHeader*       get_pass( char* hfx_memory, uint32_t index );
 
-    void                                get_shader_creation( ShaderEffectFile::PassHeader* pass_header, uint32_t index, hydra::graphics::ShaderCreation::Stage* shader_creation );
+    void                                get_shader_creation( ShaderEffectFile::PassHeader* pass_header, uint32_t index, hydra::graphics::ShaderCreation::Stage* shader_creation, uint32_t variant_index = 0 );
 
-    void                                get_pipeline( ShaderEffectFile::PassHeader* pass_header, hydra::graphics::PipelineCreation& pipeline );
+    void                                get_pipeline( ShaderEffectFile::PassHeader* pass_header, hydra::graphics::PipelineCreation& pipeline, uint32_t variant_index = 0 );
+
+    // Pass variants. The option key is the or of the masks of the enabled options, 0 being the default variant.
+    const char*                         get_option_name( const ShaderEffectFile::PassHeader* pass_header, uint32_t index );
+    uint32_t                            get_option_mask( const ShaderEffectFile::PassHeader* pass_header, const char* option_name );    // 0 if the option is not present.
+    uint32_t                            get_variant_index( const ShaderEffectFile::PassHeader* pass_header, uint32_t option_key );      // k_invalid_variant if the combination is not reachable.
 
     ShaderEffectFile::MaterialProperty* get_property( char* properties_data, uint32_t index );
 
+    // Numbers in each element of a property: 4 for colors and vectors, 1 for the other numeric types, 0 for textures.
+    uint32_t                            get_property_components( Property::Type type );
+    // Writes the values in the local constants following the property layout, converting them for Int properties.
+    void                                write_property_values( const ShaderEffectFile::MaterialProperty* property, const float* values, uint32_t num_values, char* constants_data );
+
     const hydra::graphics::ResourceListLayoutCreation::Binding* get_pass_layout_bindings( ShaderEffectFile::PassHeader* pass_header, uint32_t layout_index, uint8_t& num_bindings );
 
 
@@ -0,0 +1,485 @@
+//
+//  Hydra HFX Compiler - v0.03
+//
+//  Command line compiler for HFX shader effects. Files are independent and compiled in parallel.
+//
+//      Source code     : https://www.github.com/jorenjoestar/
+//
+//      Created         : 2020/03/17, 19.02
+//
+// Usage /////////////////////////////////
+//
+//      HFXCompiler <input> <output_folder> [-j num_threads] [-header header_folder]
+//      HFXCompiler -benchmark <declaration_count>
+//      HFXCompiler -benchmark_lexer <input>
+//
+//      input           : folder containing .hfx files, or manifest file listing one .hfx file per line.
+//                        Empty lines and lines starting with # are skipped.
+//      output_folder   : each file.hfx is compiled into output_folder\file.bhfx.
+//      -j              : number of compiling threads, calling thread included. Default uses all hardware threads.
+//      -header         : also write header_folder\effect_name.h, with C++ structs mirroring the local constants of each effect.
+//      -benchmark      : parse synthetic effects with up to declaration_count code fragments, lists, render states and passes,
+//                        doubling the size each time, and print the parsing time of each.
+//      -benchmark_lexer: split the input files into tokens, without parsing, and print the throughput.
+//
+//      Includes are searched in ..\data\source\ as for the applications, run it from the same folder.
+//      Each thread parses an included file once and shares it between all the files it compiles.
+//      Each binary is written into a temporary file and renamed when complete: a failed compilation
+//      never leaves a partial binary.
+//      The report lists, for each file, the bytes and the number of allocations of the parser arena.
+//
+//      Exit status: 0 when all files are compiled, 1 when any file failed, 2 for invalid arguments or no input files.
+//
+
+#include "ShaderCodeGenerator.h"
+#include "hydra/hydra_lib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+//
+struct CompileJob {
+
+    const char*                     input_filename;
+    const char*                     output_filename;    // Name only, the folder is shared.
+
+    double                          milliseconds;
+    size_t                          parser_bytes;       // Arena memory of the parsed effect only: included files are parsed in the include cache and not counted.
+    uint32_t                        parser_allocations;
+    bool                            success;
+
+}; // struct CompileJob
+
+//
+//
+struct BatchCompileData {
+
+    CompileJob*                     jobs;
+    hfx::CompilerContext*           contexts;           // One per thread.
+    const char*                     output_folder;
+    const char*                     header_folder;      // Null when headers are not generated.
+
+}; // struct BatchCompileData
+
+static const uint32_t               k_max_path_length           = 512;
+static const uint32_t               k_filenames_buffer_size     = 1024 * 1024;
+
+static const uint32_t               k_benchmark_declaration_size = 512;   // Upper bound of the source text of one declaration of each kind.
+static const uint32_t               k_benchmark_runs            = 4;
+static const uint32_t               k_lexer_benchmark_runs      = 256;
+
+static const int                    k_exit_success              = 0;
+static const int                    k_exit_compile_failed       = 1;
+static const int                    k_exit_invalid_arguments    = 2;
+
+//
+//
+static void compile_task( void* user_data, uint32_t index, uint32_t thread_index ) {
+
+    BatchCompileData& data = *(BatchCompileData*)user_data;
+    CompileJob& job = data.jobs[index];
+
+    const int64_t start_time = hydra::time_now();
+
+    char temporary_filename[k_max_path_length];
+    char temporary_full_filename[k_max_path_length];
+    char full_filename[k_max_path_length];
+    snprintf( temporary_filename, k_max_path_length, "%s.tmp", job.output_filename );
+    snprintf( temporary_full_filename, k_max_path_length, "%s%s", data.output_folder, temporary_filename );
+    snprintf( full_filename, k_max_path_length, "%s%s", data.output_folder, job.output_filename );
+
+    job.success = hfx::compile_hfx( data.contexts[thread_index], job.input_filename, data.output_folder, temporary_filename, nullptr, data.header_folder );
+    // Rename fails also when the output file could not be written.
+    job.success = job.success && hydra::rename_file( temporary_full_filename, full_filename );
+    if ( !job.success ) {
+        hydra::delete_file( temporary_full_filename );
+    }
+
+    job.milliseconds = hydra::time_from_milliseconds( start_time );
+
+    // The arena is reset by each compilation: its usage is the one of this file, without its includes.
+    const hydra::MemoryArena& arena = data.contexts[thread_index].parser.arena;
+    job.parser_bytes = arena.allocated_size;
+    job.parser_allocations = arena.allocation_count;
+}
+
+//
+//
+static int compare_jobs( const void* a, const void* b ) {
+    return strcmp( ( (const CompileJob*)a )->input_filename, ( (const CompileJob*)b )->input_filename );
+}
+
+//
+// Output is the input filename, without folder, with the bhfx extension.
+static void add_job( array( CompileJob )& jobs, const char* input_filename, hydra::StringBuffer& filenames_buffer ) {
+
+    const char* name = input_filename;
+    const char* last_separator = strrchr( input_filename, '\\' );
+    const char* last_slash = strrchr( input_filename, '/' );
+    if ( last_slash > last_separator ) {
+        last_separator = last_slash;
+    }
+    if ( last_separator ) {
+        name = last_separator + 1;
+    }
+
+    const char* extension = strrchr( name, '.' );
+    const uint32_t name_length = extension ? (uint32_t)( extension - name ) : (uint32_t)strlen( name );
+
+    CompileJob job;
+    job.input_filename = filenames_buffer.append_use( "%s", input_filename );
+    job.output_filename = filenames_buffer.append_use( "%.*s.bhfx", name_length, name );
+    job.milliseconds = 0.0;
+    job.parser_bytes = 0;
+    job.parser_allocations = 0;
+    job.success = false;
+
+    if ( job.input_filename && job.output_filename ) {
+        array_push( jobs, job );
+    }
+    else {
+        hydra::print_format( "Too many input files, skipping %s\n", input_filename );
+    }
+}
+
+//
+//
+static void collect_folder_jobs( array( CompileJob )& jobs, const char* folder, hydra::StringBuffer& filenames_buffer ) {
+
+    char search_pattern[k_max_path_length];
+    snprintf( search_pattern, k_max_path_length, "%s\\*.hfx", folder );
+
+    hydra::StringArray files;
+    hydra::init( files, k_filenames_buffer_size );
+    hydra::find_files_in_path( search_pattern, files );
+
+    char input_filename[k_max_path_length];
+    const uint32_t file_count = hydra::get_string_count( files );
+    for ( uint32_t i = 0; i < file_count; ++i ) {
+        snprintf( input_filename, k_max_path_length, "%s\\%s", folder, hydra::get_string( files, i ) );
+        add_job( jobs, input_filename, filenames_buffer );
+    }
+
+    hydra::terminate( files );
+}
+
+//
+//
+static bool collect_manifest_jobs( array( CompileJob )& jobs, const char* manifest_filename, hydra::StringBuffer& filenames_buffer ) {
+
+    char* manifest = hydra::read_file_into_memory( manifest_filename, nullptr );
+    if ( !manifest ) {
+        hydra::print_format( "Cannot open manifest %s\n", manifest_filename );
+        return false;
+    }
+
+    char* line = manifest;
+    while ( *line ) {
+        char* line_end = line + strcspn( line, "\r\n" );
+        const char next_character = *line_end;
+        *line_end = 0;
+
+        // Trim spaces.
+        while ( *line == ' ' || *line == '\t' ) {
+            ++line;
+        }
+        char* line_last = line_end;
+        while ( line_last > line && ( line_last[-1] == ' ' || line_last[-1] == '\t' ) ) {
+            *--line_last = 0;
+        }
+
+        if ( *line && *line != '#' ) {
+            add_job( jobs, line, filenames_buffer );
+        }
+
+        line = next_character ? line_end + 1 : line_end;
+    }
+
+    hydra::hy_free( manifest );
+    return true;
+}
+
+//
+// Input is either a folder or a manifest.
+static bool collect_jobs( array( CompileJob )& jobs, const char* input, hydra::StringBuffer& filenames_buffer ) {
+
+    if ( hydra::is_directory( input ) ) {
+        collect_folder_jobs( jobs, input, filenames_buffer );
+    }
+    else if ( !collect_manifest_jobs( jobs, input, filenames_buffer ) ) {
+        return false;
+    }
+
+    if ( array_length_u( jobs ) == 0 ) {
+        hydra::print_format( "No hfx files found in %s\n", input );
+        return false;
+    }
+
+    return true;
+}
+
+//
+// Each pass references declarations spread over the whole effect.
+static void generate_benchmark_effect( hydra::StringBuffer& source, uint32_t count ) {
+
+    source.clear();
+    source.append( "shader Benchmark {\n\n    layout {\n" );
+    for ( uint32_t i = 0; i < count; ++i ) {
+        source.append( "        list List%u {\n            texture2D texture%u;\n        }\n", i, i );
+    }
+    source.append( "    }\n\n    render_states {\n" );
+    for ( uint32_t i = 0; i < count; ++i ) {
+        source.append( "        state State%u {\n            Cull None\n        }\n", i );
+    }
+    source.append( "    }\n\n" );
+    for ( uint32_t i = 0; i < count; ++i ) {
+        source.append( "    glsl Fragment%u {\n        void main() {}\n    }\n\n", i );
+    }
+    for ( uint32_t i = 0; i < count; ++i ) {
+        const uint32_t r = ( i * 7919 ) % count;
+        source.append( "    pass Pass%u {\n        resources = List%u\n        render_states = State%u\n        vertex = Fragment%u\n        fragment = Fragment%u\n    }\n\n", i, r, r, r, r );
+    }
+    source.append( "}\n" );
+}
+
+//
+//
+static int run_parse_benchmark( uint32_t declaration_count ) {
+
+    if ( declaration_count == 0 ) {
+        hydra::print_format( "Benchmark needs at least one declaration.\n" );
+        return k_exit_invalid_arguments;
+    }
+
+    hydra::time_service_init();
+
+    hydra::StringBuffer source;
+    source.init( declaration_count * k_benchmark_declaration_size + 1024 );
+
+    hfx::CompilerContext context;
+    hfx::init_compiler_context( context );
+
+    uint32_t count = declaration_count >> 3;
+    count = count ? count : 1;
+    for ( ; ; ) {
+        generate_benchmark_effect( source, count );
+
+        // Best of a few runs.
+        double milliseconds = 0.0;
+        for ( uint32_t run = 0; run < k_benchmark_runs; ++run ) {
+            Lexer lexer;
+            reset( &context.data_buffer );
+            init_lexer( &lexer, source.data, &context.data_buffer );
+            hfx::reset_parser( &context.parser, &lexer );
+
+            const int64_t start_time = hydra::time_now();
+            hfx::generate_ast( &context.parser );
+            const double run_milliseconds = hydra::time_from_milliseconds( start_time );
+
+            milliseconds = ( run == 0 || run_milliseconds < milliseconds ) ? run_milliseconds : milliseconds;
+        }
+
+        const hydra::MemoryArena& arena = context.parser.arena;
+        hydra::print_format( "%8u declarations per kind, %6u passes: %10.2f ms, %8.3f us per pass, %8zu KB in %7u allocations\n", count, context.parser.shader.passes.size(), milliseconds, milliseconds * 1000.0 / count,
+                             arena.allocated_size / 1024, arena.allocation_count );
+
+        if ( count == declaration_count ) {
+            break;
+        }
+        count = ( count * 2 < declaration_count ) ? count * 2 : declaration_count;
+    }
+
+    hfx::terminate_compiler_context( context );
+    source.terminate();
+    hydra::time_service_terminate();
+
+    return k_exit_success;
+}
+
+//
+//
+static int run_lexer_benchmark( const char* input ) {
+
+    hydra::StringBuffer filenames_buffer;
+    filenames_buffer.init( k_filenames_buffer_size );
+
+    array( CompileJob ) jobs;
+    array_init( jobs );
+
+    if ( !collect_jobs( jobs, input, filenames_buffer ) ) {
+        array_free( jobs );
+        filenames_buffer.terminate();
+        return k_exit_invalid_arguments;
+    }
+
+    const uint32_t job_count = array_length_u( jobs );
+    qsort( jobs, job_count, sizeof( CompileJob ), compare_jobs );
+
+    hydra::time_service_init();
+
+    DataBuffer data_buffer;
+    init_data_buffer( &data_buffer, 256, 2048 );
+
+    size_t total_size = 0;
+    double total_milliseconds = 0.0;
+
+    for ( uint32_t i = 0; i < job_count; ++i ) {
+        size_t size = 0;
+        char* text = hydra::read_file_into_memory( jobs[i].input_filename, &size );
+        if ( !text ) {
+            hydra::print_format( "Cannot open %s\n", jobs[i].input_filename );
+            continue;
+        }
+
+        uint32_t token_count = 0;
+        const int64_t start_time = hydra::time_now();
+
+        for ( uint32_t run = 0; run < k_lexer_benchmark_runs; ++run ) {
+            Lexer lexer;
+            init_lexer( &lexer, text, &data_buffer );
+
+            Token token;
+            token_count = 0;
+            do {
+                next_token( &lexer, token );
+                ++token_count;
+            } while ( token.type != Token::Token_EndOfStream );
+        }
+
+        const double milliseconds = hydra::time_from_milliseconds( start_time );
+        const double megabytes = (double)size * k_lexer_benchmark_runs / ( 1024.0 * 1024.0 );
+
+        hydra::print_format( "%10.2f MB/s %8u tokens  %s\n", megabytes * 1000.0 / milliseconds, token_count, jobs[i].input_filename );
+
+        total_size += size;
+        total_milliseconds += milliseconds;
+
+        hydra::hy_free( text );
+    }
+
+    const double total_megabytes = (double)total_size * k_lexer_benchmark_runs / ( 1024.0 * 1024.0 );
+    hydra::print_format( "Lexed %.2f MB in %.2f ms: %.2f MB/s.\n", total_megabytes, total_milliseconds, total_milliseconds > 0.0 ? total_megabytes * 1000.0 / total_milliseconds : 0.0 );
+
+    terminate_data_buffer( &data_buffer );
+    hydra::time_service_terminate();
+
+    array_free( jobs );
+    filenames_buffer.terminate();
+
+    return k_exit_success;
+}
+
+//
+//
+static void make_folder_prefix( const char* folder, char* out_prefix ) {
+    const size_t length = strlen( folder );
+    const bool has_separator = length && ( folder[length - 1] == '\\' || folder[length - 1] == '/' );
+    snprintf( out_prefix, k_max_path_length, has_separator ? "%s" : "%s\\", folder );
+}
+
+//
+//
+int main( int argc, char** argv ) {
+
+    if ( argc == 3 && strcmp( argv[1], "-benchmark" ) == 0 ) {
+        return run_parse_benchmark( (uint32_t)atoi( argv[2] ) );
+    }
+
+    if ( argc == 3 && strcmp( argv[1], "-benchmark_lexer" ) == 0 ) {
+        return run_lexer_benchmark( argv[2] );
+    }
+
+    if ( argc < 3 ) {
+        hydra::print_format( "Usage: HFXCompiler <input folder or manifest> <output folder> [-j num_threads] [-header header_folder]\n       HFXCompiler -benchmark <declaration_count>\n       HFXCompiler -benchmark_lexer <input folder or manifest>\n" );
+        return k_exit_invalid_arguments;
+    }
+
+    const char* input = argv[1];
+
+    // Output folders are used as a prefix: make sure they end with a separator.
+    char output_folder[k_max_path_length];
+    make_folder_prefix( argv[2], output_folder );
+
+    char header_folder[k_max_path_length];
+    bool generate_headers = false;
+
+    uint32_t num_threads = 0;
+    for ( int a = 3; a < argc; ++a ) {
+        if ( strcmp( argv[a], "-j" ) == 0 && a + 1 < argc ) {
+            num_threads = (uint32_t)atoi( argv[++a] );
+        }
+        else if ( strcmp( argv[a], "-header" ) == 0 && a + 1 < argc ) {
+            make_folder_prefix( argv[++a], header_folder );
+            generate_headers = true;
+        }
+        else {
+            hydra::print_format( "Unknown argument %s\n", argv[a] );
+            return k_exit_invalid_arguments;
+        }
+    }
+
+    hydra::StringBuffer filenames_buffer;
+    filenames_buffer.init( k_filenames_buffer_size );
+
+    array( CompileJob ) jobs;
+    array_init( jobs );
+
+    if ( !collect_jobs( jobs, input, filenames_buffer ) ) {
+        array_free( jobs );
+        filenames_buffer.terminate();
+        return k_exit_invalid_arguments;
+    }
+
+    const uint32_t job_count = array_length_u( jobs );
+
+    // Sort inputs: report and exit status do not depend on the file system or on the scheduling.
+    qsort( jobs, job_count, sizeof( CompileJob ), compare_jobs );
+
+    hydra::time_service_init();
+    // Without workers parallel for runs on the calling thread.
+    if ( num_threads != 1 ) {
+        hydra::task_service_init( num_threads > 1 ? num_threads - 1 : 0 );
+    }
+
+    const uint32_t thread_count = hydra::task_thread_count();
+    hfx::CompilerContext* contexts = new hfx::CompilerContext[thread_count];
+    for ( uint32_t t = 0; t < thread_count; ++t ) {
+        hfx::init_compiler_context( contexts[t] );
+    }
+
+    const int64_t start_time = hydra::time_now();
+
+    BatchCompileData data = { jobs, contexts, output_folder, generate_headers ? header_folder : nullptr };
+    hydra::parallel_for( job_count, compile_task, &data );
+
+    const double total_milliseconds = hydra::time_from_milliseconds( start_time );
+
+    // Report
+    uint32_t failed_count = 0;
+    size_t peak_parser_bytes = 0;
+    for ( uint32_t i = 0; i < job_count; ++i ) {
+        const CompileJob& job = jobs[i];
+        hydra::print_format( "%-6s %10.2f ms %8zu bytes %6u allocs  %s -> %s%s\n", job.success ? "OK" : "FAILED", job.milliseconds, job.parser_bytes, job.parser_allocations,
+                             job.input_filename, output_folder, job.output_filename );
+
+        failed_count += job.success ? 0 : 1;
+        peak_parser_bytes = job.parser_bytes > peak_parser_bytes ? job.parser_bytes : peak_parser_bytes;
+    }
+
+    hydra::print_format( "Compiled %u of %u files in %.2f ms using %u threads. Parser peak %zu bytes.\n", job_count - failed_count, job_count, total_milliseconds, thread_count, peak_parser_bytes );
+
+    for ( uint32_t t = 0; t < thread_count; ++t ) {
+        hfx::terminate_compiler_context( contexts[t] );
+    }
+    delete[] contexts;
+
+    hydra::task_service_terminate();
+    hydra::time_service_terminate();
+
+    array_free( jobs );
+    filenames_buffer.terminate();
+
+    return failed_count ? k_exit_compile_failed : k_exit_success;
+}
@@ -21,6 +21,9 @@ void Application::init() {
         return;
     }
 
+    hydra::time_service_init();
+    hydra::task_service_init( 0 );
+
     // Setup Dear ImGui context
     IMGUI_CHECKVERSION();
     ImGui::CreateContext();
@@ -55,6 +58,7 @@ void Application::init() {
     // Init the gfx_device device
     hydra::graphics::DeviceCreation device_creation = {};
     device_creation.window = window;
+    device_creation.shader_cache_folder = "..\\data\\bin";
     gfx_device.init( device_creation );
 
     SDL_GL_GetDrawableSize( window, &window_width, &window_height );
@@ -174,6 +178,8 @@ void Application::terminate() {
     SDL_DestroyWindow( window );
     SDL_Quit();
 
+    hydra::task_service_terminate();
+
     hydra::print_format("Exiting application\n\n");
     stb_leakcheck_dumpmem();
 }
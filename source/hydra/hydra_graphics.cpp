@@ -1,10 +1,15 @@
 //
-//  Hydra Graphics - v0.047
+//  Hydra Graphics - v0.058
 
 #include "hydra_graphics.h"
 
 #include <string.h>
 #include <malloc.h>
+#include <mutex>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif // _MSC_VER
 
 #if defined (HYDRA_SDL)
 #include <SDL.h>
@@ -91,55 +96,218 @@ namespace graphics {
 
 // Resource Pool ////////////////////////////////////////////////////////////////
 
+static uint32_t count_trailing_zeros( uint64_t value ) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64( &index, value );
+    return index;
+#else
+    return __builtin_ctzll( value );
+#endif // _MSC_VER
+}
+
+// Grow an array copying the old content. Used only for the pool internal arrays, pages are never moved.
+static void* grow_array( void* old_data, size_t old_size, size_t new_size ) {
+    void* new_data = hy_malloc( new_size );
+    if ( old_data ) {
+        memcpy( new_data, old_data, old_size );
+        hy_free( old_data );
+    }
+    return new_data;
+}
+
 void ResourcePool::init( uint32_t pool_size, uint32_t resource_size ) {
 
-    this->size = pool_size;
+    // Page size is a power of 2 to find the page with a shift.
+    page_shift = 0;
+    while ( ( 1u << page_shift ) < pool_size ) {
+        ++page_shift;
+    }
+    page_size = 1u << page_shift;
+
     this->resource_size = resource_size;
+    slot_size = ( resource_size + k_resource_pool_alignment - 1 ) & ~( k_resource_pool_alignment - 1 );
 
-    memory = (uint8_t*)hy_malloc( pool_size * resource_size );
+    pages = nullptr;
+    page_allocations = nullptr;
+    free_indices = nullptr;
+    generations = nullptr;
+    live_bits = nullptr;
 
-    // Allocate and add free indices
-    free_indices = (uint32_t*)hy_malloc( pool_size * sizeof( uint32_t ) );
+    size = 0;
+    num_pages = 0;
     free_indices_head = 0;
+    high_water = 0;
 
-    for ( uint32_t i = 0; i < pool_size; ++i ) {
-        free_indices[i] = i;
-    }
+    grow();
 }
 
 void ResourcePool::terminate() {
 
-    hy_free( memory );
+    for ( uint32_t p = 0; p < num_pages; ++p ) {
+        hy_free( page_allocations[p] );
+    }
+
+    hy_free( pages );
+    hy_free( page_allocations );
     hy_free( free_indices );
+    hy_free( generations );
+    hy_free( live_bits );
+
+    pages = nullptr;
+    page_allocations = nullptr;
+    free_indices = nullptr;
+    generations = nullptr;
+    live_bits = nullptr;
+    size = num_pages = 0;
+}
+
+bool ResourcePool::grow() {
+
+    const uint32_t new_size = size + page_size;
+    if ( new_size > k_handle_index_mask ) {
+        HYDRA_LOG( "Resource pool cannot grow over %u resources\n", size );
+        return false;
+    }
+
+    // Add page, aligning slots to cache lines. Memory is cleared so new slots start in a known state.
+    const size_t page_memory_size = (size_t)page_size * slot_size;
+    void* page_allocation = hy_malloc( page_memory_size + k_resource_pool_alignment );
+    memset( page_allocation, 0, page_memory_size + k_resource_pool_alignment );
+
+    pages = (uint8_t**)grow_array( pages, sizeof( uint8_t* ) * num_pages, sizeof( uint8_t* ) * ( num_pages + 1 ) );
+    page_allocations = (void**)grow_array( page_allocations, sizeof( void* ) * num_pages, sizeof( void* ) * ( num_pages + 1 ) );
+
+    page_allocations[num_pages] = page_allocation;
+    pages[num_pages] = (uint8_t*)( ( (uintptr_t)page_allocation + k_resource_pool_alignment - 1 ) & ~(uintptr_t)( k_resource_pool_alignment - 1 ) );
+    ++num_pages;
+
+    // Add free indices after the ones already present: [free_indices_head, new_size) are all free.
+    free_indices = (uint32_t*)grow_array( free_indices, sizeof( uint32_t ) * size, sizeof( uint32_t ) * new_size );
+    for ( uint32_t i = size; i < new_size; ++i ) {
+        free_indices[i] = i;
+    }
+
+    const uint32_t old_words = ( size + 63 ) / 64;
+    const uint32_t new_words = ( new_size + 63 ) / 64;
+    live_bits = (uint64_t*)grow_array( live_bits, sizeof( uint64_t ) * old_words, sizeof( uint64_t ) * new_words );
+    memset( live_bits + old_words, 0, sizeof( uint64_t ) * ( new_words - old_words ) );
+
+#if defined (HYDRA_GRAPHICS_VALIDATE_HANDLES)
+    generations = (uint16_t*)grow_array( generations, sizeof( uint16_t ) * size, sizeof( uint16_t ) * new_size );
+    memset( generations + size, 0, sizeof( uint16_t ) * page_size );
+#endif // HYDRA_GRAPHICS_VALIDATE_HANDLES
+
+    size = new_size;
+    return true;
 }
 
 uint32_t ResourcePool::obtain_resource() {
-    // TODO: add bits for checking if resource is alive and use bitmasks.
-    if ( free_indices_head < size ) {
-        const uint32_t free_index = free_indices[free_indices_head++];
-        return free_index;
+    if ( free_indices_head == size && !grow() ) {
+        return k_invalid_handle;
     }
 
-    return k_invalid_handle;
+    const uint32_t free_index = free_indices[free_indices_head++];
+    live_bits[free_index >> 6] |= 1ull << ( free_index & 63 );
+
+    if ( free_indices_head > high_water ) {
+        high_water = free_indices_head;
+    }
+
+#if defined (HYDRA_GRAPHICS_VALIDATE_HANDLES)
+    return free_index | ( (uint32_t)generations[free_index] << k_handle_index_bits );
+#else
+    return free_index;
+#endif // HYDRA_GRAPHICS_VALIDATE_HANDLES
 }
 
 void ResourcePool::release_resource( uint32_t handle ) {
-    // TODO: add bits for checking if resource is alive and use bitmasks.
-    free_indices[--free_indices_head] = handle;
+    const uint32_t index = handle & k_handle_index_mask;
+#if defined (HYDRA_GRAPHICS_VALIDATE_HANDLES)
+    if ( !is_handle_valid( handle ) || !is_index_live( index ) ) {
+        HYDRA_LOG( "Double release or stale handle release: index %u, generation %u, current generation %u\n", index, handle >> k_handle_index_bits, index < size ? generations[index] : 0 );
+        HYDRA_ASSERT( false, "Invalid handle release" );
+        return;
+    }
+
+    // Bump generation: every handle to this slot is now stale.
+    generations[index] = ( generations[index] + 1 ) & k_handle_generation_mask;
+#endif // HYDRA_GRAPHICS_VALIDATE_HANDLES
+
+    live_bits[index >> 6] &= ~( 1ull << ( index & 63 ) );
+    free_indices[--free_indices_head] = index;
 }
 
 void* ResourcePool::access_resource( uint32_t handle ) {
     if ( handle != k_invalid_handle ) {
-        return &memory[handle * resource_size];
+#if defined (HYDRA_GRAPHICS_VALIDATE_HANDLES)
+        if ( !is_handle_valid( handle ) ) {
+            HYDRA_LOG( "Stale handle access: index %u, generation %u\n", handle & k_handle_index_mask, handle >> k_handle_index_bits );
+            HYDRA_ASSERT( false, "Stale handle access" );
+            return nullptr;
+        }
+        return access_resource_at_index( handle & k_handle_index_mask );
+#else
+        return access_resource_at_index( handle );
+#endif // HYDRA_GRAPHICS_VALIDATE_HANDLES
     }
     return nullptr;
 }
 
 const void* ResourcePool::access_resource( uint32_t handle ) const {
-    if ( handle != k_invalid_handle ) {
-        return &memory[handle * resource_size];
+    return ( (ResourcePool*)this )->access_resource( handle );
+}
+
+void* ResourcePool::access_resource_at_index( uint32_t index ) {
+    return &pages[index >> page_shift][( index & ( page_size - 1 ) ) * slot_size];
+}
+
+bool ResourcePool::is_handle_valid( uint32_t handle ) const {
+    if ( handle == k_invalid_handle ) {
+        return false;
     }
-    return nullptr;
+
+    const uint32_t index = handle & k_handle_index_mask;
+#if defined (HYDRA_GRAPHICS_VALIDATE_HANDLES)
+    return index < size && generations[index] == ( handle >> k_handle_index_bits );
+#else
+    return index < size;
+#endif // HYDRA_GRAPHICS_VALIDATE_HANDLES
+}
+
+bool ResourcePool::is_index_live( uint32_t index ) const {
+    return index < size && ( live_bits[index >> 6] & ( 1ull << ( index & 63 ) ) );
+}
+
+uint32_t ResourcePool::first_live_index() const {
+    return is_index_live( 0 ) ? 0 : next_live_index( 0 );
+}
+
+uint32_t ResourcePool::next_live_index( uint32_t index ) const {
+    // Search the remaining bits of the current word, then skip empty words.
+    uint32_t word = ( index + 1 ) >> 6;
+    const uint32_t num_words = ( size + 63 ) / 64;
+    if ( word >= num_words ) {
+        return k_invalid_handle;
+    }
+
+    uint64_t bits = live_bits[word] & ( ~0ull << ( ( index + 1 ) & 63 ) );
+    while ( bits == 0 ) {
+        if ( ++word == num_words ) {
+            return k_invalid_handle;
+        }
+        bits = live_bits[word];
+    }
+
+    return ( word << 6 ) + count_trailing_zeros( bits );
+}
+
+void ResourcePool::get_statistics( ResourcePoolStatistics& out_statistics ) const {
+    out_statistics.used = free_indices_head;
+    out_statistics.high_water = high_water;
+    out_statistics.capacity = size;
+    out_statistics.num_pages = num_pages;
+    out_statistics.memory_size = size * slot_size;
 }
 
 
@@ -158,6 +326,9 @@ void Device::init( const DeviceCreation& creation ) {
 void Device::terminate() {
     
     backend_terminate();
+
+    hy_free( merged_submits );
+    hy_free( merged_submits_temp );
     
     s_string_buffer.terminate();
 }
@@ -178,12 +349,158 @@ BufferHandle Device::get_dummy_constant_buffer() const {
     return dummy_constant_buffer;
 }
 
+BufferHandle Device::get_dynamic_buffer() const {
+    return dynamic_buffer;
+}
+
+const DeviceStatistics& Device::get_last_frame_statistics() const {
+    return last_frame_statistics;
+}
+
 void Device::resize( uint16_t width, uint16_t height ) {
 
     swapchain_width = width;
     swapchain_height = height;
 }
 
+void Device::reserve_merged_submits( uint32_t count ) {
+    if ( count <= max_merged_submits ) {
+        return;
+    }
+
+    // Grow geometrically to avoid reallocating every frame while the submit count settles.
+    uint32_t new_size = max_merged_submits ? max_merged_submits : 128;
+    while ( new_size < count ) {
+        new_size *= 2;
+    }
+
+    hy_free( merged_submits );
+    hy_free( merged_submits_temp );
+
+    merged_submits = (SubmitCommand*)hy_malloc( sizeof( SubmitCommand ) * new_size );
+    merged_submits_temp = (SubmitCommand*)hy_malloc( sizeof( SubmitCommand ) * new_size );
+    max_merged_submits = new_size;
+}
+
+// Command buffers can be obtained, freed and queued from multiple threads while recording.
+static std::mutex                   s_command_buffer_mutex;
+static const uint32_t               k_max_queued_command_buffers = 128;
+// Command buffers grow when needed, these are just the starting sizes.
+static const uint32_t               k_command_buffer_initial_size = 16 * 1024;
+static const uint32_t               k_command_buffer_initial_submits = 64;
+
+// Submit sorting ///////////////////////////////////////////////////////////////
+
+static const uint32_t               k_submit_sort_insertion_threshold = 32;
+
+SubmitCommand* sort_submit_commands( SubmitCommand* submits, SubmitCommand* temp, uint32_t count ) {
+
+    // Few submits: a stable insertion sort is faster than building the histograms.
+    if ( count <= k_submit_sort_insertion_threshold ) {
+        for ( uint32_t i = 1; i < count; ++i ) {
+            const SubmitCommand submit = submits[i];
+            uint32_t j = i;
+            while ( j > 0 && submits[j - 1].key > submit.key ) {
+                submits[j] = submits[j - 1];
+                --j;
+            }
+            submits[j] = submit;
+        }
+        return submits;
+    }
+
+    // Calculate the histograms of all the 8 digits with a single read of the keys.
+    uint32_t histograms[8][256];
+    memset( histograms, 0, sizeof( histograms ) );
+
+    for ( uint32_t i = 0; i < count; ++i ) {
+        const uint64_t key = submits[i].key;
+        for ( uint32_t d = 0; d < 8; ++d ) {
+            ++histograms[d][( key >> ( d * 8 ) ) & 0xff];
+        }
+    }
+
+    SubmitCommand* source = submits;
+    SubmitCommand* destination = temp;
+
+    for ( uint32_t d = 0; d < 8; ++d ) {
+        const uint32_t shift = d * 8;
+        uint32_t* histogram = histograms[d];
+
+        // All keys share the same digit: the pass would not change the order.
+        if ( histogram[( source[0].key >> shift ) & 0xff] == count ) {
+            continue;
+        }
+
+        // Convert counts to starting offsets
+        uint32_t offset = 0;
+        for ( uint32_t b = 0; b < 256; ++b ) {
+            const uint32_t digit_count = histogram[b];
+            histogram[b] = offset;
+            offset += digit_count;
+        }
+
+        // Scatter in order, keeping the sort stable.
+        for ( uint32_t i = 0; i < count; ++i ) {
+            const uint32_t digit = ( source[i].key >> shift ) & 0xff;
+            destination[histogram[digit]++] = source[i];
+        }
+
+        SubmitCommand* swap = source;
+        source = destination;
+        destination = swap;
+    }
+
+    return source;
+}
+
+
+// CommandKey ///////////////////////////////////////////////////////////////////
+
+static inline uint64_t command_key_field( uint32_t value, uint32_t bits, uint32_t shift ) {
+    return ( (uint64_t)value & ( ( 1ull << bits ) - 1 ) ) << shift;
+}
+
+static inline uint32_t command_key_extract( uint64_t key, uint32_t bits, uint32_t shift ) {
+    return (uint32_t)( ( key >> shift ) & ( ( 1ull << bits ) - 1 ) );
+}
+
+uint64_t CommandKey::encode() const {
+    // Fields defining the frame order cannot be truncated.
+    HYDRA_ASSERT( stage <= k_max_stage, "Stage %u does not fit into the CommandKey", stage );
+    HYDRA_ASSERT( phase < Phase_Count, "Invalid CommandKey phase %u", phase );
+    HYDRA_ASSERT( depth <= k_max_depth, "Depth bucket %u does not fit into the CommandKey", depth );
+
+    return command_key_field( stage, k_stage_bits, k_stage_shift ) |
+           command_key_field( phase, k_phase_bits, k_phase_shift ) |
+           command_key_field( translucent, k_translucent_bits, k_translucent_shift ) |
+           command_key_field( depth, k_depth_bits, k_depth_shift ) |
+           command_key_field( pipeline, k_pipeline_bits, k_pipeline_shift ) |
+           command_key_field( resource_list, k_resource_list_bits, k_resource_list_shift ) |
+           command_key_field( material, k_material_bits, k_material_shift );
+}
+
+CommandKey CommandKey::decode( uint64_t key ) {
+    CommandKey command_key;
+    command_key.stage = command_key_extract( key, k_stage_bits, k_stage_shift );
+    command_key.phase = command_key_extract( key, k_phase_bits, k_phase_shift );
+    command_key.translucent = command_key_extract( key, k_translucent_bits, k_translucent_shift );
+    command_key.depth = command_key_extract( key, k_depth_bits, k_depth_shift );
+    command_key.pipeline = command_key_extract( key, k_pipeline_bits, k_pipeline_shift );
+    command_key.resource_list = command_key_extract( key, k_resource_list_bits, k_resource_list_shift );
+    command_key.material = command_key_extract( key, k_material_bits, k_material_shift );
+    return command_key;
+}
+
+uint32_t CommandKey::depth_bucket( float normalized_depth ) {
+    if ( normalized_depth <= 0.0f ) {
+        return 0;
+    }
+    if ( normalized_depth >= 1.0f ) {
+        return k_max_depth;
+    }
+    return (uint32_t)( normalized_depth * k_max_depth );
+}
 
 // Resource Access //////////////////////////////////////////////////////////////
 ShaderStateAPIGnostic* Device::access_shader( ShaderHandle shader ) {
@@ -398,35 +715,35 @@ static GLuint to_gl_internal_format( TextureFormat::Enum format ) {
 
         // Compressed
         case TextureFormat::BC1_TYPELESS:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
         case TextureFormat::BC1_UNORM:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
         case TextureFormat::BC1_UNORM_SRGB:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT;
         case TextureFormat::BC2_TYPELESS:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
         case TextureFormat::BC2_UNORM:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
         case TextureFormat::BC2_UNORM_SRGB:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT;
         case TextureFormat::BC3_TYPELESS:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
         case TextureFormat::BC3_UNORM:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
         case TextureFormat::BC3_UNORM_SRGB:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;
         case TextureFormat::BC4_TYPELESS:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RED_RGTC1;
         case TextureFormat::BC4_UNORM:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RED_RGTC1;
         case TextureFormat::BC4_SNORM:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_SIGNED_RED_RGTC1;
         case TextureFormat::BC5_TYPELESS:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RG_RGTC2;
         case TextureFormat::BC5_UNORM:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RG_RGTC2;
         case TextureFormat::BC5_SNORM:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_SIGNED_RG_RGTC2;
         case TextureFormat::B5G6R5_UNORM:
             return GL_RGBA32F;
         case TextureFormat::B5G5R5A1_UNORM:
@@ -446,17 +763,17 @@ static GLuint to_gl_internal_format( TextureFormat::Enum format ) {
         case TextureFormat::B8G8R8X8_UNORM_SRGB:
             return GL_RGBA32F;
         case TextureFormat::BC6H_TYPELESS:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT;
         case TextureFormat::BC6H_UF16:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT;
         case TextureFormat::BC6H_SF16:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT;
         case TextureFormat::BC7_TYPELESS:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RGBA_BPTC_UNORM;
         case TextureFormat::BC7_UNORM:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_RGBA_BPTC_UNORM;
         case TextureFormat::BC7_UNORM_SRGB:
-            return GL_RGBA32F;
+            return GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM;
 
         case TextureFormat::UNKNOWN:
         default:
@@ -740,6 +1057,53 @@ static GLuint to_gl_min_filter_type( TextureFilter::Enum filter, TextureMipFilte
     return s_gl_min_filter_type[(filter * 2) + mipmap];
 }
 
+//
+// Size of a pixel of client data with the GL format and type, used to walk tightly packed texture levels.
+//
+static uint32_t get_gl_pixel_size( GLuint format, GLuint type ) {
+    switch ( type ) {
+        case GL_UNSIGNED_INT_10_10_10_2:
+        case GL_UNSIGNED_INT_24_8:
+        case GL_UNSIGNED_INT_5_9_9_9_REV:
+            return 4;
+
+        case GL_FLOAT_32_UNSIGNED_INT_24_8_REV:
+            return 8;
+    }
+
+    uint32_t components = 1;
+    switch ( format ) {
+        case GL_RG:
+        case GL_RG_INTEGER:
+            components = 2;
+            break;
+
+        case GL_RGB:
+        case GL_RGB_INTEGER:
+            components = 3;
+            break;
+
+        case GL_RGBA:
+        case GL_RGBA_INTEGER:
+            components = 4;
+            break;
+    }
+
+    switch ( type ) {
+        case GL_SHORT:
+        case GL_UNSIGNED_SHORT:
+        case GL_HALF_FLOAT:
+            return components * 2;
+
+        case GL_INT:
+        case GL_UNSIGNED_INT:
+        case GL_FLOAT:
+            return components * 4;
+    }
+
+    return components;
+}
+
 //
 // Texture address mode conversion to GL values.
 //
@@ -845,6 +1209,9 @@ struct BufferGL {
     GLuint                          gl_type             = 0;
     GLuint                          gl_usage            = 0;
 
+    uint32_t                        dynamic_offset      = 0;        // Stream buffers: offset of the last mapping in the dynamic buffer.
+    uint32_t                        dynamic_frame       = 0xffffffff;   // Stream buffers: absolute frame of the last mapping.
+
 }; // struct BufferGL
 
 //
@@ -958,6 +1325,8 @@ struct ResourceListLayoutGL {
 
 }; // struct ResourceListLayoutGL
 
+struct StateCacheGL;
+
 //
 //
 struct ResourceListGL {
@@ -967,10 +1336,76 @@ struct ResourceListGL {
     uint32_t                        num_resources       = 0;
 
 
-    void                            set( const uint32_t* offsets, uint32_t num_offsets ) const;
+    void                            set( const uint32_t* offsets, uint32_t num_offsets, StateCacheGL& cache ) const;
 
 }; // struct ResourceListGL
 
+static const uint32_t               k_dynamic_buffer_frames = 3;                // Frames in flight that can use dynamic memory.
+static const uint32_t               k_dynamic_buffer_frame_size = 4 * 1024 * 1024;
+static const uint32_t               k_max_dynamic_constants_size = 16 * 1024;   // Minimum GL_MAX_UNIFORM_BLOCK_SIZE.
+
+static const uint32_t               k_max_cached_vertex_bindings = 16;
+static const uint32_t               k_max_cached_resource_bindings = 32;
+
+//
+// Shadow copy of the last states sent to OpenGL, to skip redundant calls.
+// Invalid values (0xffffffff) force the next call to be issued: the cache is invalidated at the beginning of present,
+// as resource creation can change OpenGL bindings outside of it.
+struct StateCacheGL {
+
+    struct BufferRange {
+        uint32_t                    handle;
+        uint32_t                    offset;
+        uint32_t                    size;
+    };
+
+    struct VertexBufferBinding {
+        uint32_t                    handle;
+        uint32_t                    offset;
+        uint32_t                    stride;
+    };
+
+    void                            invalidate();
+    void                            invalidate_vertex_array();      // Vertex and index buffer bindings are part of the vertex array object.
+
+    // Returns true if the value differs from the cached one, caching it and counting the issued change.
+    bool                            changed( uint32_t& cached, uint32_t value );
+    template <typename T>
+    bool                            changed( T& cached, const T& value );
+
+    uint32_t                        program;
+    uint32_t                        fbo;
+    uint32_t                        vao;
+    uint32_t                        ib;
+
+    uint32_t                        viewport[4];
+    uint32_t                        scissor_enabled;
+    uint32_t                        scissor[4];
+
+    uint32_t                        depth_test;
+    uint32_t                        depth_func;
+    uint32_t                        depth_mask;
+    uint32_t                        stencil_test;
+
+    uint32_t                        blend_enabled;
+    uint32_t                        blend_function[2];
+    uint32_t                        blend_equation;
+
+    uint32_t                        cull_enabled;
+    uint32_t                        cull_face;
+    uint32_t                        front_face;
+
+    VertexBufferBinding             vertex_buffers[k_max_cached_vertex_bindings];
+    uint32_t                        textures[k_max_cached_resource_bindings];
+    uint32_t                        images[k_max_cached_resource_bindings];
+    BufferRange                     uniform_buffers[k_max_cached_resource_bindings];
+    BufferRange                     storage_buffers[k_max_cached_resource_bindings];   // Binding points are separate from the uniform buffer ones.
+
+    uint32_t                        issued_changes      = 0;
+    uint32_t                        skipped_changes     = 0;
+
+}; // struct StateCacheGL
+
 //
 // Holds all the states necessary to render.
 struct DeviceStateGL {
@@ -1005,7 +1440,16 @@ struct DeviceStateGL {
     bool                            swapchain_flag      = false;
     bool                            end_pass_flag       = false;    // End pass after last draw/dispatch.
 
+    GLsync                          dynamic_fences[k_dynamic_buffer_frames];    // Signaled when the GPU finished reading a dynamic buffer region.
+
+    StateCacheGL                    cache;
+
+    // Program binary cache. Disabled when the folder is empty.
+    char                            shader_cache_folder[256];
+    uint64_t                        driver_hash;                // Vendor, renderer and version: binaries are valid only for the driver that created them.
+
     void                            apply();
+    void                            bind_framebuffer( GLuint handle );
 
 }; // struct DeviceStateGL
 
@@ -1016,6 +1460,10 @@ static GLuint                       compile_shader( GLuint stage, const char* so
 static bool                         get_compile_info( GLuint shader, GLuint status, const char* shader_name );
 static bool                         get_link_info( GLuint shader, GLuint status, const char* shader_name );
 
+static uint64_t                     get_program_cache_key( const ShaderCreation& creation, uint64_t driver_hash );
+static GLuint                       load_program_binary( cstring filename, uint64_t driver_hash, uint64_t program_key );
+static void                         save_program_binary( GLuint program, cstring filename, uint64_t driver_hash, uint64_t program_key );
+
 static void                         create_fbo( const RenderPassCreation& creation, RenderPassGL& fbo, Device& device );
 
 static void                         cache_resource_bindings( GLuint shader, const ResourceListLayoutGL* resource_list_layout );
@@ -1024,6 +1472,9 @@ static void                         cache_resource_bindings( GLuint shader, cons
 static void                         test_texture_creation( Device& device );
 static void                         test_pool( Device& device );
 static void                         test_command_buffer( Device& device );
+static void                         test_submit_sort( Device& device );
+static void                         test_command_key( Device& device );
+static void                         test_program_cache( Device& device );
 
 void GLAPIENTRY                     gl_message_callback( GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam );
 
@@ -1044,10 +1495,11 @@ void Device::backend_init( const DeviceCreation& creation ) {
     render_passes.init( 256, sizeof( RenderPassGL ) );
     command_buffers.init( 32, sizeof( CommandBuffer ) );
 
-    for ( size_t i = 0; i < 32; i++ ) {
-        CommandBuffer* command_buffer = (CommandBuffer*)command_buffers.access_resource(i);
-        command_buffer->init( QueueType::Graphics, 10000, 1000, false );
+    for ( uint32_t i = 0; i < command_buffers.size; i++ ) {
+        CommandBuffer* command_buffer = (CommandBuffer*)command_buffers.access_resource_at_index( i );
+        command_buffer->init( QueueType::Graphics, k_command_buffer_initial_size, k_command_buffer_initial_submits, false );
     }
+    num_allocated_command_buffers = command_buffers.size;
 
     // During init, enable debug output
     glEnable( GL_DEBUG_OUTPUT );
@@ -1059,11 +1511,65 @@ void Device::backend_init( const DeviceCreation& creation ) {
 
     device_state = (DeviceStateGL*)malloc( sizeof( DeviceStateGL ) );
     memset( device_state, 0, sizeof( DeviceStateGL ) );
+    device_state->cache.invalidate();
+
+    // Program binary cache
+    if ( creation.shader_cache_folder ) {
+        GLint num_binary_formats = 0;
+        glGetIntegerv( GL_NUM_PROGRAM_BINARY_FORMATS, &num_binary_formats );
+
+        if ( num_binary_formats > 0 ) {
+            cstring vendor = (cstring)glGetString( GL_VENDOR );
+            cstring renderer = (cstring)glGetString( GL_RENDERER );
+            cstring version = (cstring)glGetString( GL_VERSION );
+
+            size_t driver_hash = hash_bytes( (void*)vendor, strlen( vendor ), 0 );
+            driver_hash = hash_bytes( (void*)renderer, strlen( renderer ), driver_hash );
+            driver_hash = hash_bytes( (void*)version, strlen( version ), driver_hash );
+            device_state->driver_hash = driver_hash;
+
+            strncpy( device_state->shader_cache_folder, creation.shader_cache_folder, sizeof( device_state->shader_cache_folder ) - 1 );
+            HYDRA_LOG( "Shader cache in %s for %s, %s, %s\n", device_state->shader_cache_folder, vendor, renderer, version );
+        }
+        else {
+            HYDRA_LOG( "Shader cache disabled: driver does not support program binaries.\n" );
+        }
+    }
+
+    // Dynamic buffer: persistently mapped, each frame allocates linearly from its own region.
+    {
+        GLint uniform_alignment = 256;
+        glGetIntegerv( GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_alignment );
+        dynamic_alignment = uniform_alignment > 16 ? (uint32_t)uniform_alignment : 16;
+        dynamic_per_frame_size = k_dynamic_buffer_frame_size;
+        dynamic_frame_index = 0;
+        dynamic_allocated_size = 0;
+        absolute_frame = 0;
+
+        dynamic_buffer.handle = buffers.obtain_resource();
+        BufferGL* buffer = access_buffer( dynamic_buffer );
+        buffer->name = "Dynamic_buffer";
+        buffer->size = dynamic_per_frame_size * k_dynamic_buffer_frames;
+        buffer->type = BufferType::Constant;
+        buffer->usage = ResourceUsageType::Stream;
+        buffer->gl_type = to_gl_buffer_type( BufferType::Constant );
+        buffer->gl_usage = 0;
+        buffer->handle = dynamic_buffer;
+        buffer->dynamic_offset = 0;
+
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glCreateBuffers( 1, &buffer->gl_handle );
+        glNamedBufferStorage( buffer->gl_handle, buffer->size, nullptr, flags );
+        dynamic_mapped_memory = (uint8_t*)glMapNamedBufferRange( buffer->gl_handle, 0, buffer->size, flags );
+    }
 
 #if defined (HYDRA_GRAPHICS_TEST)
     test_texture_creation( *this );
     test_pool( *this );
     test_command_buffer( *this );
+    test_submit_sort( *this );
+    test_command_key( *this );
+    test_program_cache( *this );
 #endif // HYDRA_GRAPHICS_TEST
 
     //
@@ -1082,7 +1588,7 @@ void Device::backend_init( const DeviceCreation& creation ) {
     BufferCreation dummy_constant_buffer_creation = { BufferType::Constant, ResourceUsageType::Immutable, 16, nullptr, "Dummy_cb" };
     dummy_constant_buffer = create_buffer( dummy_constant_buffer_creation );
 
-    queued_command_buffers = (CommandBuffer**)malloc( sizeof( CommandBuffer* ) * 128 );
+    queued_command_buffers = (CommandBuffer**)malloc( sizeof( CommandBuffer* ) * k_max_queued_command_buffers );
 }
 
 void Device::backend_terminate() {
@@ -1091,6 +1597,20 @@ void Device::backend_terminate() {
     glDisable( GL_DEBUG_OUTPUT );
 
     free( queued_command_buffers );
+
+    // Dynamic buffer
+    for ( uint32_t i = 0; i < k_dynamic_buffer_frames; ++i ) {
+        if ( device_state->dynamic_fences[i] ) {
+            glDeleteSync( device_state->dynamic_fences[i] );
+        }
+    }
+
+    BufferGL* dynamic_buffer_gl = access_buffer( dynamic_buffer );
+    glUnmapNamedBuffer( dynamic_buffer_gl->gl_handle );
+    glDeleteBuffers( 1, &dynamic_buffer_gl->gl_handle );
+    buffers.release_resource( dynamic_buffer.handle );
+    dynamic_mapped_memory = nullptr;
+
     destroy_buffer( fullscreen_vertex_buffer );
     destroy_render_pass( swapchain_pass );
     destroy_texture( dummy_texture );
@@ -1098,10 +1618,15 @@ void Device::backend_terminate() {
 
     free( device_state );
 
-    for ( size_t i = 0; i < 32; i++ ) {
-        CommandBuffer* command_buffer = (CommandBuffer*)command_buffers.access_resource( i );
-        command_buffer->terminate();
+    // Slots of grown pages are initialized only when first obtained.
+    for ( uint32_t i = 0; i < command_buffers.size && num_allocated_command_buffers; i++ ) {
+        CommandBuffer* command_buffer = (CommandBuffer*)command_buffers.access_resource_at_index( i );
+        if ( command_buffer->data ) {
+            command_buffer->terminate();
+            --num_allocated_command_buffers;
+        }
     }
+    HYDRA_ASSERT( num_allocated_command_buffers == 0, "Initialized command buffers were not found in the pool." );
 
     pipelines.terminate();
     buffers.terminate();
@@ -1121,7 +1646,9 @@ void Device::link_texture_sampler( TextureHandle texture, SamplerHandle sampler
 
     glBindTexture( texture_gl->gl_target, texture_gl->gl_handle );
 
-    glTexParameteri( texture_gl->gl_target, GL_TEXTURE_MIN_FILTER, GL_LINEAR );//GL_LINEAR_MIPMAP_LINEAR to_gl_min_filter_type( sampler_gl->creation.min_filter, sampler_gl->creation.mip_filter ) );
+    // Minification stays linear, textures with mip levels use the sampler mip filter.
+    const GLuint gl_min_filter = texture_gl->mipmaps > 1 ? to_gl_min_filter_type( TextureFilter::Linear, sampler_gl->creation.mip_filter ) : GL_LINEAR;
+    glTexParameteri( texture_gl->gl_target, GL_TEXTURE_MIN_FILTER, gl_min_filter );
     glTexParameteri( texture_gl->gl_target, GL_TEXTURE_MAG_FILTER, to_gl_mag_filter_type( sampler_gl->creation.mag_filter ) );
 
     glBindTexture( texture_gl->gl_target, 0 );
@@ -1148,6 +1675,8 @@ TextureHandle Device::create_texture( const TextureCreation& creation ) {
     // For some unknown reasons, not setting any parameter results in an unusable texture.
     glTexParameteri( gl_target, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
     glTexParameteri( gl_target, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    // Only the uploaded levels are used, or the texture would be incomplete with mip filtering.
+    glTexParameteri( gl_target, GL_TEXTURE_MAX_LEVEL, creation.mipmaps > 0 ? creation.mipmaps - 1 : 0 );
 
     const GLuint gl_internal_format = to_gl_internal_format(creation.format);
     const GLuint gl_format = to_gl_format(creation.format);
@@ -1161,9 +1690,31 @@ TextureHandle Device::create_texture( const TextureCreation& creation ) {
     switch ( creation.type ) {
         case TextureType::Texture2D:
         {
-            GLint level = 0;
+            // Levels follow each other in the initial data, from the biggest.
+            const bool compressed = TextureFormat::is_compressed( creation.format );
+            const uint32_t pixel_size = compressed ? 0 : get_gl_pixel_size( gl_format, gl_type );
+            const char* level_data = (const char*)creation.initial_data;
+            uint32_t level_width = creation.width, level_height = creation.height;
             GLint border = 0;
-            glTexImage2D( gl_target, level, gl_internal_format, creation.width, creation.height, border, gl_format, gl_type, creation.initial_data );
+
+            for ( GLint level = 0; level < creation.mipmaps; ++level ) {
+                uint32_t level_size;
+                if ( compressed ) {
+                    // Rows of 4x4 blocks, also for the levels smaller than a block.
+                    level_size = ( ( level_width + 3 ) / 4 ) * ( ( level_height + 3 ) / 4 ) * TextureFormat::get_block_size( creation.format );
+                    glCompressedTexImage2D( gl_target, level, gl_internal_format, level_width, level_height, border, level_size, level_data );
+                }
+                else {
+                    level_size = level_width * level_height * pixel_size;
+                    glTexImage2D( gl_target, level, gl_internal_format, level_width, level_height, border, gl_format, gl_type, level_data );
+                }
+
+                if ( level_data ) {
+                    level_data += level_size;
+                }
+                level_width = level_width > 1 ? level_width / 2 : 1;
+                level_height = level_height > 1 ? level_height / 2 : 1;
+            }
             break;
         }
 
@@ -1216,10 +1767,40 @@ ShaderHandle Device::create_shader( const ShaderCreation& creation ) {
         return handle;
     }
 
+    const int64_t start_time = hydra::time_now();
+
+    // Search the program binary cache first: the key covers driver and source code of all stages.
+    char cache_filename[512];
+    const bool use_cache = device_state->shader_cache_folder[0] != 0;
+    uint64_t program_key = 0;
+    GLuint gl_program = 0;
+
+    if ( use_cache ) {
+        program_key = get_program_cache_key( creation, device_state->driver_hash );
+        snprintf( cache_filename, ArrayLength( cache_filename ), "%s\\%016llx.hpb", device_state->shader_cache_folder, (unsigned long long)program_key );
+
+        gl_program = load_program_binary( cache_filename, device_state->driver_hash, program_key );
+        if ( gl_program ) {
+            ++program_cache_hits;
+
+            ShaderStateGL* shader_state = access_shader( handle );
+            shader_state->gl_program = gl_program;
+            shader_state->name = creation.name;
+
+            HYDRA_LOG( "Shader %s loaded from cache in %.3f ms\n", creation.name, hydra::time_from_milliseconds( start_time ) );
+            return handle;
+        }
+
+        ++program_cache_misses;
+    }
+
     // For each shader stage, compile them individually.
     uint32_t compiled_shaders = 0;
     // Create the program first - and then attach all the shader stages.
-    GLuint gl_program = glCreateProgram();
+    gl_program = glCreateProgram();
+    if ( use_cache ) {
+        glProgramParameteri( gl_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE );
+    }
 
     for ( compiled_shaders = 0; compiled_shaders < creation.stages_count; ++compiled_shaders ) {
         const ShaderCreation::Stage& stage = creation.stages[compiled_shaders];
@@ -1251,6 +1832,14 @@ ShaderHandle Device::create_shader( const ShaderCreation& creation ) {
         ShaderStateGL* shader_state = access_shader( handle );
         shader_state->gl_program = gl_program;
         shader_state->name = creation.name;
+
+        if ( !creation_failed ) {
+            if ( use_cache ) {
+                save_program_binary( gl_program, cache_filename, device_state->driver_hash, program_key );
+            }
+
+            HYDRA_LOG( "Shader %s compiled in %.3f ms\n", creation.name, hydra::time_from_milliseconds( start_time ) );
+        }
     }
 
     if ( creation_failed ) {
@@ -1367,6 +1956,18 @@ BufferHandle Device::create_buffer( const BufferCreation& creation ) {
     buffer->gl_usage = to_gl_buffer_usage( creation.usage );
     
     buffer->handle = handle;
+    buffer->dynamic_offset = 0;
+    buffer->dynamic_frame = 0xffffffff;
+
+    // Stream buffers have no storage: each map allocates from the dynamic buffer.
+    // Their content lasts one frame, so initial data would be lost after the first one.
+    if ( creation.usage == ResourceUsageType::Stream ) {
+        HYDRA_ASSERT( creation.type != BufferType::Index, "Stream index buffers are not supported, buffer %s", creation.name );
+        HYDRA_ASSERT( creation.initial_data == nullptr, "Stream buffers have no initial data, map them each frame. Buffer %s", creation.name );
+        buffer->gl_handle = access_buffer( dynamic_buffer )->gl_handle;
+
+        return handle;
+    }
 
     switch ( creation.type ) {
         case BufferType::Constant:
@@ -1525,7 +2126,8 @@ RenderPassHandle Device::create_render_pass( const RenderPassCreation& creation
 void Device::destroy_buffer( BufferHandle buffer ) {
     if ( buffer.handle != k_invalid_handle ) {
         BufferGL* gl_buffer = access_buffer( buffer );
-        if ( gl_buffer ) {
+        // Stream buffers share the dynamic buffer.
+        if ( gl_buffer && gl_buffer->usage != ResourceUsageType::Stream ) {
             glDeleteBuffers( 1, &gl_buffer->gl_handle );
         }
 
@@ -1673,6 +2275,25 @@ void* Device::map_buffer( const MapBufferParameters& parameters ) {
 
     BufferGL* buffer = access_buffer( parameters.buffer );
     uint32_t mapping_size = parameters.size == 0 ? buffer->size : parameters.size;  
+
+    if ( buffer->usage == ResourceUsageType::Stream ) {
+        HYDRA_ASSERT( parameters.buffer.handle != dynamic_buffer.handle, "Use dynamic_allocate to write into the dynamic buffer." );
+        // Bindings read the offset when the commands are executed: a second mapping in the same frame would replace the first for all the draws.
+        HYDRA_ASSERT( buffer->dynamic_frame != absolute_frame, "Stream buffer %s mapped twice in the same frame.", buffer->name );
+
+        // Constants are bound with the whole buffer size.
+        const uint32_t allocation_size = buffer->type == BufferType::Constant ? buffer->size : parameters.offset + mapping_size;
+        uint32_t dynamic_offset;
+        uint8_t* data = (uint8_t*)dynamic_allocate( allocation_size, dynamic_offset );
+        if ( !data ) {
+            return nullptr;
+        }
+
+        buffer->dynamic_offset = dynamic_offset;
+        buffer->dynamic_frame = absolute_frame;
+        return data + parameters.offset;
+    }
+
     GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
     return glMapNamedBufferRange( buffer->gl_handle, parameters.offset, mapping_size, flags );
 }
@@ -1682,9 +2303,50 @@ void Device::unmap_buffer( const MapBufferParameters& parameters ) {
         return;
 
     BufferGL* buffer = access_buffer( parameters.buffer );
+    // Dynamic buffer is persistent and coherent: nothing to do.
+    if ( buffer->usage == ResourceUsageType::Stream )
+        return;
+
     glUnmapNamedBuffer( buffer->gl_handle );
 }
 
+void Device::update_buffer( BufferHandle buffer, uint32_t offset, uint32_t size, const void* data ) {
+    if ( buffer.handle == k_invalid_handle || size == 0 )
+        return;
+
+    BufferGL* buffer_gl = access_buffer( buffer );
+    HYDRA_ASSERT( buffer_gl->usage != ResourceUsageType::Stream, "Stream buffer %s cannot be updated, map it instead.", buffer_gl->name );
+    HYDRA_ASSERT( offset + size <= buffer_gl->size, "Update out of buffer %s.", buffer_gl->name );
+
+    glNamedBufferSubData( buffer_gl->gl_handle, offset, size, data );
+}
+
+void Device::copy_buffer( BufferHandle source, uint32_t source_offset, BufferHandle destination, uint32_t destination_offset, uint32_t size ) {
+    if ( source.handle == k_invalid_handle || destination.handle == k_invalid_handle || size == 0 )
+        return;
+
+    BufferGL* source_gl = access_buffer( source );
+    BufferGL* destination_gl = access_buffer( destination );
+    HYDRA_ASSERT( source_gl->usage != ResourceUsageType::Stream && destination_gl->usage != ResourceUsageType::Stream, "Stream buffers cannot be copied." );
+    HYDRA_ASSERT( source_offset + size <= source_gl->size && destination_offset + size <= destination_gl->size, "Copy out of buffers %s, %s.", source_gl->name, destination_gl->name );
+
+    glCopyNamedBufferSubData( source_gl->gl_handle, destination_gl->gl_handle, source_offset, destination_offset, size );
+}
+
+void* Device::dynamic_allocate( uint32_t size, uint32_t& out_offset ) {
+
+    const uint32_t aligned_offset = ( ( dynamic_allocated_size + dynamic_alignment - 1 ) / dynamic_alignment ) * dynamic_alignment;
+    if ( aligned_offset + size > dynamic_per_frame_size ) {
+        HYDRA_LOG( "Dynamic buffer full: requested %u bytes, %u of %u already allocated this frame.\n", size, dynamic_allocated_size, dynamic_per_frame_size );
+        out_offset = 0;
+        return nullptr;
+    }
+
+    dynamic_allocated_size = aligned_offset + size;
+    out_offset = dynamic_frame_index * dynamic_per_frame_size + aligned_offset;
+    return dynamic_mapped_memory + out_offset;
+}
+
 // Other methods ////////////////////////////////////////////////////////////////
 
 static void resize_texture( TextureGL* texture , uint16_t width, uint16_t height ) {
@@ -1736,13 +2398,23 @@ void Device::resize_output_textures( RenderPassHandle render_pass, uint16_t widt
 
 void Device::queue_command_buffer( CommandBuffer* command_buffer ) {
 
+    std::lock_guard<std::mutex> lock( s_command_buffer_mutex );
+    HYDRA_ASSERT( num_queued_command_buffers < k_max_queued_command_buffers, "Too many queued command buffers, max is %u", k_max_queued_command_buffers );
     queued_command_buffers[num_queued_command_buffers++] = command_buffer;
 }
 
 CommandBuffer* Device::get_command_buffer( QueueType::Enum type, uint32_t size, bool baked ) {
+    std::lock_guard<std::mutex> lock( s_command_buffer_mutex );
+
     uint32_t handle = command_buffers.obtain_resource();
     if ( handle != k_invalid_handle ) {
         CommandBuffer* command_buffer = (CommandBuffer*)command_buffers.access_resource( handle );
+        // Command buffers in pages added by pool growth start cleared.
+        if ( command_buffer->data == nullptr ) {
+            command_buffer->init( QueueType::Graphics, k_command_buffer_initial_size, k_command_buffer_initial_submits, false );
+            ++num_allocated_command_buffers;
+        }
+
         command_buffer->handle = handle;
         command_buffer->swapchain_frame_issued = 0;
         command_buffer->baked = baked;
@@ -1753,43 +2425,44 @@ CommandBuffer* Device::get_command_buffer( QueueType::Enum type, uint32_t size,
 }
 
 void Device::free_command_buffer( CommandBuffer* command_buffer ) {
+    std::lock_guard<std::mutex> lock( s_command_buffer_mutex );
     command_buffers.release_resource( command_buffer->handle );
 }
 
 void Device::present() {
 
-    // TODO:
-    // 1. Merge and sort all command buffers.
-    // 2. Execute command buffers.
+    // OpenGL states could have been changed outside of present.
+    device_state->cache.invalidate();
+    device_state->cache.issued_changes = 0;
+    device_state->cache.skipped_changes = 0;
 
-    static SubmitCommand merged_commands[128];
+    // 1. Merge all submits from queued command buffers.
     uint32_t num_submits = 0;
-
-    // Copy all commands
     for ( uint32_t c = 0; c < num_queued_command_buffers; c++ ) {
+        num_submits += queued_command_buffers[c]->num_submits;
+    }
 
-        CommandBuffer* command_buffer = queued_command_buffers[c];
-        for ( uint32_t s = 0; s < command_buffer->num_submits; ++s ) {
-            merged_commands[num_submits++] = command_buffer->submit_commands[s];
-        }
+    reserve_merged_submits( num_submits );
 
-        command_buffer->reset();
+    num_submits = 0;
+    uint32_t command_memory = 0;
+    for ( uint32_t c = 0; c < num_queued_command_buffers; c++ ) {
 
-        if ( !command_buffer->baked )
-            command_buffers.release_resource( command_buffer->handle );
+        CommandBuffer* command_buffer = queued_command_buffers[c];
+        memcpy( merged_submits + num_submits, command_buffer->submit_commands, sizeof( SubmitCommand ) * command_buffer->num_submits );
+        num_submits += command_buffer->num_submits;
+        command_memory += command_buffer->get_used_size();
     }
-    
 
-    // TODO: missing implementation.
-    // Sort them
+    // 2. Sort them by key. Stable, so submits with the same key keep the queue order.
+    const SubmitCommand* sorted_submits = sort_submit_commands( merged_submits, merged_submits_temp, num_submits );
 
-    // Execute
-    // TODO: temporary implementation.
+    // 3. Execute
     CommandBuffer command_buffer;
 
     for ( uint32_t s = 0; s < num_submits; ++s ) {
 
-        const SubmitCommand& submit = merged_commands[s];
+        const SubmitCommand& submit = sorted_submits[s];
         const commands::SubmitHeader& submit_header = *(const commands::SubmitHeader*)submit.data;
 
         HYDRA_ASSERT(submit_header.sentinel == k_submit_header_sentinel, "");
@@ -1827,7 +2500,7 @@ void Device::present() {
                     const commands::EndPass& end_pass = command_buffer.read_command<commands::EndPass>();
                     device_state->end_pass_flag = true;
 
-                    glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+                    device_state->bind_framebuffer( 0 );
 
                     break;
                 }
@@ -1839,7 +2512,7 @@ void Device::present() {
 
                     DeviceStateGL::VertexBufferBinding& vb_binding = device_state->vb_bindings[device_state->num_vertex_streams++];
                     vb_binding.vb_handle = buffer->gl_handle;
-                    vb_binding.offset = binding.byte_offset;
+                    vb_binding.offset = buffer->dynamic_offset + binding.byte_offset;
                     vb_binding.binding = binding.binding;
 
                     break;
@@ -1984,13 +2657,50 @@ void Device::present() {
         }
     }
 
+    last_frame_statistics.submits = num_submits;
+    last_frame_statistics.issued_state_changes = device_state->cache.issued_changes;
+    last_frame_statistics.skipped_state_changes = device_state->cache.skipped_changes;
+    last_frame_statistics.command_memory = command_memory;
+    last_frame_statistics.dynamic_memory = dynamic_allocated_size;
+
+    // Fence the dynamic memory of this frame, then wait for the GPU to finish with the region of the next frame.
+    device_state->dynamic_fences[dynamic_frame_index] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+    dynamic_frame_index = ( dynamic_frame_index + 1 ) % k_dynamic_buffer_frames;
+    dynamic_allocated_size = 0;
+    ++absolute_frame;
+
+    GLsync& next_fence = device_state->dynamic_fences[dynamic_frame_index];
+    if ( next_fence ) {
+        GLenum wait_result = glClientWaitSync( next_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000 );
+        while ( wait_result == GL_TIMEOUT_EXPIRED ) {
+            wait_result = glClientWaitSync( next_fence, 0, 1000000 );
+        }
+
+        glDeleteSync( next_fence );
+        next_fence = nullptr;
+    }
+
+    // 4. Reset command buffers: submits point into their memory, so this is done after the execution.
+    {
+        std::lock_guard<std::mutex> lock( s_command_buffer_mutex );
+
+        for ( uint32_t c = 0; c < num_queued_command_buffers; c++ ) {
+
+            CommandBuffer* command_buffer = queued_command_buffers[c];
+            command_buffer->reset();
+
+            if ( !command_buffer->baked )
+                command_buffers.release_resource( command_buffer->handle );
+        }
+    }
+
     // Reset state
     num_queued_command_buffers = 0;
 }
 
 // ResourceListGL ///////////////////////////////////////////////////////////////
 
-void ResourceListGL::set( const uint32_t* offsets, uint32_t num_offsets ) const {
+void ResourceListGL::set( const uint32_t* offsets, uint32_t num_offsets, StateCacheGL& cache ) const {
 
     if ( layout == nullptr ) {
         return;
@@ -2011,7 +2721,9 @@ void ResourceListGL::set( const uint32_t* offsets, uint32_t num_offsets ) const
             case ResourceType::Texture:
             {
                 const TextureGL* texture_data = (const TextureGL*)resources[r].data;
-                glBindTextureUnit( binding.gl_block_binding, texture_data->gl_handle );
+                if ( binding.gl_block_binding >= (GLint)k_max_cached_resource_bindings || cache.changed( cache.textures[binding.gl_block_binding], texture_data->gl_handle ) ) {
+                    glBindTextureUnit( binding.gl_block_binding, texture_data->gl_handle );
+                }
 
                 break;
             }
@@ -2019,7 +2731,9 @@ void ResourceListGL::set( const uint32_t* offsets, uint32_t num_offsets ) const
             case ResourceType::TextureRW:
             {
                 const TextureGL* texture_data = (const TextureGL*)resources[r].data;
-                glBindImageTexture( binding.gl_block_binding, texture_data->gl_handle, 0, GL_FALSE, 0, GL_WRITE_ONLY, to_gl_internal_format( texture_data->format ) );
+                if ( binding.gl_block_binding >= (GLint)k_max_cached_resource_bindings || cache.changed( cache.images[binding.gl_block_binding], texture_data->gl_handle ) ) {
+                    glBindImageTexture( binding.gl_block_binding, texture_data->gl_handle, 0, GL_FALSE, 0, GL_WRITE_ONLY, to_gl_internal_format( texture_data->format ) );
+                }
 
                 break;
             }
@@ -2027,11 +2741,16 @@ void ResourceListGL::set( const uint32_t* offsets, uint32_t num_offsets ) const
             case ResourceType::Constants:
             {
                 const BufferGL* buffer = (const BufferGL*)resources[r].data;
-                const GLuint buffer_offset = 0;// num_offsets ? offsets[c] : 0;
-                const GLsizei buffer_size = buffer->size;// num_offsets ? 64 : buffer->size;
-                //int align;
-                //glGetIntegerv( GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align );
-                glBindBufferRange( buffer->gl_type, binding.gl_block_binding, buffer->gl_handle, buffer_offset, buffer_size );
+                // Offsets select a dynamic allocation: bind a range big enough for any constant block.
+                const uint32_t constants_offset = c < num_offsets ? offsets[c] : 0;
+                const uint32_t remaining_size = buffer->size - constants_offset;
+                const GLuint buffer_offset = buffer->dynamic_offset + constants_offset;
+                const GLsizei buffer_size = c < num_offsets && remaining_size > k_max_dynamic_constants_size ? k_max_dynamic_constants_size : remaining_size;
+                const StateCacheGL::BufferRange range = { buffer->gl_handle, buffer_offset, (uint32_t)buffer_size };
+                StateCacheGL::BufferRange* cached_ranges = buffer->gl_type == GL_SHADER_STORAGE_BUFFER ? cache.storage_buffers : cache.uniform_buffers;
+                if ( binding.gl_block_binding >= (GLint)k_max_cached_resource_bindings || cache.changed( cached_ranges[binding.gl_block_binding], range ) ) {
+                    glBindBufferRange( buffer->gl_type, binding.gl_block_binding, buffer->gl_handle, buffer_offset, buffer_size );
+                }
 
                 ++c;
 
@@ -2047,53 +2766,122 @@ void ResourceListGL::set( const uint32_t* offsets, uint32_t num_offsets ) const
     }
 }
 
+// StateCacheGL /////////////////////////////////////////////////////////////////
+
+void StateCacheGL::invalidate() {
+    // Set every cached value to 0xffffffff, keeping the statistics.
+    const uint32_t issued = issued_changes;
+    const uint32_t skipped = skipped_changes;
+
+    memset( this, 0xff, sizeof( StateCacheGL ) );
+
+    issued_changes = issued;
+    skipped_changes = skipped;
+}
+
+void StateCacheGL::invalidate_vertex_array() {
+    ib = 0xffffffff;
+    memset( vertex_buffers, 0xff, sizeof( vertex_buffers ) );
+}
+
+bool StateCacheGL::changed( uint32_t& cached, uint32_t value ) {
+    if ( cached == value ) {
+        ++skipped_changes;
+        return false;
+    }
+
+    cached = value;
+    ++issued_changes;
+    return true;
+}
+
+template <typename T>
+bool StateCacheGL::changed( T& cached, const T& value ) {
+    if ( memcmp( &cached, &value, sizeof( T ) ) == 0 ) {
+        ++skipped_changes;
+        return false;
+    }
+
+    memcpy( &cached, &value, sizeof( T ) );
+    ++issued_changes;
+    return true;
+}
+
 // DeviceStateGL ////////////////////////////////////////////////////////////////
+void DeviceStateGL::bind_framebuffer( GLuint handle ) {
+    if ( cache.changed( cache.fbo, handle ) ) {
+        glBindFramebuffer( GL_FRAMEBUFFER, handle );
+    }
+}
+
 void DeviceStateGL::apply()  {
 
     if ( pipeline->graphics_pipeline ) {
 
         // Bind FrameBuffer
-        if ( !swapchain_flag && fbo_handle > 0 ) {
-            glBindFramebuffer( GL_FRAMEBUFFER, fbo_handle );
-        }
+        bind_framebuffer( swapchain_flag ? 0 : fbo_handle );
 
         if ( viewport ) {
-            glViewport( viewport->rect.x, viewport->rect.y, viewport->rect.width, viewport->rect.height );
+            const uint32_t viewport_rect[4] = { (uint32_t)viewport->rect.x, (uint32_t)viewport->rect.y, (uint32_t)viewport->rect.width, (uint32_t)viewport->rect.height };
+            if ( cache.changed( cache.viewport, viewport_rect ) ) {
+                glViewport( viewport->rect.x, viewport->rect.y, viewport->rect.width, viewport->rect.height );
+            }
         }
 
         if ( scissor ) {
-            glEnable( GL_SCISSOR_TEST );
-            glScissor( scissor->x, scissor->y, scissor->width, scissor->height );
+            if ( cache.changed( cache.scissor_enabled, 1 ) ) {
+                glEnable( GL_SCISSOR_TEST );
+            }
+
+            const uint32_t scissor_rect[4] = { (uint32_t)scissor->x, (uint32_t)scissor->y, (uint32_t)scissor->width, (uint32_t)scissor->height };
+            if ( cache.changed( cache.scissor, scissor_rect ) ) {
+                glScissor( scissor->x, scissor->y, scissor->width, scissor->height );
+            }
         }
-        else {
+        else if ( cache.changed( cache.scissor_enabled, 0 ) ) {
             glDisable( GL_SCISSOR_TEST );
         }
 
         // Bind shaders
-        glUseProgram( pipeline->gl_program_cached );
+        if ( cache.changed( cache.program, pipeline->gl_program_cached ) ) {
+            glUseProgram( pipeline->gl_program_cached );
+        }
 
         if ( num_lists ) {
             for ( uint32_t l = 0; l < num_lists; ++l ) {
-                resource_lists[l]->set( resource_offsets, num_offsets );
+                resource_lists[l]->set( resource_offsets, num_offsets, cache );
             }
         }
 
         // Set depth
         if ( pipeline->depth_stencil.depth_enable ) {
-            glEnable( GL_DEPTH_TEST );
-            glDepthFunc( to_gl_comparison( pipeline->depth_stencil.depth_comparison ) );
-            glDepthMask( pipeline->depth_stencil.depth_write_enable );
+            if ( cache.changed( cache.depth_test, 1 ) ) {
+                glEnable( GL_DEPTH_TEST );
+            }
+
+            if ( cache.changed( cache.depth_func, to_gl_comparison( pipeline->depth_stencil.depth_comparison ) ) ) {
+                glDepthFunc( cache.depth_func );
+            }
+
+            if ( cache.changed( cache.depth_mask, pipeline->depth_stencil.depth_write_enable ) ) {
+                glDepthMask( pipeline->depth_stencil.depth_write_enable );
+            }
         }
         else {
-            glDisable( GL_DEPTH_TEST );
-            glDepthMask( false );
+            if ( cache.changed( cache.depth_test, 0 ) ) {
+                glDisable( GL_DEPTH_TEST );
+            }
+
+            if ( cache.changed( cache.depth_mask, 0 ) ) {
+                glDepthMask( false );
+            }
         }
 
         // Set stencil
         if ( pipeline->depth_stencil.stencil_enable ) {
             HYDRA_ASSERT( false, "Not implemented." );
         }
-        else {
+        else if ( cache.changed( cache.stencil_test, 0 ) ) {
             glDisable( GL_STENCIL_TEST );
         }
 
@@ -2122,46 +2910,69 @@ void DeviceStateGL::apply()  {
         // Set blend
         if ( pipeline->blend_state.active_states ) {
             // If there is different states, set them accordingly.
-            glEnablei( GL_BLEND, 0 );
+            if ( cache.changed( cache.blend_enabled, 1 ) ) {
+                glEnablei( GL_BLEND, 0 );
+            }
 
             const BlendState& blend_state = pipeline->blend_state.blend_states[0];
-            glBlendFunc( to_gl_blend_function( blend_state.source_color ),
-                         to_gl_blend_function( blend_state.destination_color ) );
+            const uint32_t blend_function[2] = { to_gl_blend_function( blend_state.source_color ), to_gl_blend_function( blend_state.destination_color ) };
+            if ( cache.changed( cache.blend_function, blend_function ) ) {
+                glBlendFunc( blend_function[0], blend_function[1] );
+            }
 
-            glBlendEquation( to_gl_blend_equation( blend_state.color_operation ) );
+            if ( cache.changed( cache.blend_equation, to_gl_blend_equation( blend_state.color_operation ) ) ) {
+                glBlendEquation( cache.blend_equation );
+            }
         }
         else if ( pipeline->blend_state.active_states > 1 ) {
             HYDRA_ASSERT( false, "Not implemented." );
 
             //glBlendFuncSeparate( glSrcFunction, glDstFunction, glSrcAlphaFunction, glDstAlphaFunction );
         }
-        else {
+        else if ( cache.changed( cache.blend_enabled, 0 ) ) {
             glDisable( GL_BLEND );
         }
 
         const RasterizationCreation& rasterization = pipeline->rasterization;
         if ( rasterization.cull_mode == CullMode::None ) {
-            glDisable( GL_CULL_FACE );
+            if ( cache.changed( cache.cull_enabled, 0 ) ) {
+                glDisable( GL_CULL_FACE );
+            }
         }
         else {
-            glEnable( GL_CULL_FACE );
-            glCullFace( rasterization.cull_mode == CullMode::Front ? GL_FRONT : GL_BACK );
+            if ( cache.changed( cache.cull_enabled, 1 ) ) {
+                glEnable( GL_CULL_FACE );
+            }
+
+            if ( cache.changed( cache.cull_face, rasterization.cull_mode == CullMode::Front ? GL_FRONT : GL_BACK ) ) {
+                glCullFace( cache.cull_face );
+            }
         }
 
-        glFrontFace( rasterization.front == FrontClockwise::True ? GL_CW : GL_CCW );
+        if ( cache.changed( cache.front_face, rasterization.front == FrontClockwise::True ? GL_CW : GL_CCW ) ) {
+            glFrontFace( cache.front_face );
+        }
 
         // Bind vertex array, containing vertex attributes.
-        glBindVertexArray( pipeline->gl_vao );
+        if ( cache.changed( cache.vao, pipeline->gl_vao ) ) {
+            glBindVertexArray( pipeline->gl_vao );
+            cache.invalidate_vertex_array();
+        }
 
         // Bind Index Buffer
-        glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, ib_handle );
+        if ( cache.changed( cache.ib, ib_handle ) ) {
+            glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, ib_handle );
+        }
 
         // Bind Vertex Buffers with offsets.
         const VertexInputGL& vertex_input = pipeline->vertex_input;
         for ( uint32_t i = 0; i < vertex_input.num_streams; i++ ) {
             const VertexStream& stream = vertex_input.vertex_streams[i];
 
-            glBindVertexBuffer( stream.binding, vb_bindings[i].vb_handle, vb_bindings[i].offset, stream.stride );
+            const StateCacheGL::VertexBufferBinding vertex_buffer = { vb_bindings[i].vb_handle, vb_bindings[i].offset, stream.stride };
+            if ( stream.binding >= k_max_cached_vertex_bindings || cache.changed( cache.vertex_buffers[stream.binding], vertex_buffer ) ) {
+                glBindVertexBuffer( stream.binding, vb_bindings[i].vb_handle, vb_bindings[i].offset, stream.stride );
+            }
         }
 
         // Reset cached states
@@ -2172,11 +2983,13 @@ void DeviceStateGL::apply()  {
     }
     else {
 
-        glUseProgram( pipeline->gl_program_cached );
+        if ( cache.changed( cache.program, pipeline->gl_program_cached ) ) {
+            glUseProgram( pipeline->gl_program_cached );
+        }
 
         if ( num_lists ) {
             for ( uint32_t l = 0; l < num_lists; ++l ) {
-                resource_lists[l]->set( resource_offsets, num_offsets );
+                resource_lists[l]->set( resource_offsets, num_offsets, cache );
             }
         }
     }
@@ -2185,26 +2998,65 @@ void DeviceStateGL::apply()  {
 
 // CommandBuffer ////////////////////////////////////////////////////////////////
 
+//
+// Page of command memory, followed by the commands data.
+struct CommandBufferPage {
+
+    CommandBufferPage*              next;
+    uint64_t                        size;       // Keeps data 16 bytes aligned.
+
+}; // struct CommandBufferPage
+
+static const uint32_t               k_command_buffer_min_page_size = 1024;
+
+static CommandBufferPage* allocate_command_buffer_page( uint32_t size ) {
+    CommandBufferPage* page = (CommandBufferPage*)malloc( sizeof( CommandBufferPage ) + size );
+    page->next = nullptr;
+    page->size = size;
+    return page;
+}
+
+static void free_command_buffer_pages( CommandBufferPage* page ) {
+    while ( page ) {
+        CommandBufferPage* next = page->next;
+        free( page );
+        page = next;
+    }
+}
+
 void CommandBuffer::init( QueueType::Enum type, uint32_t buffer_size, uint32_t submit_size, bool baked ) {
     this->type = type;
-    this->buffer_size = buffer_size;
+    this->buffer_size = buffer_size > k_command_buffer_min_page_size ? buffer_size : k_command_buffer_min_page_size;
     this->baked = baked;
 
-    data = (uint8_t*)malloc( buffer_size );
-    read_offset = write_offset = 0;
+    page = allocate_command_buffer_page( this->buffer_size );
+    retired_pages = nullptr;
+    data = (uint8_t*)( page + 1 );
+    read_offset = write_offset = retired_size = 0;
+    peak_size = 0;
 
-    this->max_submits = submit_size;
+    this->max_submits = submit_size > 1 ? submit_size : 1;
     this->num_submits = 0;
+    peak_submits = 0;
+
+    this->submit_commands = (SubmitCommand*)malloc( sizeof( SubmitCommand ) * max_submits );
 
-    this->submit_commands = (SubmitCommand*)malloc( sizeof( SubmitCommand ) * submit_size );
+    current_submit_command.key = 0xffffffffffffffff;
+    current_submit_command.data = nullptr;
+    current_submit_header = nullptr;
 }
 
 void CommandBuffer::terminate() {
 
-    free( data );
+    free_command_buffer_pages( retired_pages );
+    free_command_buffer_pages( page );
     free( submit_commands );
 
-    read_offset = write_offset = buffer_size = 0;
+    page = retired_pages = nullptr;
+    data = nullptr;
+    submit_commands = nullptr;
+
+    read_offset = write_offset = buffer_size = retired_size = 0;
     max_submits = num_submits = 0;
 }
 
@@ -2213,13 +3065,96 @@ void CommandBuffer::reset() {
 
     // Reset all writing properties.
     if ( !baked ) {
+        const uint32_t used_size = get_used_size();
+        peak_size = used_size > peak_size ? used_size : peak_size;
+        peak_submits = num_submits > peak_submits ? num_submits : peak_submits;
+
+        // The frame did not fit in one page: use a single page big enough for it from now on.
+        if ( retired_pages ) {
+            free_command_buffer_pages( retired_pages );
+            retired_pages = nullptr;
+
+            uint32_t new_size = buffer_size;
+            while ( new_size < used_size ) {
+                new_size *= 2;
+            }
+
+            if ( new_size != buffer_size ) {
+                free_command_buffer_pages( page );
+                page = allocate_command_buffer_page( new_size );
+                data = (uint8_t*)( page + 1 );
+                buffer_size = new_size;
+            }
+        }
+
         write_offset = 0;
+        retired_size = 0;
         num_submits = 0;
     }
 }
 
+void CommandBuffer::grow( uint32_t size ) {
+
+    // The submit being recorded is moved to the new page, to keep its commands contiguous.
+    uint8_t* submit_start = current_submit_command.data;
+    const uint32_t submit_size = submit_start ? (uint32_t)( ( data + write_offset ) - submit_start ) : 0;
+
+    uint32_t new_size = buffer_size * 2;
+    while ( new_size < submit_size + size ) {
+        new_size *= 2;
+    }
+
+    CommandBufferPage* new_page = allocate_command_buffer_page( new_size );
+    uint8_t* new_data = (uint8_t*)( new_page + 1 );
+    if ( submit_start ) {
+        memcpy( new_data, submit_start, submit_size );
+    }
+
+    // Ended submits point into the old page: keep it until reset.
+    if ( write_offset > submit_size ) {
+        page->next = retired_pages;
+        retired_pages = page;
+        retired_size += write_offset - submit_size;
+    }
+    else {
+        free( page );
+    }
+
+    page = new_page;
+    data = new_data;
+    buffer_size = new_size;
+    write_offset = submit_size;
+
+    if ( submit_start ) {
+        current_submit_command.data = data;
+        current_submit_header = (commands::SubmitHeader*)data;
+    }
+}
+
+void CommandBuffer::reserve( uint32_t size ) {
+    if ( write_offset + size > buffer_size ) {
+        grow( size );
+    }
+}
+
+void CommandBuffer::reserve_submits( uint32_t count ) {
+    if ( num_submits + count <= max_submits ) {
+        return;
+    }
+
+    uint32_t new_max_submits = max_submits * 2;
+    while ( new_max_submits < num_submits + count ) {
+        new_max_submits *= 2;
+    }
+
+    submit_commands = (SubmitCommand*)realloc( submit_commands, sizeof( SubmitCommand ) * new_max_submits );
+    max_submits = new_max_submits;
+}
+
 void CommandBuffer::begin_submit( uint64_t sort_key ) {
 
+    reserve( sizeof( commands::SubmitHeader ) );
+
     current_submit_command.key = sort_key;
     current_submit_command.data = data + write_offset;
 
@@ -2235,6 +3170,7 @@ void CommandBuffer::end_submit() {
     // Calculate final submit packed size - removing the additional header.
     current_submit_header->data_size = ( data + write_offset ) - current_submit_command.data - sizeof( commands::SubmitHeader );
 
+    reserve_submits( 1 );
     submit_commands[num_submits++] = current_submit_command;
 
     current_submit_command.key = 0xffffffffffffffff;
@@ -2535,6 +3471,97 @@ bool get_link_info( GLuint program, GLuint status, const char* shader_name ) {
     return true;
 }
 
+// Program binary cache ///////////////////////////////////////////////////////
+
+//
+// Header of a cached program binary, followed by binary_size bytes.
+struct ProgramBinaryHeader {
+
+    uint32_t                        magic;
+    uint32_t                        version;
+    uint64_t                        driver_hash;
+    uint64_t                        program_key;
+    uint32_t                        binary_format;
+    uint32_t                        binary_size;
+
+}; // struct ProgramBinaryHeader
+
+static const uint32_t               k_program_binary_magic      = 0x42504848;   // 'HHPB'
+static const uint32_t               k_program_binary_version    = 1;
+
+uint64_t get_program_cache_key( const ShaderCreation& creation, uint64_t driver_hash ) {
+    // Defines are part of the stage code, so they are covered by the source hash.
+    size_t key = (size_t)driver_hash;
+    for ( uint32_t i = 0; i < creation.stages_count; ++i ) {
+        const ShaderCreation::Stage& stage = creation.stages[i];
+        key = hash_bytes( (void*)&stage.type, sizeof( stage.type ), key );
+        key = hash_bytes( (void*)stage.code, strlen( stage.code ), key );
+    }
+    return key;
+}
+
+GLuint load_program_binary( cstring filename, uint64_t driver_hash, uint64_t program_key ) {
+    FILE* file = fopen( filename, "rb" );
+    if ( !file ) {
+        return 0;
+    }
+
+    ProgramBinaryHeader header;
+    GLuint program = 0;
+    if ( fread( &header, sizeof( ProgramBinaryHeader ), 1, file ) == 1 && header.magic == k_program_binary_magic && header.version == k_program_binary_version &&
+         header.driver_hash == driver_hash && header.program_key == program_key && header.binary_size > 0 ) {
+
+        void* binary = malloc( header.binary_size );
+        if ( fread( binary, header.binary_size, 1, file ) == 1 ) {
+            program = glCreateProgram();
+            glProgramBinary( program, header.binary_format, binary, header.binary_size );
+
+            // The driver can refuse a binary at any time: compile the program again in that case.
+            GLint result = 0;
+            glGetProgramiv( program, GL_LINK_STATUS, &result );
+            if ( !result ) {
+                HYDRA_LOG( "Cached program %s rejected by the driver, compiling it.\n", filename );
+                glDeleteProgram( program );
+                program = 0;
+            }
+        }
+        free( binary );
+    }
+
+    fclose( file );
+    return program;
+}
+
+void save_program_binary( GLuint program, cstring filename, uint64_t driver_hash, uint64_t program_key ) {
+    GLint binary_size = 0;
+    glGetProgramiv( program, GL_PROGRAM_BINARY_LENGTH, &binary_size );
+    if ( binary_size <= 0 ) {
+        return;
+    }
+
+    ProgramBinaryHeader header = { k_program_binary_magic, k_program_binary_version, driver_hash, program_key, 0, (uint32_t)binary_size };
+    void* binary = malloc( binary_size );
+    GLenum binary_format = 0;
+    glGetProgramBinary( program, binary_size, nullptr, &binary_format, binary );
+    header.binary_format = binary_format;
+
+    // Write to a temporary file and rename it, so that an interrupted write never leaves a truncated binary.
+    char temporary_filename[512];
+    snprintf( temporary_filename, ArrayLength( temporary_filename ), "%s.tmp", filename );
+
+    FILE* file = fopen( temporary_filename, "wb" );
+    if ( file ) {
+        const bool written = fwrite( &header, sizeof( ProgramBinaryHeader ), 1, file ) == 1 && fwrite( binary, binary_size, 1, file ) == 1;
+        fclose( file );
+
+        if ( !written || !hydra::rename_file( temporary_filename, filename ) ) {
+            HYDRA_LOG( "Error writing cached program %s\n", filename );
+            hydra::delete_file( temporary_filename );
+        }
+    }
+    free( binary );
+}
+
 static cstring to_string_message_type( GLenum type ) {
     switch ( type )
     {
@@ -2645,8 +3672,51 @@ void test_pool( Device & device ) {
     device.query_texture( t1, t1_info );
 
     device.destroy_texture( t1 );
+
+#if defined (HYDRA_GRAPHICS_VALIDATE_HANDLES)
+    // The released slot is reused with a new generation: the old handle must be detected as stale.
+    TextureHandle t3 = device.create_texture( texture_creation );
+    HYDRA_ASSERT( ( t3.handle & k_handle_index_mask ) == ( t1.handle & k_handle_index_mask ), "Released slot should be reused" );
+    HYDRA_ASSERT( t3.handle != t1.handle, "Reused slot should have a new generation" );
+    HYDRA_ASSERT( !device.textures.is_handle_valid( t1.handle ), "Released handle should be stale" );
+    HYDRA_ASSERT( device.textures.is_handle_valid( t3.handle ), "New handle should be valid" );
+    device.destroy_texture( t3 );
+#endif // HYDRA_GRAPHICS_VALIDATE_HANDLES
+
     device.destroy_texture( t0 );
     device.destroy_texture( t2 );
+
+    // Growth keeps pointers valid and live iteration visits only obtained slots.
+    ResourcePool pool;
+    pool.init( 4, sizeof( uint32_t ) );
+
+    uint32_t handles[9];
+    uint32_t* first = nullptr;
+    for ( uint32_t i = 0; i < 9; ++i ) {
+        handles[i] = pool.obtain_resource();
+        uint32_t* value = (uint32_t*)pool.access_resource( handles[i] );
+        HYDRA_ASSERT( ( (uintptr_t)value & ( k_resource_pool_alignment - 1 ) ) == 0, "Slot %u is not aligned", i );
+        *value = i;
+        first = first ? first : value;
+    }
+
+    HYDRA_ASSERT( *first == 0 && first == pool.access_resource( handles[0] ), "Growth should not move resources" );
+
+    pool.release_resource( handles[1] );
+    pool.release_resource( handles[6] );
+
+    uint32_t live_count = 0;
+    for ( uint32_t i = pool.first_live_index(); i != k_invalid_handle; i = pool.next_live_index( i ) ) {
+        HYDRA_ASSERT( i != 1 && i != 6, "Released slot %u should not be iterated", i );
+        ++live_count;
+    }
+    HYDRA_ASSERT( live_count == 7, "Live count should be 7 instead of %u", live_count );
+
+    ResourcePoolStatistics statistics;
+    pool.get_statistics( statistics );
+    HYDRA_ASSERT( statistics.used == 7 && statistics.high_water == 9 && statistics.num_pages == 3, "Wrong pool statistics" );
+
+    pool.terminate();
 }
 
 void test_command_buffer( Device& device ) {
@@ -2660,6 +3730,165 @@ void test_command_buffer( Device& device ) {
     HYDRA_ASSERT( draw.topology == TopologyType::Triangle, "Topology should be triangle instead of %s", TopologyType::ToString(draw.topology) );
     HYDRA_ASSERT( draw.type == CommandType::Draw, "Command should be Draw instead of %s", CommandType::ToString(draw.type) );
     HYDRA_ASSERT( draw.size == sizeof( commands::Draw ), "Size should be %u instead of %u", sizeof( commands::Draw ), draw.size );
+
+    // Growth: record more submits and commands than the initial sizes, submits must stay valid.
+    graphics::CommandBuffer growing_commands;
+    growing_commands.init( QueueType::Graphics, 1024, 4, false );
+
+    static const uint32_t k_num_submits = 1000;
+    for ( uint32_t i = 0; i < k_num_submits; ++i ) {
+        growing_commands.begin_submit( i );
+        growing_commands.draw( graphics::TopologyType::Triangle, i, 3 );
+        growing_commands.end_submit();
+    }
+
+    HYDRA_ASSERT( growing_commands.num_submits == k_num_submits, "Submits should be %u instead of %u", k_num_submits, growing_commands.num_submits );
+    HYDRA_ASSERT( growing_commands.retired_pages != nullptr, "Command buffer should have grown" );
+
+    for ( uint32_t i = 0; i < k_num_submits; ++i ) {
+        const SubmitCommand& submit = growing_commands.submit_commands[i];
+        const commands::SubmitHeader& header = *(const commands::SubmitHeader*)submit.data;
+        const commands::Draw& submit_draw = *(const commands::Draw*)( submit.data + sizeof( commands::SubmitHeader ) );
+
+        HYDRA_ASSERT( submit.key == i && header.sentinel == k_submit_header_sentinel, "Submit %u corrupted", i );
+        HYDRA_ASSERT( header.data_size == sizeof( commands::Draw ) && submit_draw.first_vertex == i, "Submit %u data corrupted", i );
+    }
+
+    // Reset frees the retired pages and fits the whole frame in one page.
+    const uint32_t used_size = growing_commands.get_used_size();
+    growing_commands.reset();
+
+    HYDRA_ASSERT( growing_commands.retired_pages == nullptr, "Retired pages should be freed at reset" );
+    HYDRA_ASSERT( growing_commands.peak_size == used_size && growing_commands.buffer_size >= used_size, "Peak size should be %u", used_size );
+    HYDRA_ASSERT( growing_commands.peak_submits == k_num_submits, "Peak submits should be %u", k_num_submits );
+
+    // Reserve: multiple commands written with one check.
+    growing_commands.begin_submit( 0 );
+    commands::Draw* draws = growing_commands.write_commands<commands::Draw>( 16 );
+    HYDRA_ASSERT( draws[15].type == CommandType::Draw && draws[15].size == sizeof( commands::Draw ), "Reserved commands not initialized" );
+    growing_commands.end_submit();
+
+    growing_commands.terminate();
+}
+
+void test_submit_sort( Device& device ) {
+
+    HYDRA_LOG( "==================================================================\n" );
+    HYDRA_LOG( "Test submit sort start.\n" );
+
+    static const uint32_t k_submit_counts[] = { 1000, 10000, 100000 };
+    static const uint32_t k_iterations = 16;
+
+    SubmitCommand* submits = (SubmitCommand*)hy_malloc( sizeof( SubmitCommand ) * 100000 );
+    SubmitCommand* temp = (SubmitCommand*)hy_malloc( sizeof( SubmitCommand ) * 100000 );
+
+    uint64_t random_state = 0x9e3779b97f4a7c15ull;
+
+    for ( uint32_t c = 0; c < ArrayLength( k_submit_counts ); ++c ) {
+        const uint32_t count = k_submit_counts[c];
+        int64_t total_time = 0;
+
+        for ( uint32_t iteration = 0; iteration < k_iterations; ++iteration ) {
+            // Fill keys with few distinct values to exercise stability. Data stores the original index.
+            for ( uint32_t i = 0; i < count; ++i ) {
+                random_state ^= random_state << 13;
+                random_state ^= random_state >> 7;
+                random_state ^= random_state << 17;
+
+                submits[i].key = random_state & 0xff000000ff00ffffull;
+                submits[i].data = (uint8_t*)(uintptr_t)i;
+            }
+
+            const int64_t start_time = hydra::time_now();
+            const SubmitCommand* sorted = sort_submit_commands( submits, temp, count );
+            total_time += hydra::time_from( start_time );
+
+            for ( uint32_t i = 1; i < count; ++i ) {
+                HYDRA_ASSERT( sorted[i - 1].key <= sorted[i].key, "Submit %u is not sorted", i );
+                HYDRA_ASSERT( sorted[i - 1].key != sorted[i].key || sorted[i - 1].data < sorted[i].data, "Submit %u is not stable", i );
+            }
+        }
+
+        const double nanoseconds_per_submit = hydra::time_microseconds( total_time ) * 1000.0 / ( (double)count * k_iterations );
+        HYDRA_LOG( "Sorted %u submits: %f ns/submit\n", count, nanoseconds_per_submit );
+    }
+
+    hy_free( submits );
+    hy_free( temp );
+
+    HYDRA_LOG( "Test finished\n" );
+    HYDRA_LOG( "==================================================================\n" );
+}
+
+void test_command_key( Device& device ) {
+    CommandKey key;
+    key.stage = 5;
+    key.phase = CommandKey::Phase_Render;
+    key.translucent = 1;
+    key.depth = CommandKey::depth_bucket( 0.5f );
+    key.pipeline = 17;
+    key.resource_list = 42;
+    key.material = 1000;
+
+    const CommandKey decoded = CommandKey::decode( key.encode() );
+    HYDRA_ASSERT( decoded.stage == key.stage, "Stage should be %u instead of %u", key.stage, decoded.stage );
+    HYDRA_ASSERT( decoded.phase == key.phase, "Phase should be %u instead of %u", key.phase, decoded.phase );
+    HYDRA_ASSERT( decoded.translucent == key.translucent, "Translucent should be %u instead of %u", key.translucent, decoded.translucent );
+    HYDRA_ASSERT( decoded.depth == key.depth, "Depth should be %u instead of %u", key.depth, decoded.depth );
+    HYDRA_ASSERT( decoded.pipeline == key.pipeline, "Pipeline should be %u instead of %u", key.pipeline, decoded.pipeline );
+    HYDRA_ASSERT( decoded.resource_list == key.resource_list, "Resource list should be %u instead of %u", key.resource_list, decoded.resource_list );
+    HYDRA_ASSERT( decoded.material == key.material, "Material should be %u instead of %u", key.material, decoded.material );
+
+    // Frame ordering: end of a stage must come before the begin of the next one, whatever the state fields.
+    CommandKey end_key;
+    end_key.stage = 1;
+    end_key.phase = CommandKey::Phase_End;
+
+    CommandKey begin_key;
+    begin_key.stage = 2;
+    begin_key.phase = CommandKey::Phase_Begin;
+    begin_key.pipeline = 0xffffffff;
+
+    HYDRA_ASSERT( end_key.encode() < begin_key.encode(), "Stage order should dominate the key" );
+}
+
+void test_program_cache( Device& device ) {
+    ShaderCreation first = {};
+    first.name = "Test_cache";
+    first.stages_count = 1;
+    first.stages[0] = { "#version 450\nlayout (local_size_x = 1) in;\nvoid main() {}\n", 0, ShaderStage::Compute };
+
+    // Same code with a different define must be a different program.
+    ShaderCreation second = first;
+    second.stages[0].code = "#version 450\n#define OPTION_TEST\nlayout (local_size_x = 1) in;\nvoid main() {}\n";
+
+    const uint64_t first_key = get_program_cache_key( first, device.device_state->driver_hash );
+    HYDRA_ASSERT( first_key == get_program_cache_key( first, device.device_state->driver_hash ), "Program key should be deterministic" );
+    HYDRA_ASSERT( first_key != get_program_cache_key( second, device.device_state->driver_hash ), "Defines should change the program key" );
+    HYDRA_ASSERT( first_key != get_program_cache_key( first, device.device_state->driver_hash + 1 ), "Driver should change the program key" );
+
+    if ( !device.device_state->shader_cache_folder[0] ) {
+        return;
+    }
+
+    // Start from an empty cache entry: first creation compiles and saves, second loads.
+    char cache_filename[512];
+    snprintf( cache_filename, ArrayLength( cache_filename ), "%s\\%016llx.hpb", device.device_state->shader_cache_folder, (unsigned long long)first_key );
+    hydra::delete_file( cache_filename );
+
+    const uint32_t hits = device.program_cache_hits;
+    const uint32_t misses = device.program_cache_misses;
+
+    for ( uint32_t i = 0; i < 2; ++i ) {
+        ShaderHandle shader = device.create_shader( first );
+        HYDRA_ASSERT( shader.handle != k_invalid_handle, "Shader creation should succeed" );
+        device.destroy_shader( shader );
+
+        HYDRA_ASSERT( device.program_cache_misses == misses + 1, "First creation should miss the cache" );
+        HYDRA_ASSERT( device.program_cache_hits == hits + i, "Second creation should hit the cache" );
+    }
+
+    hydra::delete_file( cache_filename );
 }
 
 #endif // HYDRA_OPENGL
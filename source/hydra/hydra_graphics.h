@@ -3,7 +3,7 @@
 #include <stdint.h>
 
 //
-//  Hydra Graphics - v0.047
+//  Hydra Graphics - v0.059
 //  3D API wrapper around Vulkan/Direct3D12/OpenGL.
 //  Mostly based on the amazing Sokol library (https://github.com/floooh/sokol), but with a different target (wrapping Vulkan/Direct3D12).
 //
@@ -15,6 +15,18 @@
 //
 // Revision history //////////////////////
 //
+//      0.059 (2020/03/23): + Added update and copy of buffer ranges, executed immediately.
+//      0.058 (2020/03/23): + Added block compressed texture formats BC1 to BC7.
+//      0.057 (2020/03/23): + Textures are created with all the mip levels in their initial data. Samplers use mip filtering on textures with mips.
+//      0.056 (2020/03/23): + Added program binary cache: linked programs are saved per driver and loaded instead of compiled.
+//      0.055 (2020/03/15): + Added per frame dynamic memory from a persistently mapped ring buffer, fenced. Stream buffers use it.
+//      0.054 (2020/03/12): + Command buffers grow in pages when full, with peak usage and reserve for multiple commands.
+//      0.053 (2020/03/11): + Command buffers can be obtained and queued from multiple threads.
+//      0.052 (2020/03/10): + ResourcePool grows in pages with cache line aligned slots, live bitmap iteration and statistics.
+//      0.051 (2020/03/09): + Added generational handles with stale handle and double release detection.
+//      0.050 (2020/03/08): + Added OpenGL state cache to skip redundant state changes. + Added last frame statistics.
+//      0.049 (2020/03/07): + Added CommandKey to encode/decode submit sort keys.
+//      0.048 (2020/03/06): + Added growable merged submit array and stable radix sort of submit keys in present.
 //      0.047 (2020/03/04): + Added swapchain present. + Reworked command buffer interface.
 //      0.046 (2020/03/03): + 90% graphics pipeline creation. + Added RenderPass handle to Pipeline creation.
 //      0.045 (2020/02/25): + Initial Vulkan creation with SDL support. Still missing resources.
@@ -48,6 +60,8 @@
 //  HYDRA_FREE( pointer )
 //  HYDRA_ASSERT( condition, message, ... )
 //
+//  HYDRA_GRAPHICS_VALIDATE_HANDLES     -- check handle generations to detect stale handles and double release. Defined by default in debug.
+//
 //
 // Code Philosophy ////////////////////////
 //
@@ -69,6 +83,14 @@
 //#define HYDRA_SDL
 //#define HYDRA_GLFW
 
+//////////////////////////////////
+// Validation
+
+// Handle validation can be enabled in any build (for example profiling), it costs a generation check per access.
+#if defined (_DEBUG) && !defined (HYDRA_GRAPHICS_VALIDATE_HANDLES)
+#define HYDRA_GRAPHICS_VALIDATE_HANDLES
+#endif // _DEBUG
+
 // Disable some warnings
 #ifdef _MSC_VER
 #pragma warning (disable: 4505)     // unreference function removed
@@ -580,6 +602,12 @@ static const uint8_t                k_max_shader_stages         = 5;
 static const uint32_t               k_submit_header_sentinel    = 0xfefeb7ba;
 static const uint32_t               k_invalid_handle = 0xffffffff;
 
+// Handles pack the pool index in the low bits and the generation of the slot in the high bits.
+// Without HYDRA_GRAPHICS_VALIDATE_HANDLES the generation is always 0 and handles are plain indices.
+static const uint32_t               k_handle_index_bits         = 20;
+static const uint32_t               k_handle_index_mask         = ( 1u << k_handle_index_bits ) - 1;
+static const uint32_t               k_handle_generation_mask    = ( 1u << ( 32 - k_handle_index_bits ) ) - 1;
+
 // Resource creation structs ////////////////////////////////////////////////////
 
 //
@@ -687,6 +715,7 @@ struct DeviceCreation {
     uint16_t                        width               = 1;
     uint16_t                        height              = 1;
     bool                            debug               = false;
+    const char*                     shader_cache_folder = nullptr; // Folder of the program binary cache. Null disables it.
 
 }; // struct DeviceCreation
 
@@ -706,7 +735,8 @@ struct BufferCreation {
 //
 struct TextureCreation {
 
-    void*                           initial_data        = nullptr;
+    void*                           initial_data        = nullptr;         // All the levels tightly packed, from the biggest. Rows keep the default 4 bytes unpack alignment.
+                                                                           // Compressed formats store each level as rows of 4x4 blocks.
     uint16_t                        width               = 1;
     uint16_t                        height              = 1;
     uint16_t                        depth               = 1;
@@ -881,6 +911,10 @@ namespace TextureFormat {
     inline bool                     has_depth( Enum value )             { return value >= D32_FLOAT && value < S8_UINT; }
     inline bool                     has_stencil( Enum value )           { return value == D32_FLOAT_S8X24_UINT || value == D24_UNORM_S8_UINT || value == S8_UINT; }
 
+    inline bool                     is_compressed( Enum value )         { return ( value >= BC1_TYPELESS && value <= BC5_SNORM ) || ( value >= BC6H_TYPELESS && value <= BC7_UNORM_SRGB ); }
+    // Bytes of a 4x4 block of a compressed format.
+    inline uint32_t                 get_block_size( Enum value )        { return ( value >= BC1_TYPELESS && value <= BC1_UNORM_SRGB ) || ( value >= BC4_TYPELESS && value <= BC4_SNORM ) ? 8 : 16; }
+
 } // namespace TextureFormat
 
 struct ResourceData {
@@ -1026,11 +1060,34 @@ struct DeviceStateGL;
 
 // Forward-declarations /////////////////////////////////////////////////////////
 struct CommandBuffer;
+struct CommandBufferPage;
+struct SubmitCommand;
+
 
+//
+//
+struct ResourcePoolStatistics {
+
+    uint32_t                        used                = 0;
+    uint32_t                        high_water          = 0;        // Maximum number of used slots since init.
+    uint32_t                        capacity            = 0;
+    uint32_t                        num_pages           = 0;
+    uint32_t                        memory_size         = 0;        // Slot memory, in bytes.
+
+}; // struct ResourcePoolStatistics
+
+//
+// Pool of resources allocated in pages of pool_size slots. When full a new page is added:
+// existing pages never move, so pointers to resources stay valid.
+// Slots are aligned to k_resource_pool_alignment, and a live bitmap allows iterating only the used slots:
+//
+//  for ( uint32_t i = pool.first_live_index(); i != k_invalid_handle; i = pool.next_live_index( i ) )
+//
+static const uint32_t               k_resource_pool_alignment   = 64;
 
 struct ResourcePool {
 
-    void                            init( uint32_t pool_size, uint32_t resource_size );
+    void                            init( uint32_t pool_size, uint32_t resource_size );     // Pool size is rounded up to a power of 2 and used as page size.
     void                            terminate();
 
     uint32_t                        obtain_resource();
@@ -1039,16 +1096,49 @@ struct ResourcePool {
     void*                           access_resource( uint32_t handle );
     const void*                     access_resource( uint32_t handle ) const;
 
-    uint8_t*                        memory              = nullptr;
+    void*                           access_resource_at_index( uint32_t index );                 // Unchecked access to a slot, alive or not.
+    bool                            is_handle_valid( uint32_t handle ) const;
+
+    uint32_t                        first_live_index() const;
+    uint32_t                        next_live_index( uint32_t index ) const;                    // Returns k_invalid_handle when there are no more live slots.
+    bool                            is_index_live( uint32_t index ) const;
+
+    void                            get_statistics( ResourcePoolStatistics& out_statistics ) const;
+
+    // Internals
+    bool                            grow();
+
+    uint8_t**                       pages               = nullptr;      // Aligned memory of each page.
+    void**                          page_allocations    = nullptr;      // Memory to free for each page.
     uint32_t*                       free_indices        = nullptr;
+    uint16_t*                       generations         = nullptr;      // Only with HYDRA_GRAPHICS_VALIDATE_HANDLES.
+    uint64_t*                       live_bits           = nullptr;
 
     uint32_t                        free_indices_head   = 0;
-    uint32_t                        size                = 16;
+    uint32_t                        size                = 16;           // Total number of slots in all pages.
     uint32_t                        resource_size       = 4;
+    uint32_t                        slot_size           = 64;           // Resource size aligned to k_resource_pool_alignment.
+
+    uint32_t                        page_size           = 16;
+    uint32_t                        page_shift          = 4;
+    uint32_t                        num_pages           = 0;
+    uint32_t                        high_water          = 0;
 
 }; // struct ResourcePool
 
 
+//
+// Statistics of the last presented frame.
+struct DeviceStatistics {
+
+    uint32_t                        submits                 = 0;
+    uint32_t                        issued_state_changes    = 0;
+    uint32_t                        skipped_state_changes   = 0;    // Redundant state changes filtered by the backend.
+    uint32_t                        command_memory          = 0;    // Bytes of commands recorded in all queued command buffers.
+    uint32_t                        dynamic_memory          = 0;    // Bytes allocated from the dynamic buffer.
+
+}; // struct DeviceStatistics
+
 struct Device {
 
     // Init/Terminate methods
@@ -1081,14 +1171,28 @@ struct Device {
     void                            query_resource_list( ResourceListHandle resource_list, ResourceListDescription& out_description );
 
     // Map/Unmap ////////////////////////////////////////////////////////////////
+    // Stream buffers get new memory from the dynamic buffer at each map: map them once per frame, before using them. Unmap does nothing.
+    // Mapping a stream buffer twice in a frame asserts, as do stream buffers created with initial data.
     void*                           map_buffer( const MapBufferParameters& parameters );
     void                            unmap_buffer( const MapBufferParameters& parameters );
 
+    // Update/Copy //////////////////////////////////////////////////////////////
+    // Executed immediately, not recorded in a command buffer: draws queued but not presented yet read the new content.
+    // The driver orders them after the draws already presented, with no need to wait as when mapping. Stream buffers are not supported.
+    void                            update_buffer( BufferHandle buffer, uint32_t offset, uint32_t size, const void* data );
+    void                            copy_buffer( BufferHandle source, uint32_t source_offset, BufferHandle destination, uint32_t destination_offset, uint32_t size );
+
+    // Dynamic memory ///////////////////////////////////////////////////////////
+    // Linear allocation from the dynamic buffer, valid for the commands of the current frame.
+    // Use the offset with the dynamic buffer in bind_vertex_buffer or as a constants offset in bind_resource_list.
+    void*                           dynamic_allocate( uint32_t size, uint32_t& out_offset );
+    BufferHandle                    get_dynamic_buffer() const;
+
     // Command Buffers //////////////////////////////////////////////////////////
     CommandBuffer*                  get_command_buffer( QueueType::Enum type, uint32_t size, bool baked );    // Request a command buffer with a certain size. If baked reset will affect only the read offset.
     void                            free_command_buffer( CommandBuffer* command_buffer );
 
-    void                            queue_command_buffer( CommandBuffer* command_buffer );          // Queue command buffer that will not be executed until present is called.
+    void                            queue_command_buffer( CommandBuffer* command_buffer );          // Queue command buffer that will not be executed until present is called. Thread safe, like get/free.
 
     // Rendering ////////////////////////////////////////////////////////////////
     void                            present();
@@ -1103,10 +1207,14 @@ struct Device {
     TextureHandle                   get_dummy_texture() const;
     BufferHandle                    get_dummy_constant_buffer() const;
 
+    const DeviceStatistics&         get_last_frame_statistics() const;
+
     // Internals ////////////////////////////////////////////////////////////////
     void                            backend_init( const DeviceCreation& creation );
     void                            backend_terminate();
 
+    void                            reserve_merged_submits( uint32_t count );       // Grow merged submit arrays to contain at least count submits.
+
     ResourcePool                    buffers;
     ResourcePool                    textures;
     ResourcePool                    pipelines;
@@ -1128,6 +1236,25 @@ struct Device {
     uint32_t                        num_allocated_command_buffers       = 0;
     uint32_t                        num_queued_command_buffers          = 0;
 
+    SubmitCommand*                  merged_submits                      = nullptr;  // Submits of all queued command buffers, sorted by key in present.
+    SubmitCommand*                  merged_submits_temp                 = nullptr;  // Scratch memory for the radix sort.
+    uint32_t                        max_merged_submits                  = 0;
+
+    DeviceStatistics                last_frame_statistics;
+
+    // Program binary cache lookups since init, only counted when the cache is enabled.
+    uint32_t                        program_cache_hits                  = 0;
+    uint32_t                        program_cache_misses                = 0;
+
+    // Dynamic buffer, split in one region per frame in flight.
+    BufferHandle                    dynamic_buffer;
+    uint8_t*                        dynamic_mapped_memory               = nullptr;
+    uint32_t                        dynamic_per_frame_size              = 0;
+    uint32_t                        dynamic_frame_index                 = 0;        // Region used by the current frame.
+    uint32_t                        dynamic_allocated_size              = 0;        // Bytes allocated in the current region.
+    uint32_t                        dynamic_alignment                   = 256;
+    uint32_t                        absolute_frame                      = 0;
+
     uint16_t                        swapchain_width                     = 1;
     uint16_t                        swapchain_height                    = 1;
 
@@ -1352,13 +1479,72 @@ struct SubmitCommand {
 }; // struct SubmitCommand
 
 //
+// Stable LSD radix sort of the submits on their 64 bits key.
+// Temp must contain at least count elements. Returns the array containing the sorted submits, either submits or temp.
+SubmitCommand*                      sort_submit_commands( SubmitCommand* submits, SubmitCommand* temp, uint32_t count );
+
+//
+// Submit sort key, packed from the most significant field:
+//
+//  | stage | phase | translucent | depth | pipeline | resource list | material |
+//
+// Stage and phase define the correctness of the frame (begin pass, render, end pass of each stage in order),
+// the other fields only group submits to minimize state changes.
+// Opaque submits should leave depth to 0 to sort purely by state, translucent ones should use an inverted depth bucket to draw back to front.
+// Field sizes can be tweaked here: the layout is validated at compile time.
 //
 struct CommandKey {
 
+    enum Phase {
+        Phase_Begin = 0, Phase_Render, Phase_End, Phase_Count
+    };
+
+    static const uint32_t           k_stage_bits            = 6;
+    static const uint32_t           k_phase_bits            = 2;
+    static const uint32_t           k_translucent_bits      = 1;
+    static const uint32_t           k_depth_bits            = 11;
+    static const uint32_t           k_pipeline_bits         = 14;
+    static const uint32_t           k_resource_list_bits    = 14;
+    static const uint32_t           k_material_bits         = 16;
+
+    static const uint32_t           k_material_shift        = 0;
+    static const uint32_t           k_resource_list_shift   = k_material_shift + k_material_bits;
+    static const uint32_t           k_pipeline_shift        = k_resource_list_shift + k_resource_list_bits;
+    static const uint32_t           k_depth_shift           = k_pipeline_shift + k_pipeline_bits;
+    static const uint32_t           k_translucent_shift     = k_depth_shift + k_depth_bits;
+    static const uint32_t           k_phase_shift           = k_translucent_shift + k_translucent_bits;
+    static const uint32_t           k_stage_shift           = k_phase_shift + k_phase_bits;
+    static const uint32_t           k_total_bits            = k_stage_shift + k_stage_bits;
+
+    static const uint32_t           k_max_stage             = ( 1u << k_stage_bits ) - 1;     // Last stage, used for overlays submitted after the whole pipeline (UI).
+    static const uint32_t           k_max_depth             = ( 1u << k_depth_bits ) - 1;
+
+    uint64_t                        encode() const;
+    static CommandKey               decode( uint64_t key );
+
+    static uint32_t                 depth_bucket( float normalized_depth );             // Quantize a [0..1] depth into a bucket.
+
+    uint32_t                        stage                   = 0;
+    uint32_t                        phase                   = Phase_Render;
+    uint32_t                        translucent             = 0;
+    uint32_t                        depth                   = 0;
+    uint32_t                        pipeline                = 0;                        // Ids are truncated to their field size, losing only grouping quality.
+    uint32_t                        resource_list           = 0;
+    uint32_t                        material                = 0;
+
 }; // struct CommandKey
 
+static_assert( CommandKey::k_total_bits <= 64, "CommandKey fields do not fit into 64 bits." );
+static_assert( CommandKey::k_stage_bits > 0 && CommandKey::k_phase_bits > 0, "CommandKey needs stage and phase to preserve frame ordering." );
+static_assert( CommandKey::Phase_Count <= ( 1u << CommandKey::k_phase_bits ), "CommandKey phase field is too small." );
+
 //
 //
+//
+// Commands are written in a page of memory. When full a bigger page is allocated and the submit being recorded
+// is moved there, so that each submit stays contiguous. Full pages are kept until reset, as recorded submits point into them,
+// and at reset the command buffer is resized to fit the whole frame in one page.
+//
 struct CommandBuffer {
 
     void                            init( QueueType::Enum type, uint32_t buffer_size, uint32_t submit_size, bool baked );
@@ -1396,6 +1582,16 @@ struct CommandBuffer {
     template <typename T>
     T*                              write_command();
 
+    // Write count commands of the same type with a single size check. Returns the first one.
+    template <typename T>
+    T*                              write_commands( uint32_t count );
+
+    void                            reserve( uint32_t size );                       // Make sure size bytes can be written without growing.
+    void                            reserve_submits( uint32_t count );
+    void                            grow( uint32_t size );
+
+    uint32_t                        get_used_size() const   { return retired_size + write_offset; }
+
     // Get command and proceed the reading
     template <typename T>
     const T&                        read_command();
@@ -1422,10 +1618,16 @@ struct CommandBuffer {
 
     QueueType::Enum                 type                = QueueType::Graphics;
 
-    uint8_t*                        data                = nullptr;
+    CommandBufferPage*              page                = nullptr;
+    CommandBufferPage*              retired_pages       = nullptr;      // Full pages, freed at reset.
+    uint8_t*                        data                = nullptr;      // Memory of the current page.
     uint32_t                        read_offset         = 0;
     uint32_t                        write_offset        = 0;
     uint32_t                        buffer_size         = 0;
+    uint32_t                        retired_size        = 0;            // Bytes written in the retired pages.
+
+    uint32_t                        peak_size           = 0;            // Maximum bytes written in a frame.
+    uint32_t                        peak_submits        = 0;
 
     bool                            baked               = false;        // If baked reset will affect only the read of the commands.
 
@@ -1436,15 +1638,32 @@ struct CommandBuffer {
 // CommandBuffer ////////////////////////////////////////////////////////////////
 template <typename T>
 T* CommandBuffer::write_command() {
+    if ( write_offset + sizeof( T ) > buffer_size ) {
+        grow( sizeof( T ) );
+    }
+
     T* command = (T*)(data + write_offset);
     command->type = T::Type();
     command->size = sizeof( T );
 
     write_offset += sizeof( T );
-    //HYDRA_ASSERT( write_offset < buffer_size, "Command buffer overflow!" );
     return command;
 }
 
+template <typename T>
+T* CommandBuffer::write_commands( uint32_t count ) {
+    reserve( sizeof( T ) * count );
+
+    T* commands = (T*)(data + write_offset);
+    for ( uint32_t i = 0; i < count; ++i ) {
+        commands[i].type = T::Type();
+        commands[i].size = sizeof( T );
+    }
+
+    write_offset += sizeof( T ) * count;
+    return commands;
+}
+
 template <typename T>
 const T& CommandBuffer::read_command() {
     // Get current command
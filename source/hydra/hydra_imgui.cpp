@@ -46,7 +46,9 @@ bool hydra_Imgui_Init( hydra::graphics::Device& graphics_device ) {
 
     // Create shader
     hfx::ShaderEffectFile shader_effect_file;
-    hfx::init_shader_effect_file( shader_effect_file, "..\\data\\bin\\ImGui.bhfx" );
+    if ( !hfx::init_shader_effect_file( shader_effect_file, "..\\data\\bin\\ImGui.bhfx" ) ) {
+        return false;
+    }
 
     hfx::ShaderEffectFile::PassHeader* pass_header = hfx::get_pass( shader_effect_file.memory, 0 );
     uint32_t shader_count = pass_header->num_shader_chunks;
@@ -89,7 +91,7 @@ bool hydra_Imgui_Init( hydra::graphics::Device& graphics_device ) {
     BufferCreation ib_creation = { BufferType::Index, ResourceUsageType::Dynamic, g_ib_size, nullptr, "IB_ImGui" };
     g_ib = graphics_device.create_buffer( ib_creation );
 
-    hydra::hy_free( shader_effect_file.memory );
+    hfx::terminate_shader_effect_file( shader_effect_file );
 
     return true;
 }
@@ -144,7 +146,11 @@ void hydra_imgui_collect_draw_data( ImDrawData* draw_data, hydra::graphics::Devi
 
     using namespace hydra::graphics;
 
-    commands.begin_submit( 2 );
+    // UI is drawn after every stage of the frame.
+    CommandKey key;
+    key.stage = CommandKey::k_max_stage;
+
+    commands.begin_submit( key.encode() );
 
     // Upload data
     ImDrawVert* vtx_dst = NULL;
@@ -219,6 +225,13 @@ void hydra_imgui_collect_draw_data( ImDrawData* draw_data, hydra::graphics::Devi
 
     commands.bind_resource_list( &last_resource_list, 1, nullptr, 0 );
 
+    // Reserve the worst case (scissor, resource list and draw for each command) to grow at most once.
+    uint32_t total_draw_commands = 0;
+    for ( int n = 0; n < counts; n++ ) {
+        total_draw_commands += draw_data->CmdLists[n]->CmdBuffer.Size;
+    }
+    commands.reserve( total_draw_commands * ( sizeof( commands::SetScissor ) + sizeof( commands::BindResourceList ) + sizeof( commands::DrawIndexed ) ) );
+
     size_t vtx_buffer_offset = 0, idx_buffer_offset = 0;
     for ( int n = 0; n < counts; n++ )
     {
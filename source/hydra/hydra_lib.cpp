@@ -1,5 +1,5 @@
 //
-// Hydra Lib - v0.05
+// Hydra Lib - v0.10
 
 
 #include "hydra_lib.h"
@@ -22,6 +22,15 @@
 #include "stb_leakcheck.h"
 #endif // HY_STB_LEAKCHECK
 
+#if defined(HY_TASK)
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#endif // HY_TASK
+
+#include <mutex>
+
 #if defined(HY_LOG)
     #define HYDRA_LOG                   hydra::print_format
 #else
@@ -36,6 +45,7 @@ namespace hydra {
 
 static const size_t k_string_buffer_size = 1024 * 1024;
 static char s_log_buffer[k_string_buffer_size];
+static std::mutex s_log_mutex;              // Log buffer is shared: tasks can print too.
 
 
 static void print_va_list( const char* format, va_list args ) {
@@ -52,6 +62,8 @@ static void output_visual_studio() {
 }
 
 void print_format( const char* format, ... ) {
+    std::lock_guard<std::mutex> lock( s_log_mutex );
+
     va_list args;
     va_start( args, format );
     print_va_list( format, args );
@@ -62,6 +74,8 @@ void print_format( const char* format, ... ) {
 }
 
 void print_format_console( const char* format, ... ) {
+    std::lock_guard<std::mutex> lock( s_log_mutex );
+
     va_list args;
     va_start( args, format );
     print_va_list( format, args );
@@ -73,6 +87,8 @@ void print_format_console( const char* format, ... ) {
 #if defined(_MSC_VER)
 
 void print_format_visual_studio( const char* format, ... ) {
+    std::lock_guard<std::mutex> lock( s_log_mutex );
+
     va_list args;
     va_start( args, format );
     print_va_list( format, args );
@@ -135,6 +151,31 @@ uint32_t get_full_path_name( cstring path, char* out_full_path, uint32_t max_siz
 #endif // _WIN64
 }
 
+bool rename_file( cstring filename, cstring new_filename ) {
+#if defined(_WIN64)
+    return MoveFileExA( filename, new_filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH ) != 0;
+#else
+    return rename( filename, new_filename ) == 0;
+#endif // _WIN64
+}
+
+bool is_directory( cstring path ) {
+#if defined(_WIN64)
+    const DWORD attributes = GetFileAttributesA( path );
+    return attributes != INVALID_FILE_ATTRIBUTES && ( attributes & FILE_ATTRIBUTE_DIRECTORY );
+#else
+    return false;
+#endif // _WIN64
+}
+
+bool delete_file( cstring filename ) {
+#if defined(_WIN64)
+    return DeleteFileA( filename ) != 0;
+#else
+    return remove( filename ) == 0;
+#endif // _WIN64
+}
+
 #if defined (HY_STB)
 
 void read_file( cstring filename, cstring mode, Buffer& memory ) {
@@ -218,6 +259,62 @@ char* read_file_into_memory( const char* filename, size_t* size ) {
     return text;
 }
 
+bool map_file( cstring filename, MappedFile& out_file ) {
+    out_file = MappedFile();
+
+#if defined(_WIN64)
+    HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+    if ( file == INVALID_HANDLE_VALUE ) {
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    if ( !GetFileSizeEx( file, &file_size ) || file_size.QuadPart == 0 ) {
+        CloseHandle( file );
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+    if ( !mapping ) {
+        CloseHandle( file );
+        return false;
+    }
+
+    void* memory = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+    if ( !memory ) {
+        CloseHandle( mapping );
+        CloseHandle( file );
+        return false;
+    }
+
+    out_file.memory = (char*)memory;
+    out_file.size = (size_t)file_size.QuadPart;
+    out_file.file_handle = file;
+    out_file.mapping_handle = mapping;
+#else
+    // No mapping available: fall back to a private copy of the file.
+    out_file.memory = read_file_into_memory( filename, &out_file.size );
+#endif // _WIN64
+
+    return out_file.memory != nullptr;
+}
+
+void unmap_file( MappedFile& file ) {
+    if ( !file.memory ) {
+        return;
+    }
+
+#if defined(_WIN64)
+    UnmapViewOfFile( file.memory );
+    CloseHandle( file.mapping_handle );
+    CloseHandle( file.file_handle );
+#else
+    hy_free( file.memory );
+#endif // _WIN64
+
+    file = MappedFile();
+}
+
 // Scoped file //////////////////////////////////////////////////////////////////
 ScopedFile::ScopedFile( cstring filename, cstring mode ) {
     open_file( filename, mode, &_file );
@@ -372,6 +469,220 @@ double time_seconds( int64_t time ) {
 
 #endif // HY_TIME ///////////////////////////////////////////////////////////////
 
+// Task /////////////////////////////////////////////////////////////////////////
+#if defined (HY_TASK)
+
+static const uint32_t               k_max_task_workers = 63;
+
+struct SubmittedTask {
+    TaskFunction                    function;
+    void*                           user_data;
+}; // struct SubmittedTask
+
+//
+// Workers sleep until a parallel for is started, then all threads grab indices with an atomic counter.
+// Between parallel fors they run the submitted tasks, one per worker at a time.
+struct TaskService {
+
+    std::thread                     workers[k_max_task_workers];
+    uint32_t                        num_workers         = 0;
+
+    std::mutex                      mutex;
+    std::condition_variable         work_condition;
+    std::condition_variable         done_condition;
+    std::mutex                      parallel_for_mutex;             // Only one parallel for at a time.
+
+    TaskFunction                    function            = nullptr;
+    void*                           user_data           = nullptr;
+    uint32_t                        count               = 0;
+    uint64_t                        generation          = 0;        // Incremented for each parallel for, wakes up the workers.
+    uint32_t                        active_workers      = 0;
+
+    std::atomic<uint32_t>           next_index;
+    bool                            quit                = false;
+
+    std::deque<SubmittedTask>       submitted_tasks;                // Not started yet.
+    uint32_t                        running_submitted_tasks = 0;
+    std::condition_variable         submitted_done_condition;
+
+}; // struct TaskService
+
+static TaskService                  s_task_service;
+static thread_local bool            s_inside_parallel_for = false;
+static thread_local bool            s_inside_submitted_task = false;
+static thread_local uint32_t        s_thread_index = 0;
+
+static void task_run_indices( TaskFunction function, void* user_data, uint32_t count, uint32_t thread_index ) {
+    s_inside_parallel_for = true;
+
+    for ( uint32_t index = s_task_service.next_index++; index < count; index = s_task_service.next_index++ ) {
+        function( user_data, index, thread_index );
+    }
+
+    s_inside_parallel_for = false;
+}
+
+//
+// Called with the service mutex locked, when a submitted task is waiting.
+static void task_run_submitted( std::unique_lock<std::mutex>& lock, uint32_t thread_index ) {
+    const SubmittedTask task = s_task_service.submitted_tasks.front();
+    s_task_service.submitted_tasks.pop_front();
+    ++s_task_service.running_submitted_tasks;
+
+    lock.unlock();
+    s_inside_submitted_task = true;
+    task.function( task.user_data, 0, thread_index );
+    s_inside_submitted_task = false;
+    lock.lock();
+
+    --s_task_service.running_submitted_tasks;
+    if ( s_task_service.running_submitted_tasks == 0 && s_task_service.submitted_tasks.empty() ) {
+        s_task_service.submitted_done_condition.notify_all();
+    }
+}
+
+static void task_worker_main( uint32_t thread_index ) {
+    s_thread_index = thread_index;
+    uint64_t last_generation = 0;
+
+    for ( ;; ) {
+        TaskFunction function;
+        void* user_data;
+        uint32_t count;
+        {
+            std::unique_lock<std::mutex> lock( s_task_service.mutex );
+            s_task_service.work_condition.wait( lock, [&] { return s_task_service.quit || s_task_service.generation != last_generation ||
+                                                                   !s_task_service.submitted_tasks.empty(); } );
+
+            if ( s_task_service.quit ) {
+                return;
+            }
+
+            if ( s_task_service.generation == last_generation ) {
+                task_run_submitted( lock, thread_index );
+                continue;
+            }
+
+            last_generation = s_task_service.generation;
+            function = s_task_service.function;
+            user_data = s_task_service.user_data;
+            count = s_task_service.count;
+            ++s_task_service.active_workers;
+        }
+
+        task_run_indices( function, user_data, count, thread_index );
+
+        {
+            std::lock_guard<std::mutex> lock( s_task_service.mutex );
+            --s_task_service.active_workers;
+        }
+        s_task_service.done_condition.notify_one();
+    }
+}
+
+//
+//
+void task_service_init( uint32_t num_workers ) {
+    if ( num_workers == 0 ) {
+        const uint32_t hardware_threads = std::thread::hardware_concurrency();
+        num_workers = hardware_threads > 1 ? hardware_threads - 1 : 0;
+    }
+
+    s_task_service.num_workers = num_workers < k_max_task_workers ? num_workers : k_max_task_workers;
+    s_task_service.quit = false;
+
+    for ( uint32_t i = 0; i < s_task_service.num_workers; ++i ) {
+        s_task_service.workers[i] = std::thread( task_worker_main, i + 1 );
+    }
+}
+
+//
+//
+void task_service_terminate() {
+    {
+        std::lock_guard<std::mutex> lock( s_task_service.mutex );
+        s_task_service.quit = true;
+    }
+    s_task_service.work_condition.notify_all();
+
+    for ( uint32_t i = 0; i < s_task_service.num_workers; ++i ) {
+        s_task_service.workers[i].join();
+    }
+
+    s_task_service.num_workers = 0;
+
+    // Tasks not started are dropped.
+    s_task_service.submitted_tasks.clear();
+}
+
+//
+//
+uint32_t task_thread_count() {
+    return s_task_service.num_workers + 1;
+}
+
+//
+//
+uint32_t task_thread_index() {
+    return s_thread_index;
+}
+
+//
+//
+void parallel_for( uint32_t count, TaskFunction function, void* user_data ) {
+    if ( s_task_service.num_workers == 0 || s_inside_parallel_for || s_inside_submitted_task || count <= 1 ) {
+        for ( uint32_t i = 0; i < count; ++i ) {
+            function( user_data, i, s_thread_index );
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> parallel_for_lock( s_task_service.parallel_for_mutex );
+    {
+        // A worker that woke up late for the previous parallel for must leave before the index is reset.
+        std::unique_lock<std::mutex> lock( s_task_service.mutex );
+        s_task_service.done_condition.wait( lock, [] { return s_task_service.active_workers == 0; } );
+
+        s_task_service.function = function;
+        s_task_service.user_data = user_data;
+        s_task_service.count = count;
+        s_task_service.next_index = 0;
+        ++s_task_service.generation;
+    }
+    s_task_service.work_condition.notify_all();
+
+    task_run_indices( function, user_data, count, 0 );
+
+    // Wait for workers still executing an index. Workers that woke up late find no index left.
+    std::unique_lock<std::mutex> lock( s_task_service.mutex );
+    s_task_service.done_condition.wait( lock, [] { return s_task_service.active_workers == 0; } );
+}
+
+//
+//
+void task_submit( TaskFunction function, void* user_data ) {
+    if ( s_task_service.num_workers == 0 ) {
+        function( user_data, 0, 0 );
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( s_task_service.mutex );
+        const SubmittedTask task = { function, user_data };
+        s_task_service.submitted_tasks.push_back( task );
+    }
+    s_task_service.work_condition.notify_one();
+}
+
+//
+//
+void task_wait_submitted() {
+    std::unique_lock<std::mutex> lock( s_task_service.mutex );
+    s_task_service.submitted_done_condition.wait( lock, [] { return s_task_service.running_submitted_tasks == 0 && s_task_service.submitted_tasks.empty(); } );
+}
+
+#endif // HY_TASK ///////////////////////////////////////////////////////////////
+
 //
 // StringRef ////////////////////////////////////////////////////////////////////
 
@@ -391,7 +702,7 @@ bool equals( const StringRef& a, const StringRef& b ) {
 void copy( const StringRef& a, char* buffer, uint32_t buffer_size ) {
     const uint32_t max_length = buffer_size - 1 < a.length ? buffer_size - 1 : a.length;
     memcpy( buffer, a.text, max_length );
-    buffer[a.length] = 0;
+    buffer[max_length] = 0;
 }
 
 //
@@ -533,6 +844,94 @@ void StringBuffer::clear() {
     data[0] = 0;
 }
 
+//
+// MemoryArena //////////////////////////////////////////////////////////////////
+static void add_block( MemoryArena& arena, size_t size ) {
+    MemoryArena::Block* block = (MemoryArena::Block*)hy_malloc( sizeof( MemoryArena::Block ) + size );
+    block->previous = arena.current_block;
+    block->size = size;
+
+    arena.current_block = block;
+    arena.current = (char*)( block + 1 );
+    arena.end = arena.current + size;
+    arena.reserved_size += size;
+    ++arena.block_count;
+}
+
+static void free_blocks( MemoryArena& arena ) {
+    MemoryArena::Block* block = arena.current_block;
+    while ( block ) {
+        MemoryArena::Block* previous = block->previous;
+        hy_free( block );
+        block = previous;
+    }
+
+    arena.current_block = nullptr;
+    arena.current = arena.end = nullptr;
+    arena.reserved_size = 0;
+    arena.block_count = 0;
+}
+
+void MemoryArena::init( size_t size ) {
+    block_size = size;
+    allocated_size = peak_size = 0;
+    allocation_count = 0;
+
+    add_block( *this, block_size );
+}
+
+void MemoryArena::terminate() {
+    free_blocks( *this );
+}
+
+void MemoryArena::reset() {
+    if ( block_count > 1 ) {
+        // Next use fits in a single block.
+        const size_t size = reserved_size > block_size ? reserved_size : block_size;
+        free_blocks( *this );
+        add_block( *this, size );
+    }
+    else if ( current_block ) {
+        current = (char*)( current_block + 1 );
+    }
+
+    allocated_size = 0;
+    allocation_count = 0;
+}
+
+void* MemoryArena::allocate( size_t size, size_t alignment ) {
+    char* memory = (char*)( ( (uintptr_t)current + alignment - 1 ) & ~( (uintptr_t)alignment - 1 ) );
+    if ( !current_block || memory + size > end ) {
+        const size_t needed_size = size + alignment;
+        add_block( *this, needed_size > block_size ? needed_size : block_size );
+        memory = (char*)( ( (uintptr_t)current + alignment - 1 ) & ~( (uintptr_t)alignment - 1 ) );
+    }
+
+    allocated_size += ( memory + size ) - current;
+    peak_size = allocated_size > peak_size ? allocated_size : peak_size;
+    ++allocation_count;
+
+    current = memory + size;
+    return memory;
+}
+
+void* MemoryArena::grow( void* memory, size_t size, size_t new_size, size_t alignment ) {
+    char* memory_end = (char*)memory + size;
+    if ( memory && memory_end == current && (char*)memory + new_size <= end ) {
+        allocated_size += new_size - size;
+        peak_size = allocated_size > peak_size ? allocated_size : peak_size;
+
+        current = (char*)memory + new_size;
+        return memory;
+    }
+
+    void* new_memory = allocate( new_size, alignment );
+    if ( size ) {
+        memcpy( new_memory, memory, size );
+    }
+    return new_memory;
+}
+
 //
 // StringArray //////////////////////////////////////////////////////////////////
 
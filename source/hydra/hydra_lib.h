@@ -3,9 +3,9 @@
 #include <stdint.h>
 
 //
-// Hydra Lib - v0.05
+// Hydra Lib - v0.10
 //
-// Simple general functions for log, file, process, time.
+// Simple general functions for log, file, process, time, tasks.
 //
 //      Source code     : https://www.github.com/jorenjoestar/
 //
@@ -13,6 +13,11 @@
 //
 // Revision history //////////////////////
 //
+//      0.10 (2020/03/23) + Added MemoryArena and ArenaArray: linear allocations released all at once. + Added submitted tasks, run by the workers without waiting.
+//      0.09 (2020/03/21) + Added read-only memory mapping of files.
+//      0.08 (2020/03/19) + Fixed string copy writing the terminator past the buffer when truncating.
+//      0.07 (2020/03/17) + Added rename, delete and directory check of files. Log can be used from multiple threads.
+//      0.06 (2020/03/11) + Added Task Subsystem with parallel for.
 //      0.05 (2020/03/02) + Implemented Time Subsystem. + Improved Execute Process error message.
 //      0.04 (2020/02/27) + Removal of STB-dependent parts
 //      0.03 (2019/12/17) + Interface cleanup. + Added array init macro.
@@ -33,6 +38,10 @@
 //
 //  #define HY_FILE
 //
+//  #define HY_TASK
+//
+//      Enables a small pool of worker threads to run loops in parallel.
+//
 // Todo //////////////////////////////////
 //
 //      - Move StringBuffer into this file.
@@ -42,6 +51,7 @@
 #define HY_LOG
 #define HY_PROCESS
 #define HY_TIME
+#define HY_TASK
 #define HY_STB
 #define HY_STB_LEAKCHECK
 
@@ -115,6 +125,8 @@ inline size_t                       hash_bytes( void* data, size_t length, size_
 // TODO: add the non-std versions.
 #include <string>
 #include <vector>
+#include <new>
+#include <type_traits>
 #include <Windows.h>
 
 template <typename T>
@@ -201,6 +213,77 @@ namespace hydra {
 
     }; // struct StringBuffer
 
+    //
+    // Linear allocator: allocations are never freed one by one, reset releases all of them at once.
+    // Memory comes from chained blocks. When a reset finds more than one block they are merged into one sized for the peak usage.
+    struct MemoryArena {
+
+        struct Block {
+            Block*                  previous;
+            size_t                  size;
+        }; // struct Block
+
+        void                        init( size_t block_size );
+        void                        terminate();
+        void                        reset();
+
+        void*                       allocate( size_t size, size_t alignment );
+        void*                       grow( void* memory, size_t size, size_t new_size, size_t alignment ); // Extends in place when memory is the last allocation, copies otherwise.
+
+        Block*                      current_block       = nullptr;
+        char*                       current             = nullptr;
+        char*                       end                 = nullptr;
+        size_t                      block_size          = 0;        // Minimum size of a new block.
+
+        size_t                      allocated_size      = 0;        // Bytes used since the last reset, alignment included.
+        size_t                      peak_size           = 0;        // Highest allocated_size since init.
+        size_t                      reserved_size       = 0;        // Bytes of all the blocks.
+        uint32_t                    allocation_count    = 0;        // Allocations since the last reset.
+        uint32_t                    block_count         = 0;
+
+    }; // struct MemoryArena
+
+    //
+    // Growable array allocated from a MemoryArena, that also owns the elements: copies of the array share them.
+    // Elements are never destroyed, so they must be trivially copyable.
+    template <typename T>
+    struct ArenaArray {
+
+        void                        push( MemoryArena& arena, const T& element );
+        void                        append( MemoryArena& arena, const ArenaArray<T>& other );
+
+        uint32_t                    size() const                        { return count; }
+        T*                          data() const                        { return elements; }
+        T&                          operator[]( size_t index )          { return elements[index]; }
+        const T&                    operator[]( size_t index ) const    { return elements[index]; }
+
+        T*                          elements            = nullptr;
+        uint32_t                    count               = 0;
+        uint32_t                    capacity            = 0;
+
+    }; // struct ArenaArray
+
+    static const uint32_t           k_arena_array_initial_capacity = 4;
+
+    template <typename T>
+    inline void ArenaArray<T>::push( MemoryArena& arena, const T& element ) {
+        static_assert( std::is_trivially_copyable<T>::value, "ArenaArray elements are copied and never destroyed." );
+
+        if ( count == capacity ) {
+            const uint32_t new_capacity = capacity ? capacity * 2 : k_arena_array_initial_capacity;
+            elements = (T*)arena.grow( elements, sizeof( T ) * capacity, sizeof( T ) * new_capacity, alignof( T ) );
+            capacity = new_capacity;
+        }
+        elements[count++] = element;
+    }
+
+    template <typename T>
+    inline void ArenaArray<T>::append( MemoryArena& arena, const ArenaArray<T>& other ) {
+        for ( uint32_t i = 0; i < other.count; ++i ) {
+            push( arena, other.elements[i] );
+        }
+    }
+
 
 
     // Log //////////////////////////////////////////////////////////////////////
@@ -228,6 +311,18 @@ namespace hydra {
 
     char*                           read_file_into_memory( const char* filename, size_t* size );
 
+    //
+    // Read-only view of a whole file. Pages are loaded by the OS on first access, no copy is made.
+    struct MappedFile {
+        char*                       memory              = nullptr;
+        size_t                      size                = 0;
+        void*                       file_handle         = nullptr;
+        void*                       mapping_handle      = nullptr;
+    }; // struct MappedFile
+
+    bool                            map_file( cstring filename, MappedFile& out_file );     // Returns false if the file is missing or empty.
+    void                            unmap_file( MappedFile& file );
+
     void                            open_file( cstring filename, cstring mode, FileHandle* file );
     void                            close_file( FileHandle file );
     int32_t                         read_file( uint8_t* memory, uint32_t elementSize, uint32_t count, FileHandle file );
@@ -235,6 +330,10 @@ namespace hydra {
     FileTime                        get_last_write_time( cstring filename );
     uint32_t                        get_full_path_name( cstring path, char* out_full_path, uint32_t max_size );
 
+    bool                            rename_file( cstring filename, cstring new_filename );  // Replaces new_filename if present. Used to write files atomically.
+    bool                            delete_file( cstring filename );
+    bool                            is_directory( cstring path );
+
 #if defined (HY_STB)
     void                            find_files_in_path( cstring file_pattern, StringArray& files );         // Search files matching file_pattern and puts them in files array.
                                                                                                             // Examples: "..\\data\\*", "*.bin", "*.*
@@ -280,6 +379,30 @@ namespace hydra {
 
 #endif // HY_TIME
 
+    // Task /////////////////////////////////////////////////////////////////////
+#if defined(HY_TASK)
+
+    // Function executed for each index of a parallel for. Thread index is 0 for the calling thread, 1..n for the workers.
+    typedef void                    ( *TaskFunction )( void* user_data, uint32_t index, uint32_t thread_index );
+
+    void                            task_service_init( uint32_t num_workers );      // 0 uses one worker less than the hardware threads.
+    void                            task_service_terminate();
+
+    uint32_t                        task_thread_count();                            // Workers plus the calling thread.
+    uint32_t                        task_thread_index();                            // 0 for the calling thread, 1..n for the workers.
+
+    // Execute function for each index in [0, count) and wait for completion. The calling thread participates.
+    // Runs serially, with the index of the current thread, if the service is not initialized or if called from inside
+    // another parallel for or a submitted task: a long submitted task does not block the parallel fors of the calling thread.
+    void                            parallel_for( uint32_t count, TaskFunction function, void* user_data );
+
+    // Queue function( user_data, 0, thread_index ) to run on a worker and return immediately. Tasks start in submission order,
+    // workers join a parallel for first. Runs on the calling thread if the service has no workers.
+    void                            task_submit( TaskFunction function, void* user_data );
+    void                            task_wait_submitted();                          // Wait until all the submitted tasks are completed.
+
+#endif // HY_TASK
+
     void*                           hy_malloc( size_t size );
     void                            hy_free( void* data );
 
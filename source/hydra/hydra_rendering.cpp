@@ -1,8 +1,16 @@
 //
-//  Hydra Rendering - v0.12
+//  Hydra Rendering - v0.20
 
 #include "hydra_rendering.h"
 
+#include <stdlib.h>
+#include <assert.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE__)
+#define HYDRA_CULLING_SSE
+#include <xmmintrin.h>
+#endif // SSE
+
 #include "ShaderCodeGenerator.h"
 
 #include "cglm/struct/mat4.h"
@@ -111,10 +119,23 @@ void ShaderEffect::init( const hfx::ShaderEffectFile& shader_effect_file ) {
     properties_data = shader_effect_file.properties_data;
     num_passes = shader_effect_file.header->num_passes;
 
+    memory = shader_effect_file.memory;
+
     array_init( passes );
     array_set_length( passes, num_passes );
 }
 
+PipelineHandle ShaderEffect::get_pipeline( uint32_t pass_index, uint32_t option_key ) const {
+    const ShaderEffectPass& pass = passes[pass_index];
+
+    const uint32_t variant_index = hfx::get_variant_index( hfx::get_pass( memory, pass_index ), option_key );
+    return variant_index < array_length_u( pass.variant_pipelines ) ? pass.variant_pipelines[variant_index] : pass.pipeline_handle;
+}
+
+uint32_t ShaderEffect::get_option_mask( uint32_t pass_index, const char* option_name ) const {
+    return hfx::get_option_mask( hfx::get_pass( memory, pass_index ), option_name );
+}
+
 // ShaderInstance ///////////////////////////////////////////////////////////////
 
 void ShaderInstance::load_resources( const PipelineCreation& pipeline_creation, PipelineHandle pipeline_handle, ShaderResourcesDatabase& database, ShaderResourcesLookup& lookup, Device& device ) {
@@ -231,6 +252,44 @@ void Material::load_resources( ShaderResourcesDatabase& db, Device& device ) {
     }
 }
 
+bool Material::set_property( const char* property_name, const float* values, uint32_t num_values ) {
+    const hfx::ShaderEffectFile::MaterialProperty* property = (const hfx::ShaderEffectFile::MaterialProperty*)string_hash_get( effect->name_to_property, property_name );
+    if ( !property || !hfx::get_property_components( property->type ) ) {
+        return false;
+    }
+
+    hfx::write_property_values( property, values, num_values, local_constants_data );
+    set_constants_dirty( property->offset, property->size );
+    return true;
+}
+
+void Material::set_constants_dirty( uint32_t offset, uint32_t size ) {
+    if ( dirty_constants_start == dirty_constants_end ) {
+        dirty_constants_start = offset;
+        dirty_constants_end = offset + size;
+        return;
+    }
+
+    dirty_constants_start = offset < dirty_constants_start ? offset : dirty_constants_start;
+    dirty_constants_end = offset + size > dirty_constants_end ? offset + size : dirty_constants_end;
+}
+
+void Material::upload_constants( Device& device ) {
+    if ( dirty_constants_start == dirty_constants_end ) {
+        return;
+    }
+
+    const uint32_t size = dirty_constants_end - dirty_constants_start;
+    MapBufferParameters map_parameters = { local_constants_buffer, dirty_constants_start, size };
+    void* buffer_data = device.map_buffer( map_parameters );
+    if ( buffer_data ) {
+        memcpy( buffer_data, local_constants_data + dirty_constants_start, size );
+        device.unmap_buffer( map_parameters );
+    }
+
+    dirty_constants_start = dirty_constants_end = 0;
+}
+
 // RenderPipeline ///////////////////////////////////////////////////////////////
 
 void RenderPipeline::init( ShaderResourcesDatabase* initial_db ) {
@@ -276,15 +335,44 @@ void RenderPipeline::terminate( Device& device ) {
 void RenderPipeline::update() {
 }
 
+struct RenderStageTaskData {
+    Device*                         device;
+    RenderPipeline::StageMap*       name_to_stage;
+}; // struct RenderStageTaskData
+
+static void render_stage_task( void* user_data, uint32_t index, uint32_t thread_index ) {
+
+    RenderStageTaskData& task_data = *(RenderStageTaskData*)user_data;
+    Device& device = *task_data.device;
+    RenderStage* stage = task_data.name_to_stage[index].value;
+
+    CommandBuffer* stage_commands = device.get_command_buffer( QueueType::Graphics, 0, false );
+    stage->render( device, stage_commands );
+
+    if ( stage_commands->num_submits ) {
+        device.queue_command_buffer( stage_commands );
+    }
+    else {
+        device.free_command_buffer( stage_commands );
+    }
+}
+
 void RenderPipeline::render( Device& device, CommandBuffer* commands ) {
 
-    for ( size_t i = 0; i < string_hash_length( name_to_stage ); i++ ) {
+    const uint32_t num_stages = (uint32_t)string_hash_length( name_to_stage );
+
+    // Begin and end run on the calling thread: managers rendering in end can map buffers.
+    for ( uint32_t i = 0; i < num_stages; i++ ) {
 
         RenderStage* stage = name_to_stage[i].value;
+        stage->stage_index = (uint16_t)i;
         stage->begin( device, commands );
-        stage->render( device, commands );
         stage->end( device, commands );
     }
+
+    // Record each stage in its own command buffer. Submits are sorted by stage and phase in present.
+    RenderStageTaskData task_data = { &device, name_to_stage };
+    parallel_for( num_stages, render_stage_task, &task_data );
 }
 
 void RenderPipeline::load_resources( Device& device ) {
@@ -320,7 +408,11 @@ void RenderStage::terminate() {
 
 void RenderStage::begin( Device& device, CommandBuffer* commands ) {
     // Render Pass Begin
-    commands->begin_submit( 0 );
+    CommandKey key;
+    key.stage = stage_index;
+    key.phase = CommandKey::Phase_Begin;
+
+    commands->begin_submit( key.encode() );
     commands->begin_pass( render_pass );
     commands->set_viewport( { 0, 0, (float)current_width, (float)current_height, 0.0f, 1.0f } );
     
@@ -346,12 +438,21 @@ void RenderStage::render( Device& device, CommandBuffer* commands ) {
     // TODO: for now use the material and the pass specified
     if ( material ) {
         ShaderInstance& shader_instance = material->shader_instances[pass_index];
+        // Variants share the resource layouts of the pass.
+        const PipelineHandle pipeline = option_key ? material->effect->get_pipeline( pass_index, option_key ) : shader_instance.pipeline;
+
+        CommandKey key;
+        key.stage = stage_index;
+        key.pipeline = pipeline.handle;
+        key.resource_list = shader_instance.num_resource_lists ? shader_instance.resource_lists[0].handle : 0;
+        key.material = material->pool_id;
+
         switch ( type ) {
 
             case Post:
             {
-                commands->begin_submit( pass_index );
-                commands->bind_pipeline( shader_instance.pipeline );
+                commands->begin_submit( key.encode() );
+                commands->bind_pipeline( pipeline );
                 commands->bind_resource_list( &shader_instance.resource_lists[0], shader_instance.num_resource_lists, nullptr, 0 );
                 //commands->bind_vertex_buffer( device.get_fullscreen_vertex_buffer() );
                 commands->draw( graphics::TopologyType::Triangle, 0, 3 );
@@ -361,8 +462,8 @@ void RenderStage::render( Device& device, CommandBuffer* commands ) {
 
             case PostCompute:
             {
-                commands->begin_submit( 0 );
-                commands->bind_pipeline( shader_instance.pipeline );
+                commands->begin_submit( key.encode() );
+                commands->bind_pipeline( pipeline );
                 commands->bind_resource_list( &shader_instance.resource_lists[0], shader_instance.num_resource_lists, nullptr, 0 );
                 commands->dispatch( (uint8_t)ceilf( current_width / 32.0f ), (uint8_t)ceilf( current_height / 32.0f ), 1 );
                 commands->end_submit();
@@ -371,8 +472,8 @@ void RenderStage::render( Device& device, CommandBuffer* commands ) {
 
             case Swapchain:
             {
-                commands->begin_submit( pass_index );
-                commands->bind_pipeline( shader_instance.pipeline );
+                commands->begin_submit( key.encode() );
+                commands->bind_pipeline( pipeline );
                 commands->bind_resource_list( &shader_instance.resource_lists[0], shader_instance.num_resource_lists, nullptr, 0 );
                 //commands->bind_vertex_buffer( gfx_device.get_fullscreen_vertex_buffer() );
                 commands->draw( graphics::TopologyType::Triangle, 0, 3 );
@@ -394,7 +495,7 @@ void RenderStage::render( Device& device, CommandBuffer* commands ) {
         }
 
         if ( render_manager ) {
-            RenderManager::RenderContext render_context = { &device, render_view, commands, render_view->visible_render_scenes, 0, render_scenes, 0 };
+            RenderManager::RenderContext render_context = { &device, render_view, commands, render_view->visible_render_scenes, 0, render_scenes, stage_index };
             render_manager->render( render_context );
         }
     }
@@ -405,12 +506,16 @@ void RenderStage::end( Device& device, CommandBuffer* commands ) {
     for ( uint32_t i = 0; i < array_length( render_managers ); ++i ) {
         RenderManager* render_manager = render_managers[i];
 
-        RenderManager::RenderContext render_context = { &device, render_view, commands, render_view ? render_view->visible_render_scenes : nullptr, 0, 0, 0 };
+        RenderManager::RenderContext render_context = { &device, render_view, commands, render_view ? render_view->visible_render_scenes : nullptr, 0, 0, stage_index };
         render_manager->render( render_context );
     }
 
     // Render Pass End
-    commands->begin_submit( 0 );
+    CommandKey key;
+    key.stage = stage_index;
+    key.phase = CommandKey::Phase_End;
+
+    commands->begin_submit( key.encode() );
     commands->end_pass();
     commands->end_submit();
 }
@@ -547,57 +652,788 @@ void Camera::update( hydra::graphics::Device& gfx_device ) {
     view_projection = glms_mat4_mul( projection, view );
 }
 
-// SceneRenderer ////////////////////////////////////////////////////////////////
+// GeometryArena ////////////////////////////////////////////////////////////////
 
-static void render_mesh( hydra::graphics::CommandBuffer* commands, const hydra::graphics::Mesh& mesh, uint32_t node_id, BufferHandle transformBuffer ) {
-    for ( uint32_t i = 0; i < array_length( mesh.sub_meshes ); ++i ) {
-        const hydra::graphics::SubMesh& sub_mesh = mesh.sub_meshes[i];
+static const uint32_t               k_geometry_stream_strides[GeometryStream::Count] = { sizeof( float ) * 3, sizeof( float ) * 3, sizeof( float ) * 2 };
+static const uint32_t               k_geometry_vertex_size = sizeof( float ) * 8;
+static const uint32_t               k_geometry_index_size = sizeof( uint16_t );
+static const uint32_t               k_invalid_range = 0xffffffff;
 
-        hydra::graphics::ShaderInstance& shader_instance = sub_mesh.material->shader_instances[0];
+static const char*                  s_geometry_stream_names[GeometryStream::Count] = { "Geometry_positions", "Geometry_normals", "Geometry_texcoords" };
 
-        commands->begin_submit( 0 );
-        commands->bind_pipeline( shader_instance.pipeline );
+//
+// Best fit: the smallest free range that fits keeps the big ones for big allocations.
+static uint32_t find_free_range( const GeometryRange* ranges, uint32_t count ) {
+    uint32_t best = k_invalid_range;
+    for ( uint32_t i = 0; i < array_length_u( ranges ); ++i ) {
+        if ( ranges[i].count >= count && ( best == k_invalid_range || ranges[i].count < ranges[best].count ) ) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+//
+// Allocate from the start of a free range. Returns the offset.
+static uint32_t take_free_range( array( GeometryRange )& ranges, uint32_t range_index, uint32_t count ) {
+    GeometryRange& range = ranges[range_index];
+    const uint32_t offset = range.offset;
+
+    range.offset += count;
+    range.count -= count;
+    if ( range.count == 0 ) {
+        array_delete( ranges, range_index );
+    }
+    return offset;
+}
+
+//
+// Insert a range keeping the order by offset, merged with the free ranges it touches.
+static void release_range( array( GeometryRange )& ranges, uint32_t offset, uint32_t count ) {
+    if ( count == 0 ) {
+        return;
+    }
+
+    const uint32_t range_count = array_length_u( ranges );
+    uint32_t next = 0;
+    while ( next < range_count && ranges[next].offset < offset ) {
+        ++next;
+    }
+
+    const bool merge_previous = next > 0 && ranges[next - 1].offset + ranges[next - 1].count == offset;
+    const bool merge_next = next < range_count && offset + count == ranges[next].offset;
+
+    if ( merge_previous && merge_next ) {
+        ranges[next - 1].count += count + ranges[next].count;
+        array_delete( ranges, next );
+    }
+    else if ( merge_previous ) {
+        ranges[next - 1].count += count;
+    }
+    else if ( merge_next ) {
+        ranges[next].offset = offset;
+        ranges[next].count += count;
+    }
+    else {
+        GeometryRange range = { offset, count };
+        array_insert( ranges, next, range );
+    }
+}
+
+static void create_page_buffers( Device& device, GeometryPage& page ) {
+    BufferCreation buffer_creation;
+    buffer_creation.type = BufferType::Vertex;
+    buffer_creation.usage = ResourceUsageType::Dynamic;
+
+    for ( uint32_t s = 0; s < GeometryStream::Count; ++s ) {
+        buffer_creation.size = page.vertex_capacity * k_geometry_stream_strides[s];
+        buffer_creation.name = s_geometry_stream_names[s];
+        page.vertex_buffers[s] = device.create_buffer( buffer_creation );
+    }
+
+    buffer_creation.type = BufferType::Index;
+    buffer_creation.size = page.index_capacity * k_geometry_index_size;
+    buffer_creation.name = "Geometry_indices";
+    page.index_buffer = device.create_buffer( buffer_creation );
+}
+
+static void destroy_page_buffers( Device& device, GeometryPage& page ) {
+    for ( uint32_t s = 0; s < GeometryStream::Count; ++s ) {
+        device.destroy_buffer( page.vertex_buffers[s] );
+    }
+    device.destroy_buffer( page.index_buffer );
+}
+
+void GeometryArena::init( Device& device_, const GeometryArenaCreation& creation_ ) {
+    device = &device_;
+    creation = creation_;
+
+    array_init( pages );
+    array_init( allocations );
+    array_init( free_handles );
+}
+
+void GeometryArena::terminate() {
+    for ( uint32_t p = 0; p < array_length_u( pages ); ++p ) {
+        destroy_page_buffers( *device, pages[p] );
+        array_free( pages[p].free_vertices );
+        array_free( pages[p].free_indices );
+    }
 
-        //uint32_t offsets[2] = { 0, node_id * sizeof(hmm_mat4) };
-        commands->bind_resource_list( shader_instance.resource_lists, shader_instance.num_resource_lists, 0, 0 );
+    array_free( pages );
+    array_free( allocations );
+    array_free( free_handles );
+}
 
-        for ( uint32_t vb = 0; vb < array_length( sub_mesh.vertex_buffers ); ++vb ) {
-            commands->bind_vertex_buffer( sub_mesh.vertex_buffers[vb], vb, sub_mesh.vertex_buffer_offsets[vb] );
+GeometryHandle GeometryArena::allocate( uint32_t vertex_count, uint32_t index_count ) {
+
+    // Search a page with room for both vertices and indices.
+    uint32_t page_index = k_invalid_range;
+    uint32_t vertex_range = k_invalid_range;
+    uint32_t index_range = k_invalid_range;
+    for ( uint32_t p = 0; p < array_length_u( pages ) && page_index == k_invalid_range; ++p ) {
+        vertex_range = find_free_range( pages[p].free_vertices, vertex_count );
+        index_range = find_free_range( pages[p].free_indices, index_count );
+        if ( vertex_range != k_invalid_range && index_range != k_invalid_range ) {
+            page_index = p;
         }
+    }
 
-        commands->bind_vertex_buffer( transformBuffer, 3, 0 );
-        commands->bind_index_buffer( sub_mesh.index_buffer );
+    if ( page_index == k_invalid_range ) {
+        GeometryPage page = {};
+        page.vertex_capacity = vertex_count > creation.page_vertices ? vertex_count : creation.page_vertices;
+        page.index_capacity = index_count > creation.page_indices ? index_count : creation.page_indices;
+        create_page_buffers( *device, page );
 
-        commands->drawIndexed( hydra::graphics::TopologyType::Triangle, sub_mesh.end_index, 1, sub_mesh.start_index, 0, node_id );
+        if ( page.index_buffer.handle == k_invalid_handle ) {
+            destroy_page_buffers( *device, page );
+            return { k_invalid_handle };
+        }
 
-        commands->end_submit();
+        array_init( page.free_vertices );
+        array_init( page.free_indices );
+        release_range( page.free_vertices, 0, page.vertex_capacity );
+        release_range( page.free_indices, 0, page.index_capacity );
+
+        page_index = array_length_u( pages );
+        array_push( pages, page );
+
+        vertex_range = 0;
+        index_range = 0;
+    }
+
+    GeometryPage& page = pages[page_index];
+
+    GeometryAllocation allocation;
+    allocation.page = page_index;
+    allocation.vertex_count = vertex_count;
+    allocation.index_count = index_count;
+    allocation.first_vertex = vertex_count ? take_free_range( page.free_vertices, vertex_range, vertex_count ) : 0;
+    allocation.first_index = index_count ? take_free_range( page.free_indices, index_range, index_count ) : 0;
+
+    GeometryHandle handle;
+    if ( array_length( free_handles ) ) {
+        handle.handle = array_pop( free_handles );
+        allocations[handle.handle] = allocation;
+    }
+    else {
+        handle.handle = array_length_u( allocations );
+        array_push( allocations, allocation );
+    }
+
+    return handle;
+}
+
+void GeometryArena::release( GeometryHandle handle ) {
+    if ( handle.handle == k_invalid_handle ) {
+        return;
+    }
+
+    GeometryAllocation& allocation = allocations[handle.handle];
+    GeometryPage& page = pages[allocation.page];
+    release_range( page.free_vertices, allocation.first_vertex, allocation.vertex_count );
+    release_range( page.free_indices, allocation.first_index, allocation.index_count );
+
+    allocation.vertex_count = 0;
+    allocation.index_count = 0;
+    array_push( free_handles, handle.handle );
+}
+
+void GeometryArena::upload_vertices( GeometryHandle handle, GeometryStream::Enum stream, const void* vertices, uint32_t vertex_count ) {
+    const GeometryAllocation& allocation = allocations[handle.handle];
+    assert( vertex_count <= allocation.vertex_count && "Upload bigger than the allocation." );
+
+    const uint32_t stride = k_geometry_stream_strides[stream];
+    device->update_buffer( pages[allocation.page].vertex_buffers[stream], allocation.first_vertex * stride, vertex_count * stride, vertices );
+}
+
+void GeometryArena::upload_indices( GeometryHandle handle, const uint16_t* indices, uint32_t index_count ) {
+    const GeometryAllocation& allocation = allocations[handle.handle];
+    assert( index_count <= allocation.index_count && "Upload bigger than the allocation." );
+
+    device->update_buffer( pages[allocation.page].index_buffer, allocation.first_index * k_geometry_index_size, index_count * k_geometry_index_size, indices );
+}
+
+const GeometryAllocation& GeometryArena::get_allocation( GeometryHandle handle ) const {
+    return allocations[handle.handle];
+}
+
+const GeometryPage& GeometryArena::get_page( uint32_t page ) const {
+    return pages[page];
+}
+
+struct GeometryMove {
+    uint32_t                        allocation;
+    uint32_t                        offset;
+}; // struct GeometryMove
+
+static int compare_geometry_moves( const void* a, const void* b ) {
+    const uint32_t offset_a = ( (const GeometryMove*)a )->offset;
+    const uint32_t offset_b = ( (const GeometryMove*)b )->offset;
+    return offset_a < offset_b ? -1 : offset_a > offset_b ? 1 : 0;
+}
+
+//
+// A page is fragmented if its free space is not a single range at the end.
+static bool is_page_fragmented( const GeometryRange* ranges, uint32_t capacity ) {
+    const uint32_t range_count = array_length_u( ranges );
+    return range_count > 1 || ( range_count == 1 && ranges[0].offset + ranges[0].count != capacity );
+}
+
+void GeometryArena::defragment() {
+
+    array( GeometryMove ) moves;
+    array_init( moves );
+
+    for ( uint32_t p = 0; p < array_length_u( pages ); ++p ) {
+        GeometryPage& page = pages[p];
+        if ( !is_page_fragmented( page.free_vertices, page.vertex_capacity ) && !is_page_fragmented( page.free_indices, page.index_capacity ) ) {
+            continue;
+        }
+
+        // Buffer ranges cannot be copied on themselves: allocations are packed into new buffers.
+        GeometryPage packed_page = page;
+        create_page_buffers( *device, packed_page );
+        if ( packed_page.index_buffer.handle == k_invalid_handle ) {
+            destroy_page_buffers( *device, packed_page );
+            continue;
+        }
+
+        // Vertices, in the order of their offsets.
+        array_set_length( moves, 0 );
+        for ( uint32_t a = 0; a < array_length_u( allocations ); ++a ) {
+            if ( allocations[a].page == p && allocations[a].vertex_count ) {
+                GeometryMove move = { a, allocations[a].first_vertex };
+                array_push( moves, move );
+            }
+        }
+        qsort( moves, array_length_u( moves ), sizeof( GeometryMove ), compare_geometry_moves );
+
+        uint32_t packed_vertices = 0;
+        for ( uint32_t m = 0; m < array_length_u( moves ); ++m ) {
+            GeometryAllocation& allocation = allocations[moves[m].allocation];
+            for ( uint32_t s = 0; s < GeometryStream::Count; ++s ) {
+                const uint32_t stride = k_geometry_stream_strides[s];
+                device->copy_buffer( page.vertex_buffers[s], allocation.first_vertex * stride, packed_page.vertex_buffers[s], packed_vertices * stride, allocation.vertex_count * stride );
+            }
+
+            allocation.first_vertex = packed_vertices;
+            packed_vertices += allocation.vertex_count;
+        }
+
+        // Indices are relative to the base vertex: they are copied unchanged.
+        array_set_length( moves, 0 );
+        for ( uint32_t a = 0; a < array_length_u( allocations ); ++a ) {
+            if ( allocations[a].page == p && allocations[a].index_count ) {
+                GeometryMove move = { a, allocations[a].first_index };
+                array_push( moves, move );
+            }
+        }
+        qsort( moves, array_length_u( moves ), sizeof( GeometryMove ), compare_geometry_moves );
+
+        uint32_t packed_indices = 0;
+        for ( uint32_t m = 0; m < array_length_u( moves ); ++m ) {
+            GeometryAllocation& allocation = allocations[moves[m].allocation];
+            device->copy_buffer( page.index_buffer, allocation.first_index * k_geometry_index_size, packed_page.index_buffer, packed_indices * k_geometry_index_size,
+                                 allocation.index_count * k_geometry_index_size );
+
+            allocation.first_index = packed_indices;
+            packed_indices += allocation.index_count;
+        }
+
+        destroy_page_buffers( *device, page );
+
+        array_set_length( packed_page.free_vertices, 0 );
+        array_set_length( packed_page.free_indices, 0 );
+        release_range( packed_page.free_vertices, packed_vertices, page.vertex_capacity - packed_vertices );
+        release_range( packed_page.free_indices, packed_indices, page.index_capacity - packed_indices );
+
+        page = packed_page;
+    }
+
+    array_free( moves );
+}
+
+void GeometryArena::get_statistics( GeometryArenaStatistics& out_statistics ) const {
+    out_statistics = GeometryArenaStatistics();
+    out_statistics.pages = array_length_u( pages );
+    out_statistics.allocations = array_length_u( allocations ) - array_length_u( free_handles );
+
+    for ( uint32_t p = 0; p < array_length_u( pages ); ++p ) {
+        const GeometryPage& page = pages[p];
+        out_statistics.vertex_capacity += page.vertex_capacity;
+        out_statistics.index_capacity += page.index_capacity;
+        out_statistics.free_ranges += array_length_u( page.free_vertices ) + array_length_u( page.free_indices );
+
+        uint32_t free_vertices = 0;
+        for ( uint32_t r = 0; r < array_length_u( page.free_vertices ); ++r ) {
+            const uint32_t count = page.free_vertices[r].count;
+            free_vertices += count;
+            out_statistics.largest_free_vertices = count > out_statistics.largest_free_vertices ? count : out_statistics.largest_free_vertices;
+        }
+
+        uint32_t free_indices = 0;
+        for ( uint32_t r = 0; r < array_length_u( page.free_indices ); ++r ) {
+            const uint32_t count = page.free_indices[r].count;
+            free_indices += count;
+            out_statistics.largest_free_indices = count > out_statistics.largest_free_indices ? count : out_statistics.largest_free_indices;
+        }
+
+        out_statistics.used_vertices += page.vertex_capacity - free_vertices;
+        out_statistics.used_indices += page.index_capacity - free_indices;
+    }
+
+    out_statistics.used_memory = (size_t)out_statistics.used_vertices * k_geometry_vertex_size + (size_t)out_statistics.used_indices * k_geometry_index_size;
+    out_statistics.reserved_memory = (size_t)out_statistics.vertex_capacity * k_geometry_vertex_size + (size_t)out_statistics.index_capacity * k_geometry_index_size;
+}
+
+void GeometryArena::print_report() const {
+    GeometryArenaStatistics statistics;
+    get_statistics( statistics );
+
+    print_format( "Geometry arena: %u allocations in %u pages, %zu of %zu KB used.\n", statistics.allocations, statistics.pages,
+                  statistics.used_memory / 1024, statistics.reserved_memory / 1024 );
+
+    for ( uint32_t p = 0; p < array_length_u( pages ); ++p ) {
+        const GeometryPage& page = pages[p];
+        print_format( "  Page %u: %u vertices, %u indices, free ranges:", p, page.vertex_capacity, page.index_capacity );
+
+        for ( uint32_t r = 0; r < array_length_u( page.free_vertices ); ++r ) {
+            print_format( " v[%u, %u)", page.free_vertices[r].offset, page.free_vertices[r].offset + page.free_vertices[r].count );
+        }
+        for ( uint32_t r = 0; r < array_length_u( page.free_indices ); ++r ) {
+            print_format( " i[%u, %u)", page.free_indices[r].offset, page.free_indices[r].offset + page.free_indices[r].count );
+        }
+        print_format( "\n" );
+    }
+}
+
+// SceneRenderer ////////////////////////////////////////////////////////////////
+
+//
+// Buffers and offsets of the geometry of a scene, shared by all its draws.
+struct SceneGeometry {
+    const GeometryPage*             page;
+    uint32_t                        first_vertex;
+    uint32_t                        first_index;
+
+}; // struct SceneGeometry
+
+static void render_sub_mesh( hydra::graphics::CommandBuffer* commands, const SceneGeometry& geometry, const hydra::graphics::SubMesh& sub_mesh, BufferHandle transform_buffer,
+                             uint32_t first_instance, uint32_t instance_count, uint16_t stage_index ) {
+
+    hydra::graphics::ShaderInstance& shader_instance = sub_mesh.material->shader_instances[0];
+
+    // Group submeshes by pipeline, resource list and material.
+    CommandKey key;
+    key.stage = stage_index;
+    key.pipeline = shader_instance.pipeline.handle;
+    key.resource_list = shader_instance.num_resource_lists ? shader_instance.resource_lists[0].handle : 0;
+    key.material = sub_mesh.material->pool_id;
+
+    commands->begin_submit( key.encode() );
+    commands->bind_pipeline( shader_instance.pipeline );
+
+    //uint32_t offsets[2] = { 0, node_id * sizeof(hmm_mat4) };
+    commands->bind_resource_list( shader_instance.resource_lists, shader_instance.num_resource_lists, 0, 0 );
+
+    // All the draws of the scene bind the same buffers: after the first draw the device state cache skips them.
+    for ( uint32_t s = 0; s < GeometryStream::Count; ++s ) {
+        commands->bind_vertex_buffer( geometry.page->vertex_buffers[s], s, 0 );
+    }
+
+    // Instance transforms are per instance vertex attributes, starting from first instance.
+    commands->bind_vertex_buffer( transform_buffer, GeometryStream::Count, 0 );
+    commands->bind_index_buffer( geometry.page->index_buffer );
+
+    commands->drawIndexed( hydra::graphics::TopologyType::Triangle, sub_mesh.end_index, instance_count, geometry.first_index + sub_mesh.start_index,
+                           (int32_t)( geometry.first_vertex + sub_mesh.base_vertex ), first_instance );
+
+    commands->end_submit();
+}
+
+static void render_mesh( hydra::graphics::CommandBuffer* commands, const SceneGeometry& geometry, const hydra::graphics::Mesh& mesh, uint32_t node_id, BufferHandle transformBuffer, uint16_t stage_index ) {
+    for ( uint32_t i = 0; i < array_length( mesh.sub_meshes ); ++i ) {
+        render_sub_mesh( commands, geometry, mesh.sub_meshes[i], transformBuffer, node_id, 1, stage_index );
     }
 }
 
-static void render_node( hydra::graphics::CommandBuffer* commands, const hydra::graphics::RenderNode& node, BufferHandle transformBuffer ) {
+static void render_node( hydra::graphics::CommandBuffer* commands, const SceneGeometry& geometry, const hydra::graphics::RenderNode& node, BufferHandle transformBuffer, uint16_t stage_index ) {
 
     if ( node.mesh ) {
-        render_mesh( commands, *node.mesh, node.node_id, transformBuffer );
+        render_mesh( commands, geometry, *node.mesh, node.node_id, transformBuffer, stage_index );
     }
 }
 
-static void render_scene_nodes( hydra::graphics::CommandBuffer* commands, const hydra::graphics::RenderScene& scene ) {
+static void render_scene_nodes( hydra::graphics::CommandBuffer* commands, const SceneGeometry& geometry, const hydra::graphics::RenderScene& scene, uint16_t stage_index,
+                                SceneRendererStatistics& statistics ) {
 
     const uint32_t node_count = array_length( scene.nodes );
     for ( uint32_t i = 0; i < node_count; ++i ) {
-        render_node( commands, scene.nodes[i], scene.node_transforms_buffer );
+        const RenderNode& node = scene.nodes[i];
+        render_node( commands, geometry, node, scene.node_transforms_buffer, stage_index );
+
+        const uint32_t sub_meshes = node.mesh ? array_length_u( node.mesh->sub_meshes ) : 0;
+        statistics.draws += sub_meshes;
+        statistics.instances += sub_meshes;
+    }
+}
+
+static void render_scene_batches( hydra::graphics::CommandBuffer* commands, const SceneGeometry& geometry, const hydra::graphics::RenderScene& scene, uint16_t stage_index,
+                                  SceneRendererStatistics& statistics ) {
+
+    const uint32_t batch_count = array_length_u( scene.batches );
+    for ( uint32_t i = 0; i < batch_count; ++i ) {
+        const RenderBatch& batch = scene.batches[i];
+        render_sub_mesh( commands, geometry, *batch.sub_mesh, scene.batch_transforms_buffer, batch.first_instance, batch.instance_count, stage_index );
+
+        statistics.instances += batch.instance_count;
+    }
+
+    statistics.draws += batch_count;
+    statistics.batches += batch_count;
+}
+
+// Draw consecutive visible instances of the same batch with one instanced draw.
+static void render_scene_visible_instances( hydra::graphics::CommandBuffer* commands, const SceneGeometry& geometry, const hydra::graphics::RenderScene& scene,
+                                            const RenderSceneVisibility& visibility, uint16_t stage_index, SceneRendererStatistics& statistics ) {
+
+    const uint32_t visible_count = array_length_u( visibility.visible_instances );
+    uint32_t first = 0;
+    while ( first < visible_count ) {
+        const uint32_t batch_index = scene.instances[visibility.visible_instances[first]].batch_index;
+
+        uint32_t last = first + 1;
+        while ( last < visible_count && scene.instances[visibility.visible_instances[last]].batch_index == batch_index ) {
+            ++last;
+        }
+
+        // Visible transforms are stored in the same order as the visible instances.
+        render_sub_mesh( commands, geometry, *scene.batches[batch_index].sub_mesh, visibility.visible_transforms_buffer, first, last - first, stage_index );
+
+        ++statistics.draws;
+        ++statistics.batches;
+        statistics.instances += last - first;
+
+        first = last;
     }
 }
 
 void SceneRenderer::render( RenderContext& render_context ) {
 
+    SceneRendererStatistics statistics;
+    const RenderView* render_view = render_context.render_view;
+    const uint32_t culled_scenes = render_view ? array_length_u( render_view->scene_visibility ) : 0;
+
     for ( uint32_t i = render_context.start; i < render_context.count; ++i ) {
         RenderScene& scene = render_context.render_scene_array[i];
+        if ( !scene.geometry_arena ) {
+            continue;
+        }
+
+        const GeometryAllocation& allocation = scene.geometry_arena->get_allocation( scene.geometry );
+        const SceneGeometry geometry = { &scene.geometry_arena->get_page( allocation.page ), allocation.first_vertex, allocation.first_index };
+
+        if ( i < culled_scenes && render_view->scene_visibility[i].culled ) {
+            render_scene_visible_instances( render_context.commands, geometry, scene, render_view->scene_visibility[i], render_context.stage_index, statistics );
+        }
+        else if ( array_length( scene.batches ) ) {
+            render_scene_batches( render_context.commands, geometry, scene, render_context.stage_index, statistics );
+        }
+        else {
+            render_scene_nodes( render_context.commands, geometry, scene, render_context.stage_index, statistics );
+        }
+    }
+
+    draws += statistics.draws;
+    batches += statistics.batches;
+    instances += statistics.instances;
+}
+
+void SceneRenderer::reset_statistics() {
+    draws = 0;
+    batches = 0;
+    instances = 0;
+}
+
+void SceneRenderer::get_statistics( SceneRendererStatistics& out_statistics ) const {
+    out_statistics.draws = draws;
+    out_statistics.batches = batches;
+    out_statistics.instances = instances;
+}
+
+// RenderBatch //////////////////////////////////////////////////////////////////
+
+#define HYDRA_COMPARE_FIELD( a, b ) if ( ( a ) != ( b ) ) { return ( a ) < ( b ) ? -1 : 1; }
+
+// Sub meshes can be instanced together if they draw the same geometry with the same material.
+static int compare_sub_mesh_geometry( const SubMesh& a, const SubMesh& b ) {
+
+    HYDRA_COMPARE_FIELD( (uintptr_t)a.material, (uintptr_t)b.material );
+    HYDRA_COMPARE_FIELD( a.start_index, b.start_index );
+    HYDRA_COMPARE_FIELD( a.end_index, b.end_index );
+    HYDRA_COMPARE_FIELD( a.base_vertex, b.base_vertex );
+    return 0;
+}
+
+static int compare_render_instances( const void* a, const void* b ) {
+    const RenderInstance& instance_a = *(const RenderInstance*)a;
+    const RenderInstance& instance_b = *(const RenderInstance*)b;
+
+    const int geometry = compare_sub_mesh_geometry( *instance_a.sub_mesh, *instance_b.sub_mesh );
+    if ( geometry ) {
+        return geometry;
+    }
+
+    // Keep node order inside a batch.
+    HYDRA_COMPARE_FIELD( instance_a.node_id, instance_b.node_id );
+    return 0;
+}
+
+#undef HYDRA_COMPARE_FIELD
+
+void build_render_batches( RenderScene& scene, Device& device ) {
+
+    array_init( scene.batches );
+    array_init( scene.instances );
+
+    const uint32_t node_count = array_length_u( scene.nodes );
+    for ( uint32_t i = 0; i < node_count; ++i ) {
+        const RenderNode& node = scene.nodes[i];
+        if ( !node.mesh ) {
+            continue;
+        }
+
+        for ( uint32_t s = 0; s < array_length_u( node.mesh->sub_meshes ); ++s ) {
+            RenderInstance instance = { &node.mesh->sub_meshes[s], node.node_id, 0 };
+            array_push( scene.instances, instance );
+        }
+    }
+
+    const uint32_t instance_count = array_length_u( scene.instances );
+    if ( instance_count == 0 ) {
+        return;
+    }
+
+    qsort( scene.instances, instance_count, sizeof( RenderInstance ), compare_render_instances );
+
+    // Group equal sub meshes and copy the transforms in batch order.
+    array( mat4s ) batch_transforms;
+    array_init( batch_transforms );
+    array_set_length( batch_transforms, instance_count );
+
+    for ( uint32_t i = 0; i < instance_count; ++i ) {
+        RenderInstance& instance = scene.instances[i];
+        batch_transforms[i] = scene.node_transforms[instance.node_id];
+
+        const uint32_t batch_count = array_length_u( scene.batches );
+        if ( batch_count && compare_sub_mesh_geometry( *scene.batches[batch_count - 1].sub_mesh, *instance.sub_mesh ) == 0 ) {
+            ++scene.batches[batch_count - 1].instance_count;
+        }
+        else {
+            RenderBatch batch = { instance.sub_mesh, i, 1 };
+            array_push( scene.batches, batch );
+        }
+
+        instance.batch_index = array_length_u( scene.batches ) - 1;
+    }
+
+    BufferCreation buffer_creation;
+    buffer_creation.type = BufferType::Vertex;
+    buffer_creation.usage = ResourceUsageType::Immutable;
+    buffer_creation.size = instance_count * sizeof( mat4s );
+    buffer_creation.initial_data = batch_transforms;
+    buffer_creation.name = "Batch_transforms";
+    scene.batch_transforms_buffer = device.create_buffer( buffer_creation );
+
+    array_free( batch_transforms );
+
+    // Bounding boxes as structure of arrays, padded to the SIMD width.
+    const uint32_t padded_count = ( instance_count + 3 ) & ~3u;
+    CullingBoxes& boxes = scene.culling_boxes;
+    array_init( boxes.min_x );
+    array_init( boxes.min_y );
+    array_init( boxes.min_z );
+    array_init( boxes.max_x );
+    array_init( boxes.max_y );
+    array_init( boxes.max_z );
+
+    for ( uint32_t i = 0; i < padded_count; ++i ) {
+        const Box box = i < instance_count ? scene.instances[i].sub_mesh->bounding_box : Box{};
+        array_push( boxes.min_x, box.min.x );
+        array_push( boxes.min_y, box.min.y );
+        array_push( boxes.min_z, box.min.z );
+        array_push( boxes.max_x, box.max.x );
+        array_push( boxes.max_y, box.max.y );
+        array_push( boxes.max_z, box.max.z );
+    }
+}
+
+// Culling //////////////////////////////////////////////////////////////////////
+
+static const uint32_t               k_frustum_planes = 6;
+
+// Planes are combinations of the rows of the view projection matrix (Gribb/Hartmann). Points inside have positive distance.
+static void extract_frustum_planes( const mat4s& view_projection, vec4s* planes ) {
 
-        render_scene_nodes( render_context.commands, scene );
+    for ( uint32_t axis = 0; axis < 3; ++axis ) {
+        for ( uint32_t c = 0; c < 4; ++c ) {
+            const float row_w = view_projection.raw[c][3];
+            const float row_axis = view_projection.raw[c][axis];
+
+            planes[axis * 2].raw[c] = row_w + row_axis;
+            planes[axis * 2 + 1].raw[c] = row_w - row_axis;
+        }
     }
 }
 
+// Test the box corner farthest along each plane normal: if it is behind a plane the box is outside.
+// Writes the indices of the visible boxes and returns their count.
+static uint32_t cull_boxes( const CullingBoxes& boxes, uint32_t count, const vec4s* planes, uint32_t* out_visible ) {
+
+    // Per plane, choose the min or max arrays depending on the sign of the normal.
+    const float* corner_x[k_frustum_planes];
+    const float* corner_y[k_frustum_planes];
+    const float* corner_z[k_frustum_planes];
+
+    for ( uint32_t p = 0; p < k_frustum_planes; ++p ) {
+        corner_x[p] = planes[p].x > 0.0f ? boxes.max_x : boxes.min_x;
+        corner_y[p] = planes[p].y > 0.0f ? boxes.max_y : boxes.min_y;
+        corner_z[p] = planes[p].z > 0.0f ? boxes.max_z : boxes.min_z;
+    }
+
+    uint32_t visible = 0;
+
+#if defined(HYDRA_CULLING_SSE)
+    __m128 plane_x[k_frustum_planes], plane_y[k_frustum_planes], plane_z[k_frustum_planes], plane_w[k_frustum_planes];
+    for ( uint32_t p = 0; p < k_frustum_planes; ++p ) {
+        plane_x[p] = _mm_set1_ps( planes[p].x );
+        plane_y[p] = _mm_set1_ps( planes[p].y );
+        plane_z[p] = _mm_set1_ps( planes[p].z );
+        plane_w[p] = _mm_set1_ps( planes[p].w );
+    }
+
+    const __m128 zero = _mm_setzero_ps();
+
+    // Boxes are padded to 4: test 4 at a time and ignore the padding lanes.
+    for ( uint32_t i = 0; i < count; i += 4 ) {
+        __m128 outside = zero;
+
+        for ( uint32_t p = 0; p < k_frustum_planes; ++p ) {
+            const __m128 x = _mm_mul_ps( _mm_loadu_ps( corner_x[p] + i ), plane_x[p] );
+            const __m128 y = _mm_mul_ps( _mm_loadu_ps( corner_y[p] + i ), plane_y[p] );
+            const __m128 z = _mm_mul_ps( _mm_loadu_ps( corner_z[p] + i ), plane_z[p] );
+            const __m128 distance = _mm_add_ps( _mm_add_ps( x, y ), _mm_add_ps( z, plane_w[p] ) );
+
+            outside = _mm_or_ps( outside, _mm_cmplt_ps( distance, zero ) );
+        }
+
+        const int outside_mask = _mm_movemask_ps( outside );
+        const uint32_t lanes = count - i < 4 ? count - i : 4;
+        for ( uint32_t lane = 0; lane < lanes; ++lane ) {
+            if ( ( outside_mask & ( 1 << lane ) ) == 0 ) {
+                out_visible[visible++] = i + lane;
+            }
+        }
+    }
+#else
+    for ( uint32_t i = 0; i < count; ++i ) {
+        bool outside = false;
+
+        for ( uint32_t p = 0; p < k_frustum_planes; ++p ) {
+            const float distance = corner_x[p][i] * planes[p].x + corner_y[p][i] * planes[p].y + corner_z[p][i] * planes[p].z + planes[p].w;
+            outside |= distance < 0.0f;
+        }
+
+        if ( !outside ) {
+            out_visible[visible++] = i;
+        }
+    }
+#endif // HYDRA_CULLING_SSE
+
+    return visible;
+}
+
+void cull_render_view( RenderView& view, Device& device ) {
+
+    vec4s planes[k_frustum_planes];
+    extract_frustum_planes( view.camera.view_projection, planes );
+
+    CullingStatistics statistics;
+
+    const uint32_t scene_count = array_length_u( view.visible_render_scenes );
+    while ( array_length_u( view.scene_visibility ) < scene_count ) {
+        RenderSceneVisibility visibility = { nullptr, { k_invalid_handle }, 0, false };
+        array_push( view.scene_visibility, visibility );
+    }
+
+    for ( uint32_t i = 0; i < scene_count; ++i ) {
+        const RenderScene& scene = view.visible_render_scenes[i];
+        RenderSceneVisibility& visibility = view.scene_visibility[i];
+
+        const uint32_t instance_count = array_length_u( scene.instances );
+        array_set_length( visibility.visible_instances, instance_count );
+        visibility.culled = false;
+
+        if ( instance_count == 0 ) {
+            continue;
+        }
+
+        // Every instance can be visible: the buffer holds the transforms of all of them, allocated each frame from the dynamic buffer.
+        const uint32_t transforms_size = instance_count * (uint32_t)sizeof( mat4s );
+        if ( transforms_size > device.dynamic_per_frame_size ) {
+            array_set_length( visibility.visible_instances, 0 );
+            continue;
+        }
+
+        if ( instance_count > visibility.visible_transforms_capacity ) {
+            if ( visibility.visible_transforms_buffer.handle != k_invalid_handle ) {
+                device.destroy_buffer( visibility.visible_transforms_buffer );
+            }
+
+            BufferCreation buffer_creation;
+            buffer_creation.type = BufferType::Vertex;
+            buffer_creation.usage = ResourceUsageType::Stream;
+            buffer_creation.size = transforms_size;
+            buffer_creation.name = "Visible_transforms";
+            visibility.visible_transforms_buffer = device.create_buffer( buffer_creation );
+            visibility.visible_transforms_capacity = visibility.visible_transforms_buffer.handle != k_invalid_handle ? instance_count : 0;
+        }
+
+        if ( visibility.visible_transforms_buffer.handle == k_invalid_handle ) {
+            array_set_length( visibility.visible_instances, 0 );
+            continue;
+        }
+
+        const uint32_t visible_count = cull_boxes( scene.culling_boxes, instance_count, planes, visibility.visible_instances );
+        array_set_length( visibility.visible_instances, visible_count );
+
+        if ( visible_count ) {
+            // Copy the transforms of the visible instances, so that each run of a batch is contiguous.
+            // Without them the buffer would still point at the memory of another frame: the scene is drawn without culling.
+            MapBufferParameters map_parameters = { visibility.visible_transforms_buffer, 0, visible_count * (uint32_t)sizeof( mat4s ) };
+            mat4s* transforms = (mat4s*)device.map_buffer( map_parameters );
+            if ( !transforms ) {
+                array_set_length( visibility.visible_instances, 0 );
+                continue;
+            }
+
+            for ( uint32_t v = 0; v < visible_count; ++v ) {
+                transforms[v] = scene.node_transforms[scene.instances[visibility.visible_instances[v]].node_id];
+            }
+
+            device.unmap_buffer( map_parameters );
+        }
+
+        visibility.culled = true;
+
+        statistics.tested += instance_count;
+        statistics.culled += instance_count - visible_count;
+        statistics.visible += visible_count;
+    }
+
+    view.culling_statistics = statistics;
+}
 
 //
 // 64 Distinct Colors. Used for graphs and anything that needs random colors.
@@ -641,14 +1477,8 @@ static LinVertex2D s_line_buffer_2d[k_max_lines];
 
 void LineRenderer::init( ShaderResourcesDatabase& db, Device& device ) {
 
-    // Buffer of 3D points (3d position + color)
-    BufferCreation vb_creation = { BufferType::Vertex, ResourceUsageType::Dynamic, sizeof(LinVertex) * k_max_lines, nullptr, "VB_Lines" };
-    lines_vb = device.create_buffer( vb_creation );
-    // Buffer of 2D points
-    BufferCreation vb_creation_2d = { BufferType::Vertex, ResourceUsageType::Dynamic, sizeof(LinVertex2D) * k_max_lines, nullptr, "VB_Lines_2d" };
-    lines_vb_2d = device.create_buffer( vb_creation_2d );
-
-    BufferCreation cb_creation = { BufferType::Constant, ResourceUsageType::Dynamic, sizeof(LocalConstants), nullptr, "CB_Lines" };
+    // Line vertices are written in the device dynamic buffer each frame.
+    BufferCreation cb_creation = { BufferType::Constant, ResourceUsageType::Stream, sizeof(LocalConstants), nullptr, "CB_Lines" };
     lines_cb = device.create_buffer( cb_creation );
 
     db.register_buffer( (char*)cb_creation.name, lines_cb );
@@ -734,57 +1564,63 @@ void LineRenderer::render( RenderContext& render_context ) {
         device.unmap_buffer( cb_map );
     }
 
-    if ( current_line_index ) {
-        const uint32_t mapping_size = sizeof( LinVertex ) * current_line_index;
-        MapBufferParameters map_parameters_vb = { lines_vb, 0, mapping_size };
-        LinVertex* vtx_dst = (LinVertex*)device.map_buffer( map_parameters_vb );
-        
-        if ( vtx_dst ) {
-            memcpy( vtx_dst, &s_line_buffer[0], mapping_size );
-            
-            device.unmap_buffer( map_parameters_vb );
-        }
+    const uint32_t mapping_size = sizeof( LinVertex ) * current_line_index;
+    uint32_t vb_offset = 0;
+    LinVertex* vtx_dst = current_line_index ? (LinVertex*)device.dynamic_allocate( mapping_size, vb_offset ) : nullptr;
+    if ( vtx_dst ) {
+        memcpy( vtx_dst, &s_line_buffer[0], mapping_size );
 
         CommandBuffer* commands = render_context.commands;
-        commands->begin_submit( 2 );
 
         ShaderInstance& shader_instance = line_material->shader_instances[3];
+
+        // Lines are drawn on top of the opaque geometry of the stage.
+        CommandKey key;
+        key.stage = render_context.stage_index;
+        key.translucent = 1;
+        key.pipeline = shader_instance.pipeline.handle;
+        key.material = line_material->pool_id;
+
+        commands->begin_submit( key.encode() );
         commands->bind_pipeline( shader_instance.pipeline );
         commands->bind_resource_list( shader_instance.resource_lists, shader_instance.num_resource_lists, nullptr, 0 );
-        commands->bind_vertex_buffer( lines_vb, 0, 0 );
+        commands->bind_vertex_buffer( device.get_dynamic_buffer(), 0, vb_offset );
         // Draw using instancing and 6 vertices.
         const uint32_t num_vertices = 6;
         commands->draw( TopologyType::Triangle, 0, num_vertices, current_line_index / 2 );
         commands->end_submit();
-
-        current_line_index = 0;
     }
 
-    if ( current_line_index_2d ) {
-        const uint32_t mapping_size = sizeof( LinVertex2D ) * current_line_index_2d;
-        MapBufferParameters map_parameters_vb = { lines_vb, 0, mapping_size };
-        LinVertex* vtx_dst = (LinVertex*)device.map_buffer( map_parameters_vb );
+    current_line_index = 0;
 
-        if ( vtx_dst ) {
-            memcpy( vtx_dst, &s_line_buffer_2d[0], mapping_size );
-
-            device.unmap_buffer( map_parameters_vb );
-        }
+    const uint32_t mapping_size_2d = sizeof( LinVertex2D ) * current_line_index_2d;
+    uint32_t vb_offset_2d = 0;
+    LinVertex2D* vtx_dst_2d = current_line_index_2d ? (LinVertex2D*)device.dynamic_allocate( mapping_size_2d, vb_offset_2d ) : nullptr;
+    if ( vtx_dst_2d ) {
+        memcpy( vtx_dst_2d, &s_line_buffer_2d[0], mapping_size_2d );
 
         CommandBuffer* commands = render_context.commands;
-        commands->begin_submit( 2 );
 
         ShaderInstance& shader_instance = line_material->shader_instances[4];
+
+        // Lines are drawn on top of the opaque geometry of the stage.
+        CommandKey key;
+        key.stage = render_context.stage_index;
+        key.translucent = 1;
+        key.pipeline = shader_instance.pipeline.handle;
+        key.material = line_material->pool_id;
+
+        commands->begin_submit( key.encode() );
         commands->bind_pipeline( shader_instance.pipeline );
         commands->bind_resource_list( shader_instance.resource_lists, shader_instance.num_resource_lists, nullptr, 0 );
-        commands->bind_vertex_buffer( lines_vb, 0, 0 );
+        commands->bind_vertex_buffer( device.get_dynamic_buffer(), 0, vb_offset_2d );
         // Draw using instancing and 6 vertices.
         const uint32_t num_vertices = 6;
         commands->draw( TopologyType::Triangle, 0, num_vertices, current_line_index_2d / 2 );
         commands->end_submit();
-
-        current_line_index_2d = 0;
     }
+
+    current_line_index_2d = 0;
 }
 
 // LightingManager //////////////////////////////////////////////////////////////
@@ -792,7 +1628,7 @@ void LineRenderer::render( RenderContext& render_context ) {
 struct LightingConstants {
 
     vec3s                           directional_light;
-    uint32_t                        use_point_light;
+    float                           pad0;
 
     vec3s                           camera_position;
     float                           pad1;
@@ -808,7 +1644,7 @@ struct LightingConstants {
 
 void LightingManager::init( ShaderResourcesDatabase& db, Device& device ) {
 
-    BufferCreation cb_creation = { BufferType::Constant, ResourceUsageType::Dynamic, sizeof(LightingConstants), nullptr, "lighting_constants" };
+    BufferCreation cb_creation = { BufferType::Constant, ResourceUsageType::Stream, sizeof(LightingConstants), nullptr, "lighting_constants" };
     lighting_cb = device.create_buffer( cb_creation );
 
     db.register_buffer( (char*)cb_creation.name, lighting_cb );
@@ -838,7 +1674,6 @@ void LightingManager::render( RenderContext& render_context ) {
     if ( cb_data ) {
 
         cb_data->directional_light = glms_normalize( directional_light );
-        cb_data->use_point_light = use_point_light;
 
         const Camera& camera = render_context.render_view->camera;
 
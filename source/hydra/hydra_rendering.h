@@ -1,7 +1,7 @@
 #pragma once
 
 //
-//  Hydra Rendering - v0.12
+//  Hydra Rendering - v0.20
 //
 //  High level rendering implementation based on Hydra Graphics library.
 //
@@ -12,6 +12,14 @@
 //
 // Revision history //////////////////////
 //
+//      0.20 (2020/03/23): + Added geometry arena: vertices and indices of all the scenes are suballocated from a few large buffers, with defragmentation.
+//      0.19 (2020/03/23): + Material local constants are set by property and uploaded by dirty range.
+//      0.18 (2020/03/22): + Render stages select the shader variant of the material pass with an option key. Point light is a shader option.
+//      0.17 (2020/03/15): + Per frame constants, line vertices and visible transforms use the device dynamic buffer.
+//      0.16 (2020/03/14): + Added frustum culling of render batch instances per render view.
+//      0.15 (2020/03/13): + Added render batches: nodes sharing a sub mesh and material are drawn instanced.
+//      0.14 (2020/03/11): + Render stages record their commands in parallel, each in its own command buffer.
+//      0.13 (2020/03/07): + Submits use CommandKey with the stage index in the pipeline.
 //      0.12 (2020/02/05): + Added Ray class. + Added Color Uint class. + Added Ray/Box intersection.
 //      0.11 (2020/02/04): + Moved all math to CGLM using structs. Removed HandmadeMath.
 //      0.10 (2020/02/02): + Fixed lighting + Fixed translation component in view matrix
@@ -29,6 +37,8 @@
 #include "hydra_lib.h"
 #include "hydra_graphics.h"
 
+#include <atomic>
+
 #include "cglm/types-struct.h"
 
 
@@ -136,9 +146,11 @@ struct ShaderEffectPass {
     PipelineCreation                pipeline_creation;
     char                            name[32];
 
-    PipelineHandle                  pipeline_handle;
+    PipelineHandle                  pipeline_handle;                // Default variant.
     uint32_t                        pool_id;
 
+    array(PipelineHandle)           variant_pipelines               = nullptr;  // One per variant, the first is pipeline_handle.
+
 }; // struct ShaderEffectPass
 
 //
@@ -158,12 +170,17 @@ struct ShaderEffect {
 
     void                            init( const hfx::ShaderEffectFile& shader_effect_file );
 
+    // Pipeline of the pass variant with the options of the key enabled. Unreachable combinations use the default pipeline.
+    PipelineHandle                  get_pipeline( uint32_t pass_index, uint32_t option_key ) const;
+    uint32_t                        get_option_mask( uint32_t pass_index, const char* option_name ) const;     // 0 if the pass has not the option.
+
     array(ShaderEffectPass)         passes;
 
     uint16_t                        num_passes                      = 0;
     uint16_t                        num_properties                  = 0;
     uint32_t                        local_constants_size            = 0;
 
+    char*                           memory                          = nullptr;  // Effect file, read in place.
     char*                           local_constants_default_data    = nullptr;
     char*                           properties_data                 = nullptr;
 
@@ -230,6 +247,11 @@ struct Material {
 
     void                            load_resources( ShaderResourcesDatabase& db, Device& device );
 
+    // Local constants are changed in local_constants_data and only the changed range is uploaded.
+    bool                            set_property( const char* property_name, const float* values, uint32_t num_values );  // False if the effect has no number property with the name.
+    void                            set_constants_dirty( uint32_t offset, uint32_t size );
+    void                            upload_constants( Device& device );         // Uploads the dirty range, if any, and clears it.
+
     // Runtime part
     ShaderInstance*                 shader_instances                    = nullptr;
     uint32_t                        num_instances                       = 0;
@@ -240,6 +262,8 @@ struct Material {
 
     BufferHandle                    local_constants_buffer;
     char*                           local_constants_data                = nullptr;
+    uint32_t                        dirty_constants_start               = 0;
+    uint32_t                        dirty_constants_end                 = 0;    // Nothing to upload when equal to the start.
 
     const char*                     name                                = nullptr;
     StringBuffer                    loaded_string_buffer;               // TODO: replace with global string repository!
@@ -302,6 +326,8 @@ struct RenderStage {
     uint8_t                         pad                                 : 4;
 
     uint8_t                         pass_index                          = 0;
+    uint16_t                        stage_index                         = 0;    // Position in the render pipeline, used to sort submits.
+    uint32_t                        option_key                          = 0;    // Options enabled in the material pass, to select the shader variant.
 
     Type                            type                                = Count;
     uint32_t                        pool_id                             = 0xffffffff;
@@ -315,7 +341,7 @@ struct RenderStage {
     virtual void                    terminate();
 
     virtual void                    begin( Device& device, CommandBuffer* commands );
-    virtual void                    render( Device& device, CommandBuffer* commands );
+    virtual void                    render( Device& device, CommandBuffer* commands );  // Called from worker threads: only record commands, no mapping or other GPU calls.
     virtual void                    end( Device& device, CommandBuffer* commands );
 
     virtual void                    load_resources( ShaderResourcesDatabase& db, Device& device );
@@ -344,7 +370,7 @@ struct RenderPipeline {
     void                            terminate( Device& device );
 
     void                            update();
-    void                            render( Device& device, CommandBuffer* commands );
+    void                            render( Device& device, CommandBuffer* commands );  // Begin and end go in commands, each stage render in its own queued command buffer.
 
     void                            load_resources( Device& device );
     void                            resize( uint16_t width, uint16_t height, Device& device );
@@ -421,18 +447,129 @@ struct Ray {
 bool                                ray_box_intersection( const hydra::graphics::Box& box, const hydra::graphics::Ray& ray, float &t );
 
 //
-// Mesh/models/scene ////////////////////////////////////////////////////////////
+// Geometry arena ///////////////////////////////////////////////////////////////
 
 //
+// Vertex streams of the arena. Each stream has its own buffer, so that one base vertex addresses all of them.
+struct GeometryStream {
+
+    enum Enum {
+        Position = 0, Normal, Texcoord, Count
+    }; // enum Enum
+
+}; // struct GeometryStream
+
 //
-struct SubMesh {
-    uint32_t                        start_index;
-    uint32_t                        end_index;
+// Vertices and indices allocated from a page of the arena. Offsets and counts are in vertices and 16 bits indices.
+struct GeometryAllocation {
+    uint32_t                        page;
+    uint32_t                        first_vertex;
+    uint32_t                        vertex_count;
+    uint32_t                        first_index;
+    uint32_t                        index_count;
+
+}; // struct GeometryAllocation
 
-    array( BufferHandle )           vertex_buffers;
-    array( uint32_t )               vertex_buffer_offsets;
+//
+// Stays valid when defragmentation moves the allocation.
+struct GeometryHandle {
+    uint32_t                        handle;
+
+}; // struct GeometryHandle
+
+//
+//
+struct GeometryRange {
+    uint32_t                        offset;
+    uint32_t                        count;
+
+}; // struct GeometryRange
+
+//
+// Buffers suballocated by the arena. Free ranges are sorted by offset, and merged with their neighbours when allocations are freed.
+struct GeometryPage {
+    BufferHandle                    vertex_buffers[GeometryStream::Count];
     BufferHandle                    index_buffer;
 
+    uint32_t                        vertex_capacity;
+    uint32_t                        index_capacity;
+
+    array( GeometryRange )          free_vertices;
+    array( GeometryRange )          free_indices;
+
+}; // struct GeometryPage
+
+//
+//
+struct GeometryArenaCreation {
+    uint32_t                        page_vertices       = 256 * 1024;       // 8 MB of vertices. Bigger allocations get a page of their size.
+    uint32_t                        page_indices        = 1024 * 1024;      // 2 MB of indices.
+
+}; // struct GeometryArenaCreation
+
+//
+//
+struct GeometryArenaStatistics {
+    uint32_t                        pages               = 0;
+    uint32_t                        allocations         = 0;
+    uint32_t                        free_ranges         = 0;                // More free ranges than pages means fragmentation.
+
+    uint32_t                        used_vertices       = 0;
+    uint32_t                        vertex_capacity     = 0;
+    uint32_t                        largest_free_vertices = 0;
+    uint32_t                        used_indices        = 0;
+    uint32_t                        index_capacity      = 0;
+    uint32_t                        largest_free_indices = 0;
+
+    size_t                          used_memory         = 0;                // Bytes.
+    size_t                          reserved_memory     = 0;
+
+}; // struct GeometryArenaStatistics
+
+//
+// Vertices and indices of the scenes, suballocated from a few large buffers.
+// All the draws of an arena page bind the same buffers and address their geometry with a first index and a base vertex.
+struct GeometryArena {
+
+    void                            init( Device& device, const GeometryArenaCreation& creation );
+    void                            terminate();
+
+    GeometryHandle                  allocate( uint32_t vertex_count, uint32_t index_count );   // Invalid handle if the page buffers cannot be created.
+    void                            release( GeometryHandle handle );
+
+    // Write from the start of the allocation.
+    void                            upload_vertices( GeometryHandle handle, GeometryStream::Enum stream, const void* vertices, uint32_t vertex_count );
+    void                            upload_indices( GeometryHandle handle, const uint16_t* indices, uint32_t index_count );
+
+    const GeometryAllocation&       get_allocation( GeometryHandle handle ) const;
+    const GeometryPage&             get_page( uint32_t page ) const;
+
+    // Pack the allocations of fragmented pages at their start, copying them into new buffers.
+    // Call it before recording the commands of a frame: recorded commands use the previous buffers.
+    void                            defragment();
+
+    void                            get_statistics( GeometryArenaStatistics& out_statistics ) const;
+    void                            print_report() const;
+
+    Device*                         device              = nullptr;
+    GeometryArenaCreation           creation;
+
+    array( GeometryPage )           pages               = nullptr;
+    array( GeometryAllocation )     allocations         = nullptr;          // Indexed by handle.
+    array( uint32_t )               free_handles        = nullptr;
+
+}; // struct GeometryArena
+
+//
+// Mesh/models/scene ////////////////////////////////////////////////////////////
+
+//
+// Offsets are relative to the geometry allocation of the scene.
+struct SubMesh {
+    uint32_t                        start_index;
+    uint32_t                        end_index;                              // Index count.
+    uint32_t                        base_vertex;
+
     Box                             bounding_box;
 
     Material*                       material;
@@ -458,6 +595,41 @@ struct RenderNode {
 
 }; // struct RenderNode
 
+//
+// Instances of the same sub mesh (same buffers, index range and material) drawn with one instanced draw.
+// Instance transforms of all batches are stored contiguously in the scene batch transforms buffer.
+struct RenderBatch {
+
+    const SubMesh*                  sub_mesh;           // Sub mesh of the first instance, used for buffers and material.
+    uint32_t                        first_instance;
+    uint32_t                        instance_count;
+
+}; // struct RenderBatch
+
+//
+// A sub mesh drawn by a node. Stored in batch order.
+struct RenderInstance {
+
+    const SubMesh*                  sub_mesh;
+    uint32_t                        node_id;
+    uint32_t                        batch_index;
+
+}; // struct RenderInstance
+
+//
+// World space bounding boxes of the instances, as structure of arrays for SIMD culling.
+// Arrays are padded to a multiple of 4 elements.
+struct CullingBoxes {
+
+    array( float )                  min_x;
+    array( float )                  min_y;
+    array( float )                  min_z;
+    array( float )                  max_x;
+    array( float )                  max_y;
+    array( float )                  max_z;
+
+}; // struct CullingBoxes
+
 //
 //
 struct RenderScene {
@@ -465,14 +637,22 @@ struct RenderScene {
     RenderManager*                  render_manager;
     RenderStageMask                 stage_mask;         // Used to bind the scene to one or more stages.
     BufferHandle                    node_transforms_buffer; // Shared buffers
+    BufferHandle                    batch_transforms_buffer;
+
+    GeometryArena*                  geometry_arena;     // Vertices and indices of all the sub meshes, in one allocation.
+    GeometryHandle                  geometry;
 
     array( RenderNode )             nodes;
-    array( BufferHandle )           buffers;            // All vertex and index buffers are here. Accessors will reference handles coming from here.
 
     array( mat4s )                  node_transforms;
+    array( RenderBatch )            batches;            // Optional. If present, used instead of the nodes to render.
+    array( RenderInstance )         instances;          // Instances of all batches, needed for culling.
+    CullingBoxes                    culling_boxes;
 
 }; // struct RenderScene
 
+void                                build_render_batches( RenderScene& scene, Device& device );    // To be called when all nodes are loaded.
+
 // 
 // Camera/Views
 
@@ -505,6 +685,28 @@ struct Camera {
 
 }; // struct Camera
 
+//
+// Instances of a render scene that passed the culling of a render view.
+// Visible instances are in batch order, and their transforms are copied in the same order in the visible transforms buffer.
+struct RenderSceneVisibility {
+
+    array( uint32_t )               visible_instances;
+    BufferHandle                    visible_transforms_buffer;
+    uint32_t                        visible_transforms_capacity;    // In transforms. The buffer is recreated when the scene has more instances.
+    bool                            culled;                         // False when the transforms could not be written: the scene is drawn without culling.
+
+}; // struct RenderSceneVisibility
+
+//
+//
+struct CullingStatistics {
+
+    uint32_t                        tested              = 0;
+    uint32_t                        culled              = 0;
+    uint32_t                        visible             = 0;
+
+}; // struct CullingStatistics
+
 //
 // Render view is a 'contextualized' camera - a way of using the camera in the render pipeline.
 //
@@ -513,8 +715,15 @@ struct RenderView {
     Camera                          camera;
     array( RenderScene )            visible_render_scenes;
 
+    array( RenderSceneVisibility )  scene_visibility;       // One per visible render scene, filled by cull_render_view.
+    CullingStatistics               culling_statistics;
+
 }; // struct RenderView
 
+// Test the instances of all visible render scenes against the camera frustum. Scenes without render batches are not culled.
+// Uploads the visible transforms, so it must be called on the main thread, before rendering the pipeline.
+void                                cull_render_view( RenderView& view, Device& device );
+
 //
 // Renderers
 
@@ -544,14 +753,32 @@ struct RenderManager {
 }; // struct RenderManager
 
 //
+//
+//
+struct SceneRendererStatistics {
+
+    uint32_t                        draws               = 0;
+    uint32_t                        batches             = 0;        // Draws coming from render batches.
+    uint32_t                        instances           = 0;
+
+}; // struct SceneRendererStatistics
+
 //
 //
 struct SceneRenderer : public RenderManager {
 
     void                            render( RenderContext& render_context ) override;
 
+    void                            reset_statistics();
+    void                            get_statistics( SceneRendererStatistics& out_statistics ) const;
+
     Material*                       material;
 
+    // Stages can render in parallel.
+    std::atomic<uint32_t>           draws               { 0 };
+    std::atomic<uint32_t>           batches             { 0 };
+    std::atomic<uint32_t>           instances           { 0 };
+
 }; // struct SceneRenderer
 
 //
@@ -568,8 +795,6 @@ struct LineRenderer : public RenderManager {
 
     void                            render( RenderContext& render_context ) override;
 
-    BufferHandle                    lines_vb;
-    BufferHandle                    lines_vb_2d;
     BufferHandle                    lines_cb;
     Material*                       line_material;
 
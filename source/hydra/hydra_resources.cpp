@@ -1,15 +1,36 @@
 //
-//  Hydra Resources - v0.01
+//  Hydra Resources - v0.09
 //
 
+// Scenes are cooked from glTF. Images are compiled as textures, so the loader never decodes them.
+#define TINYGLTF_IMPLEMENTATION
+#define TINYGLTF_NO_STB_IMAGE
+#define TINYGLTF_NO_STB_IMAGE_WRITE
+#define TINYGLTF_NO_EXTERNAL_IMAGE
+#define TINYGLTF_NOEXCEPTION
+#define TINYGLTF_USE_RAPIDJSON
+// Included first: the standard headers it uses conflict with the array macro of hydra.
+#include "tiny_gltf.h"
+
 #include "hydra/hydra_resources.h"
 
 #include "ShaderCodeGenerator.h"
 #include <stb_image.h>
 
+#if defined(_M_X64) || defined(__SSE2__)
+    #define HYDRA_SSE2
+    #include <emmintrin.h>
+#endif // _M_X64 || __SSE2__
+
 #include "rapidjson/document.h"
 #include "rapidjson/prettywriter.h"
 
+#include "cglm/struct/vec3.h"
+#include "cglm/struct/mat4.h"
+#include "cglm/struct/affine.h"
+#include "cglm/struct/quat.h"
+#include "cglm/struct/box.h"
+
 
 namespace hydra {
 
@@ -36,10 +57,12 @@ void ResourceManager::init() {
     static TextureFactory texture_factory;
     static ShaderFactory shader_factory;
     static MaterialFactory material_factory;
+    static SceneFactory scene_factory;
 
     resource_factories[ResourceType::Texture] = &texture_factory;
     resource_factories[ResourceType::ShaderEffect] = &shader_factory;
     resource_factories[ResourceType::Material] = &material_factory;
+    resource_factories[ResourceType::Scene] = &scene_factory;
 
     for ( size_t i = 0; i < ResourceType::Count; ++i ) {
         resource_factories[i]->init();
@@ -51,14 +74,38 @@ void ResourceManager::init() {
 
     resource_binary_folder.append( "..\\data\\bin\\" );
     resource_source_folder.append( "..\\data\\source\\" );
+
+    compile_statistics.hits = 0;
+    compile_statistics.misses = 0;
+
+    array_init( completed_jobs );
+    array_init( processed_jobs );
+    array_init( waiting_jobs );
+    array_init( failed_resources );
+    num_pending_loads = 0;
 }
 
 void ResourceManager::terminate( hydra::graphics::Device& gfx_device ) {
 
+    // Finish asynchronous loads: afterwards all the resources in the map are loaded.
+    while ( num_pending_loads ) {
+        hydra::task_wait_submitted();
+        update( gfx_device );
+    }
+
     for ( size_t i = 0; i < string_hash_length( name_to_resources ); ++i ) {
         unload_resource( &name_to_resources[i].value, gfx_device );
     }
 
+    for ( size_t i = 0; i < array_length( failed_resources ); ++i ) {
+        hydra::hy_free( failed_resources[i] );
+    }
+
+    array_free( completed_jobs );
+    array_free( processed_jobs );
+    array_free( waiting_jobs );
+    array_free( failed_resources );
+
     for ( size_t i = 0; i < ResourceType::Count; ++i ) {
         resource_factories[i]->terminate();
     }
@@ -79,6 +126,10 @@ static const char* guid_to_filename( const char* path, ResourceType::Enum type,
         case ResourceType::Material:
             return temp_string_buffer.append_use( "%s.mbhr", name );
             break;
+
+        case ResourceType::Scene:
+            return temp_string_buffer.append_use( "%s.sbhr", name );
+            break;
     }
 
     return path;
@@ -89,15 +140,65 @@ static const char* guid_to_filename( ResourceID& reference, StringBuffer& temp_s
 }
 
 static const size_t                 k_resource_random_seed = 0x7bba666dea69a46;
+static const uint32_t               k_max_resource_references = 64;     // Scenes reference all their materials.
+static const char                   k_resource_header_magic[7] = "HRES04";  // Change the version when any compiled format changes.
+
+static_assert( sizeof( ResourceHeader ) % hfx::ShaderEffectFile::k_alignment == 0 && sizeof( ResourceID ) % hfx::ShaderEffectFile::k_alignment == 0, "Data of compiled resources must stay aligned to be read in place." );
+static_assert( sizeof( TextureFileHeader ) % hfx::ShaderEffectFile::k_alignment == 0, "Texture levels must stay aligned to be uploaded in place." );
+
+//
+// Copy a mapped resource to the heap, so that its compiled file can be written again.
+static void detach_resource_memory( Resource* resource ) {
+    if ( !resource->mapped_file.memory ) {
+        return;
+    }
+
+    char* memory = (char*)hydra::hy_malloc( resource->mapped_file.size );
+    memcpy( memory, resource->mapped_file.memory, resource->mapped_file.size );
+
+    const ptrdiff_t delta = memory - resource->mapped_file.memory;
+    resource->header = (ResourceHeader*)memory;
+    resource->data += delta;
+    resource->external_references = (ResourceID*)( (char*)resource->external_references + delta );
+
+    hydra::unmap_file( resource->mapped_file );
+}
+
+//
+// Header, references and data are consecutive in the compiled file.
+static void bind_resource_memory( Resource* resource, char* memory ) {
+    resource->header = (ResourceHeader*)memory;
+    resource->external_references = (ResourceID*)( memory + sizeof( ResourceHeader ) );
+    resource->data = memory + sizeof( ResourceHeader ) + ( ( resource->header->num_external_references + resource->header->num_internal_references ) * sizeof( ResourceID ) );
+}
+
+//
+// Map the compiled file: the resource data is read in place.
+static bool map_resource_file( Resource* resource, ResourceType::Enum type, const char* filename, const char* binary_folder, StringBuffer& temp_string_buffer ) {
+    const char* resource_full_filename = temp_string_buffer.append_use( "%s%s", binary_folder, guid_to_filename( filename, type, temp_string_buffer ) );
+    if ( !hydra::map_file( resource_full_filename, resource->mapped_file ) ) {
+        hydra::print_format( "Missing resource file %s\n", resource_full_filename );
+        return false;
+    }
+
+    bind_resource_memory( resource, resource->mapped_file.memory );
+    return true;
+}
+
+static void release_resource_memory( Resource* resource ) {
+    if ( resource->mapped_file.memory ) {
+        hydra::unmap_file( resource->mapped_file );
+    }
+    else {
+        hydra::hy_free( resource->header );
+    }
+}
 
 void ResourceManager::init_resource( Resource** resource, char* memory, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) {
 
-    (*resource)->header = (ResourceHeader*)memory;
-    (*resource)->data = memory + sizeof( ResourceHeader ) + ( ( (*resource)->header->num_external_references + (*resource)->header->num_internal_references ) * sizeof( ResourceID ) );
+    bind_resource_memory( *resource, memory );
     string_hash_init_arena( (*resource)->name_to_external_resources );
 
-    (*resource)->external_references = (ResourceID*)( memory + sizeof( ResourceHeader ) );
-
     ResourceID* external_references = (*resource)->external_references;
     for ( size_t i = 0; i < (*resource)->header->num_external_references; ++i ) {
         Resource* external_resource = load_resource( ( ResourceType::Enum )external_references->type, external_references->path, gfx_device, render_pipeline );
@@ -112,91 +213,123 @@ Resource* ResourceManager::compile_resource( ResourceType::Enum type, const char
     // Reset temporary string buffer
     temporary_string_buffer.clear();
 
-    // Try to open the source file
-    // TODO: optimize - don't need to read all the file here. It can be done only if the file will be compiled.
-    size_t file_size;
-    const char* source_full_filename = temporary_string_buffer.append_use( "%s%s", resource_source_folder.data, filename );
-    char* source_file_memory = hydra::read_file_into_memory( source_full_filename, &file_size );
-    if ( !source_file_memory ) {
-        hydra::print_format( "Missing source file %s - requested by %s\n", source_full_filename, filename );
+    bool compiled = false;
+    if ( !compile_resource_file( type, filename, temporary_string_buffer, compiled ) ) {
         return nullptr;
     }
 
-    // TODO: fix hash working.
-    size_t source_file_hash = 0;
-
-    //// Search the hash file. If not found, create it.
-    //// Hash file is used to avoid recompiling the binary resource.
-    //const char* hash_full_filename = temporary_string_buffer.append_use( "..\\data\\%s.hash", filename );
-    //char* hash_memory = hydra::read_file_into_memory( hash_full_filename, nullptr );
-    //if ( !hash_memory ) {
+    if ( compiled ) {
+        ++compile_statistics.misses;
+    }
+    else {
+        ++compile_statistics.hits;
+    }
 
-    //    // Generate hash
-    //    set_rand_seed( k_resource_random_seed );
-    //    source_file_hash = hash_bytes( source_file_memory, file_size, k_resource_random_seed );
+    Resource* resource = (Resource*)hydra::hy_malloc( sizeof( Resource ) );
+    memset( resource, 0, sizeof( Resource ) );
+    resource->state = ResourceState::Loaded;
 
-    //    // Write hash to file
-    //    FILE* hash_file = nullptr;
-    //    fopen_s( &hash_file, hash_full_filename, "wb" );
-    //    if ( hash_file ) {
-    //        fwrite( &source_file_hash, sizeof( size_t ), 1, hash_file );
-    //        fclose( hash_file );
-    //    }
-    //}
-    //else {
-    //    // Read hash from file
-    //    FILE* hash_file = nullptr;
-    //    fopen_s( &hash_file, hash_full_filename, "rb" );
-    //    if ( hash_file ) {
-    //        fread( &source_file_hash, sizeof( size_t ), 1, hash_file );
-    //        fclose( hash_file );
-    //    }
-    //}
+    // Reset temporary string buffer
+    temporary_string_buffer.clear();
 
-    Resource* resource = (Resource*)hydra::hy_malloc( sizeof( Resource ) );
+    return resource;
+}
 
-    bool compile_resource = false;
-    // Try to open the binary resource.
-    // If not present or the saved source hash is different than compile it.
-    const char* compiled_resource_filename = temporary_string_buffer.append_use( "%s%s", resource_binary_folder.data, guid_to_filename( filename, type, temporary_string_buffer ) );
+bool ResourceManager::compile_resource_file( ResourceType::Enum type, const char* filename, StringBuffer& temp_string_buffer, bool& out_compiled ) {
 
-    //FILE* compiled_file = nullptr;
-    //fopen_s( &compiled_file, compiled_resource_filename, "rb" );
+    // Read the source file: its content is hashed to know if the binary resource is up to date.
+    size_t file_size;
+    const char* source_full_filename = temp_string_buffer.append_use( "%s%s", resource_source_folder.data, filename );
+    char* source_file_memory = hydra::read_file_into_memory( source_full_filename, &file_size );
+    if ( !source_file_memory ) {
+        hydra::print_format( "Missing source file %s - requested by %s\n", source_full_filename, filename );
+        return false;
+    }
 
-    //if ( compiled_file ) {
-    //    // Read the hash
-    //    fread( &resource_header, sizeof( ResourceHeader ), 1, compiled_file );
-    //    fclose( compiled_file );
-    //    compile_resource = resource_header.source_hash != source_file_hash;
-    //}
-    //else {
-    //    compile_resource = true;
-    //}
+    // Compile only if the binary resource is missing or was compiled from a different source or dependencies.
+    const char* compiled_resource_filename = temp_string_buffer.append_use( "%s%s", resource_binary_folder.data, guid_to_filename( filename, type, temp_string_buffer ) );
+    size_t source_file_hash = hash_source( source_file_memory, file_size );
+    const size_t options_hash = resource_factories[type]->get_compile_options_hash();
+    if ( options_hash ) {
+        source_file_hash = hash_bytes( (void*)&options_hash, sizeof( size_t ), source_file_hash );
+    }
 
-    // Compile resource
-    //if ( compile_resource ) 
-    {
+    out_compiled = !is_compiled_resource_valid( compiled_resource_filename, type, source_file_hash, temp_string_buffer );
+    if ( out_compiled ) {
         // Init resource header    
         ResourceHeader resource_header;
+        memcpy( resource_header.header, k_resource_header_magic, sizeof( resource_header.header ) );
         strcpy( resource_header.id.path, filename );
         resource_header.id.type = type;
         resource_header.num_external_references = 0;
         resource_header.num_internal_references = 0;
         resource_header.data_size = file_size;
+        // Factories adding internal references update the hash with hash_dependencies.
         resource_header.source_hash = source_file_hash;
 
-        ResourceID references[32];
-        ResourceFactory::CompileContext compile_context = { source_file_memory, compiled_resource_filename, temporary_string_buffer, references, &resource_header, this };
+        ResourceID references[k_max_resource_references];
+        ResourceFactory::CompileContext compile_context = { source_file_memory, compiled_resource_filename, temp_string_buffer, references, &resource_header, this };
 
         resource_factories[type]->compile_resource( compile_context );
     }
 
     hydra::hy_free( source_file_memory );
 
-    // Reset temporary string buffer
-    temporary_string_buffer.clear();
+    return true;
+}
 
-    return resource;
+size_t ResourceManager::hash_source( const char* source_memory, size_t source_size ) const {
+    return hash_bytes( (void*)source_memory, source_size, k_resource_random_seed );
+}
+
+size_t ResourceManager::hash_dependencies( size_t source_hash, const ResourceID* dependencies, uint32_t num_dependencies, StringBuffer& temp_string_buffer ) const {
+
+    size_t hash = source_hash;
+    for ( uint32_t i = 0; i < num_dependencies; ++i ) {
+        size_t dependency_size;
+        const char* dependency_full_filename = temp_string_buffer.append_use( "%s%s", resource_source_folder.data, dependencies[i].path );
+        char* dependency_memory = hydra::read_file_into_memory( dependency_full_filename, &dependency_size );
+        if ( !dependency_memory ) {
+            return 0;
+        }
+
+        // Chain the hashes: order of the dependencies matters as well.
+        hash = hash_bytes( dependency_memory, dependency_size, hash );
+        hydra::hy_free( dependency_memory );
+    }
+
+    return hash;
+}
+
+bool ResourceManager::is_compiled_resource_valid( const char* compiled_filename, ResourceType::Enum type, size_t source_hash, StringBuffer& temp_string_buffer ) const {
+
+    FILE* compiled_file = nullptr;
+    fopen_s( &compiled_file, compiled_filename, "rb" );
+    if ( !compiled_file ) {
+        return false;
+    }
+
+    // Only header and references are read, the data is needed only when loading.
+    ResourceHeader resource_header;
+    ResourceID dependencies[k_max_resource_references];
+    uint32_t num_dependencies = 0;
+
+    bool valid = fread( &resource_header, sizeof( ResourceHeader ), 1, compiled_file ) == 1 && resource_header.id.type == type &&
+                 memcmp( resource_header.header, k_resource_header_magic, sizeof( resource_header.header ) ) == 0;
+    if ( valid && resource_header.num_internal_references ) {
+        num_dependencies = resource_header.num_internal_references;
+        valid = resource_header.num_external_references + num_dependencies <= k_max_resource_references &&
+                fseek( compiled_file, sizeof( ResourceID ) * resource_header.num_external_references, SEEK_CUR ) == 0 &&
+                fread( dependencies, sizeof( ResourceID ), num_dependencies, compiled_file ) == num_dependencies;
+    }
+    fclose( compiled_file );
+
+    if ( !valid ) {
+        return false;
+    }
+
+    const size_t hash = hash_dependencies( source_hash, dependencies, num_dependencies, temp_string_buffer );
+    return hash != 0 && hash == resource_header.source_hash;
 }
 
 Resource* ResourceManager::load_resource( ResourceType::Enum type, const char* filename, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) {
@@ -207,20 +340,24 @@ Resource* ResourceManager::load_resource( ResourceType::Enum type, const char* f
     Resource* resource = string_hash_get( name_to_resources, filename );
 
     if ( resource ) {
-        return resource;
+        // Loading asynchronously: finish it now.
+        if ( resource->state != ResourceState::Loaded ) {
+            wait_resource( resource, gfx_device );
+        }
+        return resource->state == ResourceState::Loaded ? resource : nullptr;
     }
 
     resource = compile_resource( type, filename );
+    if ( !resource ) {
+        return nullptr;
+    }
 
-    // Try to load file. If not present, compile.
-    const char* resource_full_filename = temporary_string_buffer.append_use( "%s%s", resource_binary_folder.data, guid_to_filename(filename, type, temporary_string_buffer ) );
-    char* file_memory = hydra::read_file_into_memory( resource_full_filename, nullptr );
-    if ( !file_memory ) {
-        hydra::print_format( "Missing resource file %s\n", resource_full_filename );
+    if ( !map_resource_file( resource, type, filename, resource_binary_folder.data, temporary_string_buffer ) ) {
+        hydra::hy_free( resource );
         return nullptr;
     }
 
-    init_resource( &resource, file_memory, gfx_device, render_pipeline );
+    init_resource( &resource, resource->mapped_file.memory, gfx_device, render_pipeline );
 
     ResourceFactory::LoadContext load_context = { resource, gfx_device, render_pipeline };
     resource->asset = resource_factories[type]->load( load_context );
@@ -242,31 +379,55 @@ void ResourceManager::reload_resource( Resource* resource, hydra::graphics::Devi
     ResourceID* external_references = resource->external_references;
     for ( size_t i = 0; i < resource->header->num_external_references; ++i ) {
         Resource* external_resource = string_hash_get( name_to_resources, external_references->path );
-        if ( external_resource ) {
+        if ( external_resource && external_resource->state == ResourceState::Loaded ) {
             reload_resource( external_resource, gfx_device, render_pipeline );
         }
         
         external_references++;
     }
 
+    // The compiled file can be written again only when not mapped.
+    // Until the factory reload, assets still point to the old mapping and must not be used.
+    detach_resource_memory( resource );
+
     ResourceType::Enum type = (ResourceType::Enum)resource->header->id.type;
     const char* filename = resource->header->id.path;
 
-
     Resource* new_resource = compile_resource( type, filename );
 
-    // Try to load file. If not present, compile.
+    // Map the new compiled file. If not present, reload the asset from the detached memory.
     const char* resource_full_filename = temporary_string_buffer.append_use( "%s%s", resource_binary_folder.data, guid_to_filename( filename, type, temporary_string_buffer ) );
-    char* file_memory = hydra::read_file_into_memory( resource_full_filename, nullptr );
-    if ( !file_memory ) {
+    if ( !new_resource || !hydra::map_file( resource_full_filename, new_resource->mapped_file ) ) {
         hydra::print_format( "Missing resource file %s\n", resource_full_filename );
+        hydra::hy_free( new_resource );
+
+        resource_factories[type]->reload( resource, resource, temporary_string_buffer, gfx_device, render_pipeline );
         return;
     }
 
-    init_resource( &new_resource, file_memory, gfx_device, render_pipeline );
+    init_resource( &new_resource, new_resource->mapped_file.memory, gfx_device, render_pipeline );
+
+    // Reload resource. If the asset cannot use the new file, it still points to the old mapping: reload it from the detached memory.
+    if ( !resource_factories[type]->reload( resource, new_resource, temporary_string_buffer, gfx_device, render_pipeline ) ) {
+        string_hash_free( new_resource->name_to_external_resources );
+        release_resource_memory( new_resource );
+        hydra::hy_free( new_resource );
+
+        resource_factories[type]->reload( resource, resource, temporary_string_buffer, gfx_device, render_pipeline );
+        return;
+    }
+
+    // The resource now uses the new mapped file.
+    release_resource_memory( resource );
+    string_hash_free( resource->name_to_external_resources );
+
+    resource->header = new_resource->header;
+    resource->data = new_resource->data;
+    resource->external_references = new_resource->external_references;
+    resource->name_to_external_resources = new_resource->name_to_external_resources;
+    resource->mapped_file = new_resource->mapped_file;
 
-    // Reload resource
-    resource_factories[resource->header->id.type]->reload( resource, new_resource, temporary_string_buffer, gfx_device, render_pipeline );
+    hydra::hy_free( new_resource );
 
     // Reset temporary string buffer
     temporary_string_buffer.clear();
@@ -277,8 +438,8 @@ void ResourceManager::reload_resources( ResourceType::Enum type, hydra::graphics
     for ( size_t i = 0; i < string_hash_length( name_to_resources ); i++ ) {
 
         ResourceManager::ResourceMap& map_entry = name_to_resources[i];
-        // Reload resources by type
-        if ( map_entry.value->header->id.type == type ) {
+        // Reload resources by type. Resources still loading use the new files anyway.
+        if ( map_entry.value->state == ResourceState::Loaded && map_entry.value->header->id.type == type ) {
             reload_resource( map_entry.value, gfx_device, render_pipeline );
         }
     }
@@ -291,15 +452,202 @@ void ResourceManager::unload_resource( Resource** resource, hydra::graphics::Dev
 
     resource_factories[(*resource)->header->id.type]->unload((*resource)->asset, gfx_device );
 
-    hydra::hy_free( (*resource)->header );
+    string_hash_free( (*resource)->name_to_external_resources );
+    release_resource_memory( *resource );
     hydra::hy_free( *resource );
 }
 
+// Asynchronous loading /////////////////////////////////////////////////////////
+
+static const uint32_t               k_load_job_string_buffer_size = 1024 * 16;
+
+//
+// One asynchronous load, from the request to the creation of the asset.
+struct ResourceLoadJob {
+
+    ResourceManager*                manager;
+    Resource*                       resource;
+    hydra::graphics::RenderPipeline* render_pipeline;
+
+    Resource*                       dependencies[k_max_resource_references];    // Resources of the external references, once requested.
+
+    ResourceType::Enum              type;
+    char                            filename[sizeof( ResourceID::path )];
+
+    bool                            compiled;
+    bool                            success;
+
+}; // struct ResourceLoadJob
+
+//
+// Worker thread: compile if needed, map the compiled file and let the factory decode it. The device is not used.
+static void load_resource_task( void* user_data, uint32_t index, uint32_t thread_index ) {
+
+    ResourceLoadJob* job = (ResourceLoadJob*)user_data;
+    ResourceManager& manager = *job->manager;
+
+    StringBuffer temp_string_buffer;
+    temp_string_buffer.init( k_load_job_string_buffer_size );
+
+    job->success = manager.compile_resource_file( job->type, job->filename, temp_string_buffer, job->compiled ) &&
+                   map_resource_file( job->resource, job->type, job->filename, manager.get_resource_binary_folder(), temp_string_buffer );
+    if ( job->success && job->resource->header->num_external_references > k_max_resource_references ) {
+        hydra::print_format( "Too many references in resource %s\n", job->filename );
+        release_resource_memory( job->resource );
+        job->success = false;
+    }
+
+    if ( job->success ) {
+        manager.resource_factories[job->type]->decode( job->resource );
+    }
+
+    temp_string_buffer.terminate();
+
+    std::lock_guard<std::mutex> lock( manager.completed_jobs_mutex );
+    array_push( manager.completed_jobs, job );
+}
+
+Resource* ResourceManager::load_resource_async( ResourceType::Enum type, const char* filename, hydra::graphics::RenderPipeline* render_pipeline ) {
+
+    Resource* resource = string_hash_get( name_to_resources, filename );
+    if ( resource ) {
+        return resource;
+    }
+
+    if ( strlen( filename ) >= sizeof( ResourceID::path ) ) {
+        hydra::print_format( "Resource name %s is too long.\n", filename );
+        return nullptr;
+    }
+
+    resource = (Resource*)hydra::hy_malloc( sizeof( Resource ) );
+    memset( resource, 0, sizeof( Resource ) );
+    resource->state = ResourceState::Compiling;
+
+    // In the map right away: other requests of the same resource share the job.
+    string_hash_put( name_to_resources, filename, resource );
+
+    ResourceLoadJob* job = (ResourceLoadJob*)hydra::hy_malloc( sizeof( ResourceLoadJob ) );
+    memset( job, 0, sizeof( ResourceLoadJob ) );
+    job->manager = this;
+    job->resource = resource;
+    job->render_pipeline = render_pipeline;
+    job->type = type;
+    strcpy( job->filename, filename );
+
+    ++num_pending_loads;
+    hydra::task_submit( load_resource_task, job );
+
+    return resource;
+}
+
+//
+// Failed resources leave the map: loading them again tries again. Resources depending on them see a missing reference.
+static void fail_resource_load( ResourceManager& manager, ResourceLoadJob* job ) {
+    job->resource->state = ResourceState::Failed;
+    string_hash_delete( manager.name_to_resources, job->filename );
+    array_push( manager.failed_resources, job->resource );
+
+    --manager.num_pending_loads;
+    hydra::hy_free( job );
+}
+
+void ResourceManager::update( hydra::graphics::Device& gfx_device ) {
+
+    // Loop until nothing changes: a resource can complete the dependencies of others.
+    bool progress = true;
+    while ( progress ) {
+        progress = false;
+
+        // Move completed jobs out of the lock, requesting dependencies can complete other jobs on this thread.
+        {
+            std::lock_guard<std::mutex> lock( completed_jobs_mutex );
+            for ( uint32_t i = 0; i < array_length_u( completed_jobs ); ++i ) {
+                array_push( processed_jobs, completed_jobs[i] );
+            }
+            array_set_length( completed_jobs, 0 );
+        }
+
+        for ( uint32_t i = 0; i < array_length_u( processed_jobs ); ++i ) {
+            ResourceLoadJob* job = processed_jobs[i];
+            progress = true;
+
+            if ( !job->success ) {
+                fail_resource_load( *this, job );
+                continue;
+            }
+
+            if ( job->compiled ) {
+                ++compile_statistics.misses;
+            }
+            else {
+                ++compile_statistics.hits;
+            }
+
+            Resource* resource = job->resource;
+            for ( uint16_t r = 0; r < resource->header->num_external_references; ++r ) {
+                const ResourceID& reference = resource->external_references[r];
+                job->dependencies[r] = load_resource_async( (ResourceType::Enum)reference.type, reference.path, job->render_pipeline );
+            }
+
+            resource->state = ResourceState::WaitingDependencies;
+            array_push( waiting_jobs, job );
+        }
+        array_set_length( processed_jobs, 0 );
+
+        // Upload queue: create the assets of the resources with all dependencies loaded or failed.
+        for ( uint32_t i = 0; i < array_length_u( waiting_jobs ); ) {
+            ResourceLoadJob* job = waiting_jobs[i];
+            Resource* resource = job->resource;
+
+            bool dependencies_ready = true;
+            for ( uint16_t r = 0; r < resource->header->num_external_references && dependencies_ready; ++r ) {
+                const Resource* dependency = job->dependencies[r];
+                dependencies_ready = !dependency || dependency->state == ResourceState::Loaded || dependency->state == ResourceState::Failed;
+            }
+
+            if ( !dependencies_ready ) {
+                ++i;
+                continue;
+            }
+
+            // As for synchronous loads, missing references are null.
+            string_hash_init_arena( resource->name_to_external_resources );
+            for ( uint16_t r = 0; r < resource->header->num_external_references; ++r ) {
+                Resource* dependency = job->dependencies[r];
+                string_hash_put( resource->name_to_external_resources, resource->external_references[r].path, dependency && dependency->state == ResourceState::Loaded ? dependency : nullptr );
+            }
+
+            ResourceFactory::LoadContext load_context = { resource, gfx_device, job->render_pipeline };
+            resource->asset = resource_factories[job->type]->load( load_context );
+            resource->state = ResourceState::Loaded;
+
+            array_delete_swap( waiting_jobs, i );
+            --num_pending_loads;
+            hydra::hy_free( job );
+            progress = true;
+        }
+    }
+}
+
+void ResourceManager::wait_resource( Resource* resource, hydra::graphics::Device& gfx_device ) {
+
+    while ( resource->state != ResourceState::Loaded && resource->state != ResourceState::Failed ) {
+        hydra::task_wait_submitted();
+        update( gfx_device );
+    }
+}
+
 // Resource Factories ///////////////////////////////////////////////////////////
 
 // TextureFactory ///////////////////////////////////////////////////////////////
+//#define HYDRA_RESOURCES_TEST
+
 void TextureFactory::init() {
-    textures_pool.init( 4096, sizeof( hydra::graphics::Texture ) );
+    textures_pool.init( 256, sizeof( hydra::graphics::Texture ) );     // Pool grows in pages of 256 textures.
+
+#if defined (HYDRA_RESOURCES_TEST)
+    hydra::test_texture_compression();
+#endif // HYDRA_RESOURCES_TEST
 }
 
 void TextureFactory::terminate() {
@@ -307,26 +655,304 @@ void TextureFactory::terminate() {
 }
 
 
+//
+// Mip levels are filtered in bands of rows, in parallel.
+static const uint32_t               k_mip_rows_per_task = 32;
+
+//
+// Filter of a mip level from the previous one. Pixels are RGBA8.
+struct MipLevelTask {
+
+    const uint8_t*                  source;
+    uint8_t*                        destination;
+
+    uint32_t                        source_width;
+    uint32_t                        source_height;
+    uint32_t                        width;
+    uint32_t                        height;
+
+}; // struct MipLevelTask
+
+//
+// 2x2 box filter. Odd sizes drop the last source row or column, a size of 1 is repeated.
+static void filter_mip_rows( const MipLevelTask& task, uint32_t first_row, uint32_t last_row ) {
+
+    const uint32_t source_pitch = task.source_width * 4;
+
+    for ( uint32_t y = first_row; y < last_row; ++y ) {
+        const uint8_t* row0 = task.source + ( y * 2 ) * source_pitch;
+        const uint8_t* row1 = task.source_height > 1 ? row0 + source_pitch : row0;
+        uint8_t* destination = task.destination + y * task.width * 4;
+
+        uint32_t x = 0;
+#if defined(HYDRA_SSE2)
+        // 2 destination pixels per iteration, from 4 source pixels on each row.
+        if ( task.source_width > 1 ) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i rounding = _mm_set1_epi16( 2 );
+
+            for ( ; x + 2 <= task.width; x += 2 ) {
+                const __m128i top = _mm_loadu_si128( (const __m128i*)( row0 + x * 8 ) );
+                const __m128i bottom = _mm_loadu_si128( (const __m128i*)( row1 + x * 8 ) );
+                // Vertical sums with 16 bit channels: pixels 0,1 in the low sum and 2,3 in the high sum.
+                const __m128i sum_low = _mm_add_epi16( _mm_unpacklo_epi8( top, zero ), _mm_unpacklo_epi8( bottom, zero ) );
+                const __m128i sum_high = _mm_add_epi16( _mm_unpackhi_epi8( top, zero ), _mm_unpackhi_epi8( bottom, zero ) );
+                // Horizontal sums: pixels 0+1 and 2+3.
+                const __m128i sum = _mm_add_epi16( _mm_unpacklo_epi64( sum_low, sum_high ), _mm_unpackhi_epi64( sum_low, sum_high ) );
+                const __m128i average = _mm_srli_epi16( _mm_add_epi16( sum, rounding ), 2 );
+                _mm_storel_epi64( (__m128i*)( destination + x * 4 ), _mm_packus_epi16( average, average ) );
+            }
+        }
+#endif // HYDRA_SSE2
+
+        for ( ; x < task.width; ++x ) {
+            const uint32_t x0 = x * 8;
+            const uint32_t x1 = task.source_width > 1 ? x0 + 4 : x0;
+            for ( uint32_t c = 0; c < 4; ++c ) {
+                destination[x * 4 + c] = (uint8_t)( ( row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2 ) >> 2 );
+            }
+        }
+    }
+}
+
+static void mip_level_task( void* user_data, uint32_t index, uint32_t thread_index ) {
+    const MipLevelTask& task = *(const MipLevelTask*)user_data;
+
+    const uint32_t first_row = index * k_mip_rows_per_task;
+    const uint32_t last_row = first_row + k_mip_rows_per_task < task.height ? first_row + k_mip_rows_per_task : task.height;
+    filter_mip_rows( task, first_row, last_row );
+}
+
+//
+// Usage of a texture, from its file name as most tools export them. It chooses the compressed format.
+struct TextureUsage {
+
+    enum Enum {
+
+        Color = 0,                                              // Albedo, emissive: BC1, BC3 with transparency, BC7 in high quality.
+        Normal,                                                 // Tangent space normals: BC5, the shader rebuilds z.
+        Mask,                                                   // Roughness, metalness, occlusion: BC1, BC7 in high quality.
+
+        Count
+    }; // enum Enum
+}; // struct TextureUsage
+
+static const hydra::graphics::TextureFormat::Enum s_block_texture_formats[hydra::TextureBlockFormat::Count] = {
+    hydra::graphics::TextureFormat::BC1_UNORM, hydra::graphics::TextureFormat::BC3_UNORM, hydra::graphics::TextureFormat::BC4_UNORM,
+    hydra::graphics::TextureFormat::BC5_UNORM, hydra::graphics::TextureFormat::BC7_UNORM
+};
+
+static const size_t                 k_texture_options_seed = 0x2c5a6d1b8e3f4907;
+static const uint32_t               k_max_texture_mipmaps = 16;                 // Sizes are 16 bits.
+static const uint32_t               k_block_rows_per_task = 8;
+
+static TextureUsage::Enum get_texture_usage( const char* filename ) {
+
+    // Only the name of the file, lowercase.
+    const char* name = strrchr( filename, '/' ) ? strrchr( filename, '/' ) + 1 : filename;
+    name = strrchr( name, '\\' ) ? strrchr( name, '\\' ) + 1 : name;
+
+    char lowercase_name[256];
+    uint32_t length = 0;
+    for ( ; name[length] && length < ArrayLength( lowercase_name ) - 1; ++length ) {
+        lowercase_name[length] = (char)tolower( name[length] );
+    }
+    lowercase_name[length] = 0;
+
+    if ( strstr( lowercase_name, "normal" ) ) {
+        return TextureUsage::Normal;
+    }
+
+    static const char* s_mask_names[] = { "rough", "metal", "occlusion", "_ao", "mask" };
+    for ( uint32_t i = 0; i < ArrayLength( s_mask_names ); ++i ) {
+        if ( strstr( lowercase_name, s_mask_names[i] ) ) {
+            return TextureUsage::Mask;
+        }
+    }
+
+    return TextureUsage::Color;
+}
+
+static hydra::TextureBlockFormat::Enum get_texture_block_format( TextureUsage::Enum usage, bool transparent, hydra::TextureCompressionQuality::Enum quality ) {
+    const bool high_quality = quality == hydra::TextureCompressionQuality::High;
+
+    switch ( usage ) {
+        case TextureUsage::Normal:
+            return hydra::TextureBlockFormat::BC5;
+
+        case TextureUsage::Mask:
+            return high_quality ? hydra::TextureBlockFormat::BC7 : hydra::TextureBlockFormat::BC1;
+
+        default:
+            return high_quality ? hydra::TextureBlockFormat::BC7 : ( transparent ? hydra::TextureBlockFormat::BC3 : hydra::TextureBlockFormat::BC1 );
+    }
+}
+
+static bool has_transparency( const uint8_t* pixels, uint32_t num_pixels ) {
+    for ( uint32_t i = 0; i < num_pixels; ++i ) {
+        if ( pixels[i * 4 + 3] != 255 ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//
+// Compression of all the levels of a texture: each task compresses a band of block rows of a level.
+struct CompressLevelsTask {
+
+    const uint8_t*                  level_pixels[k_max_texture_mipmaps];
+    uint8_t*                        level_output[k_max_texture_mipmaps];
+    uint32_t                        level_width[k_max_texture_mipmaps];
+    uint32_t                        level_height[k_max_texture_mipmaps];
+    uint32_t                        first_band[k_max_texture_mipmaps + 1];  // Index of the first band of each level.
+    uint32_t                        num_levels;
+
+    hydra::TextureBlockFormat::Enum format;
+    hydra::TextureCompressionQuality::Enum quality;
+
+}; // struct CompressLevelsTask
+
+static void compress_levels_task( void* user_data, uint32_t index, uint32_t thread_index ) {
+    const CompressLevelsTask& task = *(const CompressLevelsTask*)user_data;
+
+    uint32_t level = 0;
+    while ( index >= task.first_band[level + 1] ) {
+        ++level;
+    }
+
+    const uint32_t block_rows = hydra::texture_block_rows( task.level_height[level] );
+    const uint32_t first_block_row = ( index - task.first_band[level] ) * k_block_rows_per_task;
+    const uint32_t last_block_row = first_block_row + k_block_rows_per_task < block_rows ? first_block_row + k_block_rows_per_task : block_rows;
+    hydra::texture_compress_block_rows( task.format, task.quality, task.level_pixels[level], task.level_width[level], task.level_height[level], first_block_row, last_block_row, task.level_output[level] );
+}
+
+//
+// Textures are decoded once and written with all their mip levels, so that loading is only an upload.
 void TextureFactory::compile_resource( CompileContext& context ) {
 
+    int width, height, channels_in_file;
+    stbi_uc* pixels = stbi_load_from_memory( (const stbi_uc*)context.source_file_memory, (int)context.out_header->data_size, &width, &height, &channels_in_file, 4 );
+    if ( !pixels || width > UINT16_MAX || height > UINT16_MAX ) {
+        hydra::print_format( "Error compiling texture %s: %s\n", context.out_header->id.path, pixels ? "size too big" : stbi_failure_reason() );
+        stbi_image_free( pixels );
+        // Remove a previously compiled version, the texture is then missing.
+        remove( context.compiled_filename );
+        return;
+    }
+
+    TextureFileHeader texture_header;
+    memset( &texture_header, 0, sizeof( TextureFileHeader ) );
+    texture_header.width = (uint16_t)width;
+    texture_header.height = (uint16_t)height;
+    texture_header.format = hydra::graphics::TextureFormat::R8G8B8A8_UNORM;
+
+    // Full chain down to 1x1. Level 0 is the decoded image, the following levels are allocated together.
+    size_t mips_size = 0;
+    uint32_t level_width = width, level_height = height;
+    for ( texture_header.mipmaps = 1; level_width > 1 || level_height > 1; ++texture_header.mipmaps ) {
+        level_width = level_width > 1 ? level_width / 2 : 1;
+        level_height = level_height > 1 ? level_height / 2 : 1;
+        mips_size += level_width * level_height * 4;
+    }
+
+    uint8_t* mips = mips_size ? (uint8_t*)hydra::hy_malloc( mips_size ) : nullptr;
+
+    // Each level depends on the previous one: levels are filtered in order, rows of a level in parallel.
+    // Asynchronous loads compile on a worker, where parallel fors run serially: the other workers load other resources.
+    MipLevelTask task = { pixels, mips, (uint32_t)width, (uint32_t)height, (uint32_t)width, (uint32_t)height };
+    for ( uint32_t level = 1; level < texture_header.mipmaps; ++level ) {
+        task.width = task.source_width > 1 ? task.source_width / 2 : 1;
+        task.height = task.source_height > 1 ? task.source_height / 2 : 1;
+
+        hydra::parallel_for( ( task.height + k_mip_rows_per_task - 1 ) / k_mip_rows_per_task, mip_level_task, &task );
+
+        task.source = task.destination;
+        task.source_width = task.width;
+        task.source_height = task.height;
+        task.destination += task.width * task.height * 4;
+    }
+
+    const size_t level_0_size = width * height * 4;
+    uint8_t* compressed_levels = nullptr;
+    size_t compressed_size = 0;
+
+    if ( compress ) {
+        // Block compress all the levels at once, in bands of block rows of any level.
+        CompressLevelsTask compress_task;
+        compress_task.num_levels = texture_header.mipmaps;
+        compress_task.quality = compression_quality;
+        compress_task.first_band[0] = 0;
+
+        const uint8_t* level_pixels = pixels;
+        level_width = width;
+        level_height = height;
+        for ( uint32_t level = 0; level < compress_task.num_levels; ++level ) {
+            compress_task.level_pixels[level] = level_pixels;
+            compress_task.level_width[level] = level_width;
+            compress_task.level_height[level] = level_height;
+            compress_task.first_band[level + 1] = compress_task.first_band[level] + ( hydra::texture_block_rows( level_height ) + k_block_rows_per_task - 1 ) / k_block_rows_per_task;
+
+            level_pixels = ( level == 0 ? mips : level_pixels + level_width * level_height * 4 );
+            level_width = level_width > 1 ? level_width / 2 : 1;
+            level_height = level_height > 1 ? level_height / 2 : 1;
+        }
+
+        compress_task.format = get_texture_block_format( get_texture_usage( context.out_header->id.path ), has_transparency( pixels, width * height ), compression_quality );
+        texture_header.format = s_block_texture_formats[compress_task.format];
+
+        for ( uint32_t level = 0; level < compress_task.num_levels; ++level ) {
+            compressed_size += hydra::texture_compressed_size( compress_task.format, compress_task.level_width[level], compress_task.level_height[level] );
+        }
+
+        compressed_levels = (uint8_t*)hydra::hy_malloc( compressed_size );
+        uint8_t* level_output = compressed_levels;
+        for ( uint32_t level = 0; level < compress_task.num_levels; ++level ) {
+            compress_task.level_output[level] = level_output;
+            level_output += hydra::texture_compressed_size( compress_task.format, compress_task.level_width[level], compress_task.level_height[level] );
+        }
+
+        hydra::parallel_for( compress_task.first_band[compress_task.num_levels], compress_levels_task, &compress_task );
+    }
+
+    context.out_header->data_size = sizeof( TextureFileHeader ) + ( compressed_levels ? compressed_size : level_0_size + mips_size );
+
     // Open binary file
     FILE* output_file = nullptr;
     fopen_s( &output_file, context.compiled_filename, "wb" );
     // Write Header
     fwrite( context.out_header, sizeof( ResourceHeader ), 1, output_file );
     // Write Data
-    fwrite( context.source_file_memory, context.out_header->data_size, 1, output_file );
+    fwrite( &texture_header, sizeof( TextureFileHeader ), 1, output_file );
+    if ( compressed_levels ) {
+        fwrite( compressed_levels, compressed_size, 1, output_file );
+    }
+    else {
+        fwrite( pixels, level_0_size, 1, output_file );
+        if ( mips ) {
+            fwrite( mips, mips_size, 1, output_file );
+        }
+    }
     fclose( output_file );
+
+    stbi_image_free( pixels );
+    hydra::hy_free( mips );
+    hydra::hy_free( compressed_levels );
+}
+
+size_t TextureFactory::get_compile_options_hash() const {
+    const uint32_t options[2] = { compress ? 1u : 0u, (uint32_t)compression_quality };
+    return hash_bytes( (void*)options, sizeof( options ), k_texture_options_seed );
 }
 
 void* TextureFactory::load( LoadContext& context ) {
 
     using namespace hydra::graphics;
 
-    int image_width, image_height, channels_in_file;
-    unsigned char* image_data = stbi_load_from_memory( (const stbi_uc*)context.resource->data, context.resource->header->data_size, &image_width, &image_height, &channels_in_file, 4 );
-
-    TextureCreation texture_creation = { image_data, image_width, image_height, 1, 1, 0, TextureFormat::R8G8B8A8_UNORM, TextureType::Texture2D };
+    // Levels are read in place and copied by the device.
+    const TextureFileHeader* texture_header = (const TextureFileHeader*)context.resource->data;
+    TextureCreation texture_creation = { (void*)( texture_header + 1 ), texture_header->width, texture_header->height, 1, texture_header->mipmaps, 0, (TextureFormat::Enum)texture_header->format, TextureType::Texture2D };
     uint32_t pool_id = textures_pool.obtain_resource();
     Texture* texture = (Texture*)textures_pool.access_resource( pool_id );
     texture->handle = context.device.create_texture( texture_creation );
@@ -346,12 +972,105 @@ void TextureFactory::unload( void* resource_data, hydra::graphics::Device& devic
 
 // ShaderFactory ////////////////////////////////////////////////////////////////
 
+//
+// Properties are cached for materials, pointing inside the effect file. Used mainly to put the property in the local constants.
+static void cache_effect_properties( hydra::graphics::ShaderEffect* effect ) {
+
+    string_hash_init_arena( effect->name_to_property );
+
+    for ( uint32_t p = 0; p < effect->num_properties; ++p ) {
+        hfx::ShaderEffectFile::MaterialProperty* property = hfx::get_property( effect->properties_data, p );
+
+        string_hash_put( effect->name_to_property, property->name, property );
+    }
+}
+
+//
+// Create the pipelines of each pass and of its variants. Variants differ only in the shader stages and share the pass resource layouts.
+static bool create_effect_pipelines( hydra::graphics::ShaderEffect* effect, char* effect_memory, hydra::graphics::Device& device ) {
+
+    using namespace hydra::graphics;
+
+    for ( uint16_t p = 0; p < effect->num_passes; p++ ) {
+        hfx::ShaderEffectFile::PassHeader* pass_header = hfx::get_pass( effect_memory, p );
+
+        ShaderEffectPass& shader_pass = effect->passes[p];
+        memcpy( shader_pass.name, pass_header->stage_name, 32 );
+
+        PipelineCreation& pipeline_creation = shader_pass.pipeline_creation;
+        memset( &pipeline_creation, 0, sizeof( PipelineCreation ) );
+
+        hfx::get_pipeline( pass_header, pipeline_creation );
+
+        // Create Resource Set Layouts
+        for ( uint16_t l = 0; l < pass_header->num_resource_layouts; l++ ) {
+
+            uint8_t num_bindings = 0;
+            const ResourceListLayoutCreation::Binding* bindings = get_pass_layout_bindings( pass_header, l, num_bindings );
+            ResourceListLayoutCreation resource_layout_creation = { bindings, num_bindings };
+
+            pipeline_creation.resource_list_layout[l] = device.create_resource_list_layout( resource_layout_creation );
+        }
+
+        array_init( shader_pass.variant_pipelines );
+
+        // Create pipeline
+        shader_pass.pipeline_handle = device.create_pipeline( pipeline_creation );
+        if ( shader_pass.pipeline_handle.handle == k_invalid_handle ) {
+            return false;
+        }
+
+        array_push( shader_pass.variant_pipelines, shader_pass.pipeline_handle );
+
+        for ( uint32_t v = 1; v < pass_header->num_variants; ++v ) {
+            PipelineCreation variant_creation = pipeline_creation;
+            for ( uint32_t s = 0; s < pass_header->num_shader_chunks; ++s ) {
+                hfx::get_shader_creation( pass_header, s, &variant_creation.shaders.stages[s], v );
+            }
+
+            PipelineHandle variant_pipeline = device.create_pipeline( variant_creation );
+            if ( variant_pipeline.handle == k_invalid_handle ) {
+                return false;
+            }
+
+            array_push( shader_pass.variant_pipelines, variant_pipeline );
+        }
+    }
+
+    return true;
+}
+
 void ShaderFactory::init() {
     shaders_pool.init( 1000, sizeof( hydra::graphics::ShaderEffect ) );
+
+#if defined(HYDRA_OPENGL)
+    // Created here, on the main thread: stb_ds changes its global seed each time a hash map is created.
+    num_compiler_contexts = hydra::task_thread_count();
+    compiler_contexts = new hfx::CompilerContext[num_compiler_contexts];
+    for ( uint32_t i = 0; i < num_compiler_contexts; ++i ) {
+        hfx::init_compiler_context( compiler_contexts[i] );
+    }
+#endif // HYDRA_OPENGL
 }
 
 void ShaderFactory::terminate() {
     shaders_pool.terminate();
+
+#if defined(HYDRA_OPENGL)
+    for ( uint32_t i = 0; i < num_compiler_contexts; ++i ) {
+        hfx::terminate_compiler_context( compiler_contexts[i] );
+    }
+    delete[] compiler_contexts;
+    compiler_contexts = nullptr;
+    num_compiler_contexts = 0;
+#endif // HYDRA_OPENGL
+}
+
+//
+// Effects compiled with another version of the .bhfx format are compiled again, instead of failing to load.
+size_t ShaderFactory::get_compile_options_hash() const {
+    const uint32_t version = hfx::ShaderEffectFile::k_version;
+    return hash_bytes( (void*)&version, sizeof( version ), k_resource_random_seed );
 }
 
 void ShaderFactory::compile_resource( CompileContext& context ) {
@@ -362,12 +1081,46 @@ void ShaderFactory::compile_resource( CompileContext& context ) {
     const char* bhfx_filename = context.temp_string_buffer.append_use( "%s.bhfx", output_filename );
     const char* hfx_full_filename = context.temp_string_buffer.append_use( "%s%s", context.resource_manager->get_resource_source_folder(), context.out_header->id.path );
 
+    StringBuffer includes_buffer;
+    includes_buffer.init( 1024 );
+
 #if defined(HYDRA_OPENGL)
     
-    hfx::compile_hfx( hfx_full_filename, context.resource_manager->get_resource_binary_folder(), bhfx_filename );
+    // Includes can have changed since the last compilation on this thread.
+    const uint32_t thread_index = hydra::task_thread_index();
+    if ( thread_index < num_compiler_contexts ) {
+        hfx::CompilerContext& compiler_context = compiler_contexts[thread_index];
+        hfx::reset_include_cache( compiler_context.include_cache );
+        hfx::compile_hfx( compiler_context, hfx_full_filename, context.resource_manager->get_resource_binary_folder(), bhfx_filename, &includes_buffer );
+    }
+    else {
+        hydra::print_format( "Cannot compile %s: the task service must be initialized before the resource manager.\n", hfx_full_filename );
+    }
 
 #endif // HYDRA_VULKAN
 
+    // Included hfx files are internal references: the effect is compiled again when any of them changes.
+    ResourceHeader& resource_header = *context.out_header;
+    ResourceID* dependencies = context.out_references + resource_header.num_external_references;
+    for ( uint32_t offset = 0; offset < includes_buffer.current_size; ) {
+        const char* include_path = includes_buffer.data + offset;
+        offset += (uint32_t)strlen( include_path ) + 1;
+
+        if ( resource_header.num_external_references + resource_header.num_internal_references == k_max_resource_references ) {
+            hydra::print_format( "Too many includes in %s, %s will not be tracked.\n", resource_header.id.path, include_path );
+            continue;
+        }
+
+        ResourceID& dependency = dependencies[resource_header.num_internal_references++];
+        strncpy( dependency.path, include_path, sizeof( dependency.path ) - 1 );
+        dependency.path[sizeof( dependency.path ) - 1] = 0;
+        dependency.type = (uint8_t)ResourceType::ShaderEffect;
+    }
+
+    includes_buffer.terminate();
+
+    resource_header.source_hash = context.resource_manager->hash_dependencies( resource_header.source_hash, dependencies, resource_header.num_internal_references, context.temp_string_buffer );
+
     // Read the newly generated bhfx file
     char* bhfx_memory = hydra::read_file_into_memory( context.compiled_filename, &context.out_header->data_size );
 
@@ -376,6 +1129,7 @@ void ShaderFactory::compile_resource( CompileContext& context ) {
     
     // Write Header
     fwrite( context.out_header, sizeof( ResourceHeader ), 1, output_file );
+    fwrite( context.out_references, sizeof( ResourceID ), resource_header.num_external_references + resource_header.num_internal_references, output_file );
     // Write Data
     fwrite( bhfx_memory, context.out_header->data_size, 1, output_file );
     fclose( output_file );
@@ -387,8 +1141,12 @@ void* ShaderFactory::load( LoadContext& context ) {
 
     using namespace hydra::graphics;
 
+    // The effect file is read in place, inside the mapped resource.
     hfx::ShaderEffectFile shader_effect_file;
-    hfx::init_shader_effect_file( shader_effect_file, context.resource->data );
+    if ( !hfx::init_shader_effect_file( shader_effect_file, context.resource->data, context.resource->header->data_size ) ) {
+        hydra::print_format( "Invalid shader effect %s\n", context.resource->header->id.path );
+        return nullptr;
+    }
 
     // 1. Create shader effect
     uint32_t effect_pool_id = shaders_pool.obtain_resource();
@@ -396,47 +1154,12 @@ void* ShaderFactory::load( LoadContext& context ) {
     effect->pool_id = effect_pool_id;
     effect->init( shader_effect_file );
     
-    bool invalid_effect = false;
-
     // 2. Create pipelines
-    for ( uint16_t p = 0; p < effect->num_passes; p++ ) {
-        hfx::ShaderEffectFile::PassHeader* pass_header = hfx::get_pass( shader_effect_file.memory, p );
-
-        ShaderEffectPass& shader_pass = effect->passes[p];
-        memcpy( shader_pass.name, pass_header->stage_name, 32 );
-
-        PipelineCreation& pipeline_creation = shader_pass.pipeline_creation;
-        memset( &pipeline_creation, 0, sizeof( PipelineCreation ) );
-
-        hfx::get_pipeline( pass_header, pipeline_creation );
-
-        // 2.1 Create Resource Set Layouts
-        for ( uint16_t l = 0; l < pass_header->num_resource_layouts; l++ ) {
-
-            uint8_t num_bindings = 0;
-            const ResourceListLayoutCreation::Binding* bindings = get_pass_layout_bindings( pass_header, l, num_bindings );
-            ResourceListLayoutCreation resource_layout_creation = { bindings, num_bindings };
-
-            pipeline_creation.resource_list_layout[l] = context.device.create_resource_list_layout( resource_layout_creation );
-        }
-
-        // Create pipeline
-        shader_pass.pipeline_handle = context.device.create_pipeline( pipeline_creation );
-        if ( shader_pass.pipeline_handle.handle == k_invalid_handle ) {
-            invalid_effect = true;
-            break;
-        }
-    }
+    const bool invalid_effect = !create_effect_pipelines( effect, shader_effect_file.memory, context.device );
 
     if ( !invalid_effect ) {
-        // 3. Cache properties for materials. Used mainly to put the property in the local constants.
-        string_hash_init_arena( effect->name_to_property );
-
-        for ( uint32_t p = 0; p < effect->num_properties; ++p ) {
-            hfx::ShaderEffectFile::MaterialProperty* property = hfx::get_property( effect->properties_data, p );
-
-            string_hash_put( effect->name_to_property, property->name, property );
-        }
+        // 3. Cache properties for materials.
+        cache_effect_properties( effect );
     }
     else {
         // 4. Cleanup of resources
@@ -465,13 +1188,19 @@ void ShaderFactory::unload( void* resource_data, hydra::graphics::Device& device
             device.destroy_resource_list_layout( pass.pipeline_creation.resource_list_layout[l] );
         }
 
+        // The first variant is the default pipeline.
+        for ( uint32_t v = 1; v < array_length_u( pass.variant_pipelines ); ++v ) {
+            device.destroy_pipeline( pass.variant_pipelines[v] );
+        }
+        array_free( pass.variant_pipelines );
+
         device.destroy_pipeline( pass.pipeline_handle );
     }
 
     shaders_pool.release_resource( effect->pool_id );
 }
 
-void ShaderFactory::reload( Resource* old_resource, Resource* new_resource, StringBuffer& temp_string_buffer, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) {
+bool ShaderFactory::reload( Resource* old_resource, Resource* new_resource, StringBuffer& temp_string_buffer, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) {
 
     using namespace hydra::graphics;
     ShaderEffect* effect = (ShaderEffect*)old_resource->asset;
@@ -480,38 +1209,25 @@ void ShaderFactory::reload( Resource* old_resource, Resource* new_resource, Stri
 
     // Open binary hfx file
     hfx::ShaderEffectFile shader_effect_file;
-    hfx::init_shader_effect_file( shader_effect_file, new_resource->data );
+    if ( !hfx::init_shader_effect_file( shader_effect_file, new_resource->data, new_resource->header->data_size ) ) {
+        hydra::print_format( "Invalid shader effect %s\n", new_resource->header->id.path );
+        return false;
+    }
 
-    effect->init( shader_effect_file );
-    
+    // Pipelines of the old file are not destroyed, as materials still use them.
     for ( uint16_t p = 0; p < effect->num_passes; p++ ) {
-        hfx::ShaderEffectFile::PassHeader* pass_header = hfx::get_pass( new_resource->data, p );
-
-        ShaderEffectPass& shader_pass = effect->passes[p];
-        memcpy( shader_pass.name, pass_header->stage_name, 32 );
-
-        PipelineCreation& pipeline_creation = shader_pass.pipeline_creation;
-        memset( &pipeline_creation, 0, sizeof( PipelineCreation ) );
-
-        hfx::get_pipeline( pass_header, pipeline_creation );
-
-        // 2.1 Create Resource Set Layouts
-        for ( uint16_t l = 0; l < pass_header->num_resource_layouts; l++ ) {
+        array_free( effect->passes[p].variant_pipelines );
+    }
 
-            uint8_t num_bindings = 0;
-            const ResourceListLayoutCreation::Binding* bindings = get_pass_layout_bindings( pass_header, l, num_bindings );
-            ResourceListLayoutCreation resource_layout_creation = { bindings, num_bindings };
+    effect->init( shader_effect_file );
 
-            pipeline_creation.resource_list_layout[l] = gfx_device.create_resource_list_layout( resource_layout_creation );
-        }
+    // Cached properties pointed to the old file.
+    string_hash_free( effect->name_to_property );
+    cache_effect_properties( effect );
+    
+    create_effect_pipelines( effect, new_resource->data, gfx_device );
 
-        // Create pipeline
-        shader_pass.pipeline_handle = gfx_device.create_pipeline( pipeline_creation );
-        //if ( shader_pass.pipeline_handle.handle == k_invalid_handle ) {
-        //    //invalid_effect = true;
-        //    break;
-        //}
-    }
+    return true;
 }
 
 
@@ -605,13 +1321,23 @@ void MaterialFactory::compile_resource( CompileContext& context ) {
             strcpy( material_property.name, itr->name.GetString() );
 
             // Use data to write value
+            memset( material_property.data, 0, sizeof( material_property.data ) );
+
             if ( itr->value.IsString() ) {
                 strcpy( material_property.data, itr->value.GetString() );
             }
-            else if ( itr->value.IsFloat() ) {
+            else if ( itr->value.IsNumber() ) {
                 float value = itr->value.GetFloat();
                 memcpy( material_property.data, &value, sizeof( float ) );
             }
+            else if ( itr->value.IsArray() ) {
+                // Colors, vectors and arrays: consecutive floats.
+                float* values = (float*)material_property.data;
+                const rapidjson::SizeType max_values = sizeof( material_property.data ) / sizeof( float );
+                for ( rapidjson::SizeType i = 0; i < itr->value.Size() && i < max_values; ++i ) {
+                    values[i] = itr->value[i].IsNumber() ? itr->value[i].GetFloat() : 0.0f;
+                }
+            }
             else {
                 hydra::print_format( "ERROR!" );
             }
@@ -731,9 +1457,10 @@ void* MaterialFactory::load( LoadContext& context ) {
                 break;
             }
 
-            case hfx::Property::Float:
+            default:
             {
-                memcpy( material->local_constants_data + material_property->offset, property.data, sizeof( float ) );
+                // Numbers are stored as floats, written with the layout of the effect.
+                hfx::write_property_values( material_property, (const float*)property.data, sizeof( property.data ) / sizeof( float ), material->local_constants_data );
                 break;
             }
         }
@@ -821,12 +1548,782 @@ void MaterialFactory::unload( void* resource_data, hydra::graphics::Device& devi
     hydra::hy_free( material->textures );
 }
 
-void MaterialFactory::reload( Resource* old_resource, Resource* new_resource, StringBuffer& temp_string_buffer, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) {
+bool MaterialFactory::reload( Resource* old_resource, Resource* new_resource, StringBuffer& temp_string_buffer, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) {
     
     using namespace hydra::graphics;
     Material* material = (Material*)old_resource->asset;
 
     material->load_resources( render_pipeline->resource_database, gfx_device );
+
+    return true;
+}
+
+// SceneFactory /////////////////////////////////////////////////////////////////
+
+static const uint32_t               k_scene_data_alignment = 16;
+static const uint32_t               k_max_scene_vertices = 65535;       // Indices are 16 bits, as drawn by the renderer.
+static const uint32_t               k_max_scene_node_depth = 256;
+
+static_assert( sizeof( SceneFile::Header ) % k_scene_data_alignment == 0 && sizeof( SceneFile::Node ) % k_scene_data_alignment == 0 &&
+               sizeof( SceneFile::SubMesh ) % k_scene_data_alignment == 0, "Scene data must stay aligned to be read in place." );
+
+//
+// Geometry of a glTF primitive. It is cooked once and shared by all the nodes drawing its mesh.
+struct ScenePrimitive {
+    uint32_t                        start_index;
+    uint32_t                        index_count;        // 0 if the primitive was skipped.
+    uint32_t                        base_vertex;
+    uint32_t                        material_index;
+    hydra::graphics::Box            bounding_box;       // Local space.
+}; // struct ScenePrimitive
+
+//
+//
+struct SceneCooker {
+    const tinygltf::Model*          model;
+    const char*                     scene_path;
+
+    array( float )                  positions;
+    array( float )                  normals;
+    array( float )                  texcoords;
+    array( uint16_t )               indices;
+    array( ScenePrimitive )         primitives;
+    array( uint32_t )               mesh_first_primitive;   // Index of the first cooked primitive of each glTF mesh.
+    array( SceneFile::Node )        nodes;
+    array( SceneFile::SubMesh )     sub_meshes;
+}; // struct SceneCooker
+
+static uint32_t align_scene_data( uint32_t size ) {
+    return ( size + k_scene_data_alignment - 1 ) & ~( k_scene_data_alignment - 1 );
+}
+
+//
+// Point the scene file to the compiled data, read in place.
+static void init_scene_file( SceneFile& scene_file, char* memory ) {
+    scene_file.header = (SceneFile::Header*)memory;
+    scene_file.nodes = (SceneFile::Node*)( memory + sizeof( SceneFile::Header ) );
+    scene_file.sub_meshes = (SceneFile::SubMesh*)( scene_file.nodes + scene_file.header->num_nodes );
+
+    const uint32_t num_vertices = scene_file.header->num_vertices;
+    scene_file.positions = (float*)( scene_file.sub_meshes + scene_file.header->num_sub_meshes );
+    scene_file.normals = (float*)( (char*)scene_file.positions + align_scene_data( num_vertices * sizeof( float ) * 3 ) );
+    scene_file.texcoords = (float*)( (char*)scene_file.normals + align_scene_data( num_vertices * sizeof( float ) * 3 ) );
+    scene_file.indices = (uint16_t*)( (char*)scene_file.texcoords + align_scene_data( num_vertices * sizeof( float ) * 2 ) );
+}
+
+//
+// Folder of a path, with the last separator. Empty for files without folder.
+static char* get_path_folder( const char* path, StringBuffer& temp_string_buffer ) {
+    const char* separator = strrchr( path, '/' );
+    const char* back_separator = strrchr( path, '\\' );
+    if ( back_separator > separator ) {
+        separator = back_separator;
+    }
+
+    return temp_string_buffer.append_use_substring( path, 0, separator ? (uint32_t)( separator - path + 1 ) : 0 );
+}
+
+//
+// Images are compiled as texture resources: the glTF loader only needs their uris.
+static bool skip_gltf_image( tinygltf::Image* image, const int image_index, std::string* error, std::string* warning, int required_width,
+                             int required_height, const unsigned char* bytes, int size, void* user_data ) {
+    return true;
+}
+
+//
+// Start of the data of an accessor, with elements of element_size bytes. Returns nullptr if the data is missing or out of its buffer.
+static const uint8_t* get_accessor_data( const tinygltf::Model& model, const tinygltf::Accessor& accessor, uint32_t element_size, uint32_t& out_stride ) {
+
+    if ( accessor.bufferView < 0 || accessor.bufferView >= (int32_t)model.bufferViews.size() || accessor.sparse.isSparse ) {
+        return nullptr;
+    }
+
+    const tinygltf::BufferView& buffer_view = model.bufferViews[accessor.bufferView];
+    if ( buffer_view.buffer < 0 || buffer_view.buffer >= (int32_t)model.buffers.size() ) {
+        return nullptr;
+    }
+
+    const tinygltf::Buffer& buffer = model.buffers[buffer_view.buffer];
+    const int32_t stride = accessor.ByteStride( buffer_view );
+    const size_t first_byte = buffer_view.byteOffset + accessor.byteOffset;
+    if ( stride <= 0 || accessor.count == 0 || first_byte + ( accessor.count - 1 ) * stride + element_size > buffer.data.size() ) {
+        return nullptr;
+    }
+
+    out_stride = (uint32_t)stride;
+    return buffer.data.data() + first_byte;
+}
+
+//
+// Read num_components floats per vertex. Normalized unsigned integers are converted, as allowed for texture coordinates.
+static bool read_accessor_floats( const tinygltf::Model& model, const tinygltf::Accessor& accessor, uint32_t num_vertices, uint32_t num_components, float* output ) {
+
+    const int32_t component_size = tinygltf::GetComponentSizeInBytes( accessor.componentType );
+    if ( accessor.count != num_vertices || tinygltf::GetNumComponentsInType( accessor.type ) < (int32_t)num_components || component_size <= 0 ||
+         ( accessor.componentType != TINYGLTF_COMPONENT_TYPE_FLOAT && !accessor.normalized ) ) {
+        return false;
+    }
+
+    uint32_t stride;
+    const uint8_t* data = get_accessor_data( model, accessor, num_components * component_size, stride );
+    if ( !data ) {
+        return false;
+    }
+
+    for ( uint32_t v = 0; v < num_vertices; ++v ) {
+        const uint8_t* element = data + v * stride;
+
+        for ( uint32_t c = 0; c < num_components; ++c, element += component_size ) {
+            switch ( accessor.componentType ) {
+                case TINYGLTF_COMPONENT_TYPE_FLOAT:
+                    memcpy( output, element, sizeof( float ) );
+                    break;
+
+                case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+                    *output = *element / 255.0f;
+                    break;
+
+                case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+                {
+                    uint16_t value;
+                    memcpy( &value, element, sizeof( uint16_t ) );
+                    *output = value / 65535.0f;
+                    break;
+                }
+
+                default:
+                    return false;
+            }
+
+            ++output;
+        }
+    }
+
+    return true;
+}
+
+//
+// Read indices of any size as 16 bits indices. Fails if an index is not a vertex of the primitive.
+static bool read_accessor_indices( const tinygltf::Model& model, const tinygltf::Accessor& accessor, uint32_t num_vertices, uint16_t* output ) {
+
+    const int32_t component_size = tinygltf::GetComponentSizeInBytes( accessor.componentType );
+    if ( accessor.type != TINYGLTF_TYPE_SCALAR || component_size <= 0 ) {
+        return false;
+    }
+
+    uint32_t stride;
+    const uint8_t* data = get_accessor_data( model, accessor, component_size, stride );
+    if ( !data ) {
+        return false;
+    }
+
+    for ( size_t i = 0; i < accessor.count; ++i ) {
+        const uint8_t* element = data + i * stride;
+        uint32_t index;
+
+        switch ( accessor.componentType ) {
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+                index = *element;
+                break;
+
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+            {
+                uint16_t value;
+                memcpy( &value, element, sizeof( uint16_t ) );
+                index = value;
+                break;
+            }
+
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+                memcpy( &index, element, sizeof( uint32_t ) );
+                break;
+
+            default:
+                return false;
+        }
+
+        if ( index >= num_vertices ) {
+            return false;
+        }
+
+        output[i] = (uint16_t)index;
+    }
+
+    return true;
+}
+
+//
+// Append the vertices and indices of a primitive to the streams of the scene. Indices stay relative to the first vertex of the primitive.
+static void cook_scene_primitive( SceneCooker& cooker, const tinygltf::Primitive& primitive, ScenePrimitive& out_primitive ) {
+
+    const tinygltf::Model& model = *cooker.model;
+    memset( &out_primitive, 0, sizeof( ScenePrimitive ) );
+
+    auto position = primitive.attributes.find( "POSITION" );
+    if ( primitive.mode != TINYGLTF_MODE_TRIANGLES || position == primitive.attributes.end() || primitive.material < 0 ||
+         primitive.material >= (int32_t)model.materials.size() ) {
+        hydra::print_format( "Scene %s - skipping primitive: only triangles with positions and a material are supported.\n", cooker.scene_path );
+        return;
+    }
+
+    const tinygltf::Accessor& position_accessor = model.accessors[position->second];
+    const uint32_t num_vertices = (uint32_t)position_accessor.count;
+    if ( num_vertices == 0 || num_vertices > k_max_scene_vertices ) {
+        hydra::print_format( "Scene %s - skipping primitive with %u vertices, the maximum is %u.\n", cooker.scene_path, num_vertices, k_max_scene_vertices );
+        return;
+    }
+
+    const uint32_t base_vertex = array_length_u( cooker.positions ) / 3;
+    array_set_length( cooker.positions, ( base_vertex + num_vertices ) * 3 );
+    array_set_length( cooker.normals, ( base_vertex + num_vertices ) * 3 );
+    array_set_length( cooker.texcoords, ( base_vertex + num_vertices ) * 2 );
+
+    float* positions = cooker.positions + base_vertex * 3;
+    float* normals = cooker.normals + base_vertex * 3;
+    float* texcoords = cooker.texcoords + base_vertex * 2;
+    memset( normals, 0, num_vertices * sizeof( float ) * 3 );
+    memset( texcoords, 0, num_vertices * sizeof( float ) * 2 );
+
+    // Missing normals and texcoords are left to zero.
+    bool valid = read_accessor_floats( model, position_accessor, num_vertices, 3, positions );
+
+    auto normal = primitive.attributes.find( "NORMAL" );
+    if ( normal != primitive.attributes.end() ) {
+        valid = valid && read_accessor_floats( model, model.accessors[normal->second], num_vertices, 3, normals );
+    }
+
+    auto texcoord = primitive.attributes.find( "TEXCOORD_0" );
+    if ( texcoord != primitive.attributes.end() ) {
+        valid = valid && read_accessor_floats( model, model.accessors[texcoord->second], num_vertices, 2, texcoords );
+    }
+
+    const uint32_t start_index = array_length_u( cooker.indices );
+    uint32_t num_indices = num_vertices;
+    if ( primitive.indices >= 0 ) {
+        const tinygltf::Accessor& index_accessor = model.accessors[primitive.indices];
+        num_indices = (uint32_t)index_accessor.count;
+
+        array_set_length( cooker.indices, start_index + num_indices );
+        valid = valid && num_indices && read_accessor_indices( model, index_accessor, num_vertices, cooker.indices + start_index );
+    }
+    else {
+        // Not indexed: vertices are drawn in order.
+        array_set_length( cooker.indices, start_index + num_indices );
+        for ( uint32_t i = 0; i < num_indices; ++i ) {
+            cooker.indices[start_index + i] = (uint16_t)i;
+        }
+    }
+
+    if ( !valid ) {
+        hydra::print_format( "Scene %s - skipping primitive with invalid vertex or index data.\n", cooker.scene_path );
+
+        array_set_length( cooker.positions, base_vertex * 3 );
+        array_set_length( cooker.normals, base_vertex * 3 );
+        array_set_length( cooker.texcoords, base_vertex * 2 );
+        array_set_length( cooker.indices, start_index );
+        return;
+    }
+
+    out_primitive.start_index = start_index;
+    out_primitive.index_count = num_indices;
+    out_primitive.base_vertex = base_vertex;
+    out_primitive.material_index = (uint32_t)primitive.material;
+
+    out_primitive.bounding_box.min = { positions[0], positions[1], positions[2] };
+    out_primitive.bounding_box.max = out_primitive.bounding_box.min;
+    for ( uint32_t v = 1; v < num_vertices; ++v ) {
+        const vec3s vertex_position = { positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2] };
+        out_primitive.bounding_box.min = glms_vec3_minv( out_primitive.bounding_box.min, vertex_position );
+        out_primitive.bounding_box.max = glms_vec3_maxv( out_primitive.bounding_box.max, vertex_position );
+    }
+}
+
+//
+// Local transform of a node: the matrix if present, otherwise translation * rotation * scale.
+static mat4s get_node_transform( const tinygltf::Node& node ) {
+
+    mat4s transform = glms_mat4_identity();
+
+    if ( node.matrix.size() == 16 ) {
+        // Both glTF and cglm store matrices by column.
+        for ( uint32_t i = 0; i < 16; ++i ) {
+            transform.raw[i / 4][i % 4] = (float)node.matrix[i];
+        }
+        return transform;
+    }
+
+    if ( node.translation.size() == 3 ) {
+        transform = glms_translate_make( { (float)node.translation[0], (float)node.translation[1], (float)node.translation[2] } );
+    }
+
+    if ( node.rotation.size() == 4 ) {
+        transform = glms_mat4_mul( transform, glms_quat_mat4( { (float)node.rotation[0], (float)node.rotation[1], (float)node.rotation[2], (float)node.rotation[3] } ) );
+    }
+
+    if ( node.scale.size() == 3 ) {
+        transform = glms_mat4_mul( transform, glms_scale_make( { (float)node.scale[0], (float)node.scale[1], (float)node.scale[2] } ) );
+    }
+
+    return transform;
+}
+
+//
+// Add a node and its children, depth first: parents always come before their children.
+static void cook_scene_node( SceneCooker& cooker, int32_t node_index, uint32_t parent_id, const mat4s& parent_transform, uint32_t depth ) {
+
+    const tinygltf::Model& model = *cooker.model;
+    if ( node_index < 0 || node_index >= (int32_t)model.nodes.size() || depth > k_max_scene_node_depth ) {
+        hydra::print_format( "Scene %s - skipping invalid node %d.\n", cooker.scene_path, node_index );
+        return;
+    }
+
+    const tinygltf::Node& node = model.nodes[node_index];
+
+    SceneFile::Node scene_node;
+    scene_node.world_transform = glms_mat4_mul( parent_transform, get_node_transform( node ) );
+    scene_node.parent_id = parent_id;
+    scene_node.first_sub_mesh = array_length_u( cooker.sub_meshes );
+    scene_node.num_sub_meshes = 0;
+    scene_node.padding = 0;
+
+    if ( node.mesh >= 0 && node.mesh < (int32_t)model.meshes.size() ) {
+        const uint32_t first_primitive = cooker.mesh_first_primitive[node.mesh];
+        const uint32_t num_primitives = (uint32_t)model.meshes[node.mesh].primitives.size();
+
+        for ( uint32_t p = 0; p < num_primitives; ++p ) {
+            const ScenePrimitive& primitive = cooker.primitives[first_primitive + p];
+            if ( !primitive.index_count ) {
+                continue;
+            }
+
+            SceneFile::SubMesh sub_mesh = {};
+            sub_mesh.start_index = primitive.start_index;
+            sub_mesh.index_count = primitive.index_count;
+            sub_mesh.base_vertex = primitive.base_vertex;
+            sub_mesh.material_index = primitive.material_index;
+
+            hydra::graphics::Box local_box = primitive.bounding_box;
+            glms_aabb_transform( local_box.box, scene_node.world_transform, sub_mesh.bounding_box.box );
+
+            array_push( cooker.sub_meshes, sub_mesh );
+            ++scene_node.num_sub_meshes;
+        }
+    }
+
+    const uint32_t node_id = array_length_u( cooker.nodes );
+    array_push( cooker.nodes, scene_node );
+
+    for ( size_t i = 0; i < node.children.size(); ++i ) {
+        cook_scene_node( cooker, node.children[i], node_id, scene_node.world_transform, depth + 1 );
+    }
+}
+
+//
+// Texture of a material property, relative to the source folder. Embedded images are not texture resources: the default is used.
+static const char* get_scene_texture_path( const tinygltf::Model& model, int32_t texture_index, const char* scene_folder, const char* default_path, StringBuffer& temp_string_buffer ) {
+
+    if ( texture_index < 0 || texture_index >= (int32_t)model.textures.size() ) {
+        return default_path;
+    }
+
+    const int32_t image_index = model.textures[texture_index].source;
+    if ( image_index < 0 || image_index >= (int32_t)model.images.size() ) {
+        return default_path;
+    }
+
+    const tinygltf::Image& image = model.images[image_index];
+    if ( image.uri.empty() || tinygltf::IsDataURI( image.uri ) ) {
+        return default_path;
+    }
+
+    return temp_string_buffer.append_use( "%s%s", scene_folder, image.uri.c_str() );
+}
+
+//
+// Write a material for the PBR effect with the textures of a glTF material.
+static void write_scene_material( const tinygltf::Model& model, const tinygltf::Material& material, const char* material_name, const char* scene_folder,
+                                  const char* hmt_full_filename, StringBuffer& temp_string_buffer ) {
+
+    rapidjson::Document document;
+    document.SetObject();
+
+    rapidjson::Document::AllocatorType& allocator = document.GetAllocator();
+
+    document.AddMember( "name", rapidjson::Value( material_name, allocator ), allocator );
+    document.AddMember( "effect_path", "PBR.hfx", allocator );
+
+    // Bindings: same as the other PBR materials.
+    static const char* s_bindings[][3] = {
+        { "ViewConstants", "CB_Lines", nullptr },
+        { "Transform", "Transform", nullptr },
+        { "albedo", "albedo_texture", "linear" },
+        { "normals", "normals_texture", "linear" },
+        { "metalRoughness", "metal_roughness_texture", "linear" },
+        { "emissive", "emissive_texture", "linear" },
+        { "linear_sampler", "linear", nullptr },
+        { "occlusion", "occlusion_texture", "linear" },
+    };
+
+    rapidjson::Value bindings( rapidjson::kArrayType );
+    for ( uint32_t i = 0; i < ArrayLength( s_bindings ); ++i ) {
+        rapidjson::Value binding( rapidjson::kObjectType );
+        binding.AddMember( "name", rapidjson::StringRef( s_bindings[i][0] ), allocator );
+        binding.AddMember( "resource_name", rapidjson::StringRef( s_bindings[i][1] ), allocator );
+        if ( s_bindings[i][2] ) {
+            binding.AddMember( "sampler", rapidjson::StringRef( s_bindings[i][2] ), allocator );
+        }
+
+        bindings.PushBack( binding, allocator );
+    }
+    document.AddMember( "bindings", bindings, allocator );
+
+    // Textures. Missing ones use textures that leave the material unchanged.
+    const tinygltf::PbrMetallicRoughness& pbr = material.pbrMetallicRoughness;
+    const char* albedo = get_scene_texture_path( model, pbr.baseColorTexture.index, scene_folder, "white.png", temp_string_buffer );
+    const char* normals = get_scene_texture_path( model, material.normalTexture.index, scene_folder, "flat_normal.png", temp_string_buffer );
+    const char* metal_roughness = get_scene_texture_path( model, pbr.metallicRoughnessTexture.index, scene_folder, "white.png", temp_string_buffer );
+    const char* emissive = get_scene_texture_path( model, material.emissiveTexture.index, scene_folder, "black.png", temp_string_buffer );
+    const char* occlusion = get_scene_texture_path( model, material.occlusionTexture.index, scene_folder, "white.png", temp_string_buffer );
+
+    rapidjson::Value property_container( rapidjson::kObjectType );
+    property_container.AddMember( "albedo_texture", rapidjson::StringRef( albedo ), allocator );
+    property_container.AddMember( "normals_texture", rapidjson::StringRef( normals ), allocator );
+    property_container.AddMember( "metal_roughness_texture", rapidjson::StringRef( metal_roughness ), allocator );
+    property_container.AddMember( "emissive_texture", rapidjson::StringRef( emissive ), allocator );
+    property_container.AddMember( "occlusion_texture", rapidjson::StringRef( occlusion ), allocator );
+
+    rapidjson::Value properties( rapidjson::kArrayType );
+    properties.PushBack( property_container, allocator );
+    document.AddMember( "properties", properties, allocator );
+
+    rapidjson::StringBuffer json_buffer;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> writer( json_buffer );
+    document.Accept( writer );
+
+    hydra::FileHandle file;
+    hydra::open_file( hmt_full_filename, "w", &file );
+    if ( !file ) {
+        hydra::print_format( "Error writing material %s\n", hmt_full_filename );
+        return;
+    }
+
+    fwrite( json_buffer.GetString(), json_buffer.GetSize(), 1, file );
+    hydra::close_file( file );
+
+    hydra::print_format( "Created material %s\n", hmt_full_filename );
+}
+
+void SceneFactory::terminate() {
+    if ( geometry_arena.device ) {
+        geometry_arena.terminate();
+    }
+}
+
+void SceneFactory::compile_resource( CompileContext& context ) {
+
+    ResourceHeader& resource_header = *context.out_header;
+    StringBuffer& temp_string_buffer = context.temp_string_buffer;
+    const char* source_folder = context.resource_manager->get_resource_source_folder();
+    const char* scene_folder = get_path_folder( resource_header.id.path, temp_string_buffer );
+
+    // 1. Parse the glTF. Buffers are read from the scene folder, images are only referenced by the materials.
+    tinygltf::TinyGLTF loader;
+    loader.SetImageLoader( skip_gltf_image, nullptr );
+
+    tinygltf::Model model;
+    std::string error, warning;
+    const char* base_folder = temp_string_buffer.append_use( "%s%s", source_folder, scene_folder );
+    const bool parsed = loader.LoadASCIIFromString( &model, &error, &warning, context.source_file_memory, (uint32_t)resource_header.data_size, base_folder );
+
+    if ( !warning.empty() ) {
+        hydra::print_format( "glTF warning in %s: %s\n", resource_header.id.path, warning.c_str() );
+    }
+
+    if ( !parsed ) {
+        hydra::print_format( "Error parsing glTF %s: %s\n", resource_header.id.path, error.c_str() );
+        remove( context.compiled_filename );
+        return;
+    }
+
+    uint32_t num_buffer_files = 0;
+    for ( size_t i = 0; i < model.buffers.size(); ++i ) {
+        num_buffer_files += !model.buffers[i].uri.empty() && !tinygltf::IsDataURI( model.buffers[i].uri );
+    }
+
+    if ( model.materials.size() + num_buffer_files > k_max_resource_references ) {
+        hydra::print_format( "Scene %s has %u materials and %u buffers, more than the %u references of a resource.\n", resource_header.id.path,
+                             (uint32_t)model.materials.size(), num_buffer_files, k_max_resource_references );
+        remove( context.compiled_filename );
+        return;
+    }
+
+    // 2. Materials are external references, with the same index as in the glTF.
+    // Missing .hmt files are created from the glTF material, and can be edited afterwards.
+    ResourceID* references = context.out_references;
+    const char* scene_name = remove_extension_from_filename( resource_header.id.path, temp_string_buffer );
+    for ( uint32_t m = 0; m < (uint32_t)model.materials.size(); ++m ) {
+        const tinygltf::Material& material = model.materials[m];
+        const char* material_name = material.name.empty() ? temp_string_buffer.append_use( "%s_material_%u", scene_name, m ) : material.name.c_str();
+
+        ResourceID& reference = references[resource_header.num_external_references++];
+        snprintf( reference.path, sizeof( reference.path ), "%s.hmt", material_name );
+        reference.type = (uint8_t)ResourceType::Material;
+
+        const char* hmt_full_filename = temp_string_buffer.append_use( "%s%s", source_folder, reference.path );
+        hydra::FileHandle hmt_file;
+        hydra::open_file( hmt_full_filename, "r", &hmt_file );
+        if ( hmt_file ) {
+            hydra::close_file( hmt_file );
+        }
+        else {
+            write_scene_material( model, material, material_name, scene_folder, hmt_full_filename, temp_string_buffer );
+        }
+    }
+
+    // 3. Buffer files are internal references: the scene is compiled again when any of them changes.
+    ResourceID* dependencies = references + resource_header.num_external_references;
+    for ( size_t i = 0; i < model.buffers.size(); ++i ) {
+        const std::string& uri = model.buffers[i].uri;
+        if ( uri.empty() || tinygltf::IsDataURI( uri ) ) {
+            continue;
+        }
+
+        ResourceID& dependency = dependencies[resource_header.num_internal_references++];
+        snprintf( dependency.path, sizeof( dependency.path ), "%s%s", scene_folder, uri.c_str() );
+        dependency.type = (uint8_t)ResourceType::Scene;
+    }
+
+    resource_header.source_hash = context.resource_manager->hash_dependencies( resource_header.source_hash, dependencies, resource_header.num_internal_references, temp_string_buffer );
+
+    // 4. Cook the geometry of each mesh, then the nodes of the scene.
+    SceneCooker cooker;
+    cooker.model = &model;
+    cooker.scene_path = resource_header.id.path;
+    array_init( cooker.positions );
+    array_init( cooker.normals );
+    array_init( cooker.texcoords );
+    array_init( cooker.indices );
+    array_init( cooker.primitives );
+    array_init( cooker.mesh_first_primitive );
+    array_init( cooker.nodes );
+    array_init( cooker.sub_meshes );
+
+    for ( size_t m = 0; m < model.meshes.size(); ++m ) {
+        const tinygltf::Mesh& mesh = model.meshes[m];
+        array_push( cooker.mesh_first_primitive, array_length_u( cooker.primitives ) );
+
+        for ( size_t p = 0; p < mesh.primitives.size(); ++p ) {
+            ScenePrimitive primitive;
+            cook_scene_primitive( cooker, mesh.primitives[p], primitive );
+            array_push( cooker.primitives, primitive );
+        }
+    }
+
+    if ( !model.scenes.empty() ) {
+        const int32_t scene_index = model.defaultScene >= 0 && model.defaultScene < (int32_t)model.scenes.size() ? model.defaultScene : 0;
+        const tinygltf::Scene& scene = model.scenes[scene_index];
+        const mat4s identity = glms_mat4_identity();
+
+        for ( size_t i = 0; i < scene.nodes.size(); ++i ) {
+            cook_scene_node( cooker, scene.nodes[i], UINT32_MAX, identity, 0 );
+        }
+    }
+    else {
+        hydra::print_format( "Scene %s has no scene: no node will be drawn.\n", resource_header.id.path );
+    }
+
+    // 5. Write header, references and the scene data.
+    SceneFile::Header scene_header;
+    scene_header.num_nodes = array_length_u( cooker.nodes );
+    scene_header.num_sub_meshes = array_length_u( cooker.sub_meshes );
+    scene_header.num_vertices = array_length_u( cooker.positions ) / 3;
+    scene_header.num_indices = array_length_u( cooker.indices );
+
+    // Each stream is aligned, as it is read in place.
+    const uint32_t stream_sizes[] = { scene_header.num_vertices * (uint32_t)sizeof( float ) * 3, scene_header.num_vertices * (uint32_t)sizeof( float ) * 3,
+                                      scene_header.num_vertices * (uint32_t)sizeof( float ) * 2 };
+    const void* streams[] = { cooker.positions, cooker.normals, cooker.texcoords };
+    const uint32_t index_data_size = scene_header.num_indices * sizeof( uint16_t );
+
+    resource_header.data_size = sizeof( SceneFile::Header ) + sizeof( SceneFile::Node ) * scene_header.num_nodes + sizeof( SceneFile::SubMesh ) * scene_header.num_sub_meshes +
+                                align_scene_data( stream_sizes[0] ) + align_scene_data( stream_sizes[1] ) + align_scene_data( stream_sizes[2] ) + index_data_size;
+
+    FILE* output_file = nullptr;
+    fopen_s( &output_file, context.compiled_filename, "wb" );
+    if ( output_file ) {
+        static const char k_padding[k_scene_data_alignment] = {};
+
+        fwrite( &resource_header, sizeof( ResourceHeader ), 1, output_file );
+        fwrite( references, sizeof( ResourceID ), resource_header.num_external_references + resource_header.num_internal_references, output_file );
+
+        fwrite( &scene_header, sizeof( SceneFile::Header ), 1, output_file );
+        fwrite( cooker.nodes, sizeof( SceneFile::Node ), scene_header.num_nodes, output_file );
+        fwrite( cooker.sub_meshes, sizeof( SceneFile::SubMesh ), scene_header.num_sub_meshes, output_file );
+        for ( uint32_t i = 0; i < ArrayLength( streams ); ++i ) {
+            fwrite( streams[i], 1, stream_sizes[i], output_file );
+            fwrite( k_padding, 1, align_scene_data( stream_sizes[i] ) - stream_sizes[i], output_file );
+        }
+        fwrite( cooker.indices, 1, index_data_size, output_file );
+        fclose( output_file );
+    }
+
+    hydra::print_format( "Scene %s: %u nodes, %u sub meshes, %u KB of vertices and indices.\n", resource_header.id.path, scene_header.num_nodes,
+                         scene_header.num_sub_meshes, ( stream_sizes[0] + stream_sizes[1] + stream_sizes[2] + index_data_size ) / 1024 );
+
+    array_free( cooker.positions );
+    array_free( cooker.normals );
+    array_free( cooker.texcoords );
+    array_free( cooker.indices );
+    array_free( cooker.primitives );
+    array_free( cooker.mesh_first_primitive );
+    array_free( cooker.nodes );
+    array_free( cooker.sub_meshes );
+}
+
+void* SceneFactory::load( LoadContext& context ) {
+
+    using namespace hydra::graphics;
+
+    SceneFile scene_file;
+    init_scene_file( scene_file, context.resource->data );
+    const SceneFile::Header& scene_header = *scene_file.header;
+
+    Device& device = context.device;
+    ShaderResourcesDatabase& resource_database = context.render_pipeline->resource_database;
+
+    RenderScene* scene = new RenderScene();
+    scene->render_manager = nullptr;
+    scene->stage_mask.value = 0;
+    scene->node_transforms_buffer.handle = k_invalid_handle;
+    scene->batch_transforms_buffer.handle = k_invalid_handle;
+    scene->geometry_arena = nullptr;
+    scene->geometry.handle = k_invalid_handle;
+    array_init( scene->nodes );
+    array_init( scene->node_transforms );
+
+    // 1. Vertices and indices of the whole scene are uploaded to one allocation of the geometry arena, from the mapped data.
+    if ( !geometry_arena.device ) {
+        geometry_arena.init( device, geometry_arena_creation );
+    }
+
+    if ( scene_header.num_vertices && scene_header.num_indices ) {
+        scene->geometry = geometry_arena.allocate( scene_header.num_vertices, scene_header.num_indices );
+    }
+
+    if ( scene->geometry.handle != k_invalid_handle ) {
+        scene->geometry_arena = &geometry_arena;
+
+        geometry_arena.upload_vertices( scene->geometry, GeometryStream::Position, scene_file.positions, scene_header.num_vertices );
+        geometry_arena.upload_vertices( scene->geometry, GeometryStream::Normal, scene_file.normals, scene_header.num_vertices );
+        geometry_arena.upload_vertices( scene->geometry, GeometryStream::Texcoord, scene_file.texcoords, scene_header.num_vertices );
+        geometry_arena.upload_indices( scene->geometry, scene_file.indices, scene_header.num_indices );
+    }
+
+    // 2. Node transforms. Materials bind them as "Transform".
+    for ( uint32_t n = 0; n < scene_header.num_nodes; ++n ) {
+        array_push( scene->node_transforms, scene_file.nodes[n].world_transform );
+    }
+
+    if ( scene_header.num_nodes ) {
+        BufferCreation buffer_creation;
+        buffer_creation.type = BufferType::Constant;
+        buffer_creation.usage = ResourceUsageType::Immutable;
+        buffer_creation.size = scene_header.num_nodes * sizeof( mat4s );
+        buffer_creation.initial_data = scene->node_transforms;
+
+        scene->node_transforms_buffer = device.create_buffer( buffer_creation );
+        resource_database.register_buffer( (char*)"Transform", scene->node_transforms_buffer );
+    }
+
+    // 3. Nodes and their meshes.
+    const ResourceID* material_references = context.resource->external_references;
+    for ( uint32_t n = 0; n < scene_header.num_nodes; ++n ) {
+        const SceneFile::Node& scene_node = scene_file.nodes[n];
+        RenderNode render_node = { nullptr, n, scene_node.parent_id };
+
+        for ( uint32_t s = scene_node.first_sub_mesh; s < scene_node.first_sub_mesh + scene_node.num_sub_meshes; ++s ) {
+            const SceneFile::SubMesh& scene_sub_mesh = scene_file.sub_meshes[s];
+
+            Resource* material_resource = scene_sub_mesh.material_index < context.resource->header->num_external_references ?
+                                          string_hash_get( context.resource->name_to_external_resources, material_references[scene_sub_mesh.material_index].path ) : nullptr;
+            Material* material = material_resource ? (Material*)material_resource->asset : nullptr;
+            if ( !material ) {
+                hydra::print_format( "Scene %s - missing material %u, sub mesh %u will not be drawn.\n", context.resource->header->id.path, scene_sub_mesh.material_index, s );
+                continue;
+            }
+
+            SubMesh sub_mesh = {};
+            sub_mesh.start_index = scene_sub_mesh.start_index;
+            sub_mesh.end_index = scene_sub_mesh.index_count;
+            sub_mesh.base_vertex = scene_sub_mesh.base_vertex;
+            sub_mesh.bounding_box = scene_sub_mesh.bounding_box;
+            sub_mesh.material = material;
+
+            if ( !render_node.mesh ) {
+                render_node.mesh = new Mesh();
+                array_init( render_node.mesh->sub_meshes );
+            }
+
+            array_push( render_node.mesh->sub_meshes, sub_mesh );
+        }
+
+        array_push( scene->nodes, render_node );
+    }
+
+    // 4. Resource lists of the materials, now that the scene buffers are registered.
+    for ( uint32_t m = 0; m < context.resource->header->num_external_references; ++m ) {
+        Resource* material_resource = string_hash_get( context.resource->name_to_external_resources, material_references[m].path );
+        if ( material_resource && material_resource->asset ) {
+            ( (Material*)material_resource->asset )->load_resources( resource_database, device );
+        }
+    }
+
+    // 5. Draw nodes sharing the same sub mesh and material with instancing.
+    build_render_batches( *scene, device );
+
+    return scene;
+}
+
+void SceneFactory::unload( void* resource_data, hydra::graphics::Device& device ) {
+
+    using namespace hydra::graphics;
+
+    RenderScene* scene = (RenderScene*)resource_data;
+    if ( !scene ) {
+        return;
+    }
+
+    if ( scene->geometry_arena ) {
+        scene->geometry_arena->release( scene->geometry );
+    }
+
+    device.destroy_buffer( scene->node_transforms_buffer );
+    device.destroy_buffer( scene->batch_transforms_buffer );
+
+    for ( uint32_t n = 0; n < array_length_u( scene->nodes ); ++n ) {
+        Mesh* mesh = scene->nodes[n].mesh;
+        if ( !mesh ) {
+            continue;
+        }
+
+        array_free( mesh->sub_meshes );
+        delete mesh;
+    }
+
+    array_free( scene->nodes );
+    array_free( scene->node_transforms );
+    array_free( scene->batches );
+    array_free( scene->instances );
+
+    CullingBoxes& boxes = scene->culling_boxes;
+    array_free( boxes.min_x );
+    array_free( boxes.min_y );
+    array_free( boxes.min_z );
+    array_free( boxes.max_x );
+    array_free( boxes.max_y );
+    array_free( boxes.max_z );
+
+    delete scene;
 }
 
 } // namespace hydra
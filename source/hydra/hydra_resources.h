@@ -1,7 +1,7 @@
 #pragma once
 
 //
-//  Hydra Resources - v0.01
+//  Hydra Resources - v0.10
 //
 //  Simple Resource Manager for Hydra.
 //
@@ -11,15 +11,32 @@
 //
 //
 // Revision history //////////////////////
+//      0.10 (2020/03/23): + Scene geometry is stored per vertex stream and suballocated from the geometry arena of the scene factory.
+//      0.09 (2020/03/23): + Added scene resources: glTF files are cooked into a binary scene, loaded without parsing.
+//      0.08 (2020/03/23): + Textures are block compressed when compiled, with the format chosen by usage and a quality option.
+//      0.07 (2020/03/23): + Textures are decoded and their mip chain generated when compiled. Loading uploads the levels.
+//      0.06 (2020/03/23): + Added asynchronous loading: compilation and decoding run on the task workers, assets are created by update once their dependencies are loaded.
+//      0.05 (2020/03/23): + Material properties can be numbers, colors, vectors and arrays, written with the layout of the effect.
+//      0.04 (2020/03/21): + Compiled resources are memory mapped and read in place. Versioned resource header.
+//      0.03 (2020/03/16): + Resources are compiled only when their source or one of their dependencies changed.
+//      0.02 (2020/03/10): + Texture pool starts smaller as resource pools can grow.
 //      0.01 (2020/02/10): + Initial version. Moved resource managers from MaterialSystem application.
 
 #include "hydra/hydra_lib.h"
 #include "hydra/hydra_rendering.h"
+#include "hydra/hydra_texture_compression.h"
+
+#include <mutex>
+
+namespace hfx {
+struct CompilerContext;
+} // namespace hfx
 
 namespace hydra {
 
 struct ResourceMap;
 struct ResourceManager;
+struct ResourceLoadJob;
 
 //
 //
@@ -30,13 +47,28 @@ struct ResourceType {
         Texture = 0,
         ShaderEffect,
         Material,
-        //Scene,
+        Scene,
 
         Count
     }; // enum Enum
 }; // struct ResourceType
 
 
+//
+// Resources loaded synchronously are always Loaded. Asynchronous loads go through all the states.
+struct ResourceState {
+
+    enum Enum {
+
+        Compiling = 0,                                          // Compiled, mapped and decoded on a worker thread.
+        WaitingDependencies,                                    // External references are loading, asset still missing.
+        Loaded,                                                 // Asset created. It is null if the factory could not load it.
+        Failed,                                                 // Source or compiled file missing.
+
+        Count
+    }; // enum Enum
+}; // struct ResourceState
+
 //
 //
 struct ResourceID {
@@ -44,9 +76,11 @@ struct ResourceID {
     char                            path[255];
 }; // struct ResourceReference
 
+//
+// Data follows the header and the references: their sizes keep the data of a mapped file aligned to 16 bytes.
 struct ResourceHeader {
 
-    char                            header[7];
+    char                            header[7];                  // Magic and version, checked before using a compiled resource.
     ResourceID                      id;
 
     size_t                          source_hash;
@@ -56,6 +90,58 @@ struct ResourceHeader {
 
 }; // struct ResourceHeader
 
+//
+// Data of a compiled texture: the header is followed by all the mip levels, tightly packed from the biggest.
+// Block compressed levels are rows of 4x4 blocks.
+struct TextureFileHeader {
+
+    uint16_t                        width;
+    uint16_t                        height;
+    uint8_t                         mipmaps;
+    uint8_t                         format;                     // hydra::graphics::TextureFormat::Enum
+    uint8_t                         padding[10];                // Keeps the levels aligned to 16 bytes.
+
+}; // struct TextureFileHeader
+
+//
+// Data of a compiled scene, read in place. The header is followed by the nodes, the sub meshes, the positions, normals,
+// texcoords and indices of the whole scene, each aligned to 16 bytes. Materials are the external references of the resource.
+struct SceneFile {
+
+    struct Header {
+        uint32_t                    num_nodes;
+        uint32_t                    num_sub_meshes;
+        uint32_t                    num_vertices;
+        uint32_t                    num_indices;
+    };
+
+    struct Node {
+        mat4s                       world_transform;            // Parent transforms already applied.
+        uint32_t                    parent_id;                  // UINT32_MAX for root nodes. Parents come before their children.
+        uint32_t                    first_sub_mesh;
+        uint32_t                    num_sub_meshes;
+        uint32_t                    padding;
+    };
+
+    struct SubMesh {
+        uint32_t                    start_index;
+        uint32_t                    index_count;                // 16 bits indices.
+        uint32_t                    base_vertex;                // Added to the indices, they are relative to the primitive.
+        uint32_t                    material_index;             // External reference of the material.
+        hydra::graphics::Box        bounding_box;               // World space, with the transform of the node.
+        uint32_t                    padding[2];
+    };
+
+    Header*                         header;
+    Node*                           nodes;
+    SubMesh*                        sub_meshes;
+    float*                          positions;
+    float*                          normals;
+    float*                          texcoords;
+    uint16_t*                       indices;
+
+}; // struct SceneFile
+
 //
 //
 struct Resource {
@@ -69,9 +155,27 @@ struct Resource {
     // External
     ResourceMap*                    name_to_external_resources;
 
+    // Header, references and data live in the mapped compiled file. Memory is copied to the heap
+    // only while the resource is reloaded, as a mapped file cannot be overwritten.
+    hydra::MappedFile               mapped_file;
+
+    void*                           decoded_data;               // Output of the factory decode, consumed by load.
+    ResourceState::Enum             state;
+
+
 }; // struct Resource
 
 
+//
+// Compiled resources store the hash of their source combined with the hashes of their internal references,
+// the files read while compiling (e.g. hfx includes). Up to date binaries are not compiled again.
+struct ResourceCompileStatistics {
+
+    uint32_t                        hits;               // Binary up to date, compilation skipped.
+    uint32_t                        misses;             // Binary missing or out of date, resource compiled.
+
+}; // struct ResourceCompileStatistics
+
 //
 //
 struct ResourceMap {
@@ -109,11 +213,16 @@ struct ResourceFactory {
     virtual void                    terminate() {}
 
     virtual void                    compile_resource( CompileContext& context ) = 0;
+    // Options and format versions changing the compiled data. They are hashed with the source, so that changing them compiles the resources again.
+    virtual size_t                  get_compile_options_hash() const { return 0; }
+    // Asynchronous loads call decode on a worker thread, before load. It can prepare resource->decoded_data without using the device.
+    virtual void                    decode( Resource* resource ) {}
     virtual void*                   load( LoadContext& context ) = 0;
 
     virtual void                    unload( void* resource_data, hydra::graphics::Device& device ) = 0;
 
-    virtual void                    reload( Resource* old_resource, Resource* new_resource, StringBuffer& temp_string_buffer, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) {}
+    // Returns false if the asset could not use the new resource, that is then discarded.
+    virtual bool                    reload( Resource* old_resource, Resource* new_resource, StringBuffer& temp_string_buffer, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) { return true; }
 
 }; //struct ResourceFactory
 
@@ -121,10 +230,14 @@ struct TextureFactory : public ResourceFactory {
 
     hydra::graphics::ResourcePool   textures_pool;
 
+    bool                            compress            = true;        // Otherwise levels are RGBA8.
+    hydra::TextureCompressionQuality::Enum compression_quality = hydra::TextureCompressionQuality::Fast;
+
     void                            init() override;
     void                            terminate() override;
 
     void                            compile_resource( CompileContext& context ) override;
+    size_t                          get_compile_options_hash() const override;
     void*                           load( LoadContext& context ) override;
     void                            unload( void* resource_data, hydra::graphics::Device& device ) override;
 };
@@ -133,14 +246,18 @@ struct ShaderFactory : public ResourceFactory {
 
     hydra::graphics::ResourcePool   shaders_pool;
 
+    hfx::CompilerContext*           compiler_contexts   = nullptr;     // One per task thread, effects are compiled on the workers.
+    uint32_t                        num_compiler_contexts = 0;
+
     void                            init() override;
     void                            terminate() override;
 
     void                            compile_resource( CompileContext& context ) override;
+    size_t                          get_compile_options_hash() const override;     // Version of the .bhfx format.
     void*                           load( LoadContext& context ) override;
     void                            unload( void* resource_data, hydra::graphics::Device& device ) override;
 
-    void                            reload( Resource* old_resource, Resource* new_resource, StringBuffer& temp_string_buffer, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) override;
+    bool                            reload( Resource* old_resource, Resource* new_resource, StringBuffer& temp_string_buffer, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) override;
 };
 
 struct MaterialFactory : public ResourceFactory {
@@ -154,7 +271,22 @@ struct MaterialFactory : public ResourceFactory {
     void*                           load( LoadContext& context ) override;
     void                            unload( void* resource_data, hydra::graphics::Device& device ) override;
 
-    void                            reload( Resource* old_resource, Resource* new_resource, StringBuffer& temp_string_buffer, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) override;
+    bool                            reload( Resource* old_resource, Resource* new_resource, StringBuffer& temp_string_buffer, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline ) override;
+};
+
+//
+// glTF scenes. Compiling cooks the meshes, transforms and materials (creating missing .hmt files), loading creates a RenderScene.
+// The geometry of all the scenes is suballocated from the geometry arena, created with the first load.
+struct SceneFactory : public ResourceFactory {
+
+    hydra::graphics::GeometryArena  geometry_arena;
+    hydra::graphics::GeometryArenaCreation geometry_arena_creation;
+
+    void                            terminate() override;
+
+    void                            compile_resource( CompileContext& context ) override;
+    void*                           load( LoadContext& context ) override;
+    void                            unload( void* resource_data, hydra::graphics::Device& device ) override;
 };
 
 //
@@ -170,15 +302,31 @@ struct ResourceManager {
     void                            terminate( hydra::graphics::Device& gfx_device );
 
     Resource*                       compile_resource( ResourceType::Enum type, const char* filename );
+    // Compile the binary file if not up to date. Uses only the given string buffer: can be called from any thread.
+    bool                            compile_resource_file( ResourceType::Enum type, const char* filename, StringBuffer& temp_string_buffer, bool& out_compiled );
     Resource*                       load_resource( ResourceType::Enum type, const char* filename, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline );
     void                            init_resource( Resource** resource, char* memory, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline );
 
+    // Returns immediately. Compilation, mapping and decoding run on the task workers; update creates the asset
+    // once all the external references are loaded. The resource stays valid until terminate, check its state.
+    Resource*                       load_resource_async( ResourceType::Enum type, const char* filename, hydra::graphics::RenderPipeline* render_pipeline );
+    void                            update( hydra::graphics::Device& gfx_device );              // Upload queue: call once per frame on the rendering thread.
+    void                            wait_resource( Resource* resource, hydra::graphics::Device& gfx_device );   // Wait for an asynchronous load to end.
+
     void                            reload_resources( ResourceType::Enum type, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline );
     void                            reload_resource( Resource* resource, hydra::graphics::Device& gfx_device, hydra::graphics::RenderPipeline* render_pipeline );
 
     void                            save_resource( Resource& resource );
     void                            unload_resource( Resource** resource, hydra::graphics::Device& gfx_device );
 
+    size_t                          hash_source( const char* source_memory, size_t source_size ) const;
+    // Combine the source hash with the hash of each dependency source file. Returns 0 if a dependency is missing.
+    size_t                          hash_dependencies( size_t source_hash, const ResourceID* dependencies, uint32_t num_dependencies, StringBuffer& temp_string_buffer ) const;
+    bool                            is_compiled_resource_valid( const char* compiled_filename, ResourceType::Enum type, size_t source_hash, StringBuffer& temp_string_buffer ) const;
+
+    const ResourceCompileStatistics& get_compile_statistics() const { return compile_statistics; }
+    uint32_t                        get_pending_loads() const   { return num_pending_loads; }
+
     const char*                     get_resource_source_folder() { return resource_source_folder.data; }
     const char*                     get_resource_binary_folder() { return resource_binary_folder.data; }
 
@@ -191,6 +339,16 @@ struct ResourceManager {
 
     hydra::StringBuffer             temporary_string_buffer;    // Used to concatenate names and such.
 
+    ResourceCompileStatistics       compile_statistics;
+
+    // Asynchronous loading
+    array( ResourceLoadJob* )       completed_jobs;             // Filled by the workers, under completed_jobs_mutex.
+    array( ResourceLoadJob* )       processed_jobs;             // Completed jobs moved out of the lock by update.
+    array( ResourceLoadJob* )       waiting_jobs;               // Waiting for their dependencies to be loaded.
+    array( Resource* )              failed_resources;           // Removed from the map, so that a later load can try again.
+    std::mutex                      completed_jobs_mutex;
+    uint32_t                        num_pending_loads;
+
 }; // struct ResourceManager
 
 } // namespace hydra
\ No newline at end of file
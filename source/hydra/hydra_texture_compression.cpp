@@ -0,0 +1,834 @@
+//
+//  Hydra Texture Compression - v0.01
+
+#include "hydra/hydra_texture_compression.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace hydra {
+
+static const uint32_t               k_block_pixels = 16;
+static const uint32_t               k_bc7_weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+//
+// 4x4 pixels of the image, RGBA. Pixels outside of the image repeat the last row and column.
+//
+static void load_block( const uint8_t* pixels, uint32_t width, uint32_t height, uint32_t block_x, uint32_t block_y, uint8_t* block ) {
+    for ( uint32_t y = 0; y < 4; ++y ) {
+        const uint32_t image_y = block_y * 4 + y < height ? block_y * 4 + y : height - 1;
+
+        for ( uint32_t x = 0; x < 4; ++x ) {
+            const uint32_t image_x = block_x * 4 + x < width ? block_x * 4 + x : width - 1;
+            memcpy( block + ( y * 4 + x ) * 4, pixels + ( image_y * width + image_x ) * 4, 4 );
+        }
+    }
+}
+
+//
+// Extremes of the block along the principal axis of the channels [first_channel, first_channel + num_channels).
+// The axis is found with power iterations on the covariance matrix.
+//
+static void principal_endpoints( const uint8_t* block, uint32_t first_channel, uint32_t num_channels, float* out_e0, float* out_e1 ) {
+
+    float mean[4] = { 0, 0, 0, 0 };
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        for ( uint32_t c = 0; c < num_channels; ++c ) {
+            mean[c] += block[i * 4 + first_channel + c];
+        }
+    }
+
+    for ( uint32_t c = 0; c < num_channels; ++c ) {
+        mean[c] /= k_block_pixels;
+    }
+
+    float covariance[4][4] = {};
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        float delta[4];
+        for ( uint32_t c = 0; c < num_channels; ++c ) {
+            delta[c] = block[i * 4 + first_channel + c] - mean[c];
+        }
+
+        for ( uint32_t r = 0; r < num_channels; ++r ) {
+            for ( uint32_t c = 0; c < num_channels; ++c ) {
+                covariance[r][c] += delta[r] * delta[c];
+            }
+        }
+    }
+
+    float axis[4] = { 1, 1, 1, 1 };
+    for ( uint32_t iteration = 0; iteration < 8; ++iteration ) {
+        float next_axis[4] = { 0, 0, 0, 0 };
+        float length = 0;
+        for ( uint32_t r = 0; r < num_channels; ++r ) {
+            for ( uint32_t c = 0; c < num_channels; ++c ) {
+                next_axis[r] += covariance[r][c] * axis[c];
+            }
+            length += next_axis[r] * next_axis[r];
+        }
+
+        // Flat block: all pixels are the mean.
+        if ( length < 1e-8f ) {
+            memcpy( out_e0, mean, sizeof( float ) * num_channels );
+            memcpy( out_e1, mean, sizeof( float ) * num_channels );
+            return;
+        }
+
+        length = 1.0f / sqrtf( length );
+        for ( uint32_t c = 0; c < num_channels; ++c ) {
+            axis[c] = next_axis[c] * length;
+        }
+    }
+
+    float min_projection = 0, max_projection = 0;
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        float projection = 0;
+        for ( uint32_t c = 0; c < num_channels; ++c ) {
+            projection += ( block[i * 4 + first_channel + c] - mean[c] ) * axis[c];
+        }
+
+        min_projection = projection < min_projection ? projection : min_projection;
+        max_projection = projection > max_projection ? projection : max_projection;
+    }
+
+    for ( uint32_t c = 0; c < num_channels; ++c ) {
+        out_e0[c] = mean[c] + axis[c] * min_projection;
+        out_e1[c] = mean[c] + axis[c] * max_projection;
+    }
+}
+
+//
+// Least squares endpoints for the pixels, each interpolated at weights[i] from e0 to e1.
+// Returns false if all the weights are the same, as the endpoints are then undetermined.
+//
+static bool fit_endpoints( const uint8_t* block, uint32_t first_channel, uint32_t num_channels, const float* weights, float* out_e0, float* out_e1 ) {
+
+    float aa = 0, ab = 0, bb = 0;
+    float ap[4] = { 0, 0, 0, 0 }, bp[4] = { 0, 0, 0, 0 };
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        const float b = weights[i];
+        const float a = 1.0f - b;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+
+        for ( uint32_t c = 0; c < num_channels; ++c ) {
+            const float value = block[i * 4 + first_channel + c];
+            ap[c] += a * value;
+            bp[c] += b * value;
+        }
+    }
+
+    const float determinant = aa * bb - ab * ab;
+    if ( fabsf( determinant ) < 1e-6f ) {
+        return false;
+    }
+
+    const float inverse_determinant = 1.0f / determinant;
+    for ( uint32_t c = 0; c < num_channels; ++c ) {
+        const float e0 = ( bb * ap[c] - ab * bp[c] ) * inverse_determinant;
+        const float e1 = ( aa * bp[c] - ab * ap[c] ) * inverse_determinant;
+        out_e0[c] = e0 < 0.0f ? 0.0f : ( e0 > 255.0f ? 255.0f : e0 );
+        out_e1[c] = e1 < 0.0f ? 0.0f : ( e1 > 255.0f ? 255.0f : e1 );
+    }
+
+    return true;
+}
+
+static inline uint32_t quantize( float value, uint32_t max_value ) {
+    const int32_t quantized = (int32_t)( value * max_value / 255.0f + 0.5f );
+    return quantized < 0 ? 0 : ( quantized > (int32_t)max_value ? max_value : (uint32_t)quantized );
+}
+
+// BC1 //////////////////////////////////////////////////////////////////////////
+
+static uint16_t pack_565( const float* color ) {
+    return (uint16_t)( ( quantize( color[0], 31 ) << 11 ) | ( quantize( color[1], 63 ) << 5 ) | quantize( color[2], 31 ) );
+}
+
+static void unpack_565( uint16_t color, int32_t* out_color ) {
+    const int32_t r = ( color >> 11 ) & 31, g = ( color >> 5 ) & 63, b = color & 31;
+    out_color[0] = ( r << 3 ) | ( r >> 2 );
+    out_color[1] = ( g << 2 ) | ( g >> 4 );
+    out_color[2] = ( b << 3 ) | ( b >> 2 );
+}
+
+//
+// Closest of the 4 colors for each pixel. Returns the squared error.
+//
+static uint32_t bc1_choose_indices( const uint8_t* block, uint16_t color0, uint16_t color1, uint32_t& out_indices ) {
+
+    int32_t palette[4][3];
+    unpack_565( color0, palette[0] );
+    unpack_565( color1, palette[1] );
+    for ( uint32_t c = 0; c < 3; ++c ) {
+        palette[2][c] = ( 2 * palette[0][c] + palette[1][c] ) / 3;
+        palette[3][c] = ( palette[0][c] + 2 * palette[1][c] ) / 3;
+    }
+
+    // Equal colors would select the 3 colors mode: only index 0 is used.
+    const uint32_t num_colors = color0 == color1 ? 1 : 4;
+
+    uint32_t error = 0;
+    out_indices = 0;
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        uint32_t best_distance = UINT32_MAX, best_index = 0;
+        for ( uint32_t p = 0; p < num_colors; ++p ) {
+            const int32_t dr = block[i * 4] - palette[p][0], dg = block[i * 4 + 1] - palette[p][1], db = block[i * 4 + 2] - palette[p][2];
+            const uint32_t distance = dr * dr + dg * dg + db * db;
+            if ( distance < best_distance ) {
+                best_distance = distance;
+                best_index = p;
+            }
+        }
+
+        error += best_distance;
+        out_indices |= best_index << ( i * 2 );
+    }
+
+    return error;
+}
+
+//
+// Color block: 2 colors 565, with color0 > color1 for the 4 colors mode, then 2 bits per pixel.
+//
+static void bc1_compress_block( const uint8_t* block, TextureCompressionQuality::Enum quality, uint8_t* output ) {
+
+    float e0[3], e1[3];
+    principal_endpoints( block, 0, 3, e0, e1 );
+
+    uint16_t color0 = pack_565( e1 ), color1 = pack_565( e0 );
+    uint32_t indices;
+    uint32_t error = bc1_choose_indices( block, color0, color1, indices );
+
+    if ( quality == TextureCompressionQuality::High ) {
+        // Position of each index between color0 and color1.
+        static const float s_index_weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+        for ( uint32_t iteration = 0; iteration < 2 && error > 0; ++iteration ) {
+            float weights[k_block_pixels];
+            for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+                weights[i] = s_index_weights[( indices >> ( i * 2 ) ) & 3];
+            }
+
+            if ( !fit_endpoints( block, 0, 3, weights, e0, e1 ) ) {
+                break;
+            }
+
+            const uint16_t refined_color0 = pack_565( e0 ), refined_color1 = pack_565( e1 );
+            uint32_t refined_indices;
+            const uint32_t refined_error = bc1_choose_indices( block, refined_color0, refined_color1, refined_indices );
+            if ( refined_error >= error ) {
+                break;
+            }
+
+            color0 = refined_color0;
+            color1 = refined_color1;
+            indices = refined_indices;
+            error = refined_error;
+        }
+    }
+
+    // Swapping the colors swaps the indices 0 with 1 and 2 with 3.
+    if ( color0 < color1 ) {
+        const uint16_t temp = color0;
+        color0 = color1;
+        color1 = temp;
+        indices ^= 0x55555555;
+    }
+
+    memcpy( output, &color0, 2 );
+    memcpy( output + 2, &color1, 2 );
+    memcpy( output + 4, &indices, 4 );
+}
+
+// BC4 //////////////////////////////////////////////////////////////////////////
+
+//
+// Closest of the 8 values for each pixel, indices packed in 48 bits. Returns the squared error.
+//
+static uint32_t bc4_choose_indices( const uint8_t* values, uint32_t value0, uint32_t value1, uint64_t& out_indices ) {
+
+    int32_t palette[8];
+    palette[0] = value0;
+    palette[1] = value1;
+    for ( uint32_t p = 2; p < 8; ++p ) {
+        palette[p] = ( ( 8 - p ) * value0 + ( p - 1 ) * value1 + 3 ) / 7;
+    }
+
+    // Equal values would select the 6 values mode: only index 0 is used.
+    const uint32_t num_values = value0 == value1 ? 1 : 8;
+
+    uint32_t error = 0;
+    out_indices = 0;
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        uint32_t best_distance = UINT32_MAX, best_index = 0;
+        for ( uint32_t p = 0; p < num_values; ++p ) {
+            const int32_t delta = values[i] - palette[p];
+            const uint32_t distance = delta * delta;
+            if ( distance < best_distance ) {
+                best_distance = distance;
+                best_index = p;
+            }
+        }
+
+        error += best_distance;
+        out_indices |= (uint64_t)best_index << ( i * 3 );
+    }
+
+    return error;
+}
+
+//
+// Single channel block: 2 values, with value0 > value1 for the 8 values mode, then 3 bits per pixel.
+//
+static void bc4_compress_block( const uint8_t* block, uint32_t channel, TextureCompressionQuality::Enum quality, uint8_t* output ) {
+
+    uint8_t values[k_block_pixels];
+    uint32_t min_value = 255, max_value = 0;
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        values[i] = block[i * 4 + channel];
+        min_value = values[i] < min_value ? values[i] : min_value;
+        max_value = values[i] > max_value ? values[i] : max_value;
+    }
+
+    uint32_t value0 = max_value, value1 = min_value;
+    uint64_t indices;
+    uint32_t error = bc4_choose_indices( values, value0, value1, indices );
+
+    // Moving the extremes inside the range can place the interpolated values closer to the pixels.
+    const uint32_t range_inset = ( max_value - min_value ) / 8;
+    const uint32_t max_inset = quality == TextureCompressionQuality::High ? ( range_inset < 3 ? range_inset : 3 ) : 0;
+    for ( uint32_t inset0 = 0; inset0 <= max_inset && error > 0; ++inset0 ) {
+        for ( uint32_t inset1 = 0; inset1 <= max_inset && error > 0; ++inset1 ) {
+            const uint32_t candidate0 = max_value - inset0, candidate1 = min_value + inset1;
+            if ( candidate0 <= candidate1 || ( inset0 == 0 && inset1 == 0 ) ) {
+                continue;
+            }
+
+            uint64_t candidate_indices;
+            const uint32_t candidate_error = bc4_choose_indices( values, candidate0, candidate1, candidate_indices );
+            if ( candidate_error < error ) {
+                value0 = candidate0;
+                value1 = candidate1;
+                indices = candidate_indices;
+                error = candidate_error;
+            }
+        }
+    }
+
+    output[0] = (uint8_t)value0;
+    output[1] = (uint8_t)value1;
+    for ( uint32_t b = 0; b < 6; ++b ) {
+        output[2 + b] = (uint8_t)( indices >> ( b * 8 ) );
+    }
+}
+
+// BC7 //////////////////////////////////////////////////////////////////////////
+
+//
+// Mode 6 endpoints: 7 bits per channel plus a shared lowest bit, the p-bit.
+//
+struct BC7Endpoints {
+
+    uint32_t                        values[2][4];       // 7 bits.
+    uint32_t                        p_bits[2];
+
+}; // struct BC7Endpoints
+
+//
+// Closest of the 16 colors for each pixel, with 4 bits indices. Returns the squared error.
+//
+static uint32_t bc7_choose_indices( const uint8_t* block, const BC7Endpoints& endpoints, uint8_t* out_indices ) {
+
+    int32_t e0[4], e1[4];
+    for ( uint32_t c = 0; c < 4; ++c ) {
+        e0[c] = ( endpoints.values[0][c] << 1 ) | endpoints.p_bits[0];
+        e1[c] = ( endpoints.values[1][c] << 1 ) | endpoints.p_bits[1];
+    }
+
+    int32_t palette[16][4];
+    for ( uint32_t p = 0; p < 16; ++p ) {
+        for ( uint32_t c = 0; c < 4; ++c ) {
+            palette[p][c] = ( ( 64 - k_bc7_weights[p] ) * e0[c] + k_bc7_weights[p] * e1[c] + 32 ) >> 6;
+        }
+    }
+
+    uint32_t error = 0;
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        uint32_t best_distance = UINT32_MAX, best_index = 0;
+        for ( uint32_t p = 0; p < 16; ++p ) {
+            uint32_t distance = 0;
+            for ( uint32_t c = 0; c < 4; ++c ) {
+                const int32_t delta = block[i * 4 + c] - palette[p][c];
+                distance += delta * delta;
+            }
+
+            if ( distance < best_distance ) {
+                best_distance = distance;
+                best_index = p;
+            }
+        }
+
+        error += best_distance;
+        out_indices[i] = (uint8_t)best_index;
+    }
+
+    return error;
+}
+
+//
+// Quantize float endpoints trying all the p-bits. Returns the squared error of the best ones.
+//
+static uint32_t bc7_quantize_endpoints( const uint8_t* block, const float* e0, const float* e1, BC7Endpoints& out_endpoints, uint8_t* out_indices ) {
+
+    uint32_t best_error = UINT32_MAX;
+    for ( uint32_t p = 0; p < 4; ++p ) {
+        BC7Endpoints endpoints;
+        endpoints.p_bits[0] = p & 1;
+        endpoints.p_bits[1] = p >> 1;
+
+        for ( uint32_t c = 0; c < 4; ++c ) {
+            const int32_t value0 = (int32_t)( ( e0[c] - endpoints.p_bits[0] ) * 0.5f + 0.5f );
+            const int32_t value1 = (int32_t)( ( e1[c] - endpoints.p_bits[1] ) * 0.5f + 0.5f );
+            endpoints.values[0][c] = value0 < 0 ? 0 : ( value0 > 127 ? 127 : value0 );
+            endpoints.values[1][c] = value1 < 0 ? 0 : ( value1 > 127 ? 127 : value1 );
+        }
+
+        uint8_t indices[k_block_pixels];
+        const uint32_t error = bc7_choose_indices( block, endpoints, indices );
+        if ( error < best_error ) {
+            best_error = error;
+            out_endpoints = endpoints;
+            memcpy( out_indices, indices, k_block_pixels );
+        }
+    }
+
+    return best_error;
+}
+
+//
+// Little endian bit stream of a 128 bits block.
+//
+struct BlockBitWriter {
+
+    void                            write( uint32_t value, uint32_t num_bits ) {
+        for ( uint32_t b = 0; b < num_bits; ++b, ++bit ) {
+            data[bit >> 3] |= (uint8_t)( ( ( value >> b ) & 1 ) << ( bit & 7 ) );
+        }
+    }
+
+    uint8_t*                        data;
+    uint32_t                        bit;
+
+}; // struct BlockBitWriter
+
+//
+// Mode 6 block: mode bits, endpoints 7 bits per channel (RRGGBBAA), 2 p-bits, then 4 bits indices.
+// The first index is the anchor and its highest bit is implicitly 0.
+//
+static void bc7_compress_block( const uint8_t* block, TextureCompressionQuality::Enum quality, uint8_t* output ) {
+
+    float e0[4], e1[4];
+    principal_endpoints( block, 0, 4, e0, e1 );
+
+    BC7Endpoints endpoints;
+    uint8_t indices[k_block_pixels];
+    uint32_t error = bc7_quantize_endpoints( block, e0, e1, endpoints, indices );
+
+    if ( quality == TextureCompressionQuality::High ) {
+        for ( uint32_t iteration = 0; iteration < 2 && error > 0; ++iteration ) {
+            float weights[k_block_pixels];
+            for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+                weights[i] = k_bc7_weights[indices[i]] / 64.0f;
+            }
+
+            if ( !fit_endpoints( block, 0, 4, weights, e0, e1 ) ) {
+                break;
+            }
+
+            BC7Endpoints refined_endpoints;
+            uint8_t refined_indices[k_block_pixels];
+            const uint32_t refined_error = bc7_quantize_endpoints( block, e0, e1, refined_endpoints, refined_indices );
+            if ( refined_error >= error ) {
+                break;
+            }
+
+            endpoints = refined_endpoints;
+            memcpy( indices, refined_indices, k_block_pixels );
+            error = refined_error;
+        }
+    }
+
+    // Anchor index must fit in 3 bits: swapping the endpoints inverts the indices.
+    if ( indices[0] & 8 ) {
+        for ( uint32_t c = 0; c < 4; ++c ) {
+            const uint32_t temp = endpoints.values[0][c];
+            endpoints.values[0][c] = endpoints.values[1][c];
+            endpoints.values[1][c] = temp;
+        }
+
+        const uint32_t temp = endpoints.p_bits[0];
+        endpoints.p_bits[0] = endpoints.p_bits[1];
+        endpoints.p_bits[1] = temp;
+
+        for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+            indices[i] = 15 - indices[i];
+        }
+    }
+
+    memset( output, 0, 16 );
+    BlockBitWriter writer = { output, 0 };
+    writer.write( 1 << 6, 7 );
+
+    for ( uint32_t c = 0; c < 4; ++c ) {
+        writer.write( endpoints.values[0][c], 7 );
+        writer.write( endpoints.values[1][c], 7 );
+    }
+
+    writer.write( endpoints.p_bits[0], 1 );
+    writer.write( endpoints.p_bits[1], 1 );
+
+    writer.write( indices[0], 3 );
+    for ( uint32_t i = 1; i < k_block_pixels; ++i ) {
+        writer.write( indices[i], 4 );
+    }
+}
+
+// API //////////////////////////////////////////////////////////////////////////
+
+uint32_t texture_block_size( TextureBlockFormat::Enum format ) {
+    return format == TextureBlockFormat::BC1 || format == TextureBlockFormat::BC4 ? 8 : 16;
+}
+
+uint32_t texture_block_rows( uint32_t height ) {
+    return ( height + 3 ) / 4;
+}
+
+size_t texture_compressed_size( TextureBlockFormat::Enum format, uint32_t width, uint32_t height ) {
+    return (size_t)( ( width + 3 ) / 4 ) * texture_block_rows( height ) * texture_block_size( format );
+}
+
+void texture_compress_block_rows( TextureBlockFormat::Enum format, TextureCompressionQuality::Enum quality, const uint8_t* rgba_pixels,
+                                  uint32_t width, uint32_t height, uint32_t first_block_row, uint32_t last_block_row, uint8_t* output ) {
+
+    const uint32_t block_size = texture_block_size( format );
+    const uint32_t blocks_per_row = ( width + 3 ) / 4;
+
+    uint8_t block[k_block_pixels * 4];
+    for ( uint32_t block_y = first_block_row; block_y < last_block_row; ++block_y ) {
+        uint8_t* block_output = output + (size_t)block_y * blocks_per_row * block_size;
+
+        for ( uint32_t block_x = 0; block_x < blocks_per_row; ++block_x, block_output += block_size ) {
+            load_block( rgba_pixels, width, height, block_x, block_y, block );
+
+            switch ( format ) {
+                case TextureBlockFormat::BC1:
+                {
+                    bc1_compress_block( block, quality, block_output );
+                    break;
+                }
+
+                case TextureBlockFormat::BC3:
+                {
+                    bc4_compress_block( block, 3, quality, block_output );
+                    bc1_compress_block( block, quality, block_output + 8 );
+                    break;
+                }
+
+                case TextureBlockFormat::BC4:
+                {
+                    bc4_compress_block( block, 0, quality, block_output );
+                    break;
+                }
+
+                case TextureBlockFormat::BC5:
+                {
+                    bc4_compress_block( block, 0, quality, block_output );
+                    bc4_compress_block( block, 1, quality, block_output + 8 );
+                    break;
+                }
+
+                case TextureBlockFormat::BC7:
+                {
+                    bc7_compress_block( block, quality, block_output );
+                    break;
+                }
+
+                default:
+                {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void texture_compress( TextureBlockFormat::Enum format, TextureCompressionQuality::Enum quality, const uint8_t* rgba_pixels,
+                       uint32_t width, uint32_t height, uint8_t* output ) {
+    texture_compress_block_rows( format, quality, rgba_pixels, width, height, 0, texture_block_rows( height ), output );
+}
+
+// Test /////////////////////////////////////////////////////////////////////////
+
+//
+// Reference decoders, written from the format specifications and not sharing code with the encoders.
+//
+static void bc1_decode_block( const uint8_t* data, uint8_t* block ) {
+    uint16_t color0, color1;
+    uint32_t indices;
+    memcpy( &color0, data, 2 );
+    memcpy( &color1, data + 2, 2 );
+    memcpy( &indices, data + 4, 4 );
+
+    int32_t palette[4][4];
+    unpack_565( color0, palette[0] );
+    unpack_565( color1, palette[1] );
+    for ( uint32_t c = 0; c < 3; ++c ) {
+        if ( color0 > color1 ) {
+            palette[2][c] = ( 2 * palette[0][c] + palette[1][c] ) / 3;
+            palette[3][c] = ( palette[0][c] + 2 * palette[1][c] ) / 3;
+        }
+        else {
+            palette[2][c] = ( palette[0][c] + palette[1][c] ) / 2;
+            palette[3][c] = 0;
+        }
+    }
+    palette[0][3] = palette[1][3] = palette[2][3] = 255;
+    palette[3][3] = color0 > color1 ? 255 : 0;
+
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        const uint32_t index = ( indices >> ( i * 2 ) ) & 3;
+        for ( uint32_t c = 0; c < 4; ++c ) {
+            block[i * 4 + c] = (uint8_t)palette[index][c];
+        }
+    }
+}
+
+static void bc4_decode_block( const uint8_t* data, uint32_t channel, uint8_t* block ) {
+    const uint32_t value0 = data[0], value1 = data[1];
+
+    uint32_t palette[8] = { value0, value1, 0, 0, 0, 0, 0, 255 };
+    if ( value0 > value1 ) {
+        for ( uint32_t p = 2; p < 8; ++p ) {
+            palette[p] = ( ( 8 - p ) * value0 + ( p - 1 ) * value1 + 3 ) / 7;
+        }
+    }
+    else {
+        for ( uint32_t p = 2; p < 6; ++p ) {
+            palette[p] = ( ( 6 - p ) * value0 + ( p - 1 ) * value1 + 2 ) / 5;
+        }
+    }
+
+    uint64_t indices = 0;
+    for ( uint32_t b = 0; b < 6; ++b ) {
+        indices |= (uint64_t)data[2 + b] << ( b * 8 );
+    }
+
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        block[i * 4 + channel] = (uint8_t)palette[( indices >> ( i * 3 ) ) & 7];
+    }
+}
+
+//
+// Only mode 6 is decoded: other modes are not written by the encoder.
+//
+static bool bc7_decode_block( const uint8_t* data, uint8_t* block ) {
+    uint32_t bit = 0;
+    auto read = [&]( uint32_t num_bits ) {
+        uint32_t value = 0;
+        for ( uint32_t b = 0; b < num_bits; ++b, ++bit ) {
+            value |= ( ( data[bit >> 3] >> ( bit & 7 ) ) & 1 ) << b;
+        }
+        return value;
+    };
+
+    if ( read( 7 ) != ( 1 << 6 ) ) {
+        return false;
+    }
+
+    uint32_t endpoints[2][4];
+    for ( uint32_t c = 0; c < 4; ++c ) {
+        endpoints[0][c] = read( 7 );
+        endpoints[1][c] = read( 7 );
+    }
+
+    const uint32_t p_bit0 = read( 1 ), p_bit1 = read( 1 );
+    for ( uint32_t c = 0; c < 4; ++c ) {
+        endpoints[0][c] = ( endpoints[0][c] << 1 ) | p_bit0;
+        endpoints[1][c] = ( endpoints[1][c] << 1 ) | p_bit1;
+    }
+
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        const uint32_t weight = k_bc7_weights[read( i == 0 ? 3 : 4 )];
+        for ( uint32_t c = 0; c < 4; ++c ) {
+            block[i * 4 + c] = (uint8_t)( ( ( 64 - weight ) * endpoints[0][c] + weight * endpoints[1][c] + 32 ) >> 6 );
+        }
+    }
+
+    return true;
+}
+
+//
+// Compress and decode the image, returning the largest channel error and the mean squared error of the channels.
+// Channels not stored by the format are not compared.
+//
+static uint32_t test_round_trip( TextureBlockFormat::Enum format, TextureCompressionQuality::Enum quality, const uint8_t* pixels, uint32_t width, uint32_t height,
+                                 float& out_mean_squared_error ) {
+
+    static const uint32_t k_test_max_size = 16;
+    uint8_t compressed[( k_test_max_size / 4 ) * ( k_test_max_size / 4 ) * 16];
+    assert( texture_compressed_size( format, width, height ) <= sizeof( compressed ) );
+    texture_compress( format, quality, pixels, width, height, compressed );
+
+    const uint32_t num_channels = format == TextureBlockFormat::BC1 ? 3 : ( format == TextureBlockFormat::BC4 ? 1 : ( format == TextureBlockFormat::BC5 ? 2 : 4 ) );
+    const uint32_t block_size = texture_block_size( format );
+    const uint32_t blocks_per_row = ( width + 3 ) / 4;
+
+    uint32_t max_error = 0;
+    uint64_t squared_error = 0;
+    for ( uint32_t block_y = 0; block_y < texture_block_rows( height ); ++block_y ) {
+        for ( uint32_t block_x = 0; block_x < blocks_per_row; ++block_x ) {
+            const uint8_t* data = compressed + ( block_y * blocks_per_row + block_x ) * block_size;
+
+            uint8_t block[k_block_pixels * 4] = {};
+            switch ( format ) {
+                case TextureBlockFormat::BC1:
+                {
+                    bc1_decode_block( data, block );
+                    break;
+                }
+
+                case TextureBlockFormat::BC3:
+                {
+                    bc1_decode_block( data + 8, block );
+                    bc4_decode_block( data, 3, block );
+                    break;
+                }
+
+                case TextureBlockFormat::BC4:
+                {
+                    bc4_decode_block( data, 0, block );
+                    break;
+                }
+
+                case TextureBlockFormat::BC5:
+                {
+                    bc4_decode_block( data, 0, block );
+                    bc4_decode_block( data + 8, 1, block );
+                    break;
+                }
+
+                case TextureBlockFormat::BC7:
+                {
+                    const bool decoded = bc7_decode_block( data, block );
+                    assert( decoded && "BC7 block should be mode 6" );
+                    break;
+                }
+
+                default:
+                {
+                    break;
+                }
+            }
+
+            for ( uint32_t y = 0; y < 4 && block_y * 4 + y < height; ++y ) {
+                for ( uint32_t x = 0; x < 4 && block_x * 4 + x < width; ++x ) {
+                    const uint8_t* source = pixels + ( ( block_y * 4 + y ) * width + block_x * 4 + x ) * 4;
+                    const uint8_t* decoded = block + ( y * 4 + x ) * 4;
+
+                    for ( uint32_t c = 0; c < num_channels; ++c ) {
+                        const uint32_t error = (uint32_t)abs( source[c] - decoded[c] );
+                        max_error = error > max_error ? error : max_error;
+                        squared_error += error * error;
+                    }
+                }
+            }
+        }
+    }
+
+    out_mean_squared_error = (float)squared_error / ( width * height * num_channels );
+    return max_error;
+}
+
+void test_texture_compression() {
+
+    // Solid block: only the quantization of the endpoints loses precision.
+    // BC1 colors are 5 and 6 bits, BC7 endpoints are 8 bits with a p-bit shared by the channels.
+    uint8_t solid[k_block_pixels * 4];
+    for ( uint32_t i = 0; i < k_block_pixels; ++i ) {
+        solid[i * 4 + 0] = 200;
+        solid[i * 4 + 1] = 100;
+        solid[i * 4 + 2] = 51;
+        solid[i * 4 + 3] = 128;
+    }
+
+    // Gradient between two colors, 6x5 so that the last blocks repeat the last row and column.
+    static const uint32_t k_gradient_width = 6, k_gradient_height = 5;
+    uint8_t gradient[k_gradient_width * k_gradient_height * 4];
+    for ( uint32_t y = 0; y < k_gradient_height; ++y ) {
+        for ( uint32_t x = 0; x < k_gradient_width; ++x ) {
+            uint8_t* pixel = gradient + ( y * k_gradient_width + x ) * 4;
+            const uint32_t t = ( x + y ) * 255 / ( k_gradient_width + k_gradient_height - 2 );
+            pixel[0] = (uint8_t)( 16 + t * 200 / 255 );
+            pixel[1] = (uint8_t)( 240 - t * 160 / 255 );
+            pixel[2] = (uint8_t)( 64 + t * 64 / 255 );
+            pixel[3] = (uint8_t)( 255 - t );
+        }
+    }
+
+    // Noise: no structure to exploit. Its variance is about 5461, encoders must do better than the mean color.
+    static const uint32_t k_noise_size = 16;
+    uint8_t noise[k_noise_size * k_noise_size * 4];
+    uint32_t random = 0x12345678;
+    for ( uint32_t i = 0; i < k_noise_size * k_noise_size * 4; ++i ) {
+        random = random * 1664525 + 1013904223;
+        noise[i] = (uint8_t)( random >> 24 );
+    }
+
+    struct TestCase {
+        TextureBlockFormat::Enum    format;
+        uint32_t                    max_solid_error;
+        uint32_t                    max_gradient_error;
+        float                       max_noise_mean_squared_error;
+    };
+
+    // Bounds are slightly above the measured errors: a broken encoder or block layout exceeds them by far.
+    static const TestCase k_test_cases[] = {
+        { TextureBlockFormat::BC1, 2, 24, 3100.0f },
+        { TextureBlockFormat::BC3, 2, 24, 2400.0f },
+        { TextureBlockFormat::BC4, 0, 10, 90.0f },
+        { TextureBlockFormat::BC5, 0, 10, 90.0f },
+        { TextureBlockFormat::BC7, 1, 7, 3200.0f },
+    };
+
+    for ( const TestCase& test : k_test_cases ) {
+        float fast_error = 0.0f, high_error = 0.0f;
+
+        uint32_t max_error = test_round_trip( test.format, TextureCompressionQuality::Fast, solid, 4, 4, fast_error );
+        assert( max_error <= test.max_solid_error && "Solid block error is too large" );
+
+        max_error = test_round_trip( test.format, TextureCompressionQuality::High, solid, 4, 4, high_error );
+        assert( max_error <= test.max_solid_error && "Solid block error is too large" );
+
+        max_error = test_round_trip( test.format, TextureCompressionQuality::Fast, gradient, k_gradient_width, k_gradient_height, fast_error );
+        assert( max_error <= test.max_gradient_error && "Gradient error is too large" );
+
+        max_error = test_round_trip( test.format, TextureCompressionQuality::High, gradient, k_gradient_width, k_gradient_height, high_error );
+        assert( max_error <= test.max_gradient_error && "Gradient error is too large" );
+        assert( high_error <= fast_error && "High quality should not increase the error" );
+
+        test_round_trip( test.format, TextureCompressionQuality::Fast, noise, k_noise_size, k_noise_size, fast_error );
+        assert( fast_error <= test.max_noise_mean_squared_error && "Noise error is too large" );
+
+        test_round_trip( test.format, TextureCompressionQuality::High, noise, k_noise_size, k_noise_size, high_error );
+        assert( high_error <= test.max_noise_mean_squared_error && "Noise error is too large" );
+        assert( high_error <= fast_error && "High quality should not increase the error" );
+
+        ( void )max_error;
+    }
+}
+
+} // namespace hydra
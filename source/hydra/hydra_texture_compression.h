@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+//  Hydra Texture Compression - v0.01
+//
+//  CPU encoders of RGBA8 images into block compressed formats.
+//
+//      Source code     : https://www.github.com/jorenjoestar/
+//
+//      Created         : 2020/03/23, 18.40
+//
+// Revision history //////////////////////
+//
+//      0.01 (2020/03/23): + Initial version. BC1, BC3, BC4, BC5 and BC7 encoders with fast and high quality.
+//
+// Documentation /////////////////////////
+//
+// Images are compressed in blocks of 4x4 pixels, from the top left, row after row. Pixels outside of the
+// image repeat the last row and column, so that any size (mip levels down to 1x1) can be compressed.
+// Blocks have the layout expected by D3D and GL.
+//
+//  BC1 : RGB, 8 bytes per block. Always uses 4 colors, alpha is opaque.
+//  BC3 : RGBA, 16 bytes per block. BC4 block for alpha followed by a BC1 block for color.
+//  BC4 : R, 8 bytes per block.
+//  BC5 : RG, 16 bytes per block. Two BC4 blocks, red then green.
+//  BC7 : RGBA, 16 bytes per block. Only mode 6 is encoded: one subset with 4 bits indices.
+//
+// Endpoints are the extremes of the principal axis of the block. High quality refines them with least squares
+// on the chosen indices and searches more candidates, for about 3 times the encoding time.
+//
+// Blocks are independent: rows of blocks can be compressed by different threads.
+//
+// test_texture_compression decodes the blocks with reference decoders: it needs no device and runs headless.
+
+namespace hydra {
+
+namespace TextureBlockFormat {
+    enum Enum {
+        BC1, BC3, BC4, BC5, BC7, Count
+    };
+
+    static const char* s_value_names[] = {
+        "BC1", "BC3", "BC4", "BC5", "BC7", "Count"
+    };
+
+    static const char* ToString( Enum e ) {
+        return s_value_names[(int)e];
+    }
+} // namespace TextureBlockFormat
+
+//
+//
+struct TextureCompressionQuality {
+
+    enum Enum {
+        Fast = 0, High, Count
+    }; // enum Enum
+
+}; // struct TextureCompressionQuality
+
+uint32_t                            texture_block_size( TextureBlockFormat::Enum format );                          // Bytes of a 4x4 block.
+uint32_t                            texture_block_rows( uint32_t height );
+size_t                              texture_compressed_size( TextureBlockFormat::Enum format, uint32_t width, uint32_t height );
+
+// Compress the blocks rows in [first_block_row, last_block_row). Output is the start of the whole compressed image.
+void                                texture_compress_block_rows( TextureBlockFormat::Enum format, TextureCompressionQuality::Enum quality, const uint8_t* rgba_pixels,
+                                                                 uint32_t width, uint32_t height, uint32_t first_block_row, uint32_t last_block_row, uint8_t* output );
+void                                texture_compress( TextureBlockFormat::Enum format, TextureCompressionQuality::Enum quality, const uint8_t* rgba_pixels,
+                                                      uint32_t width, uint32_t height, uint8_t* output );
+
+// Asserts that solid, gradient and noise images decode within error bounds for all formats and qualities. CPU only.
+void                                test_texture_compression();
+
+} // namespace hydra
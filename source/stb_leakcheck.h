@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <mutex>
 typedef struct malloc_info stb_leakcheck_malloc_info;
 
 struct malloc_info
@@ -29,9 +30,11 @@ struct malloc_info
 };
 
 static stb_leakcheck_malloc_info *mi_head;
+static std::mutex stblkck_mutex; // hydra: allocations happen on worker threads too.
 
 void *stb_leakcheck_malloc(size_t sz, const char *file, int line)
 {
+   std::lock_guard<std::mutex> lock(stblkck_mutex);
    stb_leakcheck_malloc_info *mi = (stb_leakcheck_malloc_info *) malloc(sz + sizeof(*mi));
    if (mi == NULL) return mi;
    mi->file = file;
@@ -48,6 +51,7 @@ void *stb_leakcheck_malloc(size_t sz, const char *file, int line)
 void stb_leakcheck_free(void *ptr)
 {
    if (ptr != NULL) {
+      std::lock_guard<std::mutex> lock(stblkck_mutex);
       stb_leakcheck_malloc_info *mi = (stb_leakcheck_malloc_info *) ptr - 1;
       mi->size = ~mi->size;
       #ifndef STB_LEAKCHECK_SHOWALL
@@ -113,6 +117,7 @@ static void stblkck_internal_print(const char *reason, stb_leakcheck_malloc_info
 
 void stb_leakcheck_dumpmem(void)
 {
+   std::lock_guard<std::mutex> lock(stblkck_mutex);
    stb_leakcheck_malloc_info *mi = mi_head;
    while (mi) {
       if ((ptrdiff_t) mi->size >= 0)